@@ -178,7 +178,7 @@ Backtrace::info Backtrace::
         make(int skipFrames)
 {
     Backtrace b;
-    b.pretty_print_ = prettyBackTrace(skipFrames+2);
+    b.pretty_print_ = prettyBackTrace(skipFrames+2) + task_origin::to_string (b.origin_);
     return Backtrace::info(b);
 }
 
@@ -280,7 +280,7 @@ string Backtrace::
 
     free(msg);
 
-    bt += "\n";
+    bt += "\n" + task_origin::to_string (origin_);
 
     return bt;
 }
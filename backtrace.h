@@ -1,6 +1,8 @@
 #ifndef BACKTRACE_H
 #define BACKTRACE_H
 
+#include "task_origin.h"
+
 #include <vector>
 #include <string>
 
@@ -14,6 +16,8 @@
  *
  * It should translate to a pretty backtrace when asked for a string representation.
  *
+ * It should print where the running task was submitted from, see task_origin.
+ *
  * Include debug info '-g' for this to work.
  */
 class Backtrace
@@ -27,11 +31,17 @@ class Backtrace
         std::string to_string();
         std::string to_string() const;
 
+        const std::vector<void*>& frames() const { return frames_; }
+        task_origin::id origin() const { return origin_; }
+
     private:
+        friend class backtrace_policy;
+
         Backtrace();
 
         std::string pretty_print_;
         std::vector<void*> frames_;
+        task_origin::id origin_ = task_origin::current ();
 
     public:
         static void test();
@@ -0,0 +1,814 @@
+#include "backtrace_format.h"
+#include "backtrace.h"
+#include "exceptionassert.h"
+#include "expectexception.h"
+#include "stack_depot.h"
+#include "task_origin.h"
+#include "timer.h"
+#include "trace_perf.h"
+
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <unordered_map>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _MSC_VER
+#include <io.h>
+#else
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace {
+
+class ostream_sink: public backtrace_format::sink
+{
+public:
+    explicit ostream_sink(ostream& o) : o_(o) {}
+
+    void put(const char* p, size_t n) override { o_.write (p, n); }
+
+private:
+    ostream& o_;
+};
+
+
+class fd_sink: public backtrace_format::sink
+{
+public:
+    explicit fd_sink(int fd) : fd_(fd) {}
+    ~fd_sink() { flush (); }
+
+    void put(const char* p, size_t n) override
+    {
+        if (n > sizeof(buf_) - n_)
+            flush ();
+        if (n > sizeof(buf_))
+            write_all (p, n);
+        else
+        {
+            memcpy (buf_ + n_, p, n);
+            n_ += n;
+        }
+    }
+
+private:
+    void flush()
+    {
+        write_all (buf_, n_);
+        n_ = 0;
+    }
+
+    void write_all(const char* p, size_t n)
+    {
+        while (n > 0)
+        {
+#ifdef _MSC_VER
+            int w = _write (fd_, p, (unsigned)n);
+#else
+            ssize_t w = ::write (fd_, p, n);
+#endif
+            if (w <= 0)
+                return;
+            p += w;
+            n -= w;
+        }
+    }
+
+    int fd_;
+    char buf_[4096];
+    size_t n_ = 0;
+};
+
+
+class buffer_sink: public backtrace_format::sink
+{
+public:
+    buffer_sink(char* buf, size_t size) : buf_(buf), size_(size)
+    {
+        if (size_)
+            buf_[0] = 0;
+    }
+
+    void put(const char* p, size_t n) override
+    {
+        if (n_ + 1 < size_)
+        {
+            size_t k = min(n, size_ - 1 - n_);
+            memcpy (buf_ + n_, p, k);
+            buf_[n_ + k] = 0;
+        }
+        n_ += n;
+    }
+
+    size_t length() const { return n_; }
+
+private:
+    char* buf_;
+    size_t size_;
+    size_t n_ = 0;
+};
+
+
+void put(backtrace_format::sink& s, const char* p)
+{
+    s.put (p, strlen (p));
+}
+
+
+// A name buffer allocated with malloc, as __cxa_demangle reallocs it
+struct name_buffer {
+    char* data = 0;
+    size_t size = 0;
+
+    name_buffer() = default;
+    name_buffer(const name_buffer&) = delete;
+    name_buffer& operator=(const name_buffer&) = delete;
+    ~name_buffer() { free (data); }
+
+    void assign(const char* s)
+    {
+        size_t n = strlen (s) + 1;
+        if (n > size)
+        {
+            char* d = (char*)realloc (data, n);
+            if (!d)
+                return;
+            data = d;
+            size = n;
+        }
+        memcpy (data, s, n);
+    }
+
+    void swap(name_buffer& b)
+    {
+        std::swap (data, b.data);
+        std::swap (size, b.size);
+    }
+};
+
+
+// Replaces each 'from' in 's' with 'to', which is no longer than 'from'
+void abbreviate_in_place(char* s, const string& from, const string& to)
+{
+    char* w = s;
+    const char* r = s;
+    while (const char* p = strstr (r, from.c_str ()))
+    {
+        memmove (w, r, p - r);
+        w += p - r;
+        memcpy (w, to.data (), to.size ());
+        w += to.size ();
+        r = p + from.size ();
+    }
+    memmove (w, r, strlen (r) + 1);
+}
+
+
+// True if 'p' is directly within the template arguments '<...>' of 's',
+// and not within the parameters '(...)' of a function
+bool in_template_arguments(const char* s, const char* p)
+{
+    int depth = 0;
+    while (s < p)
+    {
+        char c = *--p;
+        if (c == '>' || c == ')')
+            depth++;
+        else if (c == '<' || c == '(')
+        {
+            if (0 == depth)
+                return c == '<';
+            depth--;
+        }
+    }
+    return false;
+}
+
+
+// Removes each template argument of 's' that starts with 'prefix'
+void elide_in_place(char* s, const string& prefix)
+{
+    string what = ", " + prefix;
+    char* p = s;
+    while ((p = strstr (p, what.c_str ())))
+    {
+        if (!in_template_arguments (s, p))
+        {
+            p += what.size ();
+            continue;
+        }
+
+        // Find the end of the argument, which may be a function type
+        int depth = 0;
+        char* e = p + 2;
+        for (; *e; e++)
+        {
+            if (*e == '<' || *e == '(')
+                depth++;
+            else if ((*e == '>' || *e == ')') && 0 == depth--)
+                break;
+            else if (*e == ',' && 0 == depth)
+                break;
+        }
+
+        // Also removes the space in '> >'
+        memmove (p, e, strlen (e) + 1);
+    }
+}
+
+
+struct frame_info {
+    const char* module = 0;
+    size_t offset = 0;
+    bool has_symbol = false;
+};
+
+
+// dladdr scans the symbol table, remember what it found for each address.
+// The names are demangled but not abbreviated
+struct symbol {
+    frame_info info;
+    string name;
+};
+
+struct symbol_cache {
+    static const size_t max_size = 1 << 16;
+
+    mutex lock;
+    unordered_map<void*, symbol> symbols;
+};
+
+symbol_cache& S()
+{
+    static symbol_cache* s = new symbol_cache;
+    return *s;
+}
+
+
+symbol lookup(void* pc, name_buffer& b)
+{
+    symbol s;
+#ifndef _MSC_VER
+    Dl_info info;
+    if (dladdr (pc, &info))
+    {
+        s.info.module = info.dli_fname;
+        if (info.dli_sname)
+        {
+            s.info.has_symbol = true;
+            s.info.offset = (char*)pc - (char*)info.dli_saddr;
+
+            int status = -1;
+            char* d = abi::__cxa_demangle (info.dli_sname, b.data, b.data ? &b.size : 0, &status);
+            if (0 == status && d)
+            {
+                if (!b.data)
+                    b.size = strlen (d) + 1;
+                b.data = d;
+                s.name = d;
+            }
+            else
+                s.name = info.dli_sname;
+        }
+    }
+#else
+    (void)pc;
+    (void)b;
+#endif
+    return s;
+}
+
+
+// Writes the name of the function containing 'pc' to 'b'
+frame_info resolve(void* pc, name_buffer& b, const vector<pair<string, string>>& abbreviations, const vector<string>& elisions)
+{
+    frame_info f;
+    symbol_cache& c = S();
+    bool found;
+    {
+        unique_lock<mutex> l(c.lock);
+        auto i = c.symbols.find (pc);
+        found = i != c.symbols.end ();
+        if (found)
+        {
+            f = i->second.info;
+            b.assign (i->second.name.c_str ());
+        }
+    }
+
+    if (!found)
+    {
+        // Without the lock, other threads can print known frames while
+        // dladdr scans the symbol table. Two threads may look up the same
+        // address, the first one is kept
+        symbol s = lookup (pc, b);
+        f = s.info;
+        b.assign (s.name.c_str ());
+
+        unique_lock<mutex> l(c.lock);
+        if (c.symbols.size () < symbol_cache::max_size)
+            c.symbols.insert (make_pair (pc, move(s)));
+    }
+
+    if (!f.has_symbol)
+    {
+        char addr[32];
+        snprintf (addr, sizeof(addr), "%p", pc);
+        b.assign (addr);
+    }
+    else
+    {
+        for (const auto& a : abbreviations)
+            abbreviate_in_place (b.data, a.first, a.second);
+        for (const auto& e : elisions)
+            elide_in_place (b.data, e);
+    }
+
+    return f;
+}
+
+
+int find_match(const vector<string>& patterns, const char* name)
+{
+    for (size_t i=0; i<patterns.size (); i++)
+        if (backtrace_format::match (patterns[i].c_str (), name))
+            return (int)i;
+    return -1;
+}
+
+} // namespace
+
+
+backtrace_format::
+        backtrace_format()
+{
+    abbreviate ("std::__1::", "std::");
+    abbreviate ("std::__cxx11::", "std::");
+    abbreviate ("std::basic_string<char, std::char_traits<char>, std::allocator<char> >", "std::string");
+    abbreviate ("std::basic_ostream<char, std::char_traits<char> >", "std::ostream");
+    abbreviate ("std::basic_istream<char, std::char_traits<char> >", "std::istream");
+    elide ("std::allocator<");
+    elide ("std::less<");
+    elide ("std::equal_to<");
+    elide ("std::hash<");
+    elide ("std::default_delete<");
+
+    drop ("std::_Function_handler<*");
+    drop ("std::function<*>::operator()*");
+    drop ("std::__function::*");
+    drop ("std::__invoke*");
+    drop ("boost::exception_detail::*");
+    drop ("__libc_start_main");
+    drop ("__libc_start_call_main");
+    drop ("_start");
+    drop ("start");
+    drop ("start_thread");
+    drop ("_pthread_start");
+    drop ("thread_start");
+    drop ("clone");
+    drop ("clone3");
+    drop ("_sigtramp");
+    drop ("__restore_rt");
+
+    collapse ("std::*");
+    collapse ("boost::*");
+}
+
+
+backtrace_format backtrace_format::
+        full()
+{
+    backtrace_format f;
+    f.drop_.clear ();
+    f.collapse_.clear ();
+    f.abbreviate_.clear ();
+    f.elide_.clear ();
+    f.addresses_ = true;
+    return f;
+}
+
+
+backtrace_format& backtrace_format::
+        drop(const string& pattern)
+{
+    drop_.push_back (pattern);
+    return *this;
+}
+
+
+backtrace_format& backtrace_format::
+        collapse(const string& pattern)
+{
+    collapse_.push_back (pattern);
+    return *this;
+}
+
+
+backtrace_format& backtrace_format::
+        abbreviate(const string& from, const string& to)
+{
+    EXCEPTION_ASSERT(!from.empty ());
+    EXCEPTION_ASSERT_LESS_OR_EQUAL(to.size (), from.size ());
+
+    abbreviate_.push_back (make_pair (from, to));
+    return *this;
+}
+
+
+backtrace_format& backtrace_format::
+        elide(const string& prefix)
+{
+    EXCEPTION_ASSERT(!prefix.empty ());
+
+    elide_.push_back (prefix);
+    return *this;
+}
+
+
+backtrace_format& backtrace_format::
+        addresses(bool show)
+{
+    addresses_ = show;
+    return *this;
+}
+
+
+void backtrace_format::
+        write(sink& s, const Backtrace& b) const
+{
+    const vector<void*>& frames = b.frames ();
+    if (frames.empty ())
+    {
+        // Windows only has the pretty print, or make failed
+        string t = b.to_string ();
+        s.put (t.data (), t.size ());
+        return;
+    }
+
+    write (s, "backtrace", &frames[0], frames.size ());
+
+    for (task_origin::id i = b.origin (); i; i = task_origin::parent (i))
+    {
+        vector<void*> f = task_origin::frames (i);
+        put (s, "\n");
+        write (s, "submitted from", f.data (), f.size ());
+    }
+}
+
+
+void backtrace_format::
+        write(ostream& o, const Backtrace& b) const
+{
+    ostream_sink s(o);
+    write (s, b);
+}
+
+
+void backtrace_format::
+        write(int fd, const Backtrace& b) const
+{
+    fd_sink s(fd);
+    write (s, b);
+}
+
+
+string backtrace_format::
+        to_string(const Backtrace& b) const
+{
+    ostringstream o;
+    write (o, b);
+    return o.str ();
+}
+
+
+void backtrace_format::
+        write(sink& s, void* const* frames, size_t n) const
+{
+    write (s, "backtrace", frames, n);
+}
+
+
+void backtrace_format::
+        write(ostream& o, void* const* frames, size_t n) const
+{
+    ostream_sink s(o);
+    write (s, frames, n);
+}
+
+
+void backtrace_format::
+        write(int fd, void* const* frames, size_t n) const
+{
+    fd_sink s(fd);
+    write (s, frames, n);
+}
+
+
+size_t backtrace_format::
+        write(char* buf, size_t size, void* const* frames, size_t n) const
+{
+    buffer_sink s(buf, size);
+    write (s, frames, n);
+    return s.length ();
+}
+
+
+bool backtrace_format::
+        match(const char* pattern, const char* name)
+{
+    // Where to continue if the last '*' should match one more character
+    const char* star = 0;
+    const char* star_name = 0;
+
+    while (*name)
+    {
+        if (*pattern == '*')
+        {
+            star = ++pattern;
+            star_name = name;
+        }
+        else if (*pattern == *name)
+        {
+            pattern++;
+            name++;
+        }
+        else if (star)
+        {
+            pattern = star;
+            name = ++star_name;
+        }
+        else
+            return false;
+    }
+
+    while (*pattern == '*')
+        pattern++;
+    return !*pattern;
+}
+
+
+void backtrace_format::
+        write(sink& s, const char* title, void* const* frames, size_t n) const
+{
+    char line[128];
+    snprintf (line, sizeof(line), "%s (%d frames)\n", title, (int)n);
+    put (s, line);
+
+    // A run of frames that match the same collapse pattern, the name of its
+    // first frame is kept in 'first' in case the run ends there
+    name_buffer name, first;
+    int run_pattern = -1;
+    size_t run_start = 0, run_length = 0;
+    frame_info run_info;
+
+    auto write_frame = [&](size_t i, const char* name, const frame_info& f, void* pc)
+    {
+        snprintf (line, sizeof(line), "%-5d", (int)i);
+        put (s, line);
+        put (s, name);
+        if (addresses_)
+        {
+            if (f.has_symbol)
+            {
+                snprintf (line, sizeof(line), " (+0x%lx)", (unsigned long)f.offset);
+                put (s, line);
+            }
+            snprintf (line, sizeof(line), " [%p]", pc);
+            put (s, line);
+            if (f.module)
+            {
+                const char* m = strrchr (f.module, '/');
+                put (s, " ");
+                put (s, m ? m + 1 : f.module);
+            }
+        }
+        put (s, "\n");
+    };
+
+    auto end_run = [&]()
+    {
+        if (1 == run_length)
+            write_frame (run_start, first.data, run_info, frames[run_start]);
+        else if (1 < run_length)
+        {
+            snprintf (line, sizeof(line), "%-5d... %d frames matching ", (int)run_start, (int)run_length);
+            put (s, line);
+            put (s, collapse_[run_pattern].c_str ());
+            put (s, "\n");
+        }
+        run_pattern = -1;
+        run_length = 0;
+    };
+
+    for (size_t i=0; i<n; i++)
+    {
+        void* pc = stack_depot::caller (frames[i]);
+        frame_info f = resolve (pc, name, abbreviate_, elide_);
+        if (!name.data)
+            continue;
+
+        if (0 <= find_match (drop_, name.data))
+            continue;
+
+        int c = find_match (collapse_, name.data);
+        if (0 <= c && c == run_pattern)
+        {
+            run_length++;
+            continue;
+        }
+
+        end_run ();
+
+        if (0 <= c)
+        {
+            run_pattern = c;
+            run_start = i;
+            run_length = 1;
+            run_info = f;
+            first.swap (name);
+        }
+        else
+            write_frame (i, name.data, f, frames[i]);
+    }
+
+    end_run ();
+}
+
+
+namespace backtrace_format_test {
+
+#ifdef __GNUC__
+#define NOINLINE __attribute__((noinline))
+#else
+#define NOINLINE
+#endif
+
+volatile int calls = 0;
+
+NOINLINE Backtrace inner()
+{
+    return Backtrace::make ().value ();
+}
+
+// Not known to middle, so that the call goes through std::function
+std::function<Backtrace()> call_inner = []()
+{
+    Backtrace b = inner ();
+    calls++;
+    return b;
+};
+
+NOINLINE Backtrace middle()
+{
+    Backtrace b = call_inner ();
+    calls++;
+    return b;
+}
+
+NOINLINE Backtrace recurse(int n)
+{
+    Backtrace b = 0 < n ? recurse (n - 1) : middle ();
+    // Not a tail call
+    calls++;
+    return b;
+}
+
+NOINLINE Backtrace outer(const vector<int>& v)
+{
+    return recurse ((int)v.size ());
+}
+
+} // namespace backtrace_format_test
+
+using namespace backtrace_format_test;
+
+void backtrace_format::
+        test()
+{
+    // It should match whole names with '*' for any characters
+    {
+        EXCEPTION_ASSERT(match ("std::*", "std::vector<int>::at(unsigned long)"));
+        EXCEPTION_ASSERT(match ("*", ""));
+        EXCEPTION_ASSERT(match ("a*b*c", "aXbYbZc"));
+        EXCEPTION_ASSERT(match ("start", "start"));
+        EXCEPTION_ASSERT(!match ("start", "start_thread"));
+        EXCEPTION_ASSERT(!match ("_start", "__libc_start_main"));
+        EXCEPTION_ASSERT(!match ("a*b", "aXbY"));
+    }
+
+    // It should elide template arguments but not function parameters
+    {
+        char m[] = "std::map<int, int, std::less<int>, std::allocator<std::pair<int const, int> > >::at(int const&)";
+        elide_in_place (m, "std::less<");
+        elide_in_place (m, "std::allocator<");
+        EXCEPTION_ASSERT_EQUALS(string(m), "std::map<int, int>::at(int const&)");
+
+        char f[] = "f(int, std::hash<int> const&) const";
+        elide_in_place (f, "std::hash<");
+        EXCEPTION_ASSERT_EQUALS(string(f), "f(int, std::hash<int> const&) const");
+
+        char g[] = "g<int, std::hash<int> >(int, std::hash<int> const&)";
+        elide_in_place (g, "std::hash<");
+        EXCEPTION_ASSERT_EQUALS(string(g), "g<int>(int, std::hash<int> const&)");
+
+        char h[] = "h<void (int, std::less<int>), std::less<int> >()";
+        elide_in_place (h, "std::less<");
+        EXCEPTION_ASSERT_EQUALS(string(h), "h<void (int, std::less<int>)>()");
+    }
+
+#ifndef _MSC_VER
+    Backtrace b = outer (vector<int>(4));
+
+    // It should leave out the frames that only add noise, and be much
+    // shorter than Backtrace::to_string
+    {
+        string d = backtrace_format ().to_string (b);
+        string f = full ().to_string (b);
+        EXCEPTION_ASSERTX(d.find ("backtrace_format_test::inner()") != string::npos, d);
+        EXCEPTION_ASSERTX(d.find ("backtrace_format_test::middle()") != string::npos, d);
+        EXCEPTION_ASSERTX(d.find ("backtrace_format_test::outer(std::vector<int> const&)") != string::npos, d);
+        EXCEPTION_ASSERTX(d.find ("backtrace_format::test()") != string::npos, d);
+        EXCEPTION_ASSERTX(d.find ("__libc_start_main") == string::npos, d);
+        EXCEPTION_ASSERTX(f.find ("backtrace_format_test::inner() (+0x") != string::npos, f);
+#ifdef __GLIBCXX__
+        EXCEPTION_ASSERTX(d.find ("_Function_handler") == string::npos, d);
+        EXCEPTION_ASSERTX(f.find ("_Function_handler") != string::npos, f);
+#endif
+        EXCEPTION_ASSERT_EQUALS(d.substr (0, 10), "backtrace ");
+        EXCEPTION_ASSERT_LESS(2*d.size (), b.to_string ().size ());
+    }
+
+    // It should drop, collapse and abbreviate by the rules it's given
+    {
+        backtrace_format f;
+        f.abbreviate ("backtrace_format_test::", "bft::")
+         .drop ("bft::middle()")
+         .collapse ("bft::recurse(int)");
+        string s = f.to_string (b);
+        EXCEPTION_ASSERTX(s.find ("bft::inner()") != string::npos, s);
+        EXCEPTION_ASSERTX(s.find ("middle") == string::npos, s);
+        EXCEPTION_ASSERTX(s.find ("... 5 frames matching bft::recurse(int)\n") != string::npos, s);
+        EXCEPTION_ASSERTX(s.find ("bft::outer(") != string::npos, s);
+        EXCEPTION_ASSERTX(s.find ("backtrace_format_test") == string::npos, s);
+
+        EXPECT_EXCEPTION(ExceptionAssert, f.abbreviate ("std", "standard"));
+    }
+
+    // It should write the same text to a buffer, a file descriptor and a
+    // stream
+    {
+        backtrace_format f;
+        const vector<void*>& frames = b.frames ();
+        ostringstream o;
+        f.write (o, &frames[0], frames.size ());
+        string s = o.str ();
+
+        char buf[4096];
+        EXCEPTION_ASSERT_EQUALS(f.write (buf, sizeof(buf), &frames[0], frames.size ()), s.size ());
+        EXCEPTION_ASSERT_EQUALS(string(buf), s);
+
+        char small[16];
+        EXCEPTION_ASSERT_EQUALS(f.write (small, sizeof(small), &frames[0], frames.size ()), s.size ());
+        EXCEPTION_ASSERT_EQUALS(string(small), s.substr (0, 15));
+
+        FILE* t = tmpfile ();
+        EXCEPTION_ASSERT(t);
+        f.write (fileno (t), &frames[0], frames.size ());
+        rewind (t);
+        size_t n = fread (buf, 1, sizeof(buf), t);
+        fclose (t);
+        EXCEPTION_ASSERT_EQUALS(string(buf, n), s);
+    }
+
+    // It should be faster than Backtrace::to_string once it has seen the
+    // addresses, and cheap enough to format backtraces in error logs
+    {
+        backtrace_format f;
+        const vector<void*>& frames = b.frames ();
+        char buf[4096];
+        f.write (buf, sizeof(buf), &frames[0], frames.size ());
+
+        // A copy that hasn't cached its pretty print
+        const Backtrace c = outer (vector<int>(4));
+        Timer t;
+        for (int i=0; i<10; i++)
+            c.to_string ();
+        double T = t.elapsedAndRestart ();
+        for (int i=0; i<10; i++)
+            f.write (buf, sizeof(buf), &frames[0], frames.size ());
+        EXCEPTION_ASSERT_LESS(t.elapsed (), T);
+
+        TRACE_PERF("backtrace_format 100 backtraces");
+        for (int i=0; i<100; i++)
+            f.write (buf, sizeof(buf), &frames[0], frames.size ());
+    }
+#endif
+}
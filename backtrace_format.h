@@ -0,0 +1,110 @@
+#ifndef BACKTRACE_FORMAT_H
+#define BACKTRACE_FORMAT_H
+
+#include <cstddef>
+#include <iosfwd>
+#include <string>
+#include <utility>
+#include <vector>
+
+class Backtrace;
+
+/**
+ * @brief The backtrace_format class should write a backtrace with only the
+ * frames that matter, under short names, straight to a stream, a file
+ * descriptor or a buffer.
+ *
+ *        backtrace_format f;                   // the default rules
+ *        f.drop ("myapp::dispatch*");
+ *        f.write (std::cerr, Backtrace::make ().value ());
+ *
+ * Example output with the default rules:
+ *
+ *        backtrace (16 frames)
+ *        0    decoder::parse(std::string const&)
+ *        1    ... 4 frames matching std::*
+ *        7    worker::run()
+ *
+ * The rules apply to the demangled name of each frame:
+ *
+ *   abbreviate   replaces each 'from' with 'to', in the order the rules were
+ *                added. 'to' can't be longer than 'from'.
+ *   elide        removes the template arguments that start with 'prefix',
+ *                such as default allocators.
+ *   drop         leaves out the frames that match a pattern.
+ *   collapse     writes a run of frames that match the same pattern as one
+ *                line, dropped frames don't break a run.
+ *
+ * A pattern matches the whole name, '*' matches any characters.
+ *
+ * The default rules drop std::function and boost::exception plumbing, the C
+ * runtime entry points and signal trampolines, collapse runs of std:: and
+ * boost:: frames, and shorten inline namespaces of the standard library and
+ * std::string, and elide default allocators and comparators. full has no
+ * rules and prints the address of each frame.
+ *
+ * The demangled name of each address is looked up once and kept, and the
+ * rules are applied in a buffer that is reused. The output is written in
+ * chunks without building strings. Backtrace::to_string keeps its own format.
+ */
+class backtrace_format
+{
+public:
+    /**
+     * @brief The sink class should take the text as it's written.
+     */
+    class sink {
+    public:
+        virtual ~sink () {}
+        virtual void put (const char* p, std::size_t n) = 0;
+    };
+
+    backtrace_format ();
+    static backtrace_format full ();
+
+    backtrace_format& drop (const std::string& pattern);
+    backtrace_format& collapse (const std::string& pattern);
+    backtrace_format& abbreviate (const std::string& from, const std::string& to);
+    backtrace_format& elide (const std::string& prefix);
+
+    /**
+     * @brief addresses appends the offset in the function, the address and
+     * the module to each frame.
+     */
+    backtrace_format& addresses (bool show);
+
+    /**
+     * @brief write writes 'b' followed by the stacks that submitted its
+     * task, see task_origin.
+     */
+    void write (sink& s, const Backtrace& b) const;
+    void write (std::ostream& o, const Backtrace& b) const;
+    void write (int fd, const Backtrace& b) const;
+    std::string to_string (const Backtrace& b) const;
+
+    /**
+     * @brief write writes 'n' return addresses, innermost first.
+     */
+    void write (sink& s, void* const* frames, std::size_t n) const;
+    void write (std::ostream& o, void* const* frames, std::size_t n) const;
+    void write (int fd, void* const* frames, std::size_t n) const;
+
+    /**
+     * @brief write writes at most 'size' - 1 characters and a terminating
+     * zero to 'buf'. Returns the length of the whole text, like snprintf.
+     */
+    std::size_t write (char* buf, std::size_t size, void* const* frames, std::size_t n) const;
+
+    static bool match (const char* pattern, const char* name);
+
+    static void test ();
+
+private:
+    void write (sink& s, const char* title, void* const* frames, std::size_t n) const;
+
+    std::vector<std::string> drop_, collapse_, elide_;
+    std::vector<std::pair<std::string, std::string>> abbreviate_;
+    bool addresses_ = false;
+};
+
+#endif // BACKTRACE_FORMAT_H
@@ -0,0 +1,414 @@
+#include "backtrace_policy.h"
+#include "demangle.h"
+#include "exceptionassert.h"
+#include "trace_perf.h"
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <stdio.h>
+#include <string.h>
+
+using namespace std;
+
+namespace {
+
+typedef chrono::steady_clock clock_type;
+
+struct site {
+    string name;
+    bool own_budget = false;
+    backtrace_policy::budget b;
+
+    double tokens = 0;
+    clock_type::time_point filled;
+    clock_type::time_point minute;
+    unsigned in_minute = 0;
+
+    uint64_t calls = 0;
+    uint64_t captured = 0;
+    uint64_t skipped = 0;
+    uint64_t skipped_since = 0; // since the last capture
+
+    void set_budget(const backtrace_policy::budget& x)
+    {
+        b = x;
+        tokens = x.burst;
+        filled = clock_type::now ();
+        minute = filled;
+        in_minute = 0;
+    }
+};
+
+// A file and line, or a type with line -1. Compared by the text of the file
+// or type, the same __FILE__ may have a different address in each
+// translation unit
+struct site_key {
+    const char* name;
+    int line;
+
+    bool operator==(const site_key& k) const
+    {
+        return line == k.line && 0 == strcmp (name, k.name);
+    }
+};
+
+struct site_key_hash {
+    size_t operator()(const site_key& k) const
+    {
+        // FNV-1a
+        uint64_t h = 14695981039346656037ull;
+        for (const char* p = k.name; *p; p++)
+            h = (h ^ (unsigned char)*p) * 1099511628211ull;
+        return (size_t)(h ^ ((uint64_t)k.line * 0x9e3779b97f4a7c15ull));
+    }
+};
+
+struct policy {
+    mutex lock;
+    backtrace_policy::budget default_budget;
+    map<string, backtrace_policy::budget> budgets;
+    unordered_set<string> names; // the text of each site_key in 'sites'
+    unordered_map<site_key, site, site_key_hash> sites;
+};
+
+policy& P()
+{
+    static policy* p = new policy;
+    return *p;
+}
+
+string site_name(const site_key& k)
+{
+    const char* file = k.name;
+    for (const char* p = k.name; *p; p++)
+        if (*p == '/' || *p == '\\')
+            file = p + 1;
+    return string(file) + ":" + to_string (k.line);
+}
+
+// Assumes 'p.lock' is held
+site& find_site(policy& p, const site_key& k, const char* type_name)
+{
+    auto i = p.sites.find (k);
+    if (i != p.sites.end ())
+        return i->second;
+
+    // The key outlives the text it was given
+    site_key owned{p.names.insert (k.name).first->c_str (), k.line};
+    site& s = p.sites[owned];
+    s.name = type_name ? demangle (type_name) : site_name (k);
+    auto b = p.budgets.find (s.name);
+    s.own_budget = b != p.budgets.end ();
+    s.set_budget (s.own_budget ? b->second : p.default_budget);
+    return s;
+}
+
+// Assumes the lock of the policy is held
+bool admit(site& s)
+{
+    const backtrace_policy::budget& b = s.b;
+    s.calls++;
+
+    bool unlimited = 0 == b.first_per_minute && 0 == b.per_second && 0 == b.one_in;
+    bool ok = unlimited;
+
+    if (!ok && 0 < b.first_per_minute)
+    {
+        clock_type::time_point now = clock_type::now ();
+        if (now - s.minute >= chrono::minutes(1))
+        {
+            s.minute = now;
+            s.in_minute = 0;
+        }
+        ok = s.in_minute < b.first_per_minute;
+        s.in_minute++;
+    }
+
+    if (!ok && 0 < b.per_second)
+    {
+        clock_type::time_point now = clock_type::now ();
+        double dt = chrono::duration<double>(now - s.filled).count ();
+        s.filled = now;
+        s.tokens = min(b.burst, s.tokens + dt * b.per_second);
+        if (1 <= s.tokens)
+        {
+            s.tokens -= 1;
+            ok = true;
+        }
+    }
+
+    if (!ok && 0 < b.one_in)
+        ok = 0 == (s.calls - 1) % b.one_in;
+
+    if (ok)
+    {
+        s.captured++;
+        s.skipped_since = 0;
+    }
+    else
+    {
+        s.skipped++;
+        s.skipped_since++;
+    }
+    return ok;
+}
+
+// Returns true if a backtrace should be captured, or the placeholder text
+bool admit(const site_key& k, const char* type_name, string& placeholder)
+{
+    policy& p = P();
+    unique_lock<mutex> l(p.lock);
+    site& s = find_site (p, k, type_name);
+    if (admit (s))
+        return true;
+
+    char count[64];
+    snprintf (count, sizeof(count), ", %llu skipped since the last one captured there\n",
+              (unsigned long long)s.skipped_since);
+    placeholder = "backtrace skipped at " + s.name + count;
+    return false;
+}
+
+} // namespace
+
+
+void backtrace_policy::
+        set_default(const budget& b)
+{
+    policy& p = P();
+    unique_lock<mutex> l(p.lock);
+    p.default_budget = b;
+    for (auto& s : p.sites)
+        if (!s.second.own_budget)
+            s.second.set_budget (b);
+}
+
+
+void backtrace_policy::
+        set(const string& name, const budget& b)
+{
+    policy& p = P();
+    unique_lock<mutex> l(p.lock);
+    p.budgets[name] = b;
+    for (auto& s : p.sites)
+        if (s.second.name == name)
+        {
+            s.second.own_budget = true;
+            s.second.set_budget (b);
+        }
+}
+
+
+void backtrace_policy::
+        reset()
+{
+    policy& p = P();
+    unique_lock<mutex> l(p.lock);
+    p.default_budget = budget();
+    p.budgets.clear ();
+    p.sites.clear ();
+    p.names.clear ();
+}
+
+
+bool backtrace_policy::
+        capture(const char* file, int line)
+{
+    policy& p = P();
+    unique_lock<mutex> l(p.lock);
+    return admit (find_site (p, site_key{file, line}, 0));
+}
+
+
+Backtrace::info backtrace_policy::
+        make(const char* file, int line, int skipframes)
+{
+    string placeholder;
+    if (admit (site_key{file, line}, 0, placeholder))
+        return Backtrace::make (skipframes+1);
+
+    Backtrace b;
+    b.pretty_print_ = placeholder;
+    return Backtrace::info(b);
+}
+
+
+Backtrace::info backtrace_policy::
+        make(const type_info& t, int skipframes)
+{
+    string placeholder;
+    if (admit (site_key{t.name (), -1}, t.name (), placeholder))
+        return Backtrace::make (skipframes+1);
+
+    Backtrace b;
+    b.pretty_print_ = placeholder;
+    return Backtrace::info(b);
+}
+
+
+string backtrace_policy::
+        make_string(const char* file, int line, int skipframes)
+{
+    string placeholder;
+    if (admit (site_key{file, line}, 0, placeholder))
+        return Backtrace::make_string (skipframes+1);
+    return placeholder;
+}
+
+
+vector<backtrace_policy::site_stats> backtrace_policy::
+        sites()
+{
+    vector<site_stats> v;
+    {
+        policy& p = P();
+        unique_lock<mutex> l(p.lock);
+        for (const auto& s : p.sites)
+            v.push_back (site_stats{s.second.name, s.second.captured, s.second.skipped});
+    }
+
+    sort (v.begin (), v.end (), [](const site_stats& a, const site_stats& b) { return a.site < b.site; });
+    return v;
+}
+
+
+namespace backtrace_policy_test {
+
+const backtrace_policy::site_stats* find(const vector<backtrace_policy::site_stats>& v, const string& site)
+{
+    for (const auto& s : v)
+        if (s.site == site)
+            return &s;
+    return 0;
+}
+
+bool is_skipped(const Backtrace::info& b)
+{
+    return 0 == b.value ().to_string ().find ("backtrace skipped at ");
+}
+
+int skipped_in(int n, const char* file)
+{
+    int k = 0;
+    for (int i=0; i<n; i++)
+        k += is_skipped (backtrace_policy::make (file, 1));
+    return k;
+}
+
+struct lock_type {};
+
+// Removes the budgets of the test also when an assertion fails
+struct reset_scope {
+    reset_scope() { backtrace_policy::reset (); }
+    ~reset_scope() { backtrace_policy::reset (); }
+};
+
+} // namespace backtrace_policy_test
+
+using namespace backtrace_policy_test;
+
+void backtrace_policy::
+        test()
+{
+    reset_scope r;
+
+    // It should capture every backtrace of a site without a budget
+    {
+        EXCEPTION_ASSERT_EQUALS(skipped_in (3, "dir/backtrace_policy_test_a.cpp"), 0);
+        vector<site_stats> v = sites ();
+        const site_stats* s = find (v, "backtrace_policy_test_a.cpp:1");
+        EXCEPTION_ASSERT(s);
+        EXCEPTION_ASSERT_EQUALS(s->captured, 3u);
+        EXCEPTION_ASSERT_EQUALS(s->skipped, 0u);
+    }
+
+    // It should count a file by its text, not the address of the text
+    {
+        char a[] = "backtrace_policy_test_f.cpp";
+        char b[] = "backtrace_policy_test_f.cpp";
+        capture (a, 1);
+        capture (b, 1);
+
+        vector<site_stats> v = sites ();
+        const site_stats* s = find (v, "backtrace_policy_test_f.cpp:1");
+        EXCEPTION_ASSERT(s);
+        EXCEPTION_ASSERT_EQUALS(s->captured, 2u);
+        EXCEPTION_ASSERT_EQUALS(count_if (v.begin (), v.end (), [](const site_stats& x) {
+            return x.site == "backtrace_policy_test_f.cpp:1"; }), 1);
+    }
+
+    // It should capture the first backtraces of each minute
+    {
+        budget b;
+        b.first_per_minute = 2;
+        set ("backtrace_policy_test_b.cpp:1", b);
+        EXCEPTION_ASSERT_EQUALS(skipped_in (4, "backtrace_policy_test_b.cpp"), 2);
+
+        string s = make ("backtrace_policy_test_b.cpp", 1).value ().to_string ();
+        EXCEPTION_ASSERT_EQUALS(s, "backtrace skipped at backtrace_policy_test_b.cpp:1, 3 skipped since the last one captured there\n");
+        EXCEPTION_ASSERT_EQUALS(make_string ("backtrace_policy_test_b.cpp", 1).substr (0, 21), "backtrace skipped at ");
+    }
+
+    // It should sample one in n
+    {
+        budget b;
+        b.one_in = 3;
+        set ("backtrace_policy_test_c.cpp:1", b);
+        EXCEPTION_ASSERT(capture ("backtrace_policy_test_c.cpp", 1));
+        EXCEPTION_ASSERT_EQUALS(skipped_in (6, "backtrace_policy_test_c.cpp"), 4);
+        vector<site_stats> v = sites ();
+        const site_stats* s = find (v, "backtrace_policy_test_c.cpp:1");
+        EXCEPTION_ASSERT(s);
+        EXCEPTION_ASSERT_EQUALS(s->captured, 3u);
+        EXCEPTION_ASSERT_EQUALS(s->skipped, 4u);
+    }
+
+    // It should take tokens from a bucket that fills over time
+    {
+        budget b;
+        b.per_second = 1e-6;
+        b.burst = 2;
+        set ("backtrace_policy_test_d.cpp:1", b);
+        EXCEPTION_ASSERT_EQUALS(skipped_in (5, "backtrace_policy_test_d.cpp"), 3);
+
+        b.per_second = 1e6;
+        set ("backtrace_policy_test_d.cpp:1", b);
+        EXCEPTION_ASSERT_EQUALS(skipped_in (2, "backtrace_policy_test_d.cpp"), 0);
+    }
+
+    // It should name sites of types after the type
+    {
+        budget b;
+        b.first_per_minute = 1;
+        set_default (b);
+        EXCEPTION_ASSERT(!is_skipped (make (typeid(lock_type))));
+        EXCEPTION_ASSERT(is_skipped (make (typeid(lock_type))));
+        EXCEPTION_ASSERT(find (sites (), "backtrace_policy_test::lock_type"));
+    }
+
+    // It should attach a placeholder to an ExceptionAssert when the budget
+    // of its site is used up
+    {
+        string what[2];
+        for (int i=0; i<2; i++)
+            try {
+                EXCEPTION_ASSERT(i < 0);
+            } catch (const ExceptionAssert& x) {
+                what[i] = boost::diagnostic_information (x);
+            }
+
+        EXCEPTION_ASSERTX(what[0].find ("backtrace_policy::test") != string::npos, what[0]);
+        EXCEPTION_ASSERTX(what[1].find ("backtrace skipped at backtrace_policy.cpp:") != string::npos, what[1]);
+    }
+
+    // It should be cheap to skip a capture
+    {
+        TRACE_PERF("backtrace_policy 10000 skipped captures");
+        for (int i=0; i<10000; i++)
+            make ("backtrace_policy_test_e.cpp", 1);
+    }
+}
@@ -0,0 +1,87 @@
+#ifndef BACKTRACE_POLICY_H
+#define BACKTRACE_POLICY_H
+
+#include "backtrace.h"
+
+#include <cstdint>
+#include <string>
+#include <typeinfo>
+#include <vector>
+
+/**
+ * @brief The backtrace_policy class should limit how many backtraces each call
+ * site captures, so that a storm of errors doesn't spend its time capturing
+ * and symbolizing the same stack over and over.
+ *
+ * ExceptionAssert and the lock timeouts of shared_state_traits_backtrace
+ * capture through the policy. The signal handlers of PrettifySegfault don't,
+ * they may have interrupted a thread that holds the lock of the policy. Each
+ * site is a file and line or the type of a lock. Every site is unlimited
+ * until a budget is set:
+ *
+ *        backtrace_policy::budget b;
+ *        b.first_per_minute = 10;
+ *        b.one_in = 1000;
+ *        backtrace_policy::set_default (b);
+ *        backtrace_policy::set ("decoder.cpp:120", b);
+ *
+ * A capture is allowed if any part of the budget allows it:
+ *
+ *   first_per_minute   the first captures of each minute.
+ *   per_second, burst  a token bucket that fills with 'per_second' tokens
+ *                      per second up to 'burst' tokens, a capture takes one.
+ *   one_in             every n:th call of the site, the first included.
+ *
+ * Otherwise the Backtrace is a placeholder with the site and the number of
+ * captures skipped there, which costs a lookup under a mutex:
+ *
+ *        backtrace skipped at decoder.cpp:120, 1423 skipped since the last one
+ *        captured there
+ *
+ * Sites are named 'file:line' without the directory of the file, or by the
+ * demangled type of a lock. sites lists them.
+ */
+class backtrace_policy
+{
+public:
+    struct budget {
+        unsigned first_per_minute = 0;
+        double per_second = 0;
+        double burst = 1;
+        unsigned one_in = 0;
+    };
+
+    /**
+     * @brief set_default sets the budget of sites without one of their own.
+     * A default constructed budget is unlimited.
+     */
+    static void set_default (const budget& b);
+    static void set (const std::string& site, const budget& b);
+
+    /**
+     * @brief reset removes all budgets and statistics.
+     */
+    static void reset ();
+
+    /**
+     * @brief capture tells whether the site may capture a backtrace now, and
+     * counts the call.
+     */
+    static bool capture (const char* file, int line);
+
+    static Backtrace::info make (const char* file, int line, int skipframes=1);
+    static Backtrace::info make (const std::type_info& t, int skipframes=1);
+    static std::string make_string (const char* file, int line, int skipframes=1);
+
+    struct site_stats {
+        std::string site;
+        std::uint64_t captured;
+        std::uint64_t skipped;
+    };
+
+    static std::vector<site_stats> sites ();
+
+    static void test ();
+};
+
+#endif // BACKTRACE_POLICY_H
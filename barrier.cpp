@@ -1,6 +1,6 @@
 /**
-  This file only contains unit tests for spinning_barrier and locking_barrier.
-  This file is not required for using either.
+  This file only contains unit tests for the barriers in barrier.h.
+  This file is not required for using any of them.
   */
 
 #include "barrier.h"
@@ -37,6 +37,91 @@ void simple_barrier_test() {
 }
 
 
+template<class barrier>
+void indexed_barrier_test() {
+    bool a = true;
+    barrier b{2};
+
+    future<void> f = async(launch::async, [&a,&b]()
+    {
+        b.wait (1);
+        a = false;
+        b.wait (1);
+    });
+
+    this_thread::sleep_for (chrono::microseconds{10});
+
+    EXCEPTION_ASSERT(a);
+    b.wait (0);
+    b.wait (0);
+    EXCEPTION_ASSERT(!a);
+    f.get ();
+}
+
+
+template<class barrier>
+void indexed_barrier_stress_test(unsigned N) {
+    const unsigned M = 100;
+    barrier b{N, true};
+    vector<atomic<unsigned>> arrived(M);
+    vector<atomic<unsigned>> returned_true(M);
+    atomic<bool> ok{true};
+
+    for (unsigned j=0; j<M; j++)
+        arrived[j] = returned_true[j] = 0;
+
+    vector<future<void>> f(N);
+    for (unsigned i=0; i<N; i++)
+        f[i] = async(launch::async, [&,i]()
+        {
+            for (unsigned j=0; j<M; j++)
+            {
+                arrived[j]++;
+                if (b.wait (i))
+                    returned_true[j]++;
+                // Everyone has arrived once wait returns
+                if (arrived[j] != N)
+                    ok = false;
+            }
+        });
+
+    for (auto& x : f)
+        x.get ();
+
+    EXCEPTION_ASSERT(ok);
+    for (unsigned j=0; j<M; j++)
+        EXCEPTION_ASSERT_EQUALS(returned_true[j], 1u);
+}
+
+
+template<class barrier>
+void evaluate_indexed(const char* name, int N) {
+    vector<future<void>> f(N);
+    barrier b (N+1);
+
+    int M = 20;
+
+    for (unsigned i=0; i<f.size (); i++)
+        f[i] = async(launch::async, [&,i]()
+        {
+            b.wait (i+1);
+            for (int j=0; j<M; j++)
+                b.wait (i+1);
+        });
+
+    {
+        b.wait (0);
+        TRACE_PERF(str(boost::format("%s %d threads, %d times") % name % N % M));
+
+        for (int i=0; i<M; i++)
+            b.wait (0);
+    }
+
+    for (unsigned i=0; i<f.size (); i++)
+        f[i].get();
+}
+
+
 static void evalate(int N) {
     vector<future<void>> f(N);
     spinning_barrier sb (N+1);
@@ -112,3 +197,67 @@ void locking_barrier::
         evalate((concurentThreadsSupported+1)/2);
     }
 }
+
+
+void combining_tree_barrier::
+        test ()
+{
+    // It should behave like spinning_barrier with an id for each thread
+    {
+        indexed_barrier_test<combining_tree_barrier>();
+    }
+
+    // It should keep each node on a cache line of its own
+    {
+        struct alignas(64) node { std::atomic<unsigned int> v{0}; };
+        for (unsigned N : {1u, 3u, 17u})
+        {
+            barrier_cache_lines<node> nodes(N);
+            EXCEPTION_ASSERT_EQUALS(nodes.size (), N);
+            for (unsigned i=0; i<N; i++)
+            {
+                EXCEPTION_ASSERT_EQUALS((uintptr_t)&nodes[i] % 64, 0u);
+                EXCEPTION_ASSERT_EQUALS(nodes[i].v.load (), 0u);
+            }
+        }
+    }
+
+    // It should let the last thread to come return true, for any number of
+    // threads and any depth of the tree
+    {
+        for (unsigned N : {1u, 3u, 4u, 5u, 17u, 33u})
+            indexed_barrier_stress_test<combining_tree_barrier>(N);
+    }
+
+    // It should be fast
+    {
+        unsigned concurentThreadsSupported = std::max(1u, std::thread::hardware_concurrency());
+
+        evaluate_indexed<combining_tree_barrier>("combining_tree_barrier", 10*concurentThreadsSupported);
+        evaluate_indexed<combining_tree_barrier>("combining_tree_barrier", (concurentThreadsSupported+1)/2);
+    }
+}
+
+
+void dissemination_barrier::
+        test ()
+{
+    // It should behave like spinning_barrier with an id for each thread
+    {
+        indexed_barrier_test<dissemination_barrier>();
+    }
+
+    // It should let exactly one thread return true, for any number of threads
+    {
+        for (unsigned N : {1u, 2u, 3u, 5u, 8u, 13u})
+            indexed_barrier_stress_test<dissemination_barrier>(N);
+    }
+
+    // It should be fast
+    {
+        unsigned concurentThreadsSupported = std::max(1u, std::thread::hardware_concurrency());
+
+        evaluate_indexed<dissemination_barrier>("dissemination_barrier", 10*concurentThreadsSupported);
+        evaluate_indexed<dissemination_barrier>("dissemination_barrier", (concurentThreadsSupported+1)/2);
+    }
+}
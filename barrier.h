@@ -2,9 +2,74 @@
 #define BARRIER_H
 
 #include <atomic>
+#include <cstddef>
+#include <memory>
 #include <mutex>
+#include <new>
 #include <thread>
 
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <intrin.h>
+#endif
+
+/**
+ * @brief barrier_pause should tell the cpu that this is a spin-wait loop. It
+ * saves power and frees resources for a hyper-thread sibling.
+ */
+inline void barrier_pause ()
+{
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+    _mm_pause ();
+#elif defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause ();
+#elif defined(__aarch64__)
+    __asm__ __volatile__ ("yield");
+#endif
+}
+
+/**
+ * @brief The barrier_cache_lines class should hold 'n' default constructed
+ * T's, starting at a cache line. Before C++17 neither std::vector nor new
+ * align over-aligned types.
+ */
+template<class T>
+class barrier_cache_lines
+{
+public:
+    static_assert(0 == alignof(T) % 64, "T should be declared alignas(64)");
+
+    explicit barrier_cache_lines (std::size_t n)
+        :
+          n_(n)
+    {
+        std::size_t space = n*sizeof(T) + alignof(T);
+        raw_.reset (new char[space]);
+        void* p = raw_.get ();
+        p_ = static_cast<T*>(std::align (alignof(T), n*sizeof(T), p, space));
+        for (std::size_t i=0; i<n; i++)
+            new (p_ + i) T();
+    }
+
+    barrier_cache_lines (const barrier_cache_lines&) = delete;
+    barrier_cache_lines& operator= (const barrier_cache_lines&) = delete;
+
+    ~barrier_cache_lines ()
+    {
+        for (std::size_t i=0; i<n_; i++)
+            p_[i].~T();
+    }
+
+    T& operator[] (std::size_t i) { return p_[i]; }
+    const T& operator[] (std::size_t i) const { return p_[i]; }
+    std::size_t size () const { return n_; }
+
+private:
+    const std::size_t n_;
+    std::unique_ptr<char[]> raw_;
+    T* p_;
+};
+
+
 /**
  * @brief The spinning_barrier class should provide a lock-free spinning
  * barrier.
@@ -118,4 +183,208 @@ public:
     static void test();
 };
 
+
+/**
+ * @brief The combining_tree_barrier class should provide a spinning barrier
+ * that scales to many cores.
+ *
+ * Threads arrive at the leaves of a tree where each node is shared by at
+ * most 'fan_in' threads. The last thread to arrive at a node continues to
+ * the parent. The last thread to arrive at the root is the last thread to
+ * arrive at the barrier. Released threads release the nodes they passed on
+ * their way up. Each waiting thread spins on the node it arrived at, so no
+ * cache line is shared by more than 'fan_in' threads.
+ *
+ * Each thread must pass a unique 'id' in [0, n) to wait.
+ */
+class combining_tree_barrier
+{
+public:
+    enum { fan_in = 4 };
+
+    /**
+     * @brief combining_tree_barrier
+     * @param n number of threads to participate in the barrier.
+     * @param yield whether to yield instead of spinning. Defaults to true if
+     *        'n' is larger than the number of cores.
+     */
+    combining_tree_barrier (unsigned int n) : combining_tree_barrier(n, n > std::thread::hardware_concurrency()) {}
+    combining_tree_barrier (unsigned int n, bool yield)
+        :
+          nodes_(count_nodes (n)),
+          yield_(yield)
+    {
+        // Leaves first, the root last
+        unsigned int level_begin = 0, level_end = 0, level_size = n;
+        do {
+            unsigned int parents = (level_size + fan_in - 1) / fan_in;
+            for (unsigned int i=0; i<parents; i++)
+                nodes_[level_end + i].expected = std::min<unsigned int>(fan_in, level_size - i*fan_in);
+
+            if (level_begin != level_end)
+                for (unsigned int i=0; i<level_size; i++)
+                    nodes_[level_begin + i].parent = level_end + i/fan_in;
+
+            level_begin = level_end;
+            level_end += parents;
+            level_size = parents;
+        } while (level_size > 1);
+    }
+
+    bool wait (unsigned int id)
+    {
+        node* passed[32];
+        int depth = 0;
+        node* x = &nodes_[id / fan_in];
+
+        while (true)
+        {
+            unsigned int step = x->step.load (std::memory_order_relaxed);
+
+            if (x->count.fetch_add (1, std::memory_order_acq_rel) != x->expected - 1)
+            {
+                // Not last at this node, wait for the thread that was
+                while (x->step.load (std::memory_order_acquire) == step)
+                    spin ();
+
+                // Then release the nodes this thread passed
+                while (depth)
+                    passed[--depth]->step.fetch_add (1, std::memory_order_release);
+                return false;
+            }
+
+            // Last at this node, reset it before anyone can arrive again
+            x->count.store (0, std::memory_order_relaxed);
+            passed[depth++] = x;
+
+            if (x->parent == no_parent)
+                break;
+            x = &nodes_[x->parent];
+        }
+
+        // OK, last thread to come. Release from the root and down.
+        while (depth)
+            passed[--depth]->step.fetch_add (1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    static const unsigned int no_parent = ~0u;
+
+    static unsigned int count_nodes (unsigned int n) {
+        unsigned int nodes = 0, level_size = n;
+        do {
+            level_size = (level_size + fan_in - 1) / fan_in;
+            nodes += level_size;
+        } while (level_size > 1);
+        return nodes;
+    }
+
+    // One cache line per node
+    struct alignas(64) node {
+        std::atomic<unsigned int> count{0};
+        std::atomic<unsigned int> step{0};
+        unsigned int expected = 0;
+        unsigned int parent = no_parent;
+    };
+
+    barrier_cache_lines<node> nodes_;
+    const bool yield_;
+
+    void spin () {
+        if (yield_)
+            std::this_thread::yield ();
+        else
+            barrier_pause ();
+    }
+
+public:
+    static void test();
+};
+
+
+/**
+ * @brief The dissemination_barrier class should provide a spinning barrier
+ * without any shared counter.
+ *
+ * In round 'r' of ceil(log2 n) rounds thread 'i' signals thread
+ * 'i + 2^r mod n' and waits for a signal from thread 'i - 2^r mod n'. After
+ * the last round every thread has transitively heard from every other thread.
+ * Each flag is written by one thread, read by one thread and lives on a cache
+ * line of its own.
+ *
+ * There is no last thread to come, instead thread 0 returns true.
+ *
+ * Each thread must pass a unique 'id' in [0, n) to wait.
+ */
+class dissemination_barrier
+{
+public:
+    /**
+     * @brief dissemination_barrier
+     * @param n number of threads to participate in the barrier.
+     * @param yield whether to yield instead of spinning. Defaults to true if
+     *        'n' is larger than the number of cores.
+     */
+    dissemination_barrier (unsigned int n) : dissemination_barrier(n, n > std::thread::hardware_concurrency()) {}
+    dissemination_barrier (unsigned int n, bool yield)
+        :
+          n_(n),
+          rounds_(count_rounds (n)),
+          yield_(yield),
+          flags_(n_ * (rounds_ + 1))
+    {
+    }
+
+    bool wait (unsigned int id)
+    {
+        // The step of this thread is kept after its flags, only this thread
+        // uses it
+        std::atomic<unsigned int>& own_step = flags_[id*(rounds_ + 1) + rounds_].v;
+        unsigned int step = own_step.load (std::memory_order_relaxed) + 1;
+        own_step.store (step, std::memory_order_relaxed);
+
+        for (unsigned int r=0; r<rounds_; r++)
+        {
+            unsigned int partner = (id + (1u << r)) % n_;
+            flags_[partner*(rounds_ + 1) + r].v.store (step, std::memory_order_release);
+
+            // The partner may be one step ahead, it's OK to wrap
+            std::atomic<unsigned int>& f = flags_[id*(rounds_ + 1) + r].v;
+            while ((int)(f.load (std::memory_order_acquire) - step) < 0)
+                spin ();
+        }
+
+        return 0 == id;
+    }
+
+private:
+    // One cache line per flag
+    struct alignas(64) flag {
+        std::atomic<unsigned int> v{0};
+    };
+
+    const unsigned int n_;
+    const unsigned int rounds_;
+    const bool yield_;
+    barrier_cache_lines<flag> flags_;
+
+    static unsigned int count_rounds (unsigned int n) {
+        unsigned int rounds = 0;
+        while ((1u << rounds) < n)
+            rounds++;
+        return rounds;
+    }
+
+    void spin () {
+        if (yield_)
+            std::this_thread::yield ();
+        else
+            barrier_pause ();
+    }
+
+public:
+    static void test();
+};
+
 #endif // BARRIER_H
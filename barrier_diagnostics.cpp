@@ -0,0 +1,231 @@
+#include "barrier_diagnostics.h"
+#include "barrier.h"
+#include "exceptionassert.h"
+#include "tasktimer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <map>
+#include <sstream>
+#include <iomanip>
+
+using namespace std;
+
+barrier_diagnostics::
+        barrier_diagnostics(unsigned int n, unsigned int sample_every)
+    :
+      n_(n),
+      sample_every_(max(1u, sample_every))
+{
+}
+
+
+barrier_diagnostics::token barrier_diagnostics::
+        arrive()
+{
+    thread_buffer* b = &slots_.this_thread ();
+
+    // Every thread passes every phase, so the number of arrivals of this
+    // thread is the phase
+    uint64_t phase = b->buffer.phase++;
+    if (0 != phase % sample_every_)
+        return token{b, -1};
+
+    unique_lock<mutex> l(b->lock);
+    b->buffer.samples.push_back (sample{phase, steady_now_ns (), 0});
+    return token{b, (int64_t)b->buffer.samples.size () - 1};
+}
+
+
+void barrier_diagnostics::
+        depart(const token& t)
+{
+    if (t.sample < 0)
+        return;
+
+    uint64_t T = steady_now_ns ();
+    unique_lock<mutex> l(t.buffer->lock);
+    if (t.sample < (int64_t)t.buffer->buffer.samples.size ())
+        t.buffer->buffer.samples[t.sample].depart_ns = T;
+}
+
+
+barrier_diagnostics::report barrier_diagnostics::
+        make_report() const
+{
+    struct arrival {
+        unsigned int slot;
+        uint64_t arrive_ns, depart_ns;
+    };
+
+    map<uint64_t, vector<arrival>> phases;
+    vector<thread::id> ids;
+    slots_.for_each ([&](thread_buffer& b) {
+        ids.push_back (b.id);
+        for (const sample& s : b.buffer.samples)
+            if (s.depart_ns)
+                phases[s.phase].push_back (arrival{b.number, s.arrive_ns, s.depart_ns});
+    });
+
+    report r;
+    for (unsigned int slot=0; slot<ids.size (); slot++)
+        r.per_thread.push_back (thread_stats{slot, ids[slot], 0, 0, 0});
+
+    vector<double> skews;
+    for (const auto& p : phases)
+    {
+        // Phases that are still in progress are left out
+        const vector<arrival>& a = p.second;
+        if (a.size () != n_)
+            continue;
+
+        auto first = min_element (a.begin (), a.end (), [](const arrival& x, const arrival& y) { return x.arrive_ns < y.arrive_ns; });
+        auto last = max_element (a.begin (), a.end (), [](const arrival& x, const arrival& y) { return x.arrive_ns < y.arrive_ns; });
+
+        phase_stats s{p.first, (last->arrive_ns - first->arrive_ns) * 1e-9, last->slot, 0};
+        for (const arrival& x : a)
+        {
+            double wait = (x.depart_ns - x.arrive_ns) * 1e-9;
+            s.wait += wait;
+            r.per_thread[x.slot].wait += wait;
+            r.per_thread[x.slot].late += (x.arrive_ns - first->arrive_ns) * 1e-9;
+        }
+        r.per_thread[last->slot].slowest++;
+
+        r.wait += s.wait;
+        r.per_phase.push_back (s);
+        skews.push_back (s.skew);
+    }
+
+    r.phases = (unsigned int)skews.size ();
+    if (!skews.empty ())
+    {
+        sort (skews.begin (), skews.end ());
+        auto at = [&skews](double q) { return skews[min(skews.size () - 1, (size_t)(q*skews.size ()))]; };
+
+        double sum = 0;
+        for (double d : skews)
+            sum += d;
+
+        r.skew_mean = sum / skews.size ();
+        r.skew_p50 = at(0.5);
+        r.skew_p90 = at(0.9);
+        r.skew_p99 = at(0.99);
+        r.skew_max = skews.back ();
+    }
+
+    stable_sort (r.per_thread.begin (), r.per_thread.end (), [](const thread_stats& a, const thread_stats& b) {
+        return a.slowest != b.slowest ? a.slowest > b.slowest : a.late > b.late;
+    });
+    return r;
+}
+
+
+void barrier_diagnostics::
+        clear()
+{
+    slots_.for_each ([](thread_buffer& b) {
+        b.buffer.samples.clear ();
+    });
+}
+
+
+string barrier_diagnostics::report::
+        to_string() const
+{
+    ostringstream o;
+    o << phases << " phases, skew mean " << TaskTimer::timeToString (skew_mean)
+      << ", p50 " << TaskTimer::timeToString (skew_p50)
+      << ", p90 " << TaskTimer::timeToString (skew_p90)
+      << ", p99 " << TaskTimer::timeToString (skew_p99)
+      << ", max " << TaskTimer::timeToString (skew_max)
+      << ", total wait " << TaskTimer::timeToString (wait) << endl;
+
+    o << setw(6) << "slot" << setw(20) << "thread" << setw(10) << "slowest"
+      << setw(12) << "late" << setw(12) << "wait" << endl;
+    for (const thread_stats& t : per_thread)
+    {
+        ostringstream id;
+        id << t.id;
+        o << setw(6) << t.slot << setw(20) << id.str () << setw(10) << t.slowest
+          << setw(12) << TaskTimer::timeToString (t.late)
+          << setw(12) << TaskTimer::timeToString (t.wait) << endl;
+    }
+    return o.str ();
+}
+
+
+namespace barrier_diagnostics_test {
+
+// 'N' threads pass the barrier 'M' times, the last thread sleeps 'delay'
+// before each wait
+template<class Barrier>
+thread::id run(diagnosed_barrier<Barrier>& b, unsigned N, unsigned M, chrono::microseconds delay)
+{
+    vector<future<thread::id>> f(N);
+    for (unsigned i=0; i<N; i++)
+        f[i] = async(launch::async, [&b,i,N,M,delay]()
+        {
+            for (unsigned j=0; j<M; j++)
+            {
+                if (i == N-1)
+                    this_thread::sleep_for (delay);
+                b.wait ();
+            }
+            return this_thread::get_id ();
+        });
+
+    thread::id slow;
+    for (auto& x : f)
+        slow = x.get ();
+    return slow;
+}
+
+} // namespace barrier_diagnostics_test
+
+using namespace barrier_diagnostics_test;
+
+void barrier_diagnostics::
+        test()
+{
+    // It should tell which thread arrives late, and how late
+    {
+        unsigned N = 3, M = 10;
+        diagnosed_barrier<spinning_barrier> b(N);
+        thread::id slow = run (b, N, M, chrono::milliseconds(2));
+
+        report r = b.diagnostics ().make_report ();
+        EXCEPTION_ASSERT_EQUALS(r.phases, M);
+        EXCEPTION_ASSERT_EQUALS(r.per_phase.size (), M);
+        EXCEPTION_ASSERT_EQUALS(r.per_thread.size (), N);
+
+        // Slowest first
+        EXCEPTION_ASSERT(r.per_thread[0].id == slow);
+        EXCEPTION_ASSERT_EQUALS(r.per_thread[0].slowest, M);
+        for (const phase_stats& p : r.per_phase)
+            EXCEPTION_ASSERT_EQUALS(p.slowest, r.per_thread[0].slot);
+
+        EXCEPTION_ASSERT_LESS(1.5e-3, r.skew_p50);
+        EXCEPTION_ASSERT_LESS_OR_EQUAL(r.skew_p50, r.skew_max);
+        EXCEPTION_ASSERT_LESS(r.per_thread[0].wait, r.per_thread[1].wait);
+        EXCEPTION_ASSERT_LESS(2 * M * 1.5e-3, r.wait);
+
+        EXCEPTION_ASSERT(r.to_string ().find ("10 phases") != string::npos);
+    }
+
+    // It should record only every n:th phase in sampled mode
+    {
+        unsigned N = 2, M = 10;
+        diagnosed_barrier<locking_barrier> b(N, 4);
+        run (b, N, M, chrono::microseconds(100));
+
+        report r = b.diagnostics ().make_report ();
+        EXCEPTION_ASSERT_EQUALS(r.phases, 3u);
+        EXCEPTION_ASSERT_EQUALS(r.per_phase[1].phase, 4u);
+        EXCEPTION_ASSERT_EQUALS(r.per_phase[2].phase, 8u);
+
+        b.diagnostics ().clear ();
+        EXCEPTION_ASSERT_EQUALS(b.diagnostics ().make_report ().phases, 0u);
+    }
+}
@@ -0,0 +1,130 @@
+#ifndef BARRIER_DIAGNOSTICS_H
+#define BARRIER_DIAGNOSTICS_H
+
+#include "thread_buffers.h"
+
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief The barrier_diagnostics class should tell which thread arrives late
+ * at a barrier, and how late.
+ *
+ * Wrap a barrier in diagnosed_barrier to record when each thread arrives at,
+ * and leaves, each phase:
+ *
+ *        diagnosed_barrier<spinning_barrier> b(n);
+ *        ... run the phase-parallel loop with b.wait ()
+ *        std::cout << b.diagnostics ().make_report ().to_string ();
+ *
+ * The report has the distribution of the skew, the time from the first
+ * arrival to the last, the slowest thread of each phase and the total time
+ * threads spent waiting. A few threads that are often the slowest point to a
+ * slow thread, a slowest thread that changes from phase to phase points to
+ * imbalanced work.
+ *
+ * With 'sample_every' > 1 only every n:th phase is recorded. A phase that
+ * isn't recorded costs a thread_local lookup and an increment.
+ */
+class barrier_diagnostics
+{
+    struct sample {
+        std::uint64_t phase;
+        std::uint64_t arrive_ns;
+        std::uint64_t depart_ns;
+    };
+
+    struct thread_samples {
+        std::uint64_t phase = 0;
+        std::vector<sample> samples;
+    };
+
+    typedef thread_buffers<thread_samples>::slot thread_buffer;
+
+public:
+    explicit barrier_diagnostics (unsigned int n, unsigned int sample_every = 1);
+    barrier_diagnostics (const barrier_diagnostics&) = delete;
+    barrier_diagnostics& operator= (const barrier_diagnostics&) = delete;
+
+    struct token {
+        thread_buffer* buffer;
+        std::int64_t sample; // index in the samples of the thread, or -1
+    };
+
+    /**
+     * @brief arrive and depart are called right before and after waiting at
+     * the barrier.
+     */
+    token arrive ();
+    void depart (const token& t);
+
+    struct phase_stats {
+        std::uint64_t phase;
+        double skew;            // from the first arrival to the last
+        unsigned int slowest;   // slot of the last thread to arrive
+        double wait;            // total time spent waiting by all threads
+    };
+
+    struct thread_stats {
+        unsigned int slot;      // in order of first arrival
+        std::thread::id id;
+        unsigned int slowest;   // number of phases where this thread was last
+        double late;            // total time after the first arrival
+        double wait;            // total time spent waiting
+    };
+
+    struct report {
+        unsigned int phases = 0; // recorded phases with all threads
+        double skew_mean = 0, skew_p50 = 0, skew_p90 = 0, skew_p99 = 0, skew_max = 0;
+        double wait = 0;        // total time spent waiting by all threads
+        std::vector<phase_stats> per_phase;
+        std::vector<thread_stats> per_thread; // most often slowest first
+
+        std::string to_string () const;
+    };
+
+    report make_report () const;
+    void clear ();
+
+    static void test ();
+
+private:
+    const unsigned int n_;
+    const unsigned int sample_every_;
+
+    // The lock of a slot is only contended while a report is made
+    mutable thread_buffers<thread_samples> slots_;
+};
+
+
+/**
+ * @brief The diagnosed_barrier class should record barrier_diagnostics for
+ * a barrier with a wait() method, such as spinning_barrier or
+ * locking_barrier.
+ */
+template<class Barrier>
+class diagnosed_barrier
+{
+public:
+    explicit diagnosed_barrier (unsigned int n, unsigned int sample_every = 1)
+        : b_(n), d_(n, sample_every) {}
+
+    bool wait ()
+    {
+        barrier_diagnostics::token t = d_.arrive ();
+        bool r = b_.wait ();
+        d_.depart (t);
+        return r;
+    }
+
+    barrier_diagnostics& diagnostics () { return d_; }
+    Barrier& barrier () { return b_; }
+
+private:
+    Barrier b_;
+    barrier_diagnostics d_;
+};
+
+#endif // BARRIER_DIAGNOSTICS_H
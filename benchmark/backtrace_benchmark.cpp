@@ -0,0 +1,237 @@
+/**
+  Measures the cost of capturing and printing a Backtrace:
+
+    capture       Backtrace::make at a depth of 4, 16, 64 and 200 frames
+    to_string     the first call in the process (cold), which loads the symbol
+                  tables, later calls on fresh captures (warm), and the call
+                  on a Backtrace that has already been printed (cached)
+    make_string   capture and print in one call
+    malloc_free_log
+                  backtrace_symbols_fd into /dev/null
+    demangle      typical type names of this library
+    concurrent    Backtrace::make from 1 to 16 threads at the same time. The
+                  unwinder of glibc takes the loader lock, captures in
+                  different threads serialize on it.
+
+  Each measure is traced with TRACE_PERF and compared to the thresholds in
+  trace_perf/backtrace_benchmark.cpp.db when the benchmark exits, run it from
+  the folder that contains trace_perf. The thresholds hold for a release
+  build (Makefile.benchmark) with frame pointers.
+  */
+
+#include "benchmark.h"
+#include "../backtrace.h"
+#include "../demangle.h"
+#include "../shared_state.h"
+#include "../timer.h"
+#include "../trace_perf.h"
+
+#include <functional>
+#include <future>
+#include <map>
+#include <vector>
+#include <stdio.h>
+
+#ifndef _MSC_VER
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace backtrace_benchmark {
+
+#if defined(_MSC_VER)
+#define BENCHMARK_NOINLINE __declspec(noinline)
+#else
+#define BENCHMARK_NOINLINE __attribute__((noinline))
+#endif
+
+volatile int sink;
+
+// Calls 'f' 'depth' frames below the caller
+BENCHMARK_NOINLINE void at_depth(int depth, const function<void()>& f)
+{
+    if (depth <= 1)
+        f();
+    else
+        at_depth (depth - 1, f);
+
+    sink = depth; // not a tail call
+}
+
+
+void capture(int N)
+{
+    char info[64];
+    for (int depth : {4, 16, 64, 200})
+    {
+        snprintf (info, sizeof(info), "capture at depth %d, %d calls", depth, N);
+        double T;
+        at_depth (depth, [&]() {
+            Timer t;
+            {
+                TRACE_PERF(info);
+                for (int i=0; i<N; i++)
+                    Backtrace::make ();
+            }
+            T = t.elapsed ();
+        });
+        printf("%-40s %12.3f\n", info, 1e6*T/N);
+    }
+}
+
+
+void print(int N)
+{
+    const Backtrace cold = Backtrace::make ().value ();
+    Backtrace cached = Backtrace::make ().value ();
+    vector<Backtrace> warm;
+    for (int i=0; i<N; i++)
+        warm.push_back (Backtrace::make ().value ());
+
+    Timer t;
+    {
+        TRACE_PERF("to_string cold");
+        cold.to_string ();
+    }
+    printf("%-40s %12.3f\n", "to_string cold", 1e6*t.elapsed ());
+
+    char info[64];
+    snprintf (info, sizeof(info), "to_string warm, %d calls", N);
+    t.restart ();
+    {
+        TRACE_PERF(info);
+        for (const Backtrace& b : warm)
+            b.to_string ();
+    }
+    printf("%-40s %12.3f\n", info, 1e6*t.elapsed ()/N);
+
+    cached.to_string ();
+    int M = 100*N;
+    snprintf (info, sizeof(info), "to_string cached, %d calls", M);
+    t.restart ();
+    {
+        TRACE_PERF(info);
+        for (int i=0; i<M; i++)
+            cached.to_string ();
+    }
+    printf("%-40s %12.3f\n", info, 1e6*t.elapsed ()/M);
+
+    snprintf (info, sizeof(info), "make_string, %d calls", N);
+    t.restart ();
+    {
+        TRACE_PERF(info);
+        for (int i=0; i<N; i++)
+            Backtrace::make_string ();
+    }
+    printf("%-40s %12.3f\n", info, 1e6*t.elapsed ()/N);
+}
+
+
+void malloc_free_log(int N)
+{
+#ifndef _MSC_VER
+    fflush (stderr);
+    int null = open ("/dev/null", O_WRONLY);
+    int stderr_fd = dup (2);
+    if (null < 0 || stderr_fd < 0)
+        return;
+    dup2 (null, 2);
+
+    char info[64];
+    snprintf (info, sizeof(info), "malloc_free_log, %d calls", N);
+    Timer t;
+    {
+        TRACE_PERF(info);
+        for (int i=0; i<N; i++)
+            Backtrace::malloc_free_log ();
+    }
+    double T = t.elapsed ();
+
+    dup2 (stderr_fd, 2);
+    close (stderr_fd);
+    close (null);
+
+    printf("%-40s %12.3f\n", info, 1e6*T/N);
+#else
+    (void)N;
+#endif
+}
+
+
+void demangle_names(int N)
+{
+    const char* names[] = {
+        typeid(int).name (),
+        typeid(Backtrace).name (),
+        typeid(Backtrace::info).name (),
+        typeid(shared_state<vector<string>>).name (),
+        typeid(map<string, vector<pair<int, double>>>).name (),
+        typeid(function<void(const string&, int)>).name (),
+        typeid(&Backtrace::make).name (),
+    };
+    int n = sizeof(names)/sizeof(names[0]);
+
+    char info[64];
+    snprintf (info, sizeof(info), "demangle, %d names", N*n);
+    size_t length = 0;
+    Timer t;
+    {
+        TRACE_PERF(info);
+        for (int i=0; i<N; i++)
+            for (int j=0; j<n; j++)
+                length += demangle (names[j]).size ();
+    }
+    double T = t.elapsed ();
+    sink = (int)length;
+
+    printf("%-40s %12.3f\n", info, 1e6*T/(N*n));
+}
+
+
+void concurrent(int N)
+{
+    printf("\n%-40s %12s %12s\n", "", "us per call", "calls per ms");
+
+    char info[64];
+    for (int threads : {1, 2, 4, 8, 16})
+    {
+        promise<void> go;
+        shared_future<void> started = go.get_future ().share ();
+        vector<future<void>> workers(threads);
+        for (auto& w : workers)
+            w = async(launch::async, [started,N]() {
+                started.wait ();
+                for (int i=0; i<N; i++)
+                    Backtrace::make ();
+            });
+
+        snprintf (info, sizeof(info), "capture from %d threads, %d calls each", threads, N);
+        Timer t;
+        {
+            TRACE_PERF(info);
+            go.set_value ();
+            for (auto& w : workers)
+                w.get ();
+        }
+        double T = t.elapsed ();
+
+        printf("%-40s %12.3f %12.0f\n", info, 1e6*T/N, threads*N/(1e3*T));
+    }
+}
+
+
+void run()
+{
+    printf("%-40s %12s\n", "", "us per call");
+
+    // 'to_string cold' must be the first to symbolize in this process
+    print (100);
+    capture (10000);
+    malloc_free_log (1000);
+    demangle_names (10000);
+    concurrent (10000);
+}
+
+} // namespace backtrace_benchmark
@@ -0,0 +1,110 @@
+/**
+  Measures the time per barrier episode of spinning_barrier, locking_barrier,
+  combining_tree_barrier, dissemination_barrier and hybrid_barrier from 2 to
+  128 threads.
+
+  First all threads arrive at the same time, there is no work between the
+  barriers. Then each thread works for a random time up to 50 us between the
+  barriers, the time per episode then includes the work of the slowest
+  thread. The spinning barriers yield when there are more threads than cores.
+  */
+
+#include "benchmark.h"
+#include "../barrier.h"
+#include "../hybrid_barrier.h"
+#include "../timer.h"
+
+#include <future>
+#include <random>
+#include <vector>
+#include <stdio.h>
+
+using namespace std;
+
+namespace barrier_benchmark {
+
+// Adapt barriers without thread ids
+template<class B>
+struct anonymous {
+    B b;
+    explicit anonymous(unsigned n) : b(n) {}
+    bool wait(unsigned) { return b.wait (); }
+};
+
+
+// Busy work for a random time up to 'max_work' seconds
+struct work {
+    work(unsigned seed, double max_work) : rng(seed), d(0, max_work) {}
+
+    void operator()() {
+        double T = d(rng);
+        if (0 == T)
+            return;
+        Timer t;
+        while (t.elapsed () < T)
+            ;
+    }
+
+    mt19937 rng;
+    uniform_real_distribution<double> d;
+};
+
+
+template<class B>
+double measure(unsigned threads, unsigned episodes, double max_work)
+{
+    B b(threads);
+    vector<future<void>> workers(threads - 1);
+
+    for (unsigned i=1; i<threads; i++)
+        workers[i-1] = async(launch::async, [&b,i,episodes,max_work]() {
+            work w(i, max_work);
+            b.wait (i);
+            for (unsigned j=0; j<episodes; j++)
+            {
+                w();
+                b.wait (i);
+            }
+        });
+
+    work w(0, max_work);
+    b.wait (0);
+    Timer t;
+    for (unsigned j=0; j<episodes; j++)
+    {
+        w();
+        b.wait (0);
+    }
+    double T = t.elapsed ();
+
+    for (auto& w : workers)
+        w.get ();
+
+    return T / episodes;
+}
+
+
+void run()
+{
+    for (double max_work : {0.0, 50e-6})
+    {
+        printf("\nwork between barriers: up to %.0f us\n", max_work*1e6);
+        printf("%8s %12s %12s %12s %12s %12s   (us per episode)\n",
+               "threads", "spinning", "locking", "tree", "dissemination", "hybrid");
+
+        for (unsigned threads = 2; threads <= 128; threads *= 2)
+        {
+            unsigned episodes = max(100u, 20000u / threads);
+
+            printf("%8u %12.3f %12.3f %12.3f %12.3f %12.3f\n", threads,
+                   1e6*measure<anonymous<spinning_barrier>> (threads, episodes, max_work),
+                   1e6*measure<anonymous<locking_barrier>> (threads, episodes, max_work),
+                   1e6*measure<combining_tree_barrier> (threads, episodes, max_work),
+                   1e6*measure<dissemination_barrier> (threads, episodes, max_work),
+                   1e6*measure<anonymous<hybrid_barrier>> (threads, episodes, max_work));
+            fflush(stdout);
+        }
+    }
+}
+
+} // namespace barrier_benchmark
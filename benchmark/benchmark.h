@@ -0,0 +1,55 @@
+#ifndef BENCHMARK_BENCHMARK_H
+#define BENCHMARK_BENCHMARK_H
+
+#include <vector>
+#include <string>
+
+/**
+ * Benchmarks are not run by the unit test. Build them with
+ * Makefile.benchmark and run ./backtrace-benchmark [name ...].
+ */
+namespace benchmark {
+
+/**
+ * @brief The latency_stats struct should summarize a set of measured
+ * durations, in seconds, by its percentiles.
+ */
+struct latency_stats {
+    size_t count = 0;
+    double mean = 0;
+    double p50 = 0;
+    double p99 = 0;
+    double p999 = 0;
+    double max = 0;
+
+    static latency_stats from(std::vector<double> samples);
+};
+
+} // namespace benchmark
+
+namespace shared_state_mutex_benchmark {
+    void run ();
+}
+
+namespace shared_state_map_benchmark {
+    void run ();
+}
+
+namespace shared_state_lock_benchmark {
+    void run ();
+}
+
+namespace barrier_benchmark {
+    void run ();
+}
+
+namespace backtrace_benchmark {
+    void run ();
+}
+
+namespace startup_benchmark {
+    void run ();
+    void probe ();
+}
+
+#endif // BENCHMARK_BENCHMARK_H
@@ -0,0 +1,89 @@
+#include "benchmark.h"
+#include "../prettifysegfault.h"
+#include "../tasktimer.h"
+#include "../timer.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdio.h>
+
+namespace benchmark {
+
+latency_stats latency_stats::
+        from(std::vector<double> samples)
+{
+    latency_stats s;
+    if (samples.empty ())
+        return s;
+
+    std::sort (samples.begin (), samples.end ());
+
+    double sum = 0;
+    for (double d : samples)
+        sum += d;
+
+    auto at = [&samples](double q) { return samples[std::min(samples.size () - 1, (size_t)(q*samples.size ()))]; };
+
+    s.count = samples.size ();
+    s.mean = sum / samples.size ();
+    s.p50 = at(0.5);
+    s.p99 = at(0.99);
+    s.p999 = at(0.999);
+    s.max = samples.back ();
+    return s;
+}
+
+} // namespace benchmark
+
+
+struct {
+    const char* name;
+    void (*run)();
+    bool by_name_only; // not run without arguments
+} benchmarks[] = {
+    {"shared_state_mutex", &shared_state_mutex_benchmark::run, false},
+    {"shared_state_map", &shared_state_map_benchmark::run, false},
+    {"shared_state_lock", &shared_state_lock_benchmark::run, false},
+    {"barrier", &barrier_benchmark::run, false},
+    {"backtrace", &backtrace_benchmark::run, false},
+    {"startup", &startup_benchmark::run, false},
+    {"startup_probe", &startup_benchmark::probe, true},
+};
+
+
+int main(int argc, char** argv)
+{
+    PrettifySegfault::setup ();
+    Timer(); // Init performance counting
+
+    int matched = 0;
+    for (auto& b : benchmarks)
+    {
+        bool selected = 1 == argc && !b.by_name_only;
+        for (int i=1; i<argc; i++)
+            selected |= 0 == strcmp (argv[i], b.name);
+
+        if (!selected)
+            continue;
+
+        matched++;
+        printf("\n%s\n", b.name);
+        fflush(stdout);
+
+        Timer t;
+        b.run ();
+        printf("%s done in %s\n", b.name, TaskTimer::timeToString (t.elapsed ()).c_str ());
+        fflush(stdout);
+    }
+
+    if (0 == matched)
+    {
+        printf("%s: Unknown benchmark. Available benchmarks:\n", argv[0]);
+        for (auto& b : benchmarks)
+            if (!b.by_name_only)
+                printf("  %s\n", b.name);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,180 @@
+/**
+  Sweeps thread count, read/write ratio, critical section length, think time
+  and traits for every shared_state mutex type, to choose lock policies from
+  data rather than from the fixed contention test in shared_state.cpp.
+
+  Writes one CSV row per configuration to shared_state_lock_benchmark.csv in
+  the current directory with throughput and acquisition latency percentiles,
+  latencies in microseconds. Acquisition latency is measured from the call to
+  read() or write() until the lock is obtained.
+  */
+
+#include "benchmark.h"
+#include "../shared_state.h"
+#include "../shared_state_mutex_policies.h"
+#include "../shared_state_mutex_striped.h"
+#include "../shared_state_traits_backtrace.h"
+#include "../timer.h"
+
+#include <future>
+#include <atomic>
+#include <random>
+#include <stdio.h>
+
+using namespace std;
+
+namespace shared_state_lock_benchmark {
+
+const char* csv_file = "shared_state_lock_benchmark.csv";
+const double duration = 0.02; // per configuration
+
+const unsigned thread_counts[] = {1, 2, 4, 8, 16, 32};
+const double write_ratios[] = {0, 0.05, 0.5};
+const int critical_sections[] = {10, 1000}; // busy loop iterations
+const int think_times[] = {0, 1000};         // busy loop iterations
+
+
+static void busy(int N)
+{
+    volatile int sink = 0;
+    for (int i=0; i<N; i++)
+        sink = sink + i;
+}
+
+
+struct config {
+    unsigned threads;
+    double write_ratio;
+    int critical_section;
+    int think_time;
+};
+
+
+template<class M, class Traits>
+struct protected_state
+{
+    struct shared_state_traits: Traits {
+        typedef M shared_state_mutex;
+        // Block indefinitely, a timeout would cut off the tail
+        double timeout() { return -1; }
+        // Don't let shared_state_traits_backtrace warn about long locks
+        double verify_lock_time() { return 1; }
+    };
+
+    int v = 0;
+};
+
+
+template<class M, class Traits>
+void measure(FILE* csv, const char* policy, const char* traits, const config& c)
+{
+    typedef protected_state<M,Traits> S;
+    shared_state<S> s {new S};
+    atomic<bool> stop{false};
+    vector<future<pair<vector<double>,vector<double>>>> workers(c.threads);
+
+    for (unsigned i=0; i<c.threads; i++)
+        workers[i] = async(launch::async, [&s,&stop,&c,i]() {
+            vector<double> r, w;
+            r.reserve (1 << 14);
+            w.reserve (1 << 14);
+            mt19937 rnd(i);
+            bernoulli_distribution is_write(c.write_ratio);
+
+            while (!stop)
+            {
+                busy (c.think_time);
+
+                Timer t;
+                if (is_write (rnd))
+                {
+                    auto p = s.write ();
+                    w.push_back (t.elapsed ());
+                    busy (c.critical_section);
+                    p->v++;
+                }
+                else
+                {
+                    auto p = s.read ();
+                    r.push_back (t.elapsed ());
+                    busy (c.critical_section);
+                }
+            }
+
+            return make_pair(move(r), move(w));
+        });
+
+    this_thread::sleep_for (chrono::duration<double>(duration));
+    stop = true;
+
+    vector<double> r, w, all;
+    for (auto& f : workers)
+    {
+        auto rw = f.get ();
+        r.insert (r.end (), rw.first.begin (), rw.first.end ());
+        w.insert (w.end (), rw.second.begin (), rw.second.end ());
+    }
+    all.insert (all.end (), r.begin (), r.end ());
+    all.insert (all.end (), w.begin (), w.end ());
+
+    auto a = benchmark::latency_stats::from (move(all));
+    auto rs = benchmark::latency_stats::from (move(r));
+    auto ws = benchmark::latency_stats::from (move(w));
+
+    fprintf(csv, "%s,%s,%u,%g,%d,%d,%.0f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+            policy, traits, c.threads, c.write_ratio, c.critical_section, c.think_time,
+            a.count / duration,
+            a.p50*1e6, a.p99*1e6, a.p999*1e6,
+            rs.p50*1e6, rs.p99*1e6, rs.p999*1e6,
+            ws.p50*1e6, ws.p99*1e6, ws.p999*1e6);
+}
+
+
+template<class M>
+void run_policy(FILE* csv, const char* policy)
+{
+    Timer t;
+    for (unsigned threads : thread_counts)
+        for (double write_ratio : write_ratios)
+            for (int critical_section : critical_sections)
+                for (int think_time : think_times)
+                {
+                    config c{threads, write_ratio, critical_section, think_time};
+                    measure<M, shared_state_traits_default>(csv, policy, "none", c);
+                    measure<M, shared_state_traits_backtrace>(csv, policy, "backtrace", c);
+                }
+
+    fflush(csv);
+    printf("%-20s %.1f s\n", policy, t.elapsed ());
+    fflush(stdout);
+}
+
+
+void run ()
+{
+    FILE* csv = fopen(csv_file, "w");
+    if (!csv)
+    {
+        printf("Couldn't open %s for writing\n", csv_file);
+        return;
+    }
+
+    fprintf(csv, "policy,traits,threads,write_ratio,critical_section,think_time,ops_per_s,"
+                 "p50_us,p99_us,p999_us,read_p50_us,read_p99_us,read_p999_us,"
+                 "write_p50_us,write_p99_us,write_p999_us\n");
+
+    run_policy<shared_state_mutex_default>(csv, "default");
+    run_policy<shared_state_mutex_notimeout>(csv, "notimeout");
+    run_policy<shared_state_mutex_noshared>(csv, "noshared");
+    run_policy<shared_state_mutex_notimeout_noshared>(csv, "notimeout_noshared");
+    run_policy<shared_state_mutex_writer_preferring>(csv, "writer_preferring");
+    run_policy<shared_state_mutex_reader_preferring>(csv, "reader_preferring");
+    run_policy<shared_state_mutex_phase_fair>(csv, "phase_fair");
+    run_policy<shared_state_mutex_task_fair>(csv, "task_fair");
+    run_policy<shared_state_mutex_striped<>>(csv, "striped");
+
+    fclose(csv);
+    printf("Wrote %s\n", csv_file);
+}
+
+} // namespace shared_state_lock_benchmark
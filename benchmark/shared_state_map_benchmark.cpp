@@ -0,0 +1,130 @@
+/**
+  Measures the throughput of shared_state_map against the single lock
+  baseline, shared_state<std::unordered_map>, from 1 to 64 threads.
+
+  Each thread accesses random keys, one out of ten accesses is a write.
+  */
+
+#include "benchmark.h"
+#include "../shared_state.h"
+#include "../shared_state_map.h"
+
+#include <future>
+#include <atomic>
+#include <random>
+#include <unordered_map>
+#include <stdio.h>
+
+using namespace std;
+
+namespace shared_state_map_benchmark {
+
+// A type of its own to not clash with other instantiations of
+// shared_state_traits<unordered_map<...>>
+struct value { int v = 0; };
+typedef unordered_map<int,value> map_type;
+
+struct shared_state_traits: shared_state_traits_default {
+    // Block indefinitely, contention is what's being measured
+    double timeout() { return -1; }
+};
+
+} // namespace shared_state_map_benchmark
+
+template<>
+struct shared_state_traits<shared_state_map_benchmark::map_type>: shared_state_map_benchmark::shared_state_traits {};
+
+namespace shared_state_map_benchmark {
+
+const int keys = 4096;
+const int write_every = 10;
+
+
+struct single_lock {
+    shared_state<map_type> m {new map_type};
+
+    int read(int k) {
+        auto r = m.read ();
+        auto i = r->find (k);
+        return i == r->end () ? 0 : i->second.v;
+    }
+
+    void write(int k) { m.write ()->operator[] (k).v++; }
+};
+
+
+template<unsigned Shards>
+struct sharded {
+    shared_state_map<int,value,Shards> m;
+
+    int read(int k) {
+        auto r = m.read (k);
+        return r ? r->v : 0;
+    }
+
+    void write(int k) { m.write (k)->v++; }
+};
+
+
+template<class M>
+double measure(unsigned threads, double duration)
+{
+    M m;
+    for (int k=0; k<keys; k++)
+        m.write (k);
+
+    atomic<bool> stop{false};
+    vector<future<size_t>> workers(threads);
+
+    for (unsigned i=0; i<threads; i++)
+        workers[i] = async(launch::async, [&m,&stop,i]() {
+            mt19937 rnd(i);
+            uniform_int_distribution<int> key(0, keys-1);
+            size_t n = 0;
+            volatile int sink = 0;
+
+            for (; !stop; n++)
+            {
+                int k = key(rnd);
+                if (n % write_every)
+                    sink = sink + m.read (k);
+                else
+                    m.write (k);
+            }
+
+            return n;
+        });
+
+    this_thread::sleep_for (chrono::duration<double>(duration));
+    stop = true;
+
+    size_t n = 0;
+    for (auto& f : workers)
+        n += f.get ();
+
+    return n / duration;
+}
+
+
+void run ()
+{
+    printf("%u hardware threads, %d keys, one write per %d accesses\n",
+           thread::hardware_concurrency (), keys, write_every);
+    printf("%8s %14s %14s %14s %14s\n",
+           "threads", "single lock", "4 shards", "16 shards", "64 shards");
+
+    for (unsigned threads=1; threads<=64; threads*=2)
+    {
+        double duration = 0.25;
+        printf("%8u %14.0f %14.0f %14.0f %14.0f\n", threads,
+               measure<single_lock>(threads, duration),
+               measure<sharded<4>>(threads, duration),
+               measure<sharded<16>>(threads, duration),
+               measure<sharded<64>>(threads, duration));
+        fflush(stdout);
+    }
+
+    printf("operations per second\n");
+}
+
+} // namespace shared_state_map_benchmark
@@ -0,0 +1,148 @@
+/**
+  Measures acquisition latency percentiles of each shared_state mutex policy
+  under mixed read/write loads.
+
+  Latency is measured from the call to read() or write() until the lock is
+  obtained. Writer starvation shows up as a long tail for writes, reader
+  starvation as a long tail for reads.
+  */
+
+#include "benchmark.h"
+#include "../shared_state.h"
+#include "../shared_state_mutex_policies.h"
+#include "../timer.h"
+
+#include <future>
+#include <atomic>
+#include <algorithm>
+#include <stdio.h>
+
+using namespace std;
+
+namespace shared_state_mutex_benchmark {
+
+template<class M>
+struct protected_state
+{
+    struct shared_state_traits: shared_state_traits_default {
+        typedef M shared_state_mutex;
+        // Block indefinitely, a timeout would cut off the tail
+        double timeout() { return -1; }
+    };
+
+    void somework(int N) const {
+        for (int i=0; i<N; i++)
+            sink = sink + i;
+    }
+
+    mutable volatile int sink = 0;
+};
+
+
+struct load {
+    const char* name;
+    int write_every; // every n:th access is a write
+    int work;        // busy loop iterations in the critical section
+};
+
+
+struct result {
+    benchmark::latency_stats read, write;
+    double throughput;
+};
+
+
+template<class M>
+result measure(const load& l, unsigned threads, double duration)
+{
+    shared_state<protected_state<M>> s {new protected_state<M>};
+    atomic<bool> stop{false};
+    vector<future<pair<vector<double>,vector<double>>>> workers(threads);
+
+    for (unsigned i=0; i<threads; i++)
+        workers[i] = async(launch::async, [&s,&stop,&l,i]() {
+            vector<double> r, w;
+            r.reserve (1 << 16);
+            w.reserve (1 << 12);
+
+            // Stagger the writes between the threads
+            for (unsigned j=i; !stop; j++)
+            {
+                Timer t;
+                if (j % l.write_every)
+                {
+                    auto p = s.read ();
+                    r.push_back (t.elapsed ());
+                    p->somework (l.work);
+                }
+                else
+                {
+                    auto p = s.write ();
+                    w.push_back (t.elapsed ());
+                    p->somework (l.work);
+                }
+            }
+
+            return make_pair(move(r), move(w));
+        });
+
+    this_thread::sleep_for (chrono::duration<double>(duration));
+    stop = true;
+
+    vector<double> r, w;
+    for (auto& f : workers)
+    {
+        auto rw = f.get ();
+        r.insert (r.end (), rw.first.begin (), rw.first.end ());
+        w.insert (w.end (), rw.second.begin (), rw.second.end ());
+    }
+
+    result res;
+    res.read = benchmark::latency_stats::from (move(r));
+    res.write = benchmark::latency_stats::from (move(w));
+    res.throughput = (res.read.count + res.write.count) / duration;
+    return res;
+}
+
+
+template<class M>
+void run_policy(const char* policy, const load& l, unsigned threads)
+{
+    result r = measure<M>(l, threads, 0.25);
+
+    printf("%-18s %-14s %10.0f  %8.1f %8.1f %9.1f %9.1f  %8.1f %8.1f %9.1f %9.1f\n",
+           policy, l.name, r.throughput,
+           r.read.p50*1e6, r.read.p99*1e6, r.read.p999*1e6, r.read.max*1e6,
+           r.write.p50*1e6, r.write.p99*1e6, r.write.p999*1e6, r.write.max*1e6);
+    fflush(stdout);
+}
+
+
+void run ()
+{
+    unsigned threads = max(4u, min(16u, 2*thread::hardware_concurrency ()));
+
+    load loads[] = {
+        {"reader flood",  1000, 200},
+        {"read mostly",     20, 200},
+        {"mixed",            4, 200},
+        {"write heavy",      2, 200},
+    };
+
+    printf("%u threads, latencies in microseconds\n", threads);
+    printf("%-18s %-14s %10s  %8s %8s %9s %9s  %8s %8s %9s %9s\n",
+           "policy", "load", "ops/s",
+           "read p50", "p99", "p999", "max",
+           "write p50", "p99", "p999", "max");
+
+    for (const load& l : loads)
+    {
+        run_policy<shared_state_mutex>("default", l, threads);
+        run_policy<shared_state_mutex_writer_preferring>("writer_preferring", l, threads);
+        run_policy<shared_state_mutex_reader_preferring>("reader_preferring", l, threads);
+        run_policy<shared_state_mutex_phase_fair>("phase_fair", l, threads);
+        run_policy<shared_state_mutex_task_fair>("task_fair", l, threads);
+    }
+}
+
+} // namespace shared_state_mutex_benchmark
@@ -0,0 +1,116 @@
+/**
+  Measures the cost of starting a process that links this library, and the
+  cost of the work that runs at static initialization or on first use.
+
+  Static initializers in the library, all cheap:
+    tasktimer.cpp    is_alive, staticLock, single, thread_info_map and the
+                     log streams, no system calls
+    trace_perf.cpp   traces, created on first use by a trace_perf
+    detectgdb.cpp    was_started_through_gdb, computed on first use
+    timeline.cpp, shared_state_lock_trace.cpp
+                     a mutex and an empty vector
+    shared_state_traits_backtrace.cpp
+                     default_warning, a std::function without captures
+    shared_state_mutex_striped.h
+                     the lock pool, created on first use
+  */
+
+#include "benchmark.h"
+#include "../detectgdb.h"
+#include "../tasktimer.h"
+#include "../timer.h"
+
+#include <vector>
+#include <stdio.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char** environ;
+#endif
+
+using namespace std;
+
+namespace startup_benchmark {
+
+template<class F>
+double per_call(int N, F f)
+{
+    Timer t;
+    for (int i=0; i<N; i++)
+        f();
+    return t.elapsed () / N;
+}
+
+
+#ifdef __linux__
+// Time to start 'path' with 'arg' and wait for it to exit
+double start_process(const char* path, const char* arg, int N)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init (&actions);
+    posix_spawn_file_actions_addopen (&actions, 1, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen (&actions, 2, "/dev/null", O_WRONLY, 0);
+
+    char* argv[] = {const_cast<char*>(path), const_cast<char*>(arg), 0};
+    if (!arg)
+        argv[1] = 0;
+
+    Timer t;
+    for (int i=0; i<N; i++)
+    {
+        pid_t pid;
+        if (0 != posix_spawn (&pid, path, &actions, 0, argv, environ))
+            return -1;
+        int status;
+        waitpid (pid, &status, 0);
+    }
+    double T = t.elapsed () / N;
+
+    posix_spawn_file_actions_destroy (&actions);
+    return T;
+}
+#endif
+
+
+void probe()
+{
+    // Does nothing, started by 'run' to measure the startup of this binary
+}
+
+
+void run()
+{
+    printf("%-50s %12s\n", "", "us per call");
+    printf("%-50s %12.3f\n", "DetectGdb::is_running_through_gdb",
+           1e6*per_call (100, []{ DetectGdb::is_running_through_gdb (); }));
+    printf("%-50s %12.3f\n", "DetectGdb::was_started_through_gdb",
+           1e6*per_call (100000, []{ DetectGdb::was_started_through_gdb (); }));
+#ifndef _MSC_VER
+    printf("%-50s %12.3f\n", "ptrace attach from a forked child",
+           1e6*per_call (20, []{ DetectGdb::ptrace_probe (); }));
+#endif
+    printf("%-50s %12.3f\n", "Timer",
+           1e6*per_call (100000, []{ Timer t; }));
+    printf("%-50s %12.3f\n", "TaskTimer::timeToString",
+           1e6*per_call (100000, []{ TaskTimer::timeToString (0.001); }));
+
+#ifdef __linux__
+    char self[4096];
+    ssize_t n = readlink ("/proc/self/exe", self, sizeof(self) - 1);
+    if (n > 0)
+    {
+        self[n] = 0;
+        int N = 200;
+        printf("%-50s %12.3f\n", "start and exit /bin/true",
+               1e6*start_process ("/bin/true", 0, N));
+        printf("%-50s %12.3f\n", "start and exit this benchmark",
+               1e6*start_process (self, "startup_probe", N));
+    }
+#endif
+}
+
+} // namespace startup_benchmark
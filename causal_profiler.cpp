@@ -0,0 +1,653 @@
+#include "causal_profiler.h"
+#include "exceptionassert.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <tuple>
+#include <future>
+#include <algorithm>
+#include <cmath>
+#include <stdio.h>
+
+using namespace std;
+
+namespace {
+
+typedef chrono::steady_clock clock_type;
+
+const uint64_t min_delay_ns = 10000; // shorter delays are postponed
+
+struct point_data {
+    explicit point_data(const string& name, bool latency) : name(name), latency(latency) {}
+
+    const string name;
+    const bool latency;
+    atomic<uint64_t> visits{0};
+    atomic<uint64_t> latency_ns{0};
+};
+
+struct accumulated {
+    double effective_time = 0;
+    uint64_t visits = 0;
+    uint64_t latency_ns = 0;
+    unsigned experiments = 0;
+};
+
+const int baseline = -1;
+
+struct profiler_state {
+    atomic<bool> running{false};
+    atomic<int> selected{baseline};
+    atomic<uint64_t> speedup_ppm{0};
+    atomic<uint64_t> global_delay_ns{0};
+    atomic<unsigned> experiment{0};
+
+    mutex lock;
+    deque<point_data> points;
+    map<string, point_data*> point_names;
+    map<string, point_data*> latency_points;
+    vector<string> regions;
+    map<string, int> region_ids;
+
+    // (region, speedup in ppm, point)
+    map<tuple<int, uint64_t, point_data*>, accumulated> measurements;
+
+    thread profiler;
+    condition_variable stop_cv;
+    bool stop_requested = false;
+    causal_profiler::options opt;
+
+    ~profiler_state() {
+        if (profiler.joinable ())
+        {
+            {
+                unique_lock<mutex> l(lock);
+                stop_requested = true;
+                stop_cv.notify_all ();
+            }
+            profiler.join ();
+        }
+    }
+};
+
+profiler_state& S()
+{
+    static profiler_state s;
+    return s;
+}
+
+point_data* find_point(profiler_state& s, const string& name, bool latency)
+{
+    // s.lock is locked
+    auto i = s.point_names.find (name);
+    if (i != s.point_names.end ())
+        return i->second;
+
+    s.points.emplace_back (name, latency);
+    return s.point_names[name] = &s.points.back ();
+}
+
+
+struct thread_state {
+    bool registered = false;
+    unsigned experiment = 0;
+    uint64_t local_delay_ns = 0; // delays this thread has accounted for
+    uint64_t skipped_ns = 0;     // all virtual time skipped by this thread
+    int depth = 0;
+    clock_type::time_point start;
+};
+
+thread_state& T()
+{
+    static thread_local thread_state t;
+    profiler_state& s = S();
+    unsigned e = s.experiment.load (memory_order_acquire);
+    if (t.experiment != e)
+    {
+        t.experiment = e;
+        t.local_delay_ns = 0;
+        t.depth = 0;
+    }
+    if (!t.registered)
+    {
+        // A new thread wasn't running while the delays were inserted
+        t.registered = true;
+        t.local_delay_ns = s.global_delay_ns.load (memory_order_relaxed);
+    }
+    return t;
+}
+
+uint64_t since(clock_type::time_point t)
+{
+    return chrono::duration_cast<chrono::nanoseconds>(clock_type::now () - t).count ();
+}
+
+void catch_up(thread_state& t)
+{
+    uint64_t g = S().global_delay_ns.load (memory_order_relaxed);
+    if (g < t.local_delay_ns + min_delay_ns)
+        return;
+
+    auto start = clock_type::now ();
+    this_thread::sleep_for (chrono::nanoseconds(g - t.local_delay_ns));
+    uint64_t slept = since (start);
+
+    // Sleeping longer than needed is accounted for by the next delay
+    t.local_delay_ns += slept;
+    t.skipped_ns += slept;
+}
+
+
+void run_experiments()
+{
+    profiler_state& s = S();
+    unique_lock<mutex> l(s.lock);
+
+    for (unsigned n=0; !s.stop_requested; n++)
+    {
+        int region = baseline;
+        uint64_t ppm = 0;
+
+        vector<int> candidates;
+        for (int i=0; i<(int)s.regions.size (); i++)
+            if (s.opt.regions.empty () || find (s.opt.regions.begin (), s.opt.regions.end (), s.regions[i]) != s.opt.regions.end ())
+                candidates.push_back (i);
+
+        if (candidates.empty ())
+        {
+            s.stop_cv.wait_for (l, chrono::duration<double>(s.opt.experiment_duration));
+            continue;
+        }
+
+        // Every other experiment is a baseline
+        if (n % 2)
+        {
+            unsigned k = n / 2;
+            unsigned R = candidates.size ();
+            region = candidates[k % R];
+            ppm = (uint64_t)(1e6 * s.opt.speedups[(k / R) % s.opt.speedups.size ()]);
+        }
+
+        vector<pair<uint64_t,uint64_t>> before;
+        for (point_data& p : s.points)
+            before.push_back (make_pair(p.visits.load (), p.latency_ns.load ()));
+
+        s.global_delay_ns = 0;
+        s.speedup_ppm = ppm;
+        s.experiment++;
+        s.selected = region;
+        auto start = clock_type::now ();
+
+        s.stop_cv.wait_for (l, chrono::duration<double>(s.opt.experiment_duration),
+                            [&s](){ return s.stop_requested; });
+
+        s.selected = baseline;
+        uint64_t wall = since (start);
+        uint64_t delay = s.global_delay_ns;
+
+        if (s.stop_requested)
+            break;
+        if (delay >= wall)
+            continue;
+
+        double effective = (wall - delay) * 1e-9;
+        size_t i = 0;
+        for (point_data& p : s.points)
+        {
+            uint64_t v = p.visits.load (), lat = p.latency_ns.load ();
+            uint64_t v0 = 0, lat0 = 0;
+            if (i < before.size ())
+            {
+                v0 = before[i].first;
+                lat0 = before[i].second;
+            }
+            i++;
+
+            accumulated& a = s.measurements[make_tuple(region, ppm, &p)];
+            a.effective_time += effective;
+            a.visits += v - v0;
+            a.latency_ns += lat - lat0;
+            a.experiments++;
+        }
+    }
+}
+
+} // namespace
+
+
+void causal_profiler::
+        start()
+{
+    start (options());
+}
+
+
+void causal_profiler::
+        start(const options& o)
+{
+    EXCEPTION_ASSERT(!o.speedups.empty ());
+
+    profiler_state& s = S();
+    unique_lock<mutex> l(s.lock);
+    if (s.running)
+        return;
+
+    s.opt = o;
+    s.stop_requested = false;
+    s.running = true;
+    s.profiler = thread(run_experiments);
+}
+
+
+void causal_profiler::
+        stop()
+{
+    profiler_state& s = S();
+    {
+        unique_lock<mutex> l(s.lock);
+        if (!s.running)
+            return;
+        s.stop_requested = true;
+        s.stop_cv.notify_all ();
+    }
+
+    s.profiler.join ();
+    s.running = false;
+    s.global_delay_ns = 0;
+    s.experiment++;
+}
+
+
+bool causal_profiler::
+        running()
+{
+    return S().running.load (memory_order_relaxed);
+}
+
+
+void causal_profiler::
+        reset()
+{
+    profiler_state& s = S();
+    unique_lock<mutex> l(s.lock);
+    s.measurements.clear ();
+}
+
+
+vector<causal_profiler::opportunity> causal_profiler::
+        results()
+{
+    profiler_state& s = S();
+    unique_lock<mutex> l(s.lock);
+
+    vector<opportunity> R;
+    for (int region=0; region<(int)s.regions.size (); region++)
+        for (point_data& p : s.points)
+        {
+            auto b = s.measurements.find (make_tuple(baseline, 0, &p));
+            if (b == s.measurements.end () || 0 == b->second.visits)
+                continue;
+
+            double base_rate = b->second.visits / b->second.effective_time;
+            double base_latency = b->second.latency_ns / (double)b->second.visits;
+
+            opportunity o;
+            o.region = s.regions[region];
+            o.point = p.name;
+            o.latency = p.latency;
+
+            double sg = 0, ss = 0;
+            for (auto& m : s.measurements)
+            {
+                if (get<0>(m.first) != region || get<2>(m.first) != &p || 0 == m.second.visits)
+                    continue;
+
+                const accumulated& a = m.second;
+                estimate e;
+                e.speedup = get<1>(m.first) * 1e-6;
+                e.experiments = a.experiments;
+                if (p.latency)
+                    e.gain = 0 < base_latency ? 1 - a.latency_ns / (double)a.visits / base_latency : 0;
+                else
+                    e.gain = a.visits / a.effective_time / base_rate - 1;
+
+                o.estimates.push_back (e);
+                sg += e.speedup * e.gain;
+                ss += e.speedup * e.speedup;
+            }
+
+            if (o.estimates.empty ())
+                continue;
+
+            o.impact = 0 < ss ? sg / ss : 0;
+            R.push_back (o);
+        }
+
+    stable_sort (R.begin (), R.end (), [](const opportunity& a, const opportunity& b) {
+        return a.impact > b.impact;
+    });
+    return R;
+}
+
+
+string causal_profiler::
+        report()
+{
+    string r = "Causal profile, impact is the relative gain per relative speedup of the region\n";
+    char line[1024];
+    snprintf(line, sizeof(line), "%8s  %-30s %-40s %s\n", "impact", "region", "goal", "gain at speedup");
+    r += line;
+
+    for (const opportunity& o : results ())
+    {
+        string goal = o.point + (o.latency ? " (latency)" : " (throughput)");
+        snprintf(line, sizeof(line), "%8.2f  %-30s %-40s", o.impact, o.region.c_str (), goal.c_str ());
+        r += line;
+        for (const estimate& e : o.estimates)
+        {
+            snprintf(line, sizeof(line), " %.0f%%: %+.1f%%", e.speedup*100, e.gain*100);
+            r += line;
+        }
+        r += "\n";
+    }
+
+    return r;
+}
+
+
+causal_profiler::point::
+        point(const char* name)
+{
+    profiler_state& s = S();
+    unique_lock<mutex> l(s.lock);
+    data_ = find_point (s, name, false);
+}
+
+
+void causal_profiler::point::
+        visit()
+{
+    if (!running ())
+        return;
+
+    thread_state& t = T();
+    catch_up (t);
+    static_cast<point_data*>(data_)->visits.fetch_add (1, memory_order_relaxed);
+}
+
+
+causal_profiler::region::
+        region(const char* name)
+{
+    profiler_state& s = S();
+    unique_lock<mutex> l(s.lock);
+    auto i = s.region_ids.find (name);
+    if (i != s.region_ids.end ())
+        id_ = i->second;
+    else
+    {
+        id_ = s.regions.size ();
+        s.regions.push_back (name);
+        s.region_ids[name] = id_;
+    }
+}
+
+
+causal_profiler::region_scope::
+        region_scope(const region& r)
+    :
+      id_(r.id_),
+      counted_(false),
+      experiment_(0)
+{
+    if (!running ())
+        return;
+
+    thread_state& t = T();
+    catch_up (t);
+
+    if (id_ == S().selected.load (memory_order_relaxed))
+    {
+        if (0 == t.depth++)
+            t.start = clock_type::now ();
+        counted_ = true;
+        experiment_ = t.experiment;
+    }
+}
+
+
+causal_profiler::region_scope::
+        ~region_scope()
+{
+    if (!running ())
+        return;
+
+    thread_state& t = T();
+    if (counted_ && experiment_ == t.experiment && 0 == --t.depth)
+    {
+        // Credit this thread with the virtual speedup and let all other
+        // threads catch up
+        uint64_t d = since (t.start) * S().speedup_ppm.load (memory_order_relaxed) / 1000000;
+        S().global_delay_ns += d;
+        t.local_delay_ns += d;
+        t.skipped_ns += d;
+    }
+
+    catch_up (t);
+}
+
+
+causal_profiler::blocking_scope::
+        blocking_scope()
+{
+    if (!running ())
+        return;
+
+    catch_up (T());
+}
+
+
+causal_profiler::blocking_scope::
+        ~blocking_scope()
+{
+    if (!running ())
+        return;
+
+    // Delays inserted while this thread was blocked are already accounted for
+    thread_state& t = T();
+    t.local_delay_ns = max(t.local_delay_ns, S().global_delay_ns.load (memory_order_relaxed));
+}
+
+
+causal_profiler::latency_start causal_profiler::
+        begin_latency()
+{
+    latency_start l;
+    if (!running ())
+        return l;
+
+    thread_state& t = T();
+    l.experiment = t.experiment;
+    l.skipped = t.skipped_ns * 1e-9;
+    return l;
+}
+
+
+void causal_profiler::
+        end_latency(const string& name, double elapsed, const latency_start& start)
+{
+    if (!running () || 0 == start.experiment)
+        return;
+
+    thread_state& t = T();
+    if (t.experiment != start.experiment)
+        return;
+
+    // Virtual time, without inserted delays and speedups
+    double v = max(0.0, elapsed - (t.skipped_ns * 1e-9 - start.skipped));
+
+    profiler_state& s = S();
+    point_data* p;
+    {
+        unique_lock<mutex> l(s.lock);
+        auto i = s.latency_points.find (name);
+        if (i != s.latency_points.end ())
+            p = i->second;
+        else
+            p = s.latency_points[name] = find_point (s, name, true);
+    }
+
+    p->latency_ns.fetch_add ((uint64_t)(v * 1e9), memory_order_relaxed);
+    p->visits.fetch_add (1, memory_order_relaxed);
+}
+
+
+namespace causal_profiler_test {
+
+static const causal_profiler::opportunity* find(const vector<causal_profiler::opportunity>& R, const char* region, const char* point)
+{
+    for (const auto& o : R)
+        if (o.region == region && o.point == point)
+            return &o;
+    return 0;
+}
+
+} // namespace causal_profiler_test
+
+using namespace causal_profiler_test;
+
+void causal_profiler::
+        test()
+{
+    // It should cause no measurements while stopped
+    {
+        for (int i=0; i<10; i++)
+        {
+            CAUSAL_REGION("causal_profiler_test idle");
+            PROGRESS_POINT("causal_profiler_test idle");
+        }
+        EXCEPTION_ASSERT(!causal_profiler::running ());
+        EXCEPTION_ASSERT(!find (results (), "causal_profiler_test idle", "causal_profiler_test idle"));
+    }
+
+    // It should predict which region affects which goal
+    {
+        // Two independent threads, each spending all its time in a region of
+        // its own
+        atomic<bool> done{false};
+        auto worker = [&done](bool a) {
+            while (!done)
+            {
+                latency_start l = begin_latency ();
+                auto t = clock_type::now ();
+                if (a)
+                {
+                    CAUSAL_REGION("causal_profiler_test a");
+                    this_thread::sleep_for (chrono::milliseconds(2));
+                    PROGRESS_POINT("causal_profiler_test a done");
+                }
+                else
+                {
+                    CAUSAL_REGION("causal_profiler_test b");
+                    this_thread::sleep_for (chrono::milliseconds(2));
+                    PROGRESS_POINT("causal_profiler_test b done");
+                }
+                // Goals are matched by name, not by address
+                if (a)
+                    end_latency (string("causal_profiler_test a ") + "latency", since (t) * 1e-9, l);
+            }
+        };
+
+        future<void> fa = async(launch::async, worker, true);
+        future<void> fb = async(launch::async, worker, false);
+
+        options o;
+        o.experiment_duration = 0.04;
+        o.speedups = {0.5};
+
+        reset ();
+        start (o);
+        this_thread::sleep_for (chrono::milliseconds(500));
+        stop ();
+
+        done = true;
+        fa.get ();
+        fb.get ();
+
+        auto R = results ();
+        auto aa = find (R, "causal_profiler_test a", "causal_profiler_test a done");
+        auto ba = find (R, "causal_profiler_test b", "causal_profiler_test a done");
+        auto bb = find (R, "causal_profiler_test b", "causal_profiler_test b done");
+        auto al = find (R, "causal_profiler_test a", "causal_profiler_test a latency");
+
+        EXCEPTION_ASSERT(aa && ba && bb && al);
+
+        // Half the time in 'a' doubles the rate of 'a done' (impact 2), but
+        // 'b' doesn't affect 'a done' (impact 0). Leave room for a busy machine.
+        EXCEPTION_ASSERT_LESS(0.7, aa->impact);
+        EXCEPTION_ASSERT_LESS(0.7, bb->impact);
+        EXCEPTION_ASSERT_LESS(fabs(ba->impact), 0.5);
+        EXCEPTION_ASSERT(!aa->latency);
+
+        // Half the time in 'a' halves the latency (impact 1)
+        EXCEPTION_ASSERT(al->latency);
+        EXCEPTION_ASSERT_LESS(0.3, al->impact);
+
+        // Ranked by impact
+        EXCEPTION_ASSERT_LESS_OR_EQUAL(R.back ().impact, R.front ().impact);
+        EXCEPTION_ASSERT(report ().find ("causal_profiler_test a done (throughput)") != string::npos);
+
+        reset ();
+        EXCEPTION_ASSERT(results ().empty ());
+    }
+
+    // It should not delay a thread for the delays inserted while it was
+    // blocked or before it started
+    {
+        atomic<bool> done{false};
+        future<void> f = async(launch::async, [&done]() {
+            while (!done)
+            {
+                CAUSAL_REGION("causal_profiler_test c");
+                this_thread::sleep_for (chrono::milliseconds(2));
+            }
+        });
+
+        options o;
+        o.experiment_duration = 0.2;
+        o.speedups = {1.0};
+        o.regions = {"causal_profiler_test c"};
+
+        start (o);
+        double slowest = 0;
+        for (int i=0; i<6; i++)
+        {
+            {
+                blocking_scope b;
+                this_thread::sleep_for (chrono::milliseconds(100));
+            }
+
+            auto t = clock_type::now ();
+            PROGRESS_POINT("causal_profiler_test c blocked");
+            slowest = max(slowest, since (t) * 1e-9);
+        }
+
+        async(launch::async, [&slowest]() {
+            auto t = clock_type::now ();
+            PROGRESS_POINT("causal_profiler_test c started");
+            slowest = max(slowest, since (t) * 1e-9);
+        }).get ();
+        stop ();
+
+        done = true;
+        f.get ();
+        reset ();
+
+        EXCEPTION_ASSERT_LESS(slowest, 0.05);
+    }
+}
@@ -0,0 +1,159 @@
+#ifndef CAUSAL_PROFILER_H
+#define CAUSAL_PROFILER_H
+
+#include <string>
+#include <vector>
+
+/**
+ * @brief The causal_profiler class should predict which code regions are
+ * worth optimizing by virtually speeding them up and measuring the effect on
+ * progress points.
+ *
+ * Progress points mark goals. PROGRESS_POINT counts visits, a throughput goal.
+ * TaskTimer scopes are latency goals, named by their format string.
+ *
+ *        while (running) {
+ *            {
+ *                CAUSAL_REGION("parse");
+ *                parse ();
+ *            }
+ *            {
+ *                TaskTimer tt("Handle request");
+ *                ...
+ *            }
+ *            PROGRESS_POINT("request done");
+ *        }
+ *
+ *        causal_profiler::start ();
+ *        ...
+ *        causal_profiler::stop ();
+ *        std::cout << causal_profiler::report ();
+ *
+ * While running, the profiler performs one experiment after another. Each
+ * experiment picks a region and a speedup. Whenever a thread leaves the
+ * region, all other threads are delayed by 'speedup' times the time spent in
+ * the region. Relative to everything else the region then ran faster. Rates
+ * and latencies of the progress points are measured with the inserted delays
+ * subtracted and compared to experiments without any speedup.
+ *
+ * The report ranks each pair of region and progress point by impact, the
+ * predicted relative gain of the progress point per relative speedup of the
+ * region. An impact of 0.5 means that making the region 10% faster would make
+ * the goal about 5% better.
+ *
+ * Threads are only delayed at progress points and region boundaries, a
+ * thread that doesn't pass any instrumentation is not delayed. A thread that
+ * waits in a blocking_scope, or starts during an experiment, is not delayed
+ * for the delays inserted meanwhile, the thread that wakes it has already
+ * been delayed. Instrumentation costs a relaxed atomic load while the
+ * profiler is stopped.
+ */
+class causal_profiler
+{
+public:
+    struct options {
+        double experiment_duration = 0.05;
+        // Speedups to try, experiments without speedup are interleaved
+        std::vector<double> speedups {0.25, 0.5, 0.75, 1.0};
+        // Regions to speed up, all regions if empty
+        std::vector<std::string> regions;
+    };
+
+    static void start ();
+    static void start (const options& o);
+    static void stop ();
+    static bool running ();
+
+    /**
+     * @brief reset discards all measurements.
+     */
+    static void reset ();
+
+    struct estimate {
+        double speedup;
+        double gain;        // relative improvement of the goal
+        unsigned experiments;
+    };
+
+    struct opportunity {
+        std::string region;
+        std::string point;
+        bool latency;       // latency goal, otherwise throughput goal
+        double impact;      // gain per speedup, least squares slope
+        std::vector<estimate> estimates;
+    };
+
+    /**
+     * @brief results lists all measured opportunities, largest impact first.
+     */
+    static std::vector<opportunity> results ();
+    static std::string report ();
+
+    class point {
+    public:
+        explicit point (const char* name);
+        void visit ();
+    private:
+        void* data_;
+    };
+
+    class region_scope;
+
+    class region {
+    public:
+        explicit region (const char* name);
+    private:
+        friend class region_scope;
+        int id_;
+    };
+
+    class region_scope {
+    public:
+        explicit region_scope (const region& r);
+        region_scope (const region_scope&) = delete;
+        region_scope& operator= (const region_scope&) = delete;
+        ~region_scope ();
+    private:
+        int id_;
+        bool counted_;
+        unsigned experiment_;
+    };
+
+    /**
+     * @brief The blocking_scope class should mark a wait on another thread,
+     * such as a lock or a condition variable.
+     */
+    class blocking_scope {
+    public:
+        blocking_scope ();
+        blocking_scope (const blocking_scope&) = delete;
+        blocking_scope& operator= (const blocking_scope&) = delete;
+        ~blocking_scope ();
+    };
+
+    /**
+     * @brief begin_latency and end_latency measure latency goals, as used by
+     * TaskTimer.
+     */
+    struct latency_start {
+        unsigned experiment = 0;
+        double skipped = 0;
+    };
+
+    static latency_start begin_latency ();
+    static void end_latency (const std::string& name, double elapsed, const latency_start& start);
+
+    static void test ();
+};
+
+#define PROGRESS_POINT(name) \
+    do { \
+        static causal_profiler::point causal_point_{name}; \
+        causal_point_.visit (); \
+    } while(false)
+
+#define CAUSAL_REGION(name) \
+    static causal_profiler::region causal_region_id_{name}; \
+    causal_profiler::region_scope causal_region_{causal_region_id_}
+
+#endif // CAUSAL_PROFILER_H
@@ -0,0 +1,646 @@
+#include "control_socket.h"
+#include "causal_profiler.h"
+#include "exceptionassert.h"
+#include "expectexception.h"
+#include "heap_profiler.h"
+#include "shared_metrics.h"
+#include "shared_state_lock_simulator.h"
+#include "shared_state_lock_trace.h"
+#include "stack_usage.h"
+#include "tasktimer.h"
+#include "thread_scopes.h"
+#include "timeline.h"
+#include "timer.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace {
+
+const char* help_text =
+        "help                                  this text\n"
+        "level verbose|detailed|simple on|off  TaskTimer log levels, on logs to stdout\n"
+        "tasktimer on|off                      all TaskTimer logging\n"
+        "threads                               scopes of all threads\n"
+        "stacks                                stack usage of registered threads\n"
+        "metrics                               OpenMetrics text\n"
+        "profile causal SECONDS                causal profile\n"
+        "profile heap SECONDS                  sampled allocations\n"
+        "profile timeline SECONDS              Chrome trace event JSON\n"
+        "profile locks SECONDS                 lock waits and holds per instance\n";
+
+mutex server_lock;
+condition_variable server_cv;
+bool stopping = false;
+thread server;
+string server_path;
+int listen_fd = -1;
+int stop_pipe[2] = {-1, -1};
+
+// Waits for 'seconds' or until the server is stopped
+void wait_for(double seconds)
+{
+    unique_lock<mutex> l(server_lock);
+    server_cv.wait_for (l, chrono::duration<double>(seconds), [](){ return stopping; });
+}
+
+string escape(const string& s)
+{
+    string r;
+    for (char c : s)
+    {
+        if (c == '\\' || c == '"')
+            r += '\\';
+        if (c == '\n')
+        {
+            r += "\\n";
+            continue;
+        }
+        r += c;
+    }
+    return r;
+}
+
+string number(double v)
+{
+    char buf[32];
+    snprintf (buf, sizeof(buf), "%.9g", v);
+    return buf;
+}
+
+string lock_report(const vector<lock_trace::event>& events)
+{
+    if (events.empty ())
+        return "No lock events, locks are only traced for types with shared_state_traits_lock_trace\n";
+
+    lock_simulator::result r = lock_simulator(events).recorded ();
+    ostringstream o;
+    o << r.acquisitions << " acquisitions in " << TaskTimer::timeToString (r.makespan)
+      << ", total wait " << TaskTimer::timeToString (r.wait) << endl;
+
+    char line[160];
+    snprintf (line, sizeof(line), "%-18s %6s %12s %12s %12s %12s\n",
+              "instance", "reads", "acquisitions", "wait s", "max wait s", "hold s");
+    o << line;
+    for (const auto& i : r.instances)
+    {
+        snprintf (line, sizeof(line), "0x%-16llx %6s %12zu %12.6f %12.6f %12.6f\n",
+                  (unsigned long long)i.instance, i.shared_reads ? "shared" : "excl",
+                  i.acquisitions, i.wait, i.max_wait, i.hold);
+        o << line;
+    }
+    return o.str ();
+}
+
+string profile(const string& kind, double seconds)
+{
+    if (kind == "causal")
+    {
+        bool was = causal_profiler::running ();
+        if (!was)
+        {
+            causal_profiler::reset ();
+            causal_profiler::start ();
+        }
+        wait_for (seconds);
+        if (!was)
+            causal_profiler::stop ();
+        return causal_profiler::report ();
+    }
+
+    if (kind == "heap")
+    {
+        bool was = heap_profiler::running ();
+        if (!was)
+        {
+            heap_profiler::reset ();
+            heap_profiler::start ();
+        }
+        wait_for (seconds);
+        string r = heap_profiler::report (heap_profiler::cumulative);
+        if (!was)
+            heap_profiler::stop ();
+        return r;
+    }
+
+    if (kind == "timeline")
+    {
+        bool was = timeline::enabled ();
+        if (!was)
+        {
+            timeline::clear ();
+            timeline::enable (true);
+        }
+        wait_for (seconds);
+        if (!was)
+            timeline::enable (false);
+        return timeline::chrome_trace () + "\n";
+    }
+
+    if (kind == "locks")
+    {
+        bool was = lock_trace::enabled ();
+        if (!was)
+        {
+            lock_trace::clear ();
+            lock_trace::enable (true);
+        }
+        wait_for (seconds);
+        if (!was)
+            lock_trace::enable (false);
+        return lock_report (lock_trace::events ());
+    }
+
+    return "error: unknown profiler '" + kind + "'\n";
+}
+
+#ifndef _WIN32
+bool write_all(int fd, const string& s)
+{
+    size_t n = 0;
+    while (n < s.size ())
+    {
+        ssize_t w = send (fd, s.data () + n, s.size () - n, MSG_NOSIGNAL);
+        if (w <= 0)
+            return false;
+        n += w;
+    }
+    return true;
+}
+
+// Answers each line until the client closes its end, goes quiet for 10 s or
+// the server is stopped
+void serve_connection(int fd)
+{
+    string buffer;
+    while (true)
+    {
+        pollfd p[2] = {{fd, POLLIN, 0}, {stop_pipe[0], POLLIN, 0}};
+        if (0 >= poll (p, 2, 10000) || p[1].revents)
+            return;
+
+        char chunk[1024];
+        ssize_t n = read (fd, chunk, sizeof(chunk));
+        if (n <= 0)
+            return;
+        buffer.append (chunk, n);
+
+        size_t i;
+        while (string::npos != (i = buffer.find ('\n')))
+        {
+            string command = buffer.substr (0, i);
+            buffer.erase (0, i + 1);
+            if (!command.empty () && command.back () == '\r')
+                command.pop_back ();
+            if (command.empty ())
+                continue;
+            if (!write_all (fd, control_socket::handle (command)))
+                return;
+        }
+
+        // Don't let a client fill the memory without a newline
+        if (buffer.size () > 4096)
+            return;
+    }
+}
+
+void serve()
+{
+    while (true)
+    {
+        pollfd p[2] = {{listen_fd, POLLIN, 0}, {stop_pipe[0], POLLIN, 0}};
+        if (0 > poll (p, 2, -1) && EINTR != errno)
+            return;
+        if (p[1].revents)
+            return;
+        if (!(p[0].revents & POLLIN))
+            continue;
+
+        int fd = accept (listen_fd, 0, 0);
+        if (0 > fd)
+            continue;
+        serve_connection (fd);
+        close (fd);
+    }
+}
+#endif
+
+} // namespace
+
+
+bool control_socket::
+        start(const string& path)
+{
+#ifndef _WIN32
+    unique_lock<mutex> l(server_lock);
+    if (server.joinable ())
+        return false;
+
+    sockaddr_un addr;
+    memset (&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size () >= sizeof(addr.sun_path))
+        return false;
+    strcpy (addr.sun_path, path.c_str ());
+
+    int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+    if (0 > fd)
+        return false;
+
+    // Only for the user that runs the process, the socket can change what
+    // the process logs and read what it is doing. bind creates the socket
+    // file with the permissions that the umask leaves, so no other user may
+    // connect before the chmod below.
+    ::unlink (path.c_str ());
+    mode_t mask = umask (077);
+    int bound = bind (fd, (sockaddr*)&addr, sizeof(addr));
+    umask (mask);
+    if (0 != bound || 0 != listen (fd, 8) || 0 != pipe (stop_pipe))
+    {
+        close (fd);
+        return false;
+    }
+    chmod (path.c_str (), 0600);
+
+    listen_fd = fd;
+    server_path = path;
+    stopping = false;
+    server = thread(serve);
+    return true;
+#else
+    (void)path;
+    return false;
+#endif
+}
+
+
+void control_socket::
+        stop()
+{
+#ifndef _WIN32
+    {
+        unique_lock<mutex> l(server_lock);
+        if (!server.joinable ())
+            return;
+
+        stopping = true;
+        server_cv.notify_all ();
+        char c = 0;
+        ssize_t r = write (stop_pipe[1], &c, 1);
+        (void)r;
+    }
+
+    server.join ();
+
+    unique_lock<mutex> l(server_lock);
+    close (listen_fd);
+    close (stop_pipe[0]);
+    close (stop_pipe[1]);
+    listen_fd = stop_pipe[0] = stop_pipe[1] = -1;
+    ::unlink (server_path.c_str ());
+    server_path.clear ();
+    stopping = false;
+#endif
+}
+
+
+bool control_socket::
+        running()
+{
+    unique_lock<mutex> l(server_lock);
+    return server.joinable ();
+}
+
+
+string control_socket::
+        handle(const string& command)
+{
+    istringstream i(command);
+    string c, a, b;
+    i >> c >> a >> b;
+
+    if (c == "help")
+        return help_text;
+
+    if (c == "level")
+    {
+        TaskTimer::LogLevel level;
+        if (a == "verbose")
+            level = TaskTimer::LogVerbose;
+        else if (a == "detailed")
+            level = TaskTimer::LogDetailed;
+        else if (a == "simple")
+            level = TaskTimer::LogSimple;
+        else
+            return "error: unknown level '" + a + "'\n";
+
+        if (b != "on" && b != "off")
+            return "error: expected on or off\n";
+
+        TaskTimer::setLogLevelStream (level, b == "on" ? &cout : 0);
+        return "level " + a + " " + b + "\n";
+    }
+
+    if (c == "tasktimer")
+    {
+        if (a != "on" && a != "off")
+            return "error: expected on or off\n";
+
+        TaskTimer::setEnabled (a == "on");
+        return "tasktimer " + a + "\n";
+    }
+
+    if (c == "threads")
+        return thread_scopes::dump ();
+
+    if (c == "stacks")
+        return stack_usage::dump ();
+
+    if (c == "metrics")
+        return metrics ();
+
+    if (c == "profile")
+    {
+        char* end = 0;
+        double seconds = strtod (b.c_str (), &end);
+        if (b.empty () || *end || !(0 < seconds && seconds <= 3600))
+            return "error: expected a duration in seconds, at most 3600\n";
+
+        return profile (a, seconds);
+    }
+
+    return "error: unknown command '" + c + "', try 'help'\n";
+}
+
+
+string control_socket::
+        metrics()
+{
+    ostringstream o;
+    o << "# TYPE backtrace_threads gauge\n"
+      << "# HELP backtrace_threads Threads with published scopes.\n"
+      << "backtrace_threads " << thread_scopes::snapshot ().size () << "\n"
+      << "# TYPE backtrace_tasktimer_enabled gauge\n"
+      << "backtrace_tasktimer_enabled " << (TaskTimer::enabled () ? 1 : 0) << "\n";
+
+    if (heap_profiler::running ())
+    {
+        heap_profiler::profile p = heap_profiler::snapshot (heap_profiler::live);
+        o << "# TYPE backtrace_heap_live_bytes gauge\n"
+          << "# HELP backtrace_heap_live_bytes Estimated from the sampled allocations.\n"
+          << "backtrace_heap_live_bytes " << number (p.bytes) << "\n";
+    }
+
+    vector<shared_metrics::site_stats> sites;
+#ifndef _WIN32
+    string name = shared_metrics::name ();
+    vector<shared_metrics::process_stats> p;
+    string error;
+    if (!name.empty () && shared_metrics::read (name, p, error))
+        for (const auto& ps : p)
+            if (ps.pid == (uint32_t)getpid ())
+                sites = ps.sites;
+#endif
+
+    if (!sites.empty ())
+    {
+        o << "# TYPE backtrace_site_seconds histogram\n"
+          << "# HELP backtrace_site_seconds Latencies of shared_metrics sites.\n";
+        for (const auto& s : sites)
+        {
+            string site = "site=\"" + escape (s.name) + "\"";
+            uint64_t sum = 0;
+            for (unsigned k=0; k<s.histogram.size (); k++)
+            {
+                sum += s.histogram[k];
+                o << "backtrace_site_seconds_bucket{" << site << ",le=\""
+                  << number ((uint64_t(2) << k) * 1e-9) << "\"} " << sum << "\n";
+            }
+            o << "backtrace_site_seconds_bucket{" << site << ",le=\"+Inf\"} " << s.count << "\n"
+              << "backtrace_site_seconds_count{" << site << "} " << s.count << "\n"
+              << "backtrace_site_seconds_sum{" << site << "} " << number (s.sum_ns * 1e-9) << "\n";
+        }
+
+        o << "# TYPE backtrace_site_overruns counter\n";
+        for (const auto& s : sites)
+            o << "backtrace_site_overruns_total{site=\"" << escape (s.name) << "\"} " << s.overruns << "\n";
+
+        o << "# TYPE backtrace_site_contended counter\n";
+        for (const auto& s : sites)
+            o << "backtrace_site_contended_total{site=\"" << escape (s.name) << "\"} " << s.contended << "\n";
+    }
+
+    // The deepest of the running and ended threads of each name
+    map<string, pair<size_t, size_t>> stacks; // used, size
+    for (const auto& t : stack_usage::snapshot ())
+    {
+        pair<size_t, size_t>& m = stacks[t.name];
+        m.first = max(m.first, t.used ());
+        m.second = max(m.second, t.size);
+    }
+
+    if (!stacks.empty ())
+    {
+        o << "# TYPE backtrace_stack_used_bytes gauge\n"
+          << "# HELP backtrace_stack_used_bytes Deepest stack usage of the threads of a name.\n";
+        for (const auto& s : stacks)
+            o << "backtrace_stack_used_bytes{thread=\"" << escape (s.first) << "\"} " << s.second.first << "\n";
+
+        o << "# TYPE backtrace_stack_size_bytes gauge\n";
+        for (const auto& s : stacks)
+            o << "backtrace_stack_size_bytes{thread=\"" << escape (s.first) << "\"} " << s.second.second << "\n";
+    }
+
+    o << "# EOF\n";
+    return o.str ();
+}
+
+
+string control_socket::
+        request(const string& path, const string& command)
+{
+#ifndef _WIN32
+    sockaddr_un addr;
+    memset (&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy (addr.sun_path, path.c_str (), sizeof(addr.sun_path) - 1);
+
+    int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+    if (0 > fd || 0 != connect (fd, (sockaddr*)&addr, sizeof(addr)))
+    {
+        string e = path + ": " + strerror (errno);
+        if (0 <= fd)
+            close (fd);
+        throw runtime_error(e);
+    }
+
+    write_all (fd, command + "\n");
+    // The server answers every line and then sees the end
+    shutdown (fd, SHUT_WR);
+
+    string r;
+    char chunk[4096];
+    ssize_t n;
+    while (0 < (n = read (fd, chunk, sizeof(chunk))))
+        r.append (chunk, n);
+    close (fd);
+    return r;
+#else
+    (void)command;
+    throw runtime_error(path + ": control_socket isn't supported on Windows");
+#endif
+}
+
+
+void control_socket::
+        test()
+{
+    // It should toggle TaskTimer logging
+    {
+        EXCEPTION_ASSERT_EQUALS(handle ("level verbose off"), "level verbose off\n");
+        EXCEPTION_ASSERT(!TaskTimer::isEnabled (TaskTimer::LogVerbose));
+        EXCEPTION_ASSERT_EQUALS(handle ("level verbose on"), "level verbose on\n");
+        EXCEPTION_ASSERT(TaskTimer::isEnabled (TaskTimer::LogVerbose));
+
+        handle ("tasktimer off");
+        EXCEPTION_ASSERT(!TaskTimer::enabled ());
+        handle ("tasktimer on");
+        EXCEPTION_ASSERT(TaskTimer::enabled ());
+    }
+
+    // It should keep the scopes of a thread balanced when TaskTimer is
+    // toggled while a TaskTimer runs
+    {
+        auto depth = []() {
+            ostringstream id;
+            id << this_thread::get_id ();
+            for (const thread_scopes::thread& t : thread_scopes::snapshot ())
+                if (t.id == id.str ())
+                    return t.depth;
+            return 0u;
+        };
+
+        unsigned d = depth ();
+        {
+            TaskTimer tt("control_socket_test on, off");
+            handle ("tasktimer off");
+        }
+        handle ("tasktimer on");
+        EXCEPTION_ASSERT_EQUALS(depth (), d);
+
+        {
+            handle ("tasktimer off");
+            TaskTimer tt("control_socket_test off, on");
+            handle ("tasktimer on");
+        }
+        EXCEPTION_ASSERT_EQUALS(depth (), d);
+    }
+
+    // It should reject what it doesn't understand
+    {
+        EXCEPTION_ASSERT_EQUALS(handle ("level loud on").substr (0, 6), "error:");
+        EXCEPTION_ASSERT_EQUALS(handle ("profile heap forever").substr (0, 6), "error:");
+        EXCEPTION_ASSERT_EQUALS(handle ("profile cpu 1").substr (0, 6), "error:");
+        EXCEPTION_ASSERT_EQUALS(handle ("reboot").substr (0, 6), "error:");
+        EXCEPTION_ASSERT(handle ("help").find ("profile locks") != string::npos);
+    }
+
+    // It should run a profiler for a while and answer with its results
+    {
+        string r;
+        {
+            TaskTimer tt("control_socket_test profiled");
+            r = handle ("profile timeline 0.001");
+        }
+        EXCEPTION_ASSERTX(r.find ("\"traceEvents\"") != string::npos, r);
+        EXCEPTION_ASSERT(!timeline::enabled ());
+
+        r = handle ("profile locks 0.001");
+        EXCEPTION_ASSERTX(r.find ("No lock events") != string::npos, r);
+        EXCEPTION_ASSERT(!lock_trace::enabled ());
+    }
+
+    // It should expose the shared_metrics sites and the stack usage of this
+    // process in the OpenMetrics text format
+    {
+        string r = metrics ();
+        EXCEPTION_ASSERTX(r.find ("backtrace_threads ") != string::npos, r);
+        EXCEPTION_ASSERT_EQUALS(r.substr (r.size () - 6), "# EOF\n");
+
+#ifndef _WIN32
+        string name = "/backtrace_test_cs_" + to_string (getpid ());
+        shared_metrics::unlink (name);
+        EXCEPTION_ASSERT(shared_metrics::open (name, 2, 8));
+        shared_metrics::record ("control_socket \"test\"", 0.0015);
+
+        r = metrics ();
+        shared_metrics::close ();
+        shared_metrics::unlink (name);
+
+        EXCEPTION_ASSERTX(r.find ("backtrace_site_seconds_count{site=\"control_socket \\\"test\\\"\"} 1\n") != string::npos, r);
+        EXCEPTION_ASSERTX(r.find ("backtrace_site_seconds_bucket{site=\"control_socket \\\"test\\\"\",le=\"0.002097152\"} 1\n") != string::npos, r);
+        EXCEPTION_ASSERTX(r.find ("backtrace_site_seconds_bucket{site=\"control_socket \\\"test\\\"\",le=\"0.001048576\"} 0\n") != string::npos, r);
+#endif
+
+        std::thread([]() { stack_usage::register_thread ("control_socket_test", 0, 0); }).join ();
+        r = metrics ();
+        EXCEPTION_ASSERTX(r.find ("backtrace_stack_size_bytes{thread=\"control_socket_test\"} ") != string::npos, r);
+        EXCEPTION_ASSERT(handle ("stacks").find ("control_socket_test") != string::npos);
+    }
+
+#ifndef _WIN32
+    // It should answer commands sent to the socket
+    {
+        string path = "/tmp/backtrace_test_" + to_string (getpid ()) + ".sock";
+        mode_t mask = umask (022);
+        EXCEPTION_ASSERT(start (path));
+        EXCEPTION_ASSERT(running ());
+        EXCEPTION_ASSERT_EQUALS(umask (mask), 022u);
+        EXCEPTION_ASSERT(!start (path));
+
+        struct stat st;
+        EXCEPTION_ASSERT_EQUALS(0, stat (path.c_str (), &st));
+        EXCEPTION_ASSERT_EQUALS(st.st_mode & 0777, 0600u);
+
+        thread_scope s("control_socket_test request");
+        string r = request (path, "threads");
+        EXCEPTION_ASSERTX(r.find ("control_socket_test request") != string::npos, r);
+
+        r = request (path, "tasktimer on\nhelp\r");
+        EXCEPTION_ASSERTX(r.find ("tasktimer on\n") == 0 && r.find ("profile causal") != string::npos, r);
+
+        // It should stop a profile that is in progress when stopped
+        thread t([path]() {
+            try { request (path, "profile locks 60"); } catch (...) {}
+        });
+        this_thread::sleep_for (chrono::milliseconds(10));
+        Timer timer;
+        stop ();
+        t.join ();
+        EXCEPTION_ASSERT_LESS(timer.elapsed (), 5.0);
+        EXCEPTION_ASSERT(!running ());
+        EXCEPTION_ASSERT(!lock_trace::enabled ());
+        EXCEPTION_ASSERT_EQUALS(-1, stat (path.c_str (), &st));
+        EXPECT_EXCEPTION(runtime_error, request (path, "threads"));
+    }
+#endif
+}
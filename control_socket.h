@@ -0,0 +1,75 @@
+#ifndef CONTROL_SOCKET_H
+#define CONTROL_SOCKET_H
+
+#include <string>
+
+/**
+ * @brief The control_socket class should let an operator turn diagnostics on
+ * and off in a running process, and scrape its metrics, through a local Unix
+ * domain socket.
+ *
+ *        control_socket::start ("/tmp/myservice.sock");
+ *
+ * and from a shell:
+ *
+ *        echo threads | nc -U /tmp/myservice.sock
+ *        echo "profile heap 30" | nc -U /tmp/myservice.sock > heap.txt
+ *
+ * Each line sent is a command, each command is answered in text:
+ *
+ *        help                          lists the commands
+ *        level verbose|detailed|simple on|off
+ *                                      TaskTimer::setLogLevelStream
+ *        tasktimer on|off              TaskTimer::setEnabled
+ *        threads                       thread_scopes::dump
+ *        stacks                        stack_usage::dump
+ *        metrics                       OpenMetrics text, see below
+ *        profile causal SECONDS        causal_profiler::report
+ *        profile heap SECONDS          heap_profiler::report, cumulative
+ *        profile timeline SECONDS      timeline::chrome_trace
+ *        profile locks SECONDS         lock waits and holds per instance,
+ *                                      from lock_trace
+ *
+ * 'profile' runs the profiler for SECONDS and answers with its results, the
+ * profiler is left off unless it was already running. 'metrics' has the
+ * shared_metrics sites of this process if the segment is open, the
+ * number of threads with published scopes, and the stack usage of the
+ * threads registered with stack_usage.
+ *
+ * The socket is served by a background thread, one connection at a time, so
+ * a 'profile' command holds back other clients until it is done. The socket
+ * is only accessible by the user that runs the process. POSIX only, on
+ * Windows start returns false.
+ */
+class control_socket
+{
+public:
+    /**
+     * @brief start listens on 'path', replacing any stale socket file.
+     */
+    static bool start (const std::string& path);
+    static void stop ();
+    static bool running ();
+
+    /**
+     * @brief handle runs one command and returns the answer. The socket
+     * answers with this.
+     */
+    static std::string handle (const std::string& command);
+
+    /**
+     * @brief metrics formats the metrics of this process as OpenMetrics text.
+     */
+    static std::string metrics ();
+
+    /**
+     * @brief request sends 'command' to the socket at 'path' and returns the
+     * answer, for clients and tests. Throws std::runtime_error if it couldn't
+     * connect.
+     */
+    static std::string request (const std::string& path, const std::string& command);
+
+    static void test ();
+};
+
+#endif // CONTROL_SOCKET_H
@@ -17,6 +17,8 @@
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 
 #ifdef __APPLE__
@@ -29,8 +31,6 @@
     #define fileno _fileno
 #endif
 
-static bool was_started_through_gdb_ = DetectGdb::is_running_through_gdb ();
-
 #ifndef _MSC_VER
 
 // http://stackoverflow.com/a/10973747/1513411
@@ -51,7 +51,7 @@ bool is_running_through_gdb_xorl()
 
 
 // http://stackoverflow.com/a/3599394/1513411
-bool is_running_through_gdb_terminus()
+static bool is_running_through_gdb_terminus()
 {
   int pid = fork();
   int status = 0;
@@ -115,10 +115,42 @@ bool is_running_through_gdb_terminus()
 }
 
 
+#ifdef __linux__
+// The pid of the process tracing this process, 0 if none or -1 if unknown
+static int tracer_pid()
+{
+    FILE* f = fopen("/proc/self/status", "r");
+    if (!f)
+        return -1;
+
+    int pid = -1;
+    char line[256];
+    while (fgets(line, sizeof(line), f))
+    {
+        if (0 == strncmp(line, "TracerPid:", 10))
+        {
+            pid = atoi(line + 10);
+            break;
+        }
+    }
+
+    fclose(f);
+    return pid;
+}
+#endif
+
+
 bool DetectGdb::
         is_running_through_gdb()
 {
-#if defined(__APPLE_CPP__) && (TARGET_OS_IPHONE==0)
+#if defined(__linux__)
+    int pid = tracer_pid();
+    if (0 <= pid)
+        return 0 != pid;
+
+    // No procfs
+    return is_running_through_gdb_terminus();
+#elif defined(__APPLE_CPP__) && (TARGET_OS_IPHONE==0)
     // No implementation for detecting IOS debugger
     #ifdef _DEBUG
         return false;
@@ -132,6 +164,14 @@ bool DetectGdb::
 #endif
 }
 
+
+
+bool DetectGdb::
+        ptrace_probe()
+{
+    return is_running_through_gdb_terminus();
+}
+
 #else
 
 bool DetectGdb::
@@ -146,5 +186,7 @@ bool DetectGdb::
 bool DetectGdb::
         was_started_through_gdb()
 {
+    // Not at static initialization, most processes never ask
+    static const bool was_started_through_gdb_ = is_running_through_gdb ();
     return was_started_through_gdb_;
 }
@@ -6,12 +6,28 @@
  * started through, or is running through, gdb.
  *
  * It might work with lldb or other debuggers as well.
+ *
+ * On Linux this reads TracerPid from /proc/self/status. Elsewhere it forks a
+ * child that attempts to ptrace this process, which is much slower.
  */
 class DetectGdb
 {
 public:
     static bool is_running_through_gdb();
+
+    /**
+     * @brief was_started_through_gdb calls is_running_through_gdb the first
+     * time it is called and then returns the same result.
+     */
     static bool was_started_through_gdb();
+
+#ifndef _MSC_VER
+    /**
+     * @brief ptrace_probe forks a child that attempts to ptrace this
+     * process, the fallback of is_running_through_gdb without procfs.
+     */
+    static bool ptrace_probe();
+#endif
 };
 
 #endif // DETECTGDB_H
@@ -1,5 +1,6 @@
 #include "exceptionassert.h"
 
+#include "backtrace_policy.h"
 #include "tasktimer.h"
 #include "expectexception.h"
 
@@ -32,7 +33,7 @@ void ExceptionAssert::
         ExceptionAssert()
             << ExceptionAssert_condition(condition)
             << ExceptionAssert_message(callerMessage)
-            << Backtrace::make(2 + skipFrames),
+            << backtrace_policy::make(fileMacro, lineMacro, 2 + skipFrames),
         functionMacro,
         fileMacro,
         lineMacro);
@@ -82,7 +83,7 @@ void ExceptionAssert::
     TaskInfo("condition: %s", condition);
     TaskInfo("message: %s", callerMessage.c_str());
 
-    TaskInfo("%s", Backtrace::make_string (2).c_str());
+    TaskInfo("%s", backtrace_policy::make_string (fileMacro, lineMacro, 2).c_str());
 }
 
 
@@ -0,0 +1,549 @@
+#include "heap_profiler.h"
+#include "exceptionassert.h"
+#include "tasktimer.h"
+#include "trace_perf.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <unordered_map>
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace std;
+
+atomic<bool> heap_profiler::running_{false};
+thread_local int64_t heap_profiler::bytes_until_sample_ = 0;
+atomic<uint16_t> heap_profiler::filter_[heap_profiler::filter_size];
+
+namespace {
+
+struct sample_info {
+    stack_depot::id stack;
+    double bytes, count;
+};
+
+struct site_stats {
+    double live_bytes = 0, live_count = 0;
+    double total_bytes = 0, total_count = 0;
+    unsigned live_samples = 0, total_samples = 0;
+};
+
+struct state {
+    mutex lock;
+    atomic<size_t> sampling_rate{heap_profiler::default_sampling_rate};
+    unordered_map<void*, sample_info> live;
+    unordered_map<stack_depot::id, site_stats> sites;
+
+    string exit_filename;
+    heap_profiler::view exit_view = heap_profiler::live;
+};
+
+// Never destroyed, the profiler is used until the process is gone
+state& the_state()
+{
+    static state* s = new state;
+    return *s;
+}
+
+// Plain data, a thread_local with a constructor could allocate on first use
+struct thread_state {
+    bool initialized;
+    bool busy;              // in the profiler, don't sample or forget
+    uint64_t random;
+};
+
+thread_local thread_state this_thread_state;
+
+// Allocations and frees by the profiler itself are ignored
+struct busy_scope {
+    busy_scope() { this_thread_state.busy = true; }
+    ~busy_scope() { this_thread_state.busy = false; }
+};
+
+// Exponentially distributed number of bytes to the next sample
+int64_t draw(size_t sampling_rate)
+{
+    thread_state& t = this_thread_state;
+    if (0 == t.random)
+        t.random = (uint64_t)(uintptr_t)&t * 0x9e3779b97f4a7c15ull | 1;
+
+    // xorshift64*
+    t.random ^= t.random >> 12;
+    t.random ^= t.random << 25;
+    t.random ^= t.random >> 27;
+    double u = ((t.random * 2685821657736338717ull) >> 11) * (1.0 / 9007199254740992.0);
+    return (int64_t)(-log (1 - u) * sampling_rate) + 1;
+}
+
+
+void dump_at_exit_handler()
+{
+    heap_profiler::stop ();
+    state& s = the_state ();
+    heap_profiler::dump (s.exit_filename, s.exit_view);
+}
+
+} // namespace
+
+
+void heap_profiler::
+        start(size_t sampling_rate)
+{
+    // backtrace allocates the first time it's called
+    void* frames[4];
+    stack_depot::capture (frames, 4);
+
+    the_state ().sampling_rate = max(sampling_rate, (size_t)1);
+
+    // Other threads draw with the new rate after their next sample
+    this_thread_state.initialized = false;
+    bytes_until_sample_ = 0;
+    running_ = true;
+}
+
+
+void heap_profiler::
+        stop()
+{
+    running_ = false;
+}
+
+
+bool heap_profiler::
+        running()
+{
+    return running_;
+}
+
+
+void heap_profiler::
+        reset()
+{
+    state& s = the_state ();
+    busy_scope busy;
+    unique_lock<mutex> l(s.lock);
+    for (auto& x : s.live)
+        filter_[filter_slot (x.first)]--;
+    s.live.clear ();
+    s.sites.clear ();
+}
+
+
+void heap_profiler::
+        sample(void* p, size_t size)
+{
+    thread_state& t = this_thread_state;
+    if (t.busy)
+        return;
+
+    state& s = the_state ();
+    size_t sampling_rate = s.sampling_rate.load (memory_order_relaxed);
+    if (!t.initialized)
+    {
+        // The first allocation of a thread is only sampled if it's large
+        // enough to reach the first sample point
+        t.initialized = true;
+        bytes_until_sample_ += draw (sampling_rate);
+        if (bytes_until_sample_ > 0)
+            return;
+    }
+
+    // The distribution is memoryless, the next point doesn't depend on how
+    // far this allocation reached past this one
+    bytes_until_sample_ = draw (sampling_rate);
+
+    busy_scope busy;
+
+    void* frames[64];
+    int n = stack_depot::capture (frames, 64, 1);
+    stack_depot::id stack = stack_depot::intern (frames, n);
+
+    // An allocation of 'size' bytes is sampled with probability 'q'
+    double q = 1 - exp (-(double)max(size, (size_t)1) / sampling_rate);
+    sample_info x{stack, size / q, 1 / q};
+
+    unique_lock<mutex> l(s.lock);
+    auto i = s.live.insert (make_pair(p, x));
+    if (!i.second)
+        return; // already sampled, freed without on_free
+
+    site_stats& st = s.sites[stack];
+    st.live_bytes += x.bytes;
+    st.live_count += x.count;
+    st.live_samples++;
+    st.total_bytes += x.bytes;
+    st.total_count += x.count;
+    st.total_samples++;
+    filter_[filter_slot (p)]++;
+}
+
+
+void heap_profiler::
+        forget(void* p)
+{
+    if (this_thread_state.busy)
+        return;
+
+    state& s = the_state ();
+    busy_scope busy;
+    unique_lock<mutex> l(s.lock);
+    auto i = s.live.find (p);
+    if (i == s.live.end ())
+        return; // another address with the same slot
+
+    site_stats& st = s.sites[i->second.stack];
+    st.live_bytes -= i->second.bytes;
+    st.live_count -= i->second.count;
+    st.live_samples--;
+    s.live.erase (i);
+    filter_[filter_slot (p)]--;
+}
+
+
+heap_profiler::profile heap_profiler::
+        snapshot(view v)
+{
+    state& s = the_state ();
+    profile r{s.sampling_rate, 0, 0, 0, vector<site>()};
+
+    {
+        busy_scope busy;
+        unique_lock<mutex> l(s.lock);
+        r.sites.reserve (s.sites.size ());
+        for (const auto& x : s.sites)
+        {
+            const site_stats& st = x.second;
+            site y = v == live
+                    ? site{x.first, st.live_bytes, st.live_count, st.live_samples}
+                    : site{x.first, st.total_bytes, st.total_count, st.total_samples};
+            if (0 == y.samples)
+                continue;
+
+            r.bytes += y.bytes;
+            r.count += y.count;
+            r.samples += y.samples;
+            r.sites.push_back (y);
+        }
+    }
+
+    sort (r.sites.begin (), r.sites.end (), [](const site& a, const site& b) { return a.bytes > b.bytes; });
+    return r;
+}
+
+
+string heap_profiler::
+        report(view v, unsigned max_sites)
+{
+    profile p = snapshot (v);
+
+    ostringstream o;
+    o << "Heap profile, " << (v == live ? "live" : "cumulative") << ": "
+      << TaskTimer::bytesToString (p.bytes) << " in " << (uint64_t)(p.count + 0.5)
+      << " allocations, estimated from " << p.samples << " samples, one per "
+      << TaskTimer::bytesToString ((double)p.sampling_rate) << endl;
+
+    for (unsigned i=0; i<p.sites.size () && i<max_sites; i++)
+    {
+        const site& x = p.sites[i];
+        char share[16];
+        snprintf (share, sizeof(share), "%.1f%%", 100 * x.bytes / p.bytes);
+
+        o << endl << "#" << i << " " << TaskTimer::bytesToString (x.bytes) << " (" << share << ") in "
+          << (uint64_t)(x.count + 0.5) << " allocations, " << x.samples << " samples" << endl;
+        for (void* f : stack_depot::frames (x.stack))
+            o << "    " << stack_depot::symbol (stack_depot::caller (f)) << endl;
+    }
+
+    if (p.sites.size () > max_sites)
+        o << endl << "... and " << p.sites.size () - max_sites << " more sites" << endl;
+
+    return o.str ();
+}
+
+
+string heap_profiler::
+        folded(view v)
+{
+    profile p = snapshot (v);
+
+    ostringstream o;
+    for (const site& x : p.sites)
+    {
+        vector<void*> frames = stack_depot::frames (x.stack);
+        for (auto i = frames.rbegin (); i != frames.rend (); ++i)
+        {
+            string name = stack_depot::symbol (stack_depot::caller (*i));
+            replace (name.begin (), name.end (), ';', ':');
+            o << (i == frames.rbegin () ? "" : ";") << name;
+        }
+        o << " " << (uint64_t)(x.bytes + 0.5) << "\n";
+    }
+    return o.str ();
+}
+
+
+bool heap_profiler::
+        dump(const string& filename, view v)
+{
+    const string ext = ".folded";
+    bool is_folded = filename.size () >= ext.size ()
+            && 0 == filename.compare (filename.size () - ext.size (), ext.size (), ext);
+
+    ofstream f(filename.c_str ());
+    f << (is_folded ? folded (v) : report (v));
+    return f.good ();
+}
+
+
+void heap_profiler::
+        dump_at_exit(const string& filename, view v)
+{
+    state& s = the_state ();
+    bool registered = !s.exit_filename.empty ();
+    s.exit_filename = filename;
+    s.exit_view = v;
+    if (!registered)
+        atexit (dump_at_exit_handler);
+}
+
+
+#if defined(HEAP_PROFILER_MALLOC) || defined(HEAP_PROFILER_NEW)
+namespace {
+
+struct start_from_environment {
+    start_from_environment()
+    {
+        const char* filename = getenv ("HEAP_PROFILE");
+        if (!filename || !*filename)
+            return;
+
+        const char* rate = getenv ("HEAP_PROFILE_RATE");
+        heap_profiler::start (rate ? strtoull (rate, 0, 10) : heap_profiler::default_sampling_rate);
+        heap_profiler::dump_at_exit (filename, heap_profiler::live);
+    }
+} start_from_environment_;
+
+} // namespace
+#endif
+
+
+#ifdef HEAP_PROFILER_MALLOC
+extern "C" {
+
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* p, size_t size);
+void __libc_free(void* p);
+
+void* malloc(size_t size) noexcept
+{
+    void* p = __libc_malloc (size);
+    if (p)
+        heap_profiler::on_alloc (p, size);
+    return p;
+}
+
+void* calloc(size_t n, size_t size) noexcept
+{
+    void* p = __libc_calloc (n, size);
+    if (p)
+        heap_profiler::on_alloc (p, n*size);
+    return p;
+}
+
+void* realloc(void* p, size_t size) noexcept
+{
+    if (p)
+        heap_profiler::on_free (p);
+    void* q = __libc_realloc (p, size);
+    if (q)
+        heap_profiler::on_alloc (q, size);
+    return q;
+}
+
+void free(void* p) noexcept
+{
+    if (p)
+        heap_profiler::on_free (p);
+    __libc_free (p);
+}
+
+} // extern "C"
+
+#elif defined(HEAP_PROFILER_NEW)
+void* operator new(size_t size)
+{
+    void* p = malloc (size ? size : 1);
+    if (!p)
+        throw bad_alloc();
+    heap_profiler::on_alloc (p, size);
+    return p;
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void* operator new(size_t size, const nothrow_t&) noexcept
+{
+    void* p = malloc (size ? size : 1);
+    if (p)
+        heap_profiler::on_alloc (p, size);
+    return p;
+}
+
+void* operator new[](size_t size, const nothrow_t& t) noexcept
+{
+    return operator new(size, t);
+}
+
+void operator delete(void* p) noexcept
+{
+    if (p)
+        heap_profiler::on_free (p);
+    free (p);
+}
+
+void operator delete[](void* p) noexcept
+{
+    operator delete(p);
+}
+
+void operator delete(void* p, const nothrow_t&) noexcept
+{
+    operator delete(p);
+}
+
+void operator delete[](void* p, const nothrow_t&) noexcept
+{
+    operator delete(p);
+}
+
+#ifdef __cpp_sized_deallocation
+void operator delete(void* p, size_t) noexcept
+{
+    operator delete(p);
+}
+
+void operator delete[](void* p, size_t) noexcept
+{
+    operator delete(p);
+}
+#endif
+#endif
+
+
+namespace heap_profiler_test {
+
+void* allocate(size_t size)
+{
+    void* p = malloc (size);
+    heap_profiler::on_alloc (p, size);
+    return p;
+}
+
+void release(void* p)
+{
+    heap_profiler::on_free (p);
+    free (p);
+}
+
+} // namespace heap_profiler_test
+
+using namespace heap_profiler_test;
+
+void heap_profiler::
+        test()
+{
+    // Through a volatile pointer for the stacks to differ by call site
+    void* (*volatile allocate_here)(size_t) = &allocate;
+
+    // It should estimate live and cumulative bytes by call stack
+    {
+        reset ();
+        start (4096);
+
+        vector<void*> kept;
+        for (int i=0; i<2000; i++)
+            kept.push_back (allocate_here (1000));
+        for (int i=0; i<2000; i++)
+            release (allocate_here (1000));
+
+        stop ();
+
+        profile l = snapshot (live);
+        EXCEPTION_ASSERT_EQUALS(l.sampling_rate, 4096u);
+        EXCEPTION_ASSERT_EQUALS(l.sites.size (), 1u);
+        EXCEPTION_ASSERT_LESS(1.6e6, l.bytes);
+        EXCEPTION_ASSERT_LESS(l.bytes, 2.4e6);
+        EXCEPTION_ASSERT_LESS(1600, l.count);
+        EXCEPTION_ASSERT_LESS(l.count, 2400);
+
+        profile c = snapshot (cumulative);
+        EXCEPTION_ASSERT_EQUALS(c.sites.size (), 2u);
+        EXCEPTION_ASSERT_LESS(3.2e6, c.bytes);
+        EXCEPTION_ASSERT_LESS(c.bytes, 4.8e6);
+        EXCEPTION_ASSERT_LESS(l.samples, c.samples);
+
+        // It should forget samples when they are freed, also when stopped
+        for (void* p : kept)
+            release (p);
+        EXCEPTION_ASSERT(snapshot (live).sites.empty ());
+        EXCEPTION_ASSERT_EQUALS(snapshot (cumulative).samples, c.samples);
+
+        // It should not sample when stopped
+        release (allocate_here (1 << 20));
+        EXCEPTION_ASSERT_EQUALS(snapshot (cumulative).samples, c.samples);
+    }
+
+    // It should list the stacks in a report and as folded stacks
+    {
+        reset ();
+        start (1);
+        void* p = allocate_here (100);
+        stop ();
+
+        string r = report (live);
+        EXCEPTION_ASSERTX(r.find ("Heap profile, live: 100 B in 1 allocations, estimated from 1 samples, one per 1 B") == 0, r);
+        EXCEPTION_ASSERTX(r.find ("heap_profiler_test::allocate") != string::npos, r);
+        EXCEPTION_ASSERTX(r.find ("heap_profiler::test") != string::npos, r);
+
+        // Outermost first
+        string f = folded (live);
+        size_t caller = f.find ("heap_profiler::test();");
+        size_t callee = f.find ("heap_profiler_test::allocate");
+        EXCEPTION_ASSERTX(caller != string::npos && callee != string::npos && caller < callee, f);
+        EXCEPTION_ASSERTX(f.find (" 100\n") == f.size () - 5, f);
+
+        // It should name the innermost frame by the allocating function
+        EXCEPTION_ASSERTX(callee == f.rfind (';') + 1, f);
+
+        release (p);
+        EXCEPTION_ASSERT(folded (live).empty ());
+        EXCEPTION_ASSERT(!folded (cumulative).empty ());
+        reset ();
+        EXCEPTION_ASSERT(folded (cumulative).empty ());
+    }
+
+    // It should cost a few nanoseconds per allocation at the default rate
+    {
+        void* p = malloc (64);
+        start ();
+        {
+            TRACE_PERF("heap_profiler 1000000 on_alloc and on_free");
+            for (int i=0; i<1000000; i++)
+            {
+                on_alloc (p, 64);
+                on_free (p);
+            }
+        }
+        stop ();
+        free (p);
+        reset ();
+    }
+}
@@ -0,0 +1,137 @@
+#ifndef HEAP_PROFILER_H
+#define HEAP_PROFILER_H
+
+#include "stack_depot.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * @brief The heap_profiler class should tell which call stacks allocate the
+ * most memory, and which still hold it, at a cost low enough for production.
+ *
+ * Allocations are sampled by bytes. Each thread draws the number of bytes to
+ * its next sample from an exponential distribution with the mean
+ * 'sampling_rate', so that an allocation is sampled with a probability
+ * proportional to its size. A sample captures the stack of the allocation
+ * and is weighted by the inverse of its probability to estimate the bytes
+ * and allocations it stands for. Allocations that aren't sampled cost a
+ * thread_local decrement, a free that isn't of a sampled allocation costs a
+ * lookup in a small table.
+ *
+ * The allocator reports to on_alloc and on_free. Build with
+ * -DHEAP_PROFILER_NEW to report from operator new and delete, and with
+ * -DHEAP_PROFILER_MALLOC to report from malloc, calloc, realloc and free
+ * (glibc only). A program built with either starts the profiler if the
+ * environment variable HEAP_PROFILE names a file to dump to at exit, and
+ * takes the sampling rate from HEAP_PROFILE_RATE.
+ *
+ *        heap_profiler::start ();
+ *        ... run the workload
+ *        heap_profiler::dump ("heap.folded", heap_profiler::live);
+ *        std::cout << heap_profiler::report (heap_profiler::cumulative);
+ *
+ * The live view has the samples that haven't been freed, at exit those are
+ * the leaks. The cumulative view has every sample since start or reset.
+ */
+class heap_profiler
+{
+public:
+    static const std::size_t default_sampling_rate = 512*1024;
+
+    static void start (std::size_t sampling_rate = default_sampling_rate);
+    static void stop ();
+    static bool running ();
+
+    /**
+     * @brief reset discards all samples, also the live ones.
+     */
+    static void reset ();
+
+    /**
+     * @brief on_alloc and on_free are called by the allocator, on_free before
+     * the memory is released.
+     */
+    static void on_alloc (void* p, std::size_t size)
+    {
+        if (!running_.load (std::memory_order_relaxed))
+            return;
+
+        if ((bytes_until_sample_ -= (std::int64_t)size) > 0)
+            return;
+
+        sample (p, size);
+    }
+
+    static void on_free (void* p)
+    {
+        if (0 == filter_[filter_slot (p)].load (std::memory_order_relaxed))
+            return;
+
+        forget (p);
+    }
+
+    enum view {
+        live,
+        cumulative
+    };
+
+    struct site {
+        stack_depot::id stack;
+        double bytes;       // estimated
+        double count;       // estimated number of allocations
+        unsigned samples;
+    };
+
+    struct profile {
+        std::size_t sampling_rate;
+        double bytes, count;
+        unsigned samples;
+        std::vector<site> sites; // most bytes first
+    };
+
+    static profile snapshot (view v);
+
+    /**
+     * @brief report lists the sites with the most bytes and their stacks.
+     */
+    static std::string report (view v, unsigned max_sites = 20);
+
+    /**
+     * @brief folded has one line per site with the outermost frame first,
+     * frames separated by ';' and followed by the number of bytes. As read
+     * by flamegraph.pl and speedscope.
+     */
+    static std::string folded (view v);
+
+    /**
+     * @brief dump writes 'folded' to files ending with ".folded", and
+     * 'report' otherwise.
+     */
+    static bool dump (const std::string& filename, view v);
+    static void dump_at_exit (const std::string& filename, view v);
+
+    static void test ();
+
+private:
+    static const unsigned filter_size = 1 << 15;
+
+    static std::atomic<bool> running_;
+    static thread_local std::int64_t bytes_until_sample_;
+    // Number of live samples by a hash of their address
+    static std::atomic<std::uint16_t> filter_[filter_size];
+
+    static unsigned filter_slot (void* p)
+    {
+        std::uintptr_t x = (std::uintptr_t)p;
+        return (unsigned)((x >> 4) ^ (x >> 19)) & (filter_size - 1);
+    }
+
+    static void sample (void* p, std::size_t size);
+    static void forget (void* p);
+};
+
+#endif // HEAP_PROFILER_H
@@ -0,0 +1,146 @@
+#include "hybrid_barrier.h"
+#include "exceptionassert.h"
+#include "timer.h"
+#include "trace_perf.h"
+
+#include <future>
+#include <vector>
+#include <climits>
+
+#include <boost/format.hpp>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+void hybrid_barrier::
+        sleep(unsigned int step)
+{
+    sleepers_.fetch_add (1);
+
+#ifdef __linux__
+    // FUTEX_WAIT returns right away if the phase has already changed
+    while (step_.load () == step)
+        syscall(SYS_futex, reinterpret_cast<int*>(&step_), FUTEX_WAIT_PRIVATE, (int)step, nullptr, nullptr, 0);
+#else
+    {
+        unique_lock<mutex> l(m_);
+        while (step_.load () == step)
+            cv_.wait (l);
+    }
+#endif
+
+    sleepers_.fetch_sub (1);
+}
+
+
+void hybrid_barrier::
+        wake_all()
+{
+#ifdef __linux__
+    syscall(SYS_futex, reinterpret_cast<int*>(&step_), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+#else
+    // Synchronize with threads that are about to wait
+    { unique_lock<mutex> l(m_); }
+    cv_.notify_all ();
+#endif
+}
+
+
+namespace hybrid_barrier_test {
+
+// Arrive at the barrier 'M' times from 'N' threads, thread 'late' arrives
+// 'delay' late each time
+static void run(hybrid_barrier& b, unsigned N, unsigned M, unsigned late, chrono::microseconds delay, vector<unsigned>* returned_true = 0)
+{
+    vector<future<void>> f(N);
+    atomic<bool> ok{true};
+    vector<atomic<unsigned>> arrived(M);
+    for (auto& a : arrived)
+        a = 0;
+
+    for (unsigned i=0; i<N; i++)
+        f[i] = async(launch::async, [&,i]()
+        {
+            for (unsigned j=0; j<M; j++)
+            {
+                if (i == late)
+                    this_thread::sleep_for (delay);
+                arrived[j]++;
+                bool last = b.wait ();
+                if (arrived[j] != N)
+                    ok = false;
+                if (last && returned_true)
+                    (*returned_true)[j]++;
+            }
+        });
+
+    for (auto& x : f)
+        x.get ();
+
+    EXCEPTION_ASSERT(ok);
+}
+
+} // namespace hybrid_barrier_test
+
+using namespace hybrid_barrier_test;
+
+void hybrid_barrier::
+        test()
+{
+    // It should let the last thread to come return true
+    {
+        unsigned N = 5, M = 200;
+        hybrid_barrier b(N);
+        vector<unsigned> returned_true(M);
+
+        run (b, N, M, 0, chrono::microseconds(0), &returned_true);
+
+        for (unsigned j=0; j<M; j++)
+            EXCEPTION_ASSERT_EQUALS(returned_true[j], 1u);
+    }
+
+    // It should not spin when there are more threads than cores
+    {
+        hybrid_barrier b(std::thread::hardware_concurrency () + 1);
+        EXCEPTION_ASSERT_EQUALS(b.spin_budget_ns (), 0);
+    }
+
+    // It should stop spinning when arrivals are skewed
+    {
+        unsigned N = std::max(2u, std::thread::hardware_concurrency ());
+        hybrid_barrier b(N);
+        long long min_spin = min_spin_ns;
+        EXCEPTION_ASSERT_EQUALS(b.spin_budget_ns (), N <= std::thread::hardware_concurrency () ? min_spin : 0);
+
+        run (b, N, 20, N-1, chrono::milliseconds(1));
+        EXCEPTION_ASSERT_EQUALS(b.spin_budget_ns (), 0);
+
+        // and spin again when they are not
+        if (2 <= std::thread::hardware_concurrency ())
+        {
+            run (b, N, 200, 0, chrono::microseconds(0));
+            EXCEPTION_ASSERT_LESS(0, b.spin_budget_ns ());
+        }
+    }
+
+    // It should be fast both in lockstep and with skewed arrivals
+    {
+        unsigned N = std::max(2u, std::thread::hardware_concurrency ());
+        hybrid_barrier b(N);
+
+        {
+            TRACE_PERF(str(boost::format("hybrid_barrier %d threads, 100 times in lockstep") % N));
+            run (b, N, 100, 0, chrono::microseconds(0));
+        }
+
+        {
+            TRACE_PERF(str(boost::format("hybrid_barrier %d threads, 20 times 1 ms late") % N));
+            run (b, N, 20, 0, chrono::milliseconds(1));
+        }
+    }
+}
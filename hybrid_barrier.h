@@ -0,0 +1,135 @@
+#ifndef HYBRID_BARRIER_H
+#define HYBRID_BARRIER_H
+
+#include "barrier.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+/**
+ * @brief The hybrid_barrier class should spin while the other threads are
+ * expected to arrive soon, and otherwise sleep.
+ *
+ * The first thread to arrive measures how long it waited, the skew of the
+ * phase. Waiting threads spin for about twice the average skew of recent
+ * phases, or not at all if that is longer than 'max_spin_ns'. Then they
+ * sleep on a futex keyed to the phase word and are woken by a single
+ * FUTEX_WAKE from the last thread. When arrivals are in lockstep it behaves
+ * like spinning_barrier, when they are skewed it behaves like
+ * locking_barrier.
+ *
+ * Threads never spin if there are more threads than cores. On platforms
+ * without futexes sleeping threads wait on a condition variable instead.
+ */
+class hybrid_barrier
+{
+public:
+    /**
+     * @brief hybrid_barrier
+     * @param n number of threads to participate in the barrier.
+     */
+    hybrid_barrier (unsigned int n)
+        :
+          n_ (n),
+          may_spin_ (n <= std::thread::hardware_concurrency())
+    {}
+
+    bool wait ()
+    {
+        unsigned int step = step_.load ();
+        unsigned int arrived = nwait_.fetch_add (1);
+
+        if (arrived == n_ - 1)
+        {
+            // OK, last thread to come.
+            nwait_.store (0);
+            step_.fetch_add (1);
+            if (sleepers_.load ())
+                wake_all ();
+            return true;
+        }
+
+        long long start = now_ns ();
+        long long budget = spin_budget_ns ();
+        if (0 < budget)
+        {
+            long long deadline = start + budget;
+            for (unsigned int i=1; step_.load (std::memory_order_acquire) == step; i++)
+            {
+                barrier_pause ();
+                if (0 == i % 64 && now_ns () > deadline)
+                    break;
+            }
+        }
+
+        if (step_.load (std::memory_order_acquire) == step)
+            sleep (step);
+
+        // Only the first thread writes skew_ns_
+        if (arrived == 0)
+            update_skew (now_ns () - start);
+        return false;
+    }
+
+    /**
+     * @brief spin_budget_ns is how long a waiting thread currently spins
+     * before it sleeps.
+     */
+    long long spin_budget_ns () const
+    {
+        if (!may_spin_)
+            return 0;
+
+        long long skew = skew_ns_.load (std::memory_order_relaxed);
+        return skew < max_spin_ns ? 2*skew + min_spin_ns : 0;
+    }
+
+    // Spin for at least this long, sleeping costs a few microseconds anyway
+    static const long long min_spin_ns = 2000;
+
+    // Sleep right away if the average skew is longer than this
+    static const long long max_spin_ns = 50000;
+
+private:
+    // Number of synchronized threads.
+    const unsigned int n_;
+    const bool may_spin_;
+
+    // Number of barrier syncronizations completed so far, it's OK to wrap.
+    // The futex word, written once per phase and read by spinning threads.
+    alignas(64) std::atomic<unsigned int> step_{0};
+
+    // Number of threads currently waiting, on a cache line of its own as it's
+    // written by every thread.
+    alignas(64) std::atomic<unsigned int> nwait_{0};
+
+    alignas(64) std::atomic<unsigned int> sleepers_{0};
+    std::atomic<long long> skew_ns_{0};
+
+#ifndef __linux__
+    std::mutex m_;
+    std::condition_variable cv_;
+#endif
+
+    static long long now_ns () {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now ().time_since_epoch ()).count ();
+    }
+
+    void update_skew (long long skew) {
+        // Exponential moving average over the last few phases
+        long long avg = skew_ns_.load (std::memory_order_relaxed);
+        skew_ns_.store ((3*avg + skew) / 4, std::memory_order_relaxed);
+    }
+
+    void sleep (unsigned int step);
+    void wake_all ();
+
+public:
+    static void test();
+};
+
+#endif // HYBRID_BARRIER_H
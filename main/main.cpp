@@ -3,13 +3,7 @@
 
 int main(int argc, char** argv)
 {
-    if (1 != argc)
-    {
-        printf("%s: Invalid argument\n", argv[0]);
-        return 1;
-    }
-
     PrettifySegfault::setup ();
 
-    return BacktraceTest::UnitTest::test(false);
+    return BacktraceTest::UnitTest::test(argc, argv);
 }
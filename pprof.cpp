@@ -0,0 +1,998 @@
+#include "pprof.h"
+#include "exceptionassert.h"
+#include "heap_profiler.h"
+#include "shared_state_traits_metrics.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <time.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <elf.h>
+#include <link.h>
+#endif
+
+#ifdef PPROF_CXA_THROW
+#include <dlfcn.h>
+#endif
+
+using namespace std;
+
+namespace {
+
+int64_t system_now_ns()
+{
+    return chrono::duration_cast<chrono::nanoseconds>(
+                chrono::system_clock::now ().time_since_epoch ()).count ();
+}
+
+// Writes protobuf wire format, fields with default values are left out
+class proto {
+public:
+    string o;
+
+    void varint(uint64_t v)
+    {
+        while (v >= 0x80)
+        {
+            o += (char)(v | 0x80);
+            v >>= 7;
+        }
+        o += (char)v;
+    }
+
+    void field(int number, uint64_t v)
+    {
+        if (0 == v)
+            return;
+        varint ((uint64_t)number << 3);
+        varint (v);
+    }
+
+    void field(int number, const string& bytes)
+    {
+        varint ((uint64_t)number << 3 | 2);
+        varint (bytes.size ());
+        o += bytes;
+    }
+
+    void packed(int number, const vector<uint64_t>& v)
+    {
+        if (v.empty ())
+            return;
+        proto p;
+        for (uint64_t x : v)
+            p.varint (x);
+        field (number, p.o);
+    }
+};
+
+class string_table {
+public:
+    vector<string> table{""};
+
+    uint64_t operator()(const string& s)
+    {
+        auto i = index.find (s);
+        if (i != index.end ())
+            return i->second;
+        index[s] = table.size ();
+        table.push_back (s);
+        return table.size () - 1;
+    }
+
+private:
+    map<string, uint64_t> index{{"", 0}};
+};
+
+struct module {
+    uint64_t start, limit, offset;
+    string filename, build_id;
+};
+
+#ifdef __linux__
+string build_id(const dl_phdr_info* info)
+{
+    for (int i=0; i<info->dlpi_phnum; i++)
+    {
+        const ElfW(Phdr)& ph = info->dlpi_phdr[i];
+        if (PT_NOTE != ph.p_type)
+            continue;
+
+        const char* p = (const char*)(info->dlpi_addr + ph.p_vaddr);
+        const char* end = p + ph.p_memsz;
+        while (p + sizeof(ElfW(Nhdr)) <= end)
+        {
+            const ElfW(Nhdr)* n = (const ElfW(Nhdr)*)p;
+            const char* name = p + sizeof(ElfW(Nhdr));
+            const unsigned char* desc = (const unsigned char*)name + ((n->n_namesz + 3) & ~3u);
+            if (NT_GNU_BUILD_ID == n->n_type && 4 == n->n_namesz && 0 == memcmp (name, "GNU", 4))
+            {
+                string r;
+                char hex[3];
+                for (unsigned j=0; j<n->n_descsz; j++)
+                {
+                    snprintf (hex, sizeof(hex), "%02x", desc[j]);
+                    r += hex;
+                }
+                return r;
+            }
+            p = (const char*)desc + ((n->n_descsz + 3) & ~3u);
+        }
+    }
+    return "";
+}
+
+int add_module(dl_phdr_info* info, size_t, void* data)
+{
+    vector<module>& modules = *(vector<module>*)data;
+    string filename = info->dlpi_name ? info->dlpi_name : "";
+    if (filename.empty () && modules.empty ())
+    {
+        // The executable
+        char buf[4096];
+        ssize_t n = readlink ("/proc/self/exe", buf, sizeof(buf) - 1);
+        if (0 < n)
+            filename.assign (buf, n);
+    }
+
+    string id = build_id (info);
+    for (int i=0; i<info->dlpi_phnum; i++)
+    {
+        const ElfW(Phdr)& ph = info->dlpi_phdr[i];
+        if (PT_LOAD == ph.p_type && (ph.p_flags & PF_X))
+            modules.push_back (module{info->dlpi_addr + ph.p_vaddr,
+                                      info->dlpi_addr + ph.p_vaddr + ph.p_memsz,
+                                      ph.p_offset, filename, id});
+    }
+    return 0;
+}
+#endif
+
+vector<module> modules()
+{
+    vector<module> r;
+#ifdef __linux__
+    dl_iterate_phdr (add_module, &r);
+#endif
+    return r;
+}
+
+// Samples collected between takes
+struct collector {
+    mutex lock;
+    atomic<bool> running{false};
+    int64_t start_ns = 0;
+    map<stack_depot::id, vector<int64_t>> values;
+
+    void add(stack_depot::id id, const vector<int64_t>& v)
+    {
+        unique_lock<mutex> l(lock);
+        vector<int64_t>& t = values[id];
+        t.resize (v.size ());
+        for (size_t i=0; i<v.size (); i++)
+            t[i] += v[i];
+    }
+};
+
+collector& C(pprof::kind k)
+{
+    // Leaked, samples may be recorded after static destructors have run
+    static collector* c = new collector[4];
+    return c[k];
+}
+
+stack_depot::id capture(int skip)
+{
+    void* frames[64];
+    int n = stack_depot::capture (frames, 64, skip + 1);
+    return stack_depot::intern (frames, n);
+}
+
+
+#ifndef _WIN32
+const unsigned max_frames = 64;
+const unsigned ring_size = 1024;
+
+struct cpu_slot {
+    // 0 free, 1 written by the signal handler, 2 ready
+    atomic<int> state{0};
+    int n = 0;
+    void* frames[max_frames];
+};
+
+cpu_slot* ring = 0;
+atomic<uint64_t> ring_head{0};
+mutex drain_lock;
+thread drainer;
+condition_variable drainer_cv;
+bool drainer_stop = false;
+
+void on_sigprof(int)
+{
+    if (!C(pprof::cpu).running.load (memory_order_relaxed))
+        return;
+
+    int saved_errno = errno;
+    cpu_slot& s = ring[ring_head.fetch_add (1, memory_order_relaxed) % ring_size];
+    int expected = 0;
+    if (s.state.compare_exchange_strong (expected, 1, memory_order_acquire))
+    {
+        // Skip on_sigprof and the signal trampoline
+        s.n = stack_depot::capture (s.frames, max_frames, 2);
+        s.state.store (2, memory_order_release);
+    }
+    errno = saved_errno;
+}
+
+void drain()
+{
+    unique_lock<mutex> l(drain_lock);
+    const int64_t period = 1000000000 / pprof::cpu_hz;
+    for (unsigned i=0; i<ring_size; i++)
+    {
+        cpu_slot& s = ring[i];
+        if (2 != s.state.load (memory_order_acquire))
+            continue;
+
+        stack_depot::id id = stack_depot::intern (s.frames, s.n);
+        s.state.store (0, memory_order_release);
+        C(pprof::cpu).add (id, {1, period});
+    }
+}
+
+void drain_until_stopped()
+{
+    unique_lock<mutex> l(drain_lock);
+    while (!drainer_stop)
+    {
+        drainer_cv.wait_for (l, chrono::milliseconds(20));
+        l.unlock ();
+        drain ();
+        l.lock ();
+    }
+}
+
+void set_timer(unsigned hz)
+{
+    itimerval t;
+    memset (&t, 0, sizeof(t));
+    if (hz)
+    {
+        t.it_interval.tv_usec = 1000000 / hz;
+        t.it_value = t.it_interval;
+    }
+    setitimer (ITIMER_PROF, &t, 0);
+}
+#endif
+
+
+mutex rotate_lock;
+condition_variable rotate_cv;
+thread rotator;
+bool rotate_stop = false;
+
+void save_running(const string& prefix)
+{
+    char stamp[32];
+    time_t t = time (0);
+    tm local;
+#ifdef _WIN32
+    localtime_s (&local, &t);
+#else
+    localtime_r (&t, &local);
+#endif
+    strftime (stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &local);
+
+    for (pprof::kind k : {pprof::cpu, pprof::heap, pprof::contention, pprof::throws})
+        if (pprof::running (k))
+            pprof::take (k).save (prefix + "." + pprof::name (k) + "." + stamp + ".pb.gz");
+}
+
+} // namespace
+
+
+pprof::profile::
+        profile(const vector<value_type>& sample_types, const value_type& period_type, int64_t period)
+    :
+      sample_types_(sample_types),
+      period_type_(period_type),
+      period_(period)
+{
+}
+
+
+void pprof::profile::
+        add(stack_depot::id stack, const vector<int64_t>& values)
+{
+    vector<int64_t>& v = samples_[stack];
+    v.resize (sample_types_.size ());
+    for (size_t i=0; i<v.size () && i<values.size (); i++)
+        v[i] += values[i];
+}
+
+
+void pprof::profile::
+        set_time(int64_t time_ns, int64_t duration_ns)
+{
+    time_ns_ = time_ns;
+    duration_ns_ = duration_ns;
+}
+
+
+size_t pprof::profile::
+        samples() const
+{
+    return samples_.size ();
+}
+
+
+const vector<int64_t>& pprof::profile::
+        values(stack_depot::id stack) const
+{
+    auto i = samples_.find (stack);
+    return i == samples_.end () ? none_ : i->second;
+}
+
+
+string pprof::profile::
+        serialize() const
+{
+    string_table strings;
+    vector<module> mods = modules ();
+    map<void*, uint64_t> locations;
+    map<string, uint64_t> functions;
+    proto location_fields, function_fields, sample_fields;
+
+    for (const auto& s : samples_)
+    {
+        vector<uint64_t> ids;
+        for (void* frame : stack_depot::frames (s.first))
+        {
+            uint64_t& id = locations[frame];
+            if (!id)
+            {
+                id = locations.size ();
+
+                void* pc = stack_depot::caller (frame);
+                uint64_t address = (uint64_t)(uintptr_t)pc;
+                string symbol = stack_depot::symbol (pc);
+                uint64_t& function = functions[symbol];
+                if (!function)
+                {
+                    function = functions.size ();
+                    proto f;
+                    f.field (1, function);
+                    f.field (2, strings (symbol));
+                    f.field (3, strings (symbol));
+                    function_fields.field (5, f.o);
+                }
+
+                uint64_t mapping = 0;
+                for (size_t m=0; m<mods.size (); m++)
+                    if (mods[m].start <= address && address < mods[m].limit)
+                        mapping = m + 1;
+
+                proto line;
+                line.field (1, function);
+                proto l;
+                l.field (1, id);
+                l.field (2, mapping);
+                l.field (3, address);
+                l.field (4, line.o);
+                location_fields.field (4, l.o);
+            }
+            ids.push_back (id);
+        }
+
+        vector<uint64_t> values;
+        for (int64_t v : s.second)
+            values.push_back ((uint64_t)v);
+
+        proto p;
+        p.packed (1, ids);
+        p.packed (2, values);
+        sample_fields.field (2, p.o);
+    }
+
+    proto r;
+    for (const value_type& t : sample_types_)
+    {
+        proto v;
+        v.field (1, strings (t.type));
+        v.field (2, strings (t.unit));
+        r.field (1, v.o);
+    }
+    r.o += sample_fields.o;
+
+    for (size_t m=0; m<mods.size (); m++)
+    {
+        proto p;
+        p.field (1, m + 1);
+        p.field (2, mods[m].start);
+        p.field (3, mods[m].limit);
+        p.field (4, mods[m].offset);
+        p.field (5, strings (mods[m].filename));
+        p.field (6, strings (mods[m].build_id));
+        p.field (7, 1); // has_functions
+        r.field (3, p.o);
+    }
+
+    r.o += location_fields.o;
+    r.o += function_fields.o;
+
+    proto period_type;
+    period_type.field (1, strings (period_type_.type));
+    period_type.field (2, strings (period_type_.unit));
+
+    // The string table comes after everything that refers to it
+    for (const string& s : strings.table)
+        r.field (6, s);
+    r.field (9, (uint64_t)time_ns_);
+    r.field (10, (uint64_t)duration_ns_);
+    r.field (11, period_type.o);
+    r.field (12, (uint64_t)period_);
+    return r.o;
+}
+
+
+bool pprof::profile::
+        save(const string& filename, bool gzip) const
+{
+    string data = serialize ();
+    if (gzip)
+        data = pprof::gzip (data);
+
+    ofstream o(filename, ios::binary);
+    o.write (data.data (), data.size ());
+    return (bool)o;
+}
+
+
+const char* pprof::
+        name(kind k)
+{
+    switch (k)
+    {
+    case cpu: return "cpu";
+    case heap: return "heap";
+    case contention: return "contention";
+    case throws: return "throws";
+    }
+    return "";
+}
+
+
+void pprof::
+        start(kind k)
+{
+    if (heap == k)
+    {
+        if (!heap_profiler::running ())
+            heap_profiler::start ();
+        return;
+    }
+
+    collector& c = C(k);
+    {
+        unique_lock<mutex> l(c.lock);
+        if (c.running)
+            return;
+        c.values.clear ();
+        c.start_ns = system_now_ns ();
+    }
+
+#ifndef _WIN32
+    if (cpu == k)
+    {
+        if (!ring)
+        {
+            ring = new cpu_slot[ring_size];
+
+            // The first capture loads the unwinder, which isn't safe in a
+            // signal handler
+            void* frames[4];
+            stack_depot::capture (frames, 4);
+
+            struct sigaction sa;
+            memset (&sa, 0, sizeof(sa));
+            sa.sa_handler = on_sigprof;
+            sa.sa_flags = SA_RESTART;
+            sigemptyset (&sa.sa_mask);
+            sigaction (SIGPROF, &sa, 0);
+        }
+
+        drainer_stop = false;
+        drainer = thread(drain_until_stopped);
+        c.running = true;
+        set_timer (cpu_hz);
+        return;
+    }
+#else
+    if (cpu == k)
+        return;
+#endif
+
+    c.running = true;
+}
+
+
+void pprof::
+        stop(kind k)
+{
+    if (heap == k)
+    {
+        heap_profiler::stop ();
+        return;
+    }
+
+    collector& c = C(k);
+    if (!c.running.exchange (false))
+        return;
+
+#ifndef _WIN32
+    if (cpu == k)
+    {
+        // The handler stays, a signal that is already on its way would
+        // otherwise end the process
+        set_timer (0);
+        {
+            unique_lock<mutex> l(drain_lock);
+            drainer_stop = true;
+            drainer_cv.notify_all ();
+        }
+        drainer.join ();
+        drain ();
+    }
+#endif
+}
+
+
+bool pprof::
+        running(kind k)
+{
+    if (heap == k)
+        return heap_profiler::running ();
+    return C(k).running;
+}
+
+
+pprof::profile pprof::
+        take(kind k)
+{
+    int64_t now = system_now_ns ();
+
+    if (heap == k)
+    {
+        heap_profiler::profile all = heap_profiler::snapshot (heap_profiler::cumulative);
+        heap_profiler::profile live = heap_profiler::snapshot (heap_profiler::live);
+
+        profile p({{"alloc_objects", "count"}, {"alloc_space", "bytes"},
+                   {"inuse_objects", "count"}, {"inuse_space", "bytes"}},
+                  {"space", "bytes"}, (int64_t)all.sampling_rate);
+        for (const auto& s : all.sites)
+            p.add (s.stack, {(int64_t)(s.count + 0.5), (int64_t)(s.bytes + 0.5), 0, 0});
+        for (const auto& s : live.sites)
+            p.add (s.stack, {0, 0, (int64_t)(s.count + 0.5), (int64_t)(s.bytes + 0.5)});
+        return p;
+    }
+
+#ifndef _WIN32
+    if (cpu == k && ring)
+        drain ();
+#endif
+
+    vector<value_type> types{{"throws", "count"}};
+    value_type period_type{"throws", "count"};
+    int64_t period = 1;
+    if (cpu == k)
+    {
+        types = {{"samples", "count"}, {"cpu", "nanoseconds"}};
+        period_type = {"cpu", "nanoseconds"};
+        period = 1000000000 / cpu_hz;
+    }
+    else if (contention == k)
+    {
+        types = {{"contentions", "count"}, {"delay", "nanoseconds"}};
+        period_type = {"contentions", "count"};
+    }
+
+    profile p(types, period_type, period);
+
+    collector& c = C(k);
+    unique_lock<mutex> l(c.lock);
+    for (const auto& v : c.values)
+        p.add (v.first, v.second);
+    p.set_time (c.start_ns, c.start_ns ? now - c.start_ns : 0);
+    c.values.clear ();
+    c.start_ns = now;
+    return p;
+}
+
+
+void pprof::
+        record_contention(double wait_seconds, int skip)
+{
+    collector& c = C(contention);
+    if (!c.running.load (memory_order_relaxed))
+        return;
+
+    c.add (capture (skip + 1), {1, (int64_t)(wait_seconds * 1e9)});
+}
+
+
+void pprof::
+        record_throw(int skip)
+{
+    collector& c = C(throws);
+    if (!c.running.load (memory_order_relaxed))
+        return;
+
+    c.add (capture (skip + 1), {1});
+}
+
+
+void pprof::
+        rotate(const string& prefix, double minutes)
+{
+    stop_rotate ();
+
+    unique_lock<mutex> l(rotate_lock);
+    rotate_stop = false;
+    rotator = thread([prefix, minutes]()
+    {
+        unique_lock<mutex> l(rotate_lock);
+        while (!rotate_stop)
+        {
+            rotate_cv.wait_for (l, chrono::duration<double>(minutes * 60));
+            // Also saves what was collected since the last file when stopped
+            l.unlock ();
+            save_running (prefix);
+            l.lock ();
+        }
+    });
+}
+
+
+void pprof::
+        stop_rotate()
+{
+    {
+        unique_lock<mutex> l(rotate_lock);
+        if (!rotator.joinable ())
+            return;
+        rotate_stop = true;
+        rotate_cv.notify_all ();
+    }
+    rotator.join ();
+}
+
+
+string pprof::
+        gzip(const string& data)
+{
+    static uint32_t table[256];
+    static once_flag init;
+    call_once (init, []()
+    {
+        for (uint32_t i=0; i<256; i++)
+        {
+            uint32_t c = i;
+            for (int k=0; k<8; k++)
+                c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+    });
+
+    uint32_t crc = 0xffffffff;
+    for (unsigned char b : data)
+        crc = table[(crc ^ b) & 0xff] ^ (crc >> 8);
+    crc ^= 0xffffffff;
+
+    auto le32 = [](string& o, uint32_t v) {
+        for (int i=0; i<4; i++)
+            o += (char)(v >> (8*i));
+    };
+
+    // No modification time, no flags, unknown OS
+    string r("\x1f\x8b\x08\x00\x00\x00\x00\x00\x00\xff", 10);
+    size_t i = 0;
+    do
+    {
+        size_t n = min(data.size () - i, (size_t)65535);
+        bool last = i + n == data.size ();
+        r += (char)(last ? 1 : 0);
+        r += (char)(n & 0xff);
+        r += (char)(n >> 8);
+        r += (char)(~n & 0xff);
+        r += (char)((~n >> 8) & 0xff);
+        r.append (data, i, n);
+        i += n;
+    } while (i < data.size ());
+
+    le32 (r, crc);
+    le32 (r, (uint32_t)data.size ());
+    return r;
+}
+
+
+#ifdef PPROF_CXA_THROW
+extern "C" {
+
+// The type is a std::type_info*, declared as in libstdc++
+[[noreturn]] void __cxa_throw(void* object, void* type, void (*destructor)(void*))
+{
+    typedef void (*cxa_throw_t)(void*, void*, void (*)(void*));
+    static cxa_throw_t next = (cxa_throw_t)dlsym (RTLD_NEXT, "__cxa_throw");
+
+    // Skip this frame, the stack starts at the throw
+    pprof::record_throw (1);
+    next (object, type, destructor);
+    abort ();
+}
+
+} // extern "C"
+#endif
+
+
+namespace pprof_test {
+
+// Reads the top level fields of a message, as number and payload
+vector<pair<int, string>> fields(const string& m)
+{
+    vector<pair<int, string>> r;
+    size_t i = 0;
+    auto varint = [&]() {
+        uint64_t v = 0;
+        for (int s=0; i<m.size (); s+=7)
+        {
+            unsigned char b = m[i++];
+            v |= (uint64_t)(b & 0x7f) << s;
+            if (!(b & 0x80))
+                break;
+        }
+        return v;
+    };
+
+    while (i < m.size ())
+    {
+        uint64_t key = varint ();
+        if (2 == (key & 7))
+        {
+            size_t n = varint ();
+            r.push_back (make_pair ((int)(key >> 3), m.substr (i, n)));
+            i += n;
+        }
+        else
+        {
+            uint64_t v = varint ();
+            r.push_back (make_pair ((int)(key >> 3), to_string (v)));
+        }
+    }
+    return r;
+}
+
+vector<string> strings(const string& m)
+{
+    vector<string> r;
+    for (const auto& f : fields (m))
+        if (6 == f.first)
+            r.push_back (f.second);
+    return r;
+}
+
+#ifdef __GNUC__
+__attribute__((noinline))
+#endif
+void wait_for_lock(double seconds)
+{
+    pprof::record_contention (seconds);
+}
+
+#ifdef __GNUC__
+__attribute__((noinline))
+#endif
+double spin(double seconds)
+{
+    volatile double x = 0;
+    clock_t end = clock () + (clock_t)(seconds * CLOCKS_PER_SEC);
+    while (clock () < end)
+        for (int i=0; i<10000; i++)
+            x = x + 1;
+    return x;
+}
+
+class A {
+public:
+    struct shared_state_traits: shared_state_traits_metrics {
+        double timeout () { return 0.002; }
+    };
+};
+
+} // namespace pprof_test
+
+using namespace pprof_test;
+
+void pprof::
+        test()
+{
+    // It should write a profile.proto message with an entry for each distinct
+    // stack and tables of its frames
+    {
+        // Like return addresses, inside the functions
+        void* test = (char*)(void*)&pprof::test + 1;
+        void* gzip = (char*)(void*)&pprof::gzip + 1;
+        void* take = (char*)(void*)&pprof::take + 1;
+        void* frames[2][3] = {{test, gzip, take}, {gzip, take}};
+        stack_depot::id a = stack_depot::intern (frames[0] + 0, 3);
+        stack_depot::id b = stack_depot::intern (frames[1] + 0, 2);
+
+        profile p({{"contentions", "count"}, {"delay", "nanoseconds"}}, {"contentions", "count"}, 1);
+        p.add (a, {1, 100});
+        p.add (b, {1, 200});
+        p.add (a, {2, 300});
+        EXCEPTION_ASSERT_EQUALS(p.samples (), 2u);
+        EXCEPTION_ASSERT_EQUALS(p.values (a)[0], 3);
+        EXCEPTION_ASSERT_EQUALS(p.values (a)[1], 400);
+        EXCEPTION_ASSERT(p.values (123456789).empty ());
+
+        string m = p.serialize ();
+        map<int, int> count;
+        for (const auto& f : fields (m))
+            count[f.first]++;
+
+        EXCEPTION_ASSERT_EQUALS(count[1], 2);   // sample_type
+        EXCEPTION_ASSERT_EQUALS(count[2], 2);   // sample
+        EXCEPTION_ASSERT_EQUALS(count[4], 3);   // location
+        EXCEPTION_ASSERT_EQUALS(count[5], 3);   // function
+        EXCEPTION_ASSERT_EQUALS(count[12], 1);  // period
+#ifdef __linux__
+        EXCEPTION_ASSERT_LESS(0, count[3]);     // mapping
+#endif
+
+        vector<string> s = strings (m);
+        EXCEPTION_ASSERT_EQUALS(s[0], "");
+        EXCEPTION_ASSERT(find (s.begin (), s.end (), "delay") != s.end ());
+        EXCEPTION_ASSERT(find (s.begin (), s.end (), "pprof::gzip(std::string const&)") != s.end ()
+                         || find (s.begin (), s.end (), "pprof::gzip(std::__cxx11::basic_string<char, std::char_traits<char>, std::allocator<char> > const&)") != s.end ());
+    }
+
+    // It should wrap data in gzip without compressing it
+    {
+        string data(70000, 'x');
+        data[0] = 'a';
+        string z = gzip (data);
+        EXCEPTION_ASSERT_EQUALS(z.size (), 10 + 2*5 + data.size () + 8);
+        EXCEPTION_ASSERT_EQUALS(z.substr (0, 3), string("\x1f\x8b\x08"));
+        EXCEPTION_ASSERT_EQUALS(z[15], 'a');
+        EXCEPTION_ASSERT_EQUALS(z.substr (z.size () - 4), string("\x70\x11\x01\x00", 4));
+
+        // CRC-32 of "123456789" is cbf43926
+        z = gzip ("123456789");
+        EXCEPTION_ASSERT_EQUALS(z.substr (z.size () - 8, 4), string("\x26\x39\xf4\xcb"));
+        EXCEPTION_ASSERT_EQUALS(gzip ("").size (), 10u + 5 + 8);
+    }
+
+    // It should count lock waits and throws by stack while they are running
+    {
+        wait_for_lock (0.001);
+        record_throw ();
+        EXCEPTION_ASSERT_EQUALS(take (contention).samples (), 0u);
+
+        start (contention);
+        start (throws);
+        wait_for_lock (0.001);
+        wait_for_lock (0.002);
+        record_throw ();
+
+        shared_state<A> a(new A);
+        {
+            auto w = a.write ();
+            thread([&a]()
+            {
+                try {
+                    a.write ();
+                } catch (shared_state<A>::lock_failed&) {}
+            }).join ();
+        }
+        stop (contention);
+        stop (throws);
+        wait_for_lock (0.001);
+
+        // Called from three different lines
+        profile p = take (contention);
+        EXCEPTION_ASSERT_EQUALS(p.samples (), 3u);
+
+        int64_t waits = 0, delay = 0;
+        for (stack_depot::id i=0; i<stack_depot::size (); i++)
+            if (!p.values (i).empty ())
+            {
+                waits += p.values (i)[0];
+                delay += p.values (i)[1];
+            }
+        EXCEPTION_ASSERT_EQUALS(waits, 3);
+        EXCEPTION_ASSERT_LESS_OR_EQUAL(5000000, delay);
+
+        EXCEPTION_ASSERT_EQUALS(take (throws).samples (), 1u);
+        EXCEPTION_ASSERT_EQUALS(take (contention).samples (), 0u);
+    }
+
+    // It should write heap profiles with allocated and in use columns
+    {
+        heap_profiler::reset ();
+        heap_profiler::start (1);
+        char x, y;
+        heap_profiler::on_alloc (&x, 100);
+        heap_profiler::on_alloc (&y, 200);
+        heap_profiler::on_free (&x);
+        heap_profiler::stop ();
+
+        profile p = take (heap);
+        int64_t alloc = 0, inuse = 0;
+        for (stack_depot::id i=0; i<stack_depot::size (); i++)
+            if (!p.values (i).empty ())
+            {
+                alloc += p.values (i)[1];
+                inuse += p.values (i)[3];
+            }
+        heap_profiler::reset ();
+
+        EXCEPTION_ASSERT_EQUALS(alloc, 300);
+        EXCEPTION_ASSERT_EQUALS(inuse, 200);
+    }
+
+#ifndef _WIN32
+    // It should sample the stacks that use CPU time
+    {
+        start (cpu);
+        spin (0.3);
+        stop (cpu);
+
+        profile p = take (cpu);
+        EXCEPTION_ASSERT_LESS(0u, p.samples ());
+
+        vector<string> s = strings (p.serialize ());
+        EXCEPTION_ASSERT(find (s.begin (), s.end (), "pprof_test::spin(double)") != s.end ());
+        EXCEPTION_ASSERT(find (s.begin (), s.end (), "cpu") != s.end ());
+    }
+
+    // It should save a new file for every running profile every few minutes
+    {
+        string prefix = "/tmp/backtrace_test_" + to_string (getpid ());
+        start (throws);
+        rotate (prefix, 0.001);
+        record_throw ();
+        this_thread::sleep_for (chrono::milliseconds(150));
+        stop_rotate ();
+        stop (throws);
+
+        unsigned files = 0;
+        for (int i=-2; i<=0; i++)
+        {
+            time_t t = time (0) + i;
+            tm local;
+            localtime_r (&t, &local);
+            char stamp[32];
+            strftime (stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &local);
+            string f = prefix + ".throws." + stamp + ".pb.gz";
+            if (0 == ::access (f.c_str (), F_OK))
+                files++;
+            ::unlink (f.c_str ());
+        }
+        EXCEPTION_ASSERT_LESS(0u, files);
+    }
+#endif
+}
@@ -0,0 +1,137 @@
+#ifndef PPROF_H
+#define PPROF_H
+
+#include "stack_depot.h"
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+/**
+ * @brief The pprof class should write CPU, heap, lock contention and throw
+ * profiles in the profile.proto format read by pprof, without depending on
+ * protobuf or zlib.
+ *
+ *        pprof::start (pprof::cpu);
+ *        pprof::start (pprof::contention);
+ *        ... run the workload
+ *        pprof::take (pprof::cpu).save ("cpu.pb.gz");
+ *        pprof::take (pprof::contention).save ("contention.pb.gz");
+ *
+ *        go tool pprof -top cpu.pb.gz
+ *
+ * or keep writing a new file for each profile that is running every few
+ * minutes, named like prefix.cpu.20240102-030405.pb.gz:
+ *
+ *        pprof::rotate ("/var/tmp/myservice", 10);
+ *
+ * Sources:
+ *
+ *   cpu          samples of the stacks that use CPU time, from a SIGPROF
+ *                timer at 'cpu_hz'. Not on Windows.
+ *   heap         heap_profiler samples, allocated and still in use.
+ *   contention   lock waits from shared_state_traits_metrics, and
+ *                record_contention.
+ *   throws       record_throw. Build with -DPPROF_CXA_THROW to count every
+ *                C++ throw (Linux and macOS).
+ *
+ * Functions are named from the symbols of the process, so the profile reads
+ * without the binaries. Mappings tell pprof which module each address belongs
+ * to, with its build id on Linux.
+ *
+ * The CPU signal handler only copies the stack into a free slot of a ring
+ * buffer that a background thread interns. Samples are dropped if the
+ * background thread doesn't keep up.
+ */
+class pprof
+{
+public:
+    struct value_type {
+        std::string type, unit;
+    };
+
+    /**
+     * @brief The profile class should build one profile.proto message.
+     * Samples with the same stack are summed.
+     */
+    class profile {
+    public:
+        profile (const std::vector<value_type>& sample_types, const value_type& period_type, std::int64_t period);
+
+        void add (stack_depot::id stack, const std::vector<std::int64_t>& values);
+        void set_time (std::int64_t time_ns, std::int64_t duration_ns);
+
+        std::size_t samples () const;
+        const std::vector<std::int64_t>& values (stack_depot::id stack) const;
+
+        /**
+         * @brief serialize returns the message, uncompressed.
+         */
+        std::string serialize () const;
+
+        /**
+         * @brief save writes the message, gzipped if 'gzip'. Returns false if
+         * the file couldn't be written.
+         */
+        bool save (const std::string& filename, bool gzip = true) const;
+
+    private:
+        std::vector<value_type> sample_types_;
+        value_type period_type_;
+        std::int64_t period_;
+        std::int64_t time_ns_ = 0, duration_ns_ = 0;
+        std::map<stack_depot::id, std::vector<std::int64_t>> samples_;
+        std::vector<std::int64_t> none_;
+    };
+
+    enum kind {
+        cpu,
+        heap,
+        contention,
+        throws
+    };
+
+    static const char* name (kind k);
+
+    static const unsigned cpu_hz = 100;
+
+    /**
+     * @brief start begins to collect samples of 'k', heap starts
+     * heap_profiler if it isn't running.
+     */
+    static void start (kind k);
+    static void stop (kind k);
+    static bool running (kind k);
+
+    /**
+     * @brief take returns the samples of 'k' since start or the previous
+     * take, and forgets them. heap has the allocations since heap_profiler
+     * was started or reset, and the allocations still in use.
+     */
+    static profile take (kind k);
+
+    /**
+     * @brief record_contention counts a lock wait at the stack of the
+     * caller, skipping 'skip' more frames, if contention is running.
+     */
+    static void record_contention (double wait_seconds, int skip = 0);
+    static void record_throw (int skip = 0);
+
+    /**
+     * @brief rotate saves a profile of every kind that is running every
+     * 'minutes', from a background thread, until stop_rotate.
+     */
+    static void rotate (const std::string& prefix, double minutes);
+    static void stop_rotate ();
+
+    /**
+     * @brief gzip wraps 'data' in the gzip format, in stored deflate blocks
+     * that aren't compressed.
+     */
+    static std::string gzip (const std::string& data);
+
+    static void test ();
+};
+
+#endif // PPROF_H
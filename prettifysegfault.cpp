@@ -129,6 +129,8 @@ void handler(int sig)
 void printSignalInfo(int sig, bool noaction)
 {
     // Lots of memory allocations here. Not neat, but more helpful.
+    // Backtraces aren't limited by backtrace_policy here, the signal may
+    // have interrupted a thread that holds its lock.
 
     if (enable_signal_print)
         TaskInfo("Got %s(%d) '%s'\n%s",
@@ -0,0 +1,815 @@
+#include "shared_metrics.h"
+#include "shared_state_traits_metrics.h"
+#include "exceptionassert.h"
+#include "tasktimer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <string.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace {
+
+const char magic[8] = {'B','T','M','E','T','R','C','1'};
+// Regions start at this offset, after the segment_header
+const size_t header_size = 64;
+
+typedef shared_metrics::segment_header segment_header;
+typedef shared_metrics::region_header region_header;
+typedef shared_metrics::site_data site_data;
+
+void set_name(char* dst, const string& src, size_t n)
+{
+    strncpy (dst, src.c_str (), n - 1);
+    dst[n - 1] = 0;
+}
+
+string truncated(const string& name)
+{
+    return name.substr (0, shared_metrics::max_name - 1);
+}
+
+region_header* region_at(const segment_header* h, unsigned i)
+{
+    return (region_header*)((char*)h + header_size + i*(size_t)h->region_size);
+}
+
+site_data* site_at(region_header* r, unsigned i)
+{
+    return (site_data*)((char*)r + sizeof(region_header)) + i;
+}
+
+// Everything that changes when the segment is opened, closed or when the
+// process forks
+struct state {
+    mutex lock;
+    atomic<segment_header*> segment{nullptr};
+    string name;
+    atomic<uint32_t> generation{1};
+    region_header* region = 0;
+    map<string, site_data*> sites; // in 'region' by name
+};
+
+state& S()
+{
+    // Leaked, TaskTimers may be destroyed after static destructors have run
+    static state* s = new state;
+    return *s;
+}
+
+#ifndef _WIN32
+string process_name()
+{
+    char buf[32] = {0};
+    int fd = ::open ("/proc/self/comm", O_RDONLY);
+    if (0 <= fd)
+    {
+        ssize_t n = ::read (fd, buf, sizeof(buf) - 1);
+        ::close (fd);
+        if (0 < n && buf[n-1] == '\n')
+            buf[n-1] = 0;
+    }
+    return buf;
+}
+
+bool is_dead(uint32_t pid)
+{
+    return 0 != kill ((pid_t)pid, 0) && ESRCH == errno;
+}
+
+void fork_prepare() { S().lock.lock (); }
+void fork_parent() { S().lock.unlock (); }
+void fork_child()
+{
+    // The child claims a region of its own on its first record
+    state& s = S();
+    s.region = 0;
+    s.sites.clear ();
+    s.generation++;
+    s.lock.unlock ();
+}
+#endif
+
+// Assumes S().lock is held. Prefers regions that were never used over the
+// regions of processes that have exited.
+region_header* claim_region(segment_header* h)
+{
+#ifndef _WIN32
+    uint32_t pid = (uint32_t)getpid ();
+    for (int pass=0; pass<2; pass++)
+        for (unsigned i=0; i<h->max_regions; i++)
+        {
+            region_header* r = region_at (h, i);
+            uint32_t p = r->pid.load ();
+            if (p == pid)
+                return r;
+            if (!(0 == p || (1 == pass && is_dead (p))))
+                continue;
+            if (!r->pid.compare_exchange_strong (p, pid))
+                continue;
+
+            r->sites.store (0);
+            memset ((void*)site_at (r, 0), 0, h->max_sites * sizeof(site_data));
+            r->start_ns = chrono::duration_cast<chrono::nanoseconds>(
+                        chrono::system_clock::now ().time_since_epoch ()).count ();
+            set_name (r->process, process_name (), sizeof(r->process));
+            return r;
+        }
+#else
+    (void)h;
+#endif
+    return 0;
+}
+
+// Assumes S().lock is held. Returns 0 if the segment isn't open or if there
+// is no room.
+site_data* find_site(const string& name)
+{
+    state& s = S();
+    segment_header* h = s.segment.load ();
+    if (!h)
+        return 0;
+
+    auto i = s.sites.find (name);
+    if (i != s.sites.end ())
+        return i->second;
+
+    if (!s.region)
+    {
+        s.region = claim_region (h);
+        if (!s.region)
+            return 0;
+
+        // Sites from before the segment was closed and opened again
+        uint32_t n = min(s.region->sites.load (memory_order_relaxed), h->max_sites);
+        for (unsigned j=0; j<n; j++)
+            s.sites[site_at (s.region, j)->name] = site_at (s.region, j);
+
+        i = s.sites.find (name);
+        if (i != s.sites.end ())
+            return i->second;
+    }
+
+    uint32_t n = s.region->sites.load (memory_order_relaxed);
+    if (n >= h->max_sites)
+        return 0;
+
+    site_data* d = site_at (s.region, n);
+    set_name (d->name, name, sizeof(d->name));
+    // Publish the name before readers may look at the site
+    s.region->sites.store (n + 1, memory_order_release);
+    s.sites[name] = d;
+    return d;
+}
+
+unsigned bucket(uint64_t ns)
+{
+    unsigned b = 0;
+    while (b + 1 < shared_metrics::buckets && (ns >> (b + 1)))
+        b++;
+    return b;
+}
+
+void add(site_data* d, uint64_t ns)
+{
+    d->count.fetch_add (1, memory_order_relaxed);
+    d->sum_ns.fetch_add (ns, memory_order_relaxed);
+    d->histogram[bucket (ns)].fetch_add (1, memory_order_relaxed);
+
+    uint64_t m = d->max_ns.load (memory_order_relaxed);
+    while (m < ns && !d->max_ns.compare_exchange_weak (m, ns, memory_order_relaxed))
+        ;
+}
+
+
+// Sites that shared_metrics::record has looked up in this thread, 0 for
+// names there was no room for
+struct name_cache {
+    // Names are dropped from the cache, not from the region, past this
+    static const size_t max_names = 1024;
+
+    uint32_t generation = 0;
+    map<string, site_data*> sites;
+
+    ~name_cache() { destroyed () = true; }
+
+    // Still readable while the thread_locals of an exiting thread, or of the
+    // main thread at exit, are destroyed
+    static bool& destroyed()
+    {
+        static thread_local bool d = false;
+        return d;
+    }
+};
+
+
+site_data* find_site_of_thread(const string& name)
+{
+    state& s = S();
+    if (name_cache::destroyed ())
+    {
+        unique_lock<mutex> l(s.lock);
+        return find_site (name);
+    }
+
+    static thread_local name_cache c;
+    uint32_t g = s.generation.load (memory_order_acquire);
+    if (c.generation != g || c.sites.size () >= name_cache::max_names)
+    {
+        c.sites.clear ();
+        c.generation = g;
+    }
+
+    auto i = c.sites.find (name);
+    if (i != c.sites.end ())
+        return i->second;
+
+    unique_lock<mutex> l(s.lock);
+    site_data* d = find_site (name);
+    c.sites[name] = d;
+    return d;
+}
+
+uint64_t to_ns(double seconds)
+{
+    if (!(0 < seconds))
+        return 0;
+    if (seconds > 1e9)
+        return (uint64_t)1e18;
+    return (uint64_t)(seconds*1e9);
+}
+
+} // namespace
+
+
+bool shared_metrics::
+        open(const string& name, unsigned max_regions, unsigned max_sites)
+{
+#ifndef _WIN32
+    state& s = S();
+    unique_lock<mutex> l(s.lock);
+    if (s.segment.load ())
+        return true;
+
+    static once_flag atfork;
+    call_once (atfork, [](){ pthread_atfork (fork_prepare, fork_parent, fork_child); });
+
+    size_t region_size = sizeof(region_header) + max_sites * sizeof(site_data);
+    size_t size = header_size + max_regions * region_size;
+    void* p = MAP_FAILED;
+
+    int fd = shm_open (name.c_str (), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (0 <= fd)
+    {
+        if (0 == ftruncate (fd, (off_t)size))
+            p = mmap (0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close (fd);
+        if (MAP_FAILED == p)
+            return false;
+
+        segment_header* h = (segment_header*)p;
+        h->version = version;
+        h->max_regions = max_regions;
+        h->max_sites = max_sites;
+        h->region_size = (uint32_t)region_size;
+        // Readers and other writers wait for the magic
+        atomic_thread_fence (memory_order_release);
+        memcpy (h->magic, magic, sizeof(magic));
+    }
+    else
+    {
+        if (EEXIST != errno)
+            return false;
+
+        // Some other process created it, use its layout
+        fd = shm_open (name.c_str (), O_RDWR, 0);
+        if (0 > fd)
+            return false;
+
+        segment_header h;
+        for (int attempt=0; attempt<1000; attempt++)
+        {
+            struct stat st;
+            if (0 == fstat (fd, &st) && st.st_size >= (off_t)header_size
+                && (ssize_t)sizeof(h) == pread (fd, &h, sizeof(h), 0)
+                && 0 == memcmp (h.magic, magic, sizeof(magic)))
+            {
+                size = header_size + h.max_regions * (size_t)h.region_size;
+                if (h.version == version && st.st_size >= (off_t)size)
+                    p = mmap (0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                break;
+            }
+            this_thread::sleep_for (chrono::milliseconds(1));
+        }
+        ::close (fd);
+        if (MAP_FAILED == p)
+            return false;
+    }
+
+    // Sites handles from a previous segment look up their data again
+    s.region = 0;
+    s.sites.clear ();
+    s.generation++;
+    s.name = name;
+    s.segment = (segment_header*)p;
+    return true;
+#else
+    (void)name;
+    (void)max_regions;
+    (void)max_sites;
+    return false;
+#endif
+}
+
+
+void shared_metrics::
+        close()
+{
+    state& s = S();
+    unique_lock<mutex> l(s.lock);
+    // The mapping is kept, other threads may still be recording into it
+    s.segment = nullptr;
+    s.name.clear ();
+    s.region = 0;
+    s.sites.clear ();
+    s.generation++;
+}
+
+
+bool shared_metrics::
+        is_open()
+{
+    return nullptr != S().segment.load (memory_order_relaxed);
+}
+
+
+string shared_metrics::
+        name()
+{
+    state& s = S();
+    unique_lock<mutex> l(s.lock);
+    return s.name;
+}
+
+
+void shared_metrics::
+        unlink(const string& name)
+{
+#ifndef _WIN32
+    shm_unlink (name.c_str ());
+#else
+    (void)name;
+#endif
+}
+
+
+shared_metrics::site::
+        site(const string& name, double limit)
+    :
+      name_(truncated (name)),
+      limit_ns_(to_ns (limit))
+{
+}
+
+
+shared_metrics::site_data* shared_metrics::site::
+        data()
+{
+    state& s = S();
+    uint32_t g = s.generation.load (memory_order_acquire);
+    if (g == generation_.load (memory_order_acquire))
+        return data_.load (memory_order_relaxed);
+
+    if (!s.segment.load (memory_order_relaxed))
+        return 0;
+
+    unique_lock<mutex> l(s.lock);
+    site_data* d = find_site (name_);
+    data_.store (d, memory_order_relaxed);
+    generation_.store (s.generation.load (), memory_order_release);
+    return d;
+}
+
+
+void shared_metrics::site::
+        record(double seconds)
+{
+    site_data* d = data ();
+    if (!d)
+        return;
+
+    uint64_t ns = to_ns (seconds);
+    add (d, ns);
+    if (limit_ns_ && ns > limit_ns_)
+        d->overruns.fetch_add (1, memory_order_relaxed);
+}
+
+
+void shared_metrics::site::
+        overrun()
+{
+    if (site_data* d = data ())
+        d->overruns.fetch_add (1, memory_order_relaxed);
+}
+
+
+void shared_metrics::site::
+        contended()
+{
+    if (site_data* d = data ())
+        d->contended.fetch_add (1, memory_order_relaxed);
+}
+
+
+void shared_metrics::
+        record(const string& name, double seconds)
+{
+    if (!S().segment.load (memory_order_relaxed))
+        return;
+
+    if (name.size () >= max_name)
+    {
+        record (truncated (name), seconds);
+        return;
+    }
+
+    if (site_data* d = find_site_of_thread (name))
+        add (d, to_ns (seconds));
+}
+
+
+double shared_metrics::site_stats::
+        mean() const
+{
+    return count ? sum_ns * 1e-9 / count : 0;
+}
+
+
+double shared_metrics::site_stats::
+        percentile(double q) const
+{
+    uint64_t n = 0;
+    for (uint64_t c : histogram)
+        n += c;
+    if (0 == n)
+        return 0;
+
+    double target = q * n;
+    uint64_t sum = 0;
+    for (unsigned i=0; i<histogram.size (); i++)
+    {
+        sum += histogram[i];
+        if (sum >= target && histogram[i])
+            return min(double(uint64_t(2) << i), double(max_ns)) * 1e-9;
+    }
+    return max_ns * 1e-9;
+}
+
+
+bool shared_metrics::
+        read(const string& name, vector<process_stats>& out, string& error)
+{
+    out.clear ();
+#ifndef _WIN32
+    int fd = shm_open (name.c_str (), O_RDONLY, 0);
+    if (0 > fd)
+    {
+        error = name + ": " + strerror (errno);
+        return false;
+    }
+
+    struct stat st;
+    segment_header h;
+    if (0 != fstat (fd, &st) || st.st_size < (off_t)header_size
+        || (ssize_t)sizeof(h) != pread (fd, &h, sizeof(h), 0)
+        || 0 != memcmp (h.magic, magic, sizeof(magic)))
+    {
+        ::close (fd);
+        error = name + ": not a metrics segment, or not ready";
+        return false;
+    }
+
+    size_t size = header_size + h.max_regions * (size_t)h.region_size;
+    if (h.version != version || st.st_size < (off_t)size
+        || h.region_size != sizeof(region_header) + h.max_sites * sizeof(site_data))
+    {
+        ::close (fd);
+        error = name + ": unsupported version " + to_string (h.version);
+        return false;
+    }
+
+    void* p = mmap (0, size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close (fd);
+    if (MAP_FAILED == p)
+    {
+        error = name + ": " + strerror (errno);
+        return false;
+    }
+
+    for (unsigned i=0; i<h.max_regions; i++)
+    {
+        region_header* r = region_at ((segment_header*)p, i);
+        uint32_t pid = r->pid.load ();
+        if (0 == pid)
+            continue;
+
+        process_stats ps;
+        ps.pid = pid;
+        ps.process = string(r->process, strnlen (r->process, sizeof(r->process)));
+
+        uint32_t n = min(r->sites.load (memory_order_acquire), h.max_sites);
+        for (unsigned j=0; j<n; j++)
+        {
+            site_data* d = site_at (r, j);
+            site_stats s;
+            s.name = string(d->name, strnlen (d->name, sizeof(d->name)));
+            s.count = d->count.load (memory_order_relaxed);
+            s.sum_ns = d->sum_ns.load (memory_order_relaxed);
+            s.max_ns = d->max_ns.load (memory_order_relaxed);
+            s.overruns = d->overruns.load (memory_order_relaxed);
+            s.contended = d->contended.load (memory_order_relaxed);
+            for (unsigned k=0; k<buckets; k++)
+                s.histogram.push_back (d->histogram[k].load (memory_order_relaxed));
+            ps.sites.push_back (s);
+        }
+        out.push_back (ps);
+    }
+
+    munmap (p, size);
+    return true;
+#else
+    (void)name;
+    error = "shared_metrics isn't supported on Windows";
+    return false;
+#endif
+}
+
+
+vector<shared_metrics::site_stats> shared_metrics::
+        merge(const vector<process_stats>& p)
+{
+    map<string, site_stats> m;
+    for (const process_stats& ps : p)
+        for (const site_stats& s : ps.sites)
+        {
+            auto i = m.find (s.name);
+            if (i == m.end ())
+            {
+                m[s.name] = s;
+                continue;
+            }
+
+            site_stats& t = i->second;
+            t.count += s.count;
+            t.sum_ns += s.sum_ns;
+            t.max_ns = max(t.max_ns, s.max_ns);
+            t.overruns += s.overruns;
+            t.contended += s.contended;
+            for (unsigned k=0; k<t.histogram.size () && k<s.histogram.size (); k++)
+                t.histogram[k] += s.histogram[k];
+        }
+
+    vector<site_stats> r;
+    for (auto& v : m)
+        r.push_back (v.second);
+
+    // Most time spent first
+    stable_sort (r.begin (), r.end (), [](const site_stats& a, const site_stats& b) { return a.sum_ns > b.sum_ns; });
+    return r;
+}
+
+
+namespace shared_metrics_test {
+
+const shared_metrics::site_stats* find(const vector<shared_metrics::site_stats>& v, const string& name)
+{
+    for (const shared_metrics::site_stats& s : v)
+        if (s.name == name)
+            return &s;
+    return 0;
+}
+
+class A {
+public:
+    struct shared_state_traits: shared_state_traits_metrics {
+        double timeout () { return 0.002; }
+    };
+};
+
+} // namespace shared_metrics_test
+
+using namespace shared_metrics_test;
+
+void shared_metrics::
+        test()
+{
+#ifndef _WIN32
+    string name = "/backtrace_test_" + to_string (getpid ());
+    unlink (name);
+
+    // It should drop records while the segment isn't open
+    {
+        EXCEPTION_ASSERT(!is_open ());
+        static site s("shared_metrics_test closed");
+        s.record (0.001);
+
+        vector<process_stats> p;
+        string error;
+        EXCEPTION_ASSERT(!read (name, p, error));
+        EXCEPTION_ASSERT(!error.empty ());
+    }
+
+    // It should publish counts and latency histograms per site to readers in
+    // other processes
+    {
+        EXCEPTION_ASSERT(open (name, 4, 16));
+        EXCEPTION_ASSERT(is_open ());
+        EXCEPTION_ASSERT_EQUALS(shared_metrics::name (), name);
+
+        static site s("shared_metrics_test site", 0.005);
+        for (int i=0; i<98; i++)
+            s.record (0.001);
+        s.record (0.010);
+        s.record (0.020);
+        record ("shared_metrics_test by name", 0.5);
+
+        vector<process_stats> p;
+        string error;
+        EXCEPTION_ASSERTX(read (name, p, error), error);
+        EXCEPTION_ASSERT_EQUALS(p.size (), 1u);
+        EXCEPTION_ASSERT_EQUALS(p[0].pid, (uint32_t)getpid ());
+
+        const site_stats* t = find (p[0].sites, "shared_metrics_test site");
+        EXCEPTION_ASSERT(t);
+        EXCEPTION_ASSERT_EQUALS(t->count, 100u);
+        EXCEPTION_ASSERT_EQUALS(t->overruns, 2u);
+        EXCEPTION_ASSERT_EQUALS(t->max_ns, 20000000u);
+        EXCEPTION_ASSERT_LESS(0.0012, t->mean ());
+        EXCEPTION_ASSERT_LESS(t->mean (), 0.0013);
+        // Bucket edges are powers of two in ns
+        EXCEPTION_ASSERT_LESS_OR_EQUAL(0.001, t->percentile (0.5));
+        EXCEPTION_ASSERT_LESS(t->percentile (0.5), 0.0021);
+        EXCEPTION_ASSERT_LESS_OR_EQUAL(0.010, t->percentile (0.99));
+        EXCEPTION_ASSERT_EQUALS(t->percentile (1), 0.020);
+
+        t = find (p[0].sites, "shared_metrics_test by name");
+        EXCEPTION_ASSERT(t);
+        EXCEPTION_ASSERT_EQUALS(t->count, 1u);
+    }
+
+    // It should record TaskTimer scopes by their format string
+    {
+        {
+            TaskTimer tt("shared_metrics_test %d", 0);
+            tt.suppressTiming ();
+        }
+        // More formatted timers than there are sites
+        for (int i=1; i<=20; i++)
+        {
+            TaskTimer tt("shared_metrics_test %d", i);
+        }
+
+        vector<process_stats> p;
+        string error;
+        EXCEPTION_ASSERTX(read (name, p, error), error);
+        EXCEPTION_ASSERT(!find (p[0].sites, "shared_metrics_test 1"));
+        const site_stats* t = find (p[0].sites, "shared_metrics_test %d");
+        EXCEPTION_ASSERT(t);
+        EXCEPTION_ASSERT_EQUALS(t->count, 20u);
+    }
+
+    // It should count lock waits and lock timeouts
+    {
+        shared_state<A> a(new A);
+        auto w = a.write ();
+
+        thread th([&a]()
+        {
+            try {
+                a.write ();
+            } catch (shared_state<A>::lock_failed&) {}
+        });
+        th.join ();
+        w.unlock ();
+
+        vector<process_stats> p;
+        string error;
+        EXCEPTION_ASSERTX(read (name, p, error), error);
+        const site_stats* t = find (p[0].sites, "lock shared_metrics_test::A");
+        EXCEPTION_ASSERT(t);
+        EXCEPTION_ASSERT_EQUALS(t->overruns, 1u);
+        EXCEPTION_ASSERT_EQUALS(t->contended, 1u);
+        EXCEPTION_ASSERT_LESS_OR_EQUAL(0.002, t->mean ());
+    }
+
+    // It should give a forked process a region of its own, and merge the
+    // regions by site name
+    {
+        static site s("shared_metrics_test site");
+        pid_t pid = fork ();
+        if (0 == pid)
+        {
+            for (int i=0; i<10; i++)
+                s.record (0.001);
+            _exit (0);
+        }
+
+        int status = 0;
+        waitpid (pid, &status, 0);
+        EXCEPTION_ASSERT_EQUALS(status, 0);
+
+        vector<process_stats> p;
+        string error;
+        EXCEPTION_ASSERTX(read (name, p, error), error);
+        EXCEPTION_ASSERT_EQUALS(p.size (), 2u);
+
+        vector<site_stats> m = merge (p);
+        const site_stats* t = find (m, "shared_metrics_test site");
+        EXCEPTION_ASSERT(t);
+        EXCEPTION_ASSERT_EQUALS(t->count, 110u);
+        EXCEPTION_ASSERT_EQUALS(t->overruns, 2u);
+    }
+
+    // It should reuse the regions of processes that have exited when there is
+    // no room left
+    {
+        vector<pid_t> children;
+        for (int i=0; i<3; i++)
+        {
+            pid_t pid = fork ();
+            if (0 == pid)
+            {
+                record ("shared_metrics_test child", 0.001);
+                _exit (0);
+            }
+            int status = 0;
+            waitpid (pid, &status, 0);
+        }
+
+        vector<process_stats> p;
+        string error;
+        EXCEPTION_ASSERTX(read (name, p, error), error);
+        EXCEPTION_ASSERT_EQUALS(p.size (), 4u);
+        EXCEPTION_ASSERT_EQUALS(p[0].pid, (uint32_t)getpid ());
+    }
+
+    // It should attach to a segment that another process created
+    {
+        close ();
+        EXCEPTION_ASSERT(!is_open ());
+        EXCEPTION_ASSERT(open (name));
+        record ("shared_metrics_test reopened", 0.001);
+
+        vector<process_stats> p;
+        string error;
+        EXCEPTION_ASSERTX(read (name, p, error), error);
+        EXCEPTION_ASSERT_EQUALS(p.size (), 4u);
+        EXCEPTION_ASSERT(find (p[0].sites, "shared_metrics_test reopened"));
+    }
+
+    close ();
+    unlink (name);
+
+    // It should drop records by names there is no room for, and keep
+    // counting the names that have a site, from any thread
+    {
+        EXCEPTION_ASSERT(open (name, 2, 2));
+        auto f = []() {
+            for (int i=0; i<3; i++)
+            {
+                record ("shared_metrics_test a", 0.001);
+                record ("shared_metrics_test b", 0.001);
+                record ("shared_metrics_test c", 0.001);
+            }
+        };
+        f ();
+        thread(f).join ();
+
+        vector<process_stats> p;
+        string error;
+        EXCEPTION_ASSERTX(read (name, p, error), error);
+        EXCEPTION_ASSERT_EQUALS(p[0].sites.size (), 2u);
+        EXCEPTION_ASSERT_EQUALS(find (p[0].sites, "shared_metrics_test a")->count, 6u);
+        EXCEPTION_ASSERT_EQUALS(find (p[0].sites, "shared_metrics_test b")->count, 6u);
+        EXCEPTION_ASSERT(!find (p[0].sites, "shared_metrics_test c"));
+    }
+
+    close ();
+    unlink (name);
+#endif
+}
@@ -0,0 +1,160 @@
+#ifndef SHARED_METRICS_H
+#define SHARED_METRICS_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * @brief The shared_metrics class should keep counts and latency histograms
+ * per call site in shared memory, where other processes can read them while
+ * this process runs.
+ *
+ *        shared_metrics::open ("/myservice");
+ *
+ *        static shared_metrics::site decode("decode");
+ *        decode.record (seconds);
+ *
+ * and from a shell, without any request to the service:
+ *
+ *        ./metrics_top /myservice
+ *
+ * While the segment is open, every TaskTimer is recorded in a site named by
+ * the first line of its format string, so that a loop of formatted timers
+ * shares one site, and every TRACE_PERF scope in a site named by its info
+ * text. shared_state_traits_metrics records lock contention.
+ *
+ * Each process claims a region of its own in the segment, and a process
+ * that forks gets a new region in the child on its first record. Readers
+ * merge the regions by site name, so the workers of a prefork server show up
+ * as one. Regions of processes that have exited are kept until another
+ * process needs the room.
+ *
+ * A region is only written by its own process, with relaxed atomic
+ * increments. A record through a site handle costs a few atomic additions.
+ * A record by name also costs a lookup in a map of the calling thread, and
+ * takes a process-wide lock the first time the thread uses the name. Each
+ * distinct name takes a site, so names that vary with their arguments soon
+ * fill the region. Records are dropped while the segment isn't open, and
+ * when the region has no room for more sites.
+ *
+ * POSIX only, on Windows open returns false.
+ */
+class shared_metrics
+{
+public:
+    static const std::uint32_t version = 1;
+    static const unsigned max_name = 64;
+    // Bucket i counts latencies from 2^i ns up to 2^(i+1) ns, the last
+    // bucket also counts anything longer
+    static const unsigned buckets = 40;
+
+    // Layout of the segment: a header followed by 'max_regions' regions,
+    // each a region_header followed by 'max_sites' sites
+    struct segment_header {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t max_regions;
+        std::uint32_t max_sites;
+        std::uint32_t region_size; // bytes
+    };
+
+    struct region_header {
+        std::atomic<std::uint32_t> pid; // 0 if never used
+        std::atomic<std::uint32_t> sites; // sites in use
+        std::uint64_t start_ns;         // system clock
+        char process[32];
+    };
+
+    struct site_data {
+        char name[max_name];
+        std::atomic<std::uint64_t> count;
+        std::atomic<std::uint64_t> sum_ns;
+        std::atomic<std::uint64_t> max_ns;
+        std::atomic<std::uint64_t> overruns;  // above the limit of the site
+        std::atomic<std::uint64_t> contended; // lock waits
+        std::atomic<std::uint64_t> histogram[buckets];
+    };
+
+    /**
+     * @brief open creates the segment 'name', or attaches to it if another
+     * process already did. 'name' is a shm_open name like "/myservice".
+     */
+    static bool open (const std::string& name, unsigned max_regions = 16, unsigned max_sites = 256);
+    static void close ();
+    static bool is_open ();
+
+    /**
+     * @brief name is the name of the open segment, empty if none.
+     */
+    static std::string name ();
+
+    /**
+     * @brief unlink removes the segment, processes that have it open keep
+     * their mapping.
+     */
+    static void unlink (const std::string& name);
+
+    /**
+     * @brief The site class is a handle to the data of a call site in the
+     * region of this process, keep it in a static.
+     */
+    class site {
+    public:
+        explicit site (const std::string& name, double limit = 0);
+        site (const site&) = delete;
+        site& operator= (const site&) = delete;
+
+        /**
+         * @brief record counts one call that took 'seconds', and an overrun
+         * if it took longer than the limit of the site.
+         */
+        void record (double seconds);
+        void overrun ();
+        void contended ();
+
+    private:
+        const std::string name_;
+        const std::uint64_t limit_ns_;
+        std::atomic<site_data*> data_{nullptr};
+        std::atomic<std::uint32_t> generation_{0};
+
+        site_data* data ();
+    };
+
+    /**
+     * @brief record counts one call of the site 'name', looked up in a map
+     * of the calling thread. Use a site handle where it matters.
+     */
+    static void record (const std::string& name, double seconds);
+
+    struct site_stats {
+        std::string name;
+        std::uint64_t count, sum_ns, max_ns, overruns, contended;
+        std::vector<std::uint64_t> histogram;
+
+        double mean () const;
+        double percentile (double q) const; // upper edge of the bucket
+    };
+
+    struct process_stats {
+        std::uint32_t pid;
+        std::string process;
+        std::vector<site_stats> sites;
+    };
+
+    /**
+     * @brief read copies every used region of the segment 'name'.
+     */
+    static bool read (const std::string& name, std::vector<process_stats>& out, std::string& error);
+
+    /**
+     * @brief merge sums the sites with the same name in all processes.
+     */
+    static std::vector<site_stats> merge (const std::vector<process_stats>& p);
+
+    static void test ();
+};
+
+#endif // SHARED_METRICS_H
@@ -351,6 +351,54 @@ void test ()
 #endif
     }
 
+    // shared_state should wait for a given time without throwing any exception
+    // when using try_read_for, try_write_for, try_read_until or
+    // try_write_until.
+#ifndef SHARED_STATE_NO_TIMEOUT
+    {
+        with_timeout_0::ptr a{new with_timeout_0};
+        with_timeout_0::const_ptr consta{a};
+
+        if (auto w = a.try_write_for (chrono::milliseconds{1}))
+        {
+            EXCEPTION_ASSERT(!a.try_read_for (chrono::milliseconds{1}));
+            EXCEPTION_ASSERT(!consta.try_read_until (chrono::steady_clock::now () + chrono::milliseconds{1}));
+            EXCEPTION_ASSERT(!a.try_write_until (chrono::steady_clock::now () + chrono::milliseconds{1}));
+        }
+        else
+        {
+            EXCEPTION_ASSERT(false);
+        }
+
+        EXCEPTION_ASSERT(a.try_read_for (chrono::milliseconds{1}));
+        EXCEPTION_ASSERT(a.try_write_until (chrono::steady_clock::now ()));
+
+        // Wait for another thread to release the lock, which is locked and
+        // unlocked by that thread
+        promise<void> locked;
+        future<void> f = async(launch::async, [&a, &locked](){
+            auto w = a.write ();
+            locked.set_value ();
+            this_thread::sleep_for (chrono::milliseconds{1});
+            w.unlock ();
+        });
+        locked.get_future ().wait ();
+        EXCEPTION_ASSERT(a.try_write_for (chrono::seconds{1}));
+        f.get ();
+
+        int N = 1000;
+        auto r = a.write ();
+
+        TRACE_PERF ("shared_state should fail fast with try_write_for");
+        for (int i=0; i<N; i++)
+            a.try_write_for (chrono::seconds{0});
+
+        trace_perf_.reset ("shared_state should fail fast with try_read_for");
+        for (int i=0; i<N; i++)
+            a.try_read_for (chrono::seconds{0});
+    }
+#endif
+
     // It should keep the lock for the duration of a statement
     shared_state<base> b(new derivative);
     b.traits ()->b = b.raw ();
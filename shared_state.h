@@ -69,6 +69,18 @@
  *          ...
  *        }
  *
+ * Where contention is expected, wait for a given time without any exception
+ * (and without the backtrace that some traits attach to lock_failed):
+ *
+ *        if (auto w = p.try_write_for (std::chrono::milliseconds(2)))
+ *        {
+ *          w->...
+ *        }
+ *        else
+ *        {
+ *          // back off
+ *        }
+ *
  * You can also discard the thread safety and get unprotected access to a
  * mutable state:
  *
@@ -90,6 +102,9 @@
  * shared_state should fail within 0.1 microseconds in a 'release' build when
  * using 'try_write' or 'try_read' on a busy lock.
  *
+ * shared_state should fail without any exception, backtrace or allocation
+ * when 'try_write_for' or 'try_read_for' times out.
+ *
  * shared_state should cause an overhead of less than 0.3 microseconds in a
  * 'release' build when using 'write' or 'read'.
  *
@@ -375,6 +390,27 @@ public:
             }
         }
 
+        // Never calls timeout_failed, a failed attempt is a null pointer
+        template<class TryLockShared>
+        read_ptr (const shared_state& vp, TryLockShared try_lock_shared)
+            :   l (&vp.d->lock),
+                d (vp.d),
+                p (0)
+        {
+            if (!try_lock_shared (*l))
+                return;
+
+            p = d->p;
+
+            try {
+                d->locked (p);
+            } catch (...) {
+                p = 0;
+                l->unlock_shared ();
+                throw;
+            }
+        }
+
         typename details::shared_state_mutex* l;
         std::shared_ptr<details> d;
         const element_type* p;
@@ -487,6 +523,28 @@ public:
             }
         }
 
+        // See read_ptr (const shared_state&, TryLockShared)
+        template<class TryLock,
+                 class = typename disable_if <std::is_convertible<const T*, T*>::value>::type>
+        write_ptr (const shared_state& vp, TryLock try_lock)
+            :   l (&vp.d->lock),
+                d (vp.d),
+                p (0)
+        {
+            if (!try_lock (*l))
+                return;
+
+            p = d->p;
+
+            try {
+                d->locked (p);
+            } catch (...) {
+                p = 0;
+                l->unlock ();
+                throw;
+            }
+        }
+
         typename details::shared_state_mutex* l;
         std::shared_ptr<details> d;
         T* p;
@@ -518,6 +576,46 @@ public:
      */
     write_ptr try_write() const { return write_ptr(*this, bool()); }
 
+    /**
+     * @brief try_read_for waits at most 'rel_time' for the lock, regardless
+     * of the timeout in shared_state_traits.
+     *
+     * If the lock was not obtained the accessors return null pointers.
+     * shared_state_traits::timeout_failed is not called, so there is no
+     * exception, no backtrace and no allocation on failure. Use this where
+     * contention is expected and handled by backing off.
+     *
+     * With SHARED_STATE_NO_TIMEOUT this blocks until the lock is obtained.
+     */
+    template<class Duration>
+    read_ptr try_read_for(const Duration& rel_time) const {
+        return read_ptr(*this, [&rel_time](typename details::shared_state_mutex& m) { return m.try_lock_shared_for (rel_time); });
+    }
+
+    /**
+     * @brief try_read_until. See try_read_for.
+     */
+    template<class TimePoint>
+    read_ptr try_read_until(const TimePoint& abs_time) const {
+        return read_ptr(*this, [&abs_time](typename details::shared_state_mutex& m) { return m.try_lock_shared_until (abs_time); });
+    }
+
+    /**
+     * @brief try_write_for. See try_read_for.
+     */
+    template<class Duration>
+    write_ptr try_write_for(const Duration& rel_time) const {
+        return write_ptr(*this, [&rel_time](typename details::shared_state_mutex& m) { return m.try_lock_for (rel_time); });
+    }
+
+    /**
+     * @brief try_write_until. See try_read_for.
+     */
+    template<class TimePoint>
+    write_ptr try_write_until(const TimePoint& abs_time) const {
+        return write_ptr(*this, [&abs_time](typename details::shared_state_mutex& m) { return m.try_lock_until (abs_time); });
+    }
+
     /**
      * @brief mutex returns the mutex object for this instance.
      */
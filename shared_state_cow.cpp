@@ -0,0 +1,167 @@
+/**
+  This file only contains unit tests for shared_state_cow.
+  This file is not required for using shared_state_cow.
+
+  The tests are written so that they can be read as examples.
+  */
+
+#include "shared_state_cow.h"
+#include "exceptionassert.h"
+#include "expectexception.h"
+#include "trace_perf.h"
+#include "barrier.h"
+
+#include <future>
+#include <vector>
+#include <map>
+
+using namespace std;
+
+namespace shared_state_cow_test {
+
+struct Table
+{
+    struct shared_state_traits: shared_state_traits_default {
+        double timeout() { return 0.010; }
+    };
+
+    map<int,int> routes;
+    int version = 0;
+};
+
+
+void test ()
+{
+    // It should provide snapshots with shared read-only access
+    {
+        shared_state_cow<Table> t {new Table};
+
+        shared_state_cow<Table>::read_ptr r = t.read ();
+        EXCEPTION_ASSERT_EQUALS(r->version, 0);
+        EXCEPTION_ASSERT(r->routes.empty ());
+
+        // can't write to a snapshot
+        // r->version = 1;
+        // error: cannot assign to variable 'r' with const-qualified type
+    }
+
+    // It should let a writer modify a private copy and publish it atomically
+    {
+        shared_state_cow<Table> t {new Table};
+        auto before = t.read ();
+
+        {
+            auto w = t.write ();
+            w->routes[1] = 2;
+            w->version = 1;
+
+            // Readers still see the previous version while the copy is modified
+            EXCEPTION_ASSERT_EQUALS(t.read ()->version, 0);
+            EXCEPTION_ASSERT(t.read ()->routes.empty ());
+
+            // Publish on out-of-scope
+        }
+
+        EXCEPTION_ASSERT_EQUALS(t.read ()->version, 1);
+        EXCEPTION_ASSERT_EQUALS(t.read ()->routes.at (1), 2);
+
+        // Snapshots may outlive later writes
+        EXCEPTION_ASSERT_EQUALS(before->version, 0);
+        EXCEPTION_ASSERT(before->routes.empty ());
+    }
+
+    // It should discard the copy if the writer fails with an exception
+    {
+        shared_state_cow<Table> t {new Table};
+
+        try {
+            auto w = t.write ();
+            w->version = 1;
+            throw runtime_error("failed reload");
+        } catch (const runtime_error&) {
+        }
+
+        EXCEPTION_ASSERT_EQUALS(t.read ()->version, 0);
+
+        {
+            auto w = t.write ();
+            w->version = 2;
+            w.discard ();
+        }
+
+        EXCEPTION_ASSERT_EQUALS(t.read ()->version, 0);
+    }
+
+    // It should serialize writers
+    {
+        shared_state_cow<Table> t {new Table};
+
+        {
+            auto w = t.write ();
+            EXCEPTION_ASSERT(!t.try_write ());
+#ifndef SHARED_STATE_NO_TIMEOUT
+            EXPECT_EXCEPTION(lock_failed, t.write ());
+#endif
+        }
+
+        EXCEPTION_ASSERT(t.try_write ());
+
+        int N = 100;
+        vector<future<void>> workers(4);
+        for (unsigned i=0; i<workers.size (); i++)
+            workers[i] = async(launch::async, [&t,N](){
+                for (int j=0; j<N; j++)
+                {
+                    auto w = t.write ();
+                    w->version++;
+                }
+            });
+
+        for (unsigned i=0; i<workers.size (); i++)
+            workers[i].get ();
+
+        EXCEPTION_ASSERT_EQUALS(t.read ()->version, N*(int)workers.size ());
+    }
+
+    // It should not block readers while a writer rebuilds the state
+    {
+        shared_state_cow<Table> t {new Table};
+        spinning_barrier barrier(2);
+
+        future<void> f = async(launch::async, [&](){
+            auto w = t.write ();
+            for (int i=0; i<1000; i++)
+                w->routes[i] = i;
+            barrier.wait ();
+            // hold the writer lock while the other thread reads
+            barrier.wait ();
+            w->version = 1;
+        });
+
+        barrier.wait ();
+        EXCEPTION_ASSERT_EQUALS(t.read ()->version, 0);
+        EXCEPTION_ASSERT(t.read ()->routes.empty ());
+        barrier.wait ();
+        f.get ();
+
+        EXCEPTION_ASSERT_EQUALS(t.read ()->version, 1);
+        EXCEPTION_ASSERT_EQUALS(t.read ()->routes.size (), 1000u);
+    }
+
+    // It should take a snapshot with a low overhead
+    {
+        int N = 10000;
+        shared_state_cow<Table> t {new Table};
+        shared_state<Table> s {new Table};
+
+        TRACE_PERF ("shared_state_cow should take snapshots with a low overhead");
+        for (int i=0; i<N; i++)
+            t.read ()->version;
+
+        trace_perf_.reset ("shared_state_cow should take snapshots with a low overhead : shared_state reference");
+        for (int i=0; i<N; i++)
+            s.read ()->version;
+    }
+}
+
+} // namespace shared_state_cow_test
@@ -0,0 +1,276 @@
+/**
+ * Include: shared_state_cow.h, shared_state.h
+ * Library: C++11 only
+ *
+ * The shared_state_cow class is a copy-on-write variant of shared_state for
+ * large read-heavy states. Readers never wait for writers.
+ *
+ *   - read() returns a snapshot of the current version. Taking a snapshot is
+ *     an atomic load of a reference counted pointer and never blocks on a
+ *     writer.
+ *   - write() clones the current version into a private copy that the caller
+ *     can modify. The copy is published atomically when the write_ptr goes out
+ *     of scope. Writers are serialized with the mutex and timeout from
+ *     shared_state_traits.
+ *   - snapshots may outlive any number of later writes.
+ *
+ *
+ * In a nutshell
+ * -------------
+ *
+ *        shared_state_cow<RoutingTable> t {new RoutingTable};
+ *        ...
+ *        auto r = t.read ();      // Snapshot, never blocks
+ *        r->lookup (...);
+ *        ...
+ *        {
+ *          auto w = t.write ();   // Clone of the current version
+ *          w->reload (...);       // Readers still see the old version
+ *        }                        // Publish
+ *
+ *
+ * A write_ptr that is destroyed while unwinding from an exception discards
+ * its copy instead of publishing a partially modified state. Call
+ * write_ptr::discard() to drop changes explicitly.
+ *
+ * T must be copy constructible. Each write() costs one copy of T, so this is
+ * only a good trade-off when reads are much more frequent than writes. Use
+ * shared_state otherwise.
+ *
+ * Lock timeouts for writers are reported through
+ * shared_state_traits::timeout_failed, i.e a shared_state<T>::lock_failed is
+ * thrown with the default traits.
+ *
+ * Author: johan.b.gustafsson@gmail.com
+ */
+
+#ifndef SHARED_STATE_COW_H
+#define SHARED_STATE_COW_H
+
+#include "shared_state.h"
+
+#include <exception>
+#include <memory>
+
+template<class T>
+class shared_state_cow final
+{
+public:
+    typedef typename std::remove_const<T>::type element_type;
+
+private:
+    typedef typename shared_state_details_helper<element_type>::type traits_type;
+
+    struct details: public traits_type {
+        details(element_type* p) : current(p) {}
+        details(details const&) = delete;
+        details& operator=(details const&) = delete;
+
+        typedef typename traits_type::shared_state_mutex shared_state_mutex;
+        mutable shared_state_mutex write_lock;
+
+        // Only accessed through std::atomic_load and std::atomic_store
+        std::shared_ptr<const element_type> current;
+    };
+
+public:
+    /**
+     * @brief read_ptr is a snapshot of a published version. It is never
+     * modified and stays valid for as long as any copy of it is alive.
+     */
+    typedef std::shared_ptr<const element_type> read_ptr;
+
+    shared_state_cow () {}
+
+    template<class Y,
+             class = typename std::enable_if <std::is_convertible<Y*, element_type*>::value>::type>
+    explicit shared_state_cow ( Y* p )
+    {
+        reset(p);
+    }
+
+    void reset() {
+        d.reset ();
+    }
+
+    template<class Y,
+             class = typename std::enable_if <std::is_convertible<Y*, element_type*>::value>::type>
+    void reset( Y* yp ) {
+        d.reset (new details(yp));
+    }
+
+
+    /**
+     * The purpose of write_ptr is to provide a private copy of the current
+     * version to a single writer, and to publish that copy atomically. Other
+     * writers are blocked during the lifetime of the write_ptr, readers are
+     * not.
+     *
+     * @see class shared_state_cow
+     */
+    class write_ptr {
+    public:
+        write_ptr() : is_unwinding(false) {}
+
+        write_ptr(write_ptr&& b)
+            :   write_ptr()
+        {
+            swap(b);
+        }
+
+        write_ptr(const write_ptr&) = delete;
+        write_ptr& operator=(write_ptr const&) = delete;
+
+        ~write_ptr() {
+            if (is_unwinding || !std::uncaught_exception ())
+                publish ();
+            else
+                discard ();
+        }
+
+#ifdef _DEBUG
+        element_type* operator-> () const { assert(p); return p.get (); }
+        element_type& operator* () const { assert(p); return *p; }
+#else
+        element_type* operator-> () const { return p.get (); }
+        element_type& operator* () const { return *p; }
+#endif
+        element_type* get () const { return p.get (); }
+        explicit operator bool() const { return (bool)p; }
+
+        /**
+         * @brief publish makes the modified copy visible to new readers and
+         * releases the writer lock.
+         */
+        void publish() {
+            if (p)
+            {
+                element_type* q = p.get ();
+                std::atomic_store (&d->current, std::shared_ptr<const element_type>(std::move(p)));
+                d->write_lock.unlock ();
+                d->unlocked (q);
+            }
+        }
+
+        /**
+         * @brief discard drops the modified copy and releases the writer lock.
+         * The current version is left untouched.
+         */
+        void discard() {
+            if (p)
+            {
+                std::unique_ptr<element_type> q = std::move(p);
+                d->write_lock.unlock ();
+                d->unlocked (q.get ());
+            }
+        }
+
+        void swap(write_ptr& b) {
+            std::swap(d, b.d);
+            std::swap(p, b.p);
+            std::swap(is_unwinding, b.is_unwinding);
+        }
+
+    private:
+        friend class shared_state_cow;
+
+        explicit write_ptr (const std::shared_ptr<details>& vd)
+            :   d (vd),
+                is_unwinding (std::uncaught_exception ())
+        {
+            // write_lock is not locked, but timeout is required to be reentrant
+            double timeout = d->timeout();
+
+            if (d->write_lock.try_lock())
+            {
+            }
+            else if (timeout < 0)
+            {
+                d->write_lock.lock ();
+            }
+            else if (d->write_lock.try_lock_for (shared_state_chrono::duration<double>{timeout}))
+            {
+            }
+            else
+            {
+                element_type* current = const_cast<element_type*>(std::atomic_load (&d->current).get ());
+                d->timeout_failed (current);
+                // timeout_failed is expected to throw. But if it doesn't,
+                // make this behave as a null pointer
+                return;
+            }
+
+            clone ();
+        }
+
+        write_ptr (const std::shared_ptr<details>& vd, bool)
+            :   d (vd),
+                is_unwinding (std::uncaught_exception ())
+        {
+            if (d->write_lock.try_lock ())
+                clone ();
+        }
+
+        void clone() {
+            try {
+                p.reset (new element_type(*std::atomic_load (&d->current)));
+                d->locked (p.get ());
+            } catch (...) {
+                p.reset ();
+                d->write_lock.unlock ();
+                throw;
+            }
+        }
+
+        std::shared_ptr<details> d;
+        std::unique_ptr<element_type> p;
+        bool is_unwinding;
+    };
+
+
+    /**
+     * @brief read returns a snapshot of the current version. Never blocks.
+     */
+    read_ptr read() const { return std::atomic_load (&d->current); }
+
+    /**
+     * @brief write returns a private copy of the current version which is
+     * published when the write_ptr goes out of scope. Not accessible if T is
+     * const.
+     */
+    template<class = typename disable_if <std::is_convertible<const T*, T*>::value>::type>
+    write_ptr write() const { return write_ptr(d); }
+
+    /**
+     * @brief try_write only obtains the writer lock if it is readily
+     * available. Otherwise the accessors of the returned write_ptr are null
+     * pointers.
+     */
+    template<class = typename disable_if <std::is_convertible<const T*, T*>::value>::type>
+    write_ptr try_write() const { return write_ptr(d, bool()); }
+
+    /**
+     * @brief traits provides unprotected access to the instance of
+     * shared_state_traits used for this type.
+     */
+    std::shared_ptr<traits_type> traits() const { return d; }
+
+    explicit operator bool() const { return (bool)d; }
+    bool operator== (const shared_state_cow& b) const { return d == b.d; }
+    bool operator!= (const shared_state_cow& b) const { return !(*this == b); }
+    bool operator < (const shared_state_cow& b) const { return this->d < b.d; }
+
+    void swap(shared_state_cow& b) {
+        std::swap(d, b.d);
+    }
+
+private:
+    std::shared_ptr<details> d;
+};
+
+
+namespace shared_state_cow_test {
+    void test ();
+}
+
+#endif // SHARED_STATE_COW_H
@@ -0,0 +1,473 @@
+#include "shared_state_lock_simulator.h"
+#include "exceptionassert.h"
+
+#include <algorithm>
+#include <deque>
+#include <queue>
+#include <functional>
+#include <limits>
+
+using namespace std;
+
+namespace {
+
+struct interval {
+    uint64_t start, end;
+    uint32_t thread;
+};
+
+template<class M, class V>
+V lookup(const M& m, uint64_t instance, V otherwise)
+{
+    auto i = m.find (instance);
+    if (i == m.end ())
+        i = m.find (lock_simulator::all);
+    return i == m.end () ? otherwise : i->second;
+}
+
+void finish(lock_simulator::result& r, map<uint64_t, lock_simulator::instance_result>& instances)
+{
+    for (auto& i : instances)
+    {
+        r.acquisitions += i.second.acquisitions;
+        r.wait += i.second.wait;
+        r.instances.push_back (i.second);
+    }
+
+    sort (r.instances.begin (), r.instances.end (),
+          [](const lock_simulator::instance_result& a, const lock_simulator::instance_result& b) {
+        return a.wait != b.wait ? a.wait > b.wait : a.instance < b.instance;
+    });
+
+    r.throughput = 0 < r.makespan ? r.acquisitions / r.makespan : 0;
+}
+
+} // namespace
+
+
+const std::uint64_t lock_simulator::all;
+
+
+lock_simulator::
+        lock_simulator(const vector<lock_trace::event>& unsorted)
+{
+    vector<lock_trace::event> events = unsorted;
+    stable_sort (events.begin (), events.end (), [](const lock_trace::event& a, const lock_trace::event& b) {
+        return a.thread != b.thread ? a.thread < b.thread : a.time_ns < b.time_ns;
+    });
+
+    if (events.empty ())
+        return;
+
+    uint64_t first = events.front ().time_ns, last = first;
+    for (const auto& e : events)
+    {
+        first = min(first, e.time_ns);
+        last = max(last, e.time_ns);
+    }
+
+    map<uint64_t, instance_result> instances;
+    map<uint64_t, vector<interval>> reads;
+
+    for (size_t i=0; i<events.size ();)
+    {
+        uint32_t thread = events[i].thread;
+        size_t end = i;
+        while (end < events.size () && events[end].thread == thread)
+            end++;
+
+        thread_ops t;
+        t.start = (events[i].time_ns - first) * 1e-9;
+        uint64_t prev = events[i].time_ns;
+        map<uint64_t, vector<pair<uint64_t,bool>>> held; // acquire times
+
+        auto push = [&](lock_trace::event_kind kind, const lock_trace::event& e, uint64_t gap_from) {
+            t.ops.push_back (op{kind, e.instance, 0 != e.shared, (e.time_ns - gap_from) * 1e-9});
+        };
+
+        for (; i<end; i++)
+        {
+            const lock_trace::event& e = events[i];
+            switch (e.kind)
+            {
+            case lock_trace::requested:
+            {
+                // A request must be followed by its outcome, otherwise the
+                // trace was stopped while waiting
+                if (i+1 == end || events[i+1].instance != e.instance
+                        || (events[i+1].kind != lock_trace::acquired && events[i+1].kind != lock_trace::abandoned))
+                    break;
+
+                const lock_trace::event& o = events[i+1];
+                push (lock_trace::requested, e, prev);
+                push ((lock_trace::event_kind)o.kind, o, e.time_ns);
+                prev = o.time_ns;
+                i++;
+
+                if (o.kind == lock_trace::acquired)
+                {
+                    instance_result& r = instances[e.instance];
+                    r.instance = e.instance;
+                    r.acquisitions++;
+                    double w = (o.time_ns - e.time_ns) * 1e-9;
+                    r.wait += w;
+                    r.max_wait = max(r.max_wait, w);
+                    held[e.instance].push_back (make_pair(o.time_ns, 0 != o.shared));
+                }
+                break;
+            }
+            case lock_trace::released:
+            {
+                // Releases of locks acquired before the trace started are
+                // skipped
+                auto& h = held[e.instance];
+                if (h.empty ())
+                    break;
+
+                push (lock_trace::released, e, prev);
+                prev = e.time_ns;
+
+                instances[e.instance].hold += (e.time_ns - h.back ().first) * 1e-9;
+                if (h.back ().second)
+                    reads[e.instance].push_back (interval{h.back ().first, e.time_ns, thread});
+                h.pop_back ();
+                break;
+            }
+            default:
+                // An outcome without a request, the trace was started while
+                // waiting
+                break;
+            }
+        }
+
+        // Locks still held when the trace was stopped are released at the end
+        for (auto& h : held)
+            for (size_t j=0; j<h.second.size (); j++)
+            {
+                lock_trace::event e{prev, h.first, thread, lock_trace::released, 0, 0};
+                push (lock_trace::released, e, prev);
+            }
+
+        threads_.push_back (move(t));
+    }
+
+    for (auto& r : reads)
+    {
+        vector<interval>& v = r.second;
+        sort (v.begin (), v.end (), [](const interval& a, const interval& b) { return a.start < b.start; });
+        uint64_t max_end = 0;
+        uint32_t max_thread = 0;
+        for (const interval& x : v)
+        {
+            if (x.start < max_end && x.thread != max_thread)
+                overlapping_reads_.insert (r.first);
+            if (x.end > max_end)
+            {
+                max_end = x.end;
+                max_thread = x.thread;
+            }
+        }
+    }
+
+    for (auto& i : instances)
+        i.second.shared_reads = 0 != overlapping_reads_.count (i.first);
+
+    recorded_.makespan = (last - first) * 1e-9;
+    finish (recorded_, instances);
+}
+
+
+lock_simulator::result lock_simulator::
+        recorded() const
+{
+    return recorded_;
+}
+
+
+lock_simulator::result lock_simulator::
+        simulate(const model& m) const
+{
+    struct waiter {
+        size_t thread;
+        bool shared;
+        double since;
+    };
+
+    struct lock_state {
+        map<size_t, int> holders; // thread -> recursion count
+        bool shared = false;
+        deque<waiter> waiters;
+    };
+
+    struct thread_state {
+        size_t pc = 0;
+        double t = 0;
+        bool blocked = false;
+        vector<pair<uint64_t,double>> held; // instance, acquire time
+    };
+
+    map<uint64_t, lock_state> locks;
+    map<uint64_t, instance_result> instances;
+    vector<thread_state> threads(threads_.size ());
+
+    typedef pair<double,size_t> ready;
+    priority_queue<ready, vector<ready>, greater<ready>> queue;
+
+    auto lock_free = [&m](uint64_t instance) {
+        return m.lock_free.count (instance) || m.lock_free.count (all);
+    };
+
+    auto reads_shared = [&](uint64_t instance) {
+        return lookup (m.shared_reads, instance, 0 != overlapping_reads_.count (instance));
+    };
+
+    auto schedule = [&](size_t th) {
+        thread_state& s = threads[th];
+        const vector<op>& ops = threads_[th].ops;
+        if (s.pc >= ops.size ())
+            return;
+
+        // The strongest scale of all held instances
+        double scale = s.held.empty () ? 1 : numeric_limits<double>::max ();
+        for (auto& h : s.held)
+            scale = min(scale, lookup (m.critical_section_scale, h.first, 1.0));
+        queue.push (ready(s.t + ops[s.pc].gap * scale, th));
+    };
+
+    auto can_grant = [](const lock_state& l, size_t th, bool shared, bool first_in_line) {
+        if (l.holders.empty ())
+            return true;
+        // Recursion, the trace shows that it didn't dead-lock
+        if (l.holders.count (th))
+            return l.holders.size () == 1 || (shared && l.shared);
+        return shared && l.shared && (first_in_line || l.waiters.empty ());
+    };
+
+    auto grant = [&](size_t th, uint64_t instance, bool shared, double since, double at) {
+        thread_state& s = threads[th];
+        if (!lock_free (instance))
+        {
+            lock_state& l = locks[instance];
+            l.shared = l.holders.empty () ? shared : l.shared && shared;
+            l.holders[th]++;
+        }
+
+        instance_result& r = instances[instance];
+        r.instance = instance;
+        r.shared_reads = reads_shared (instance);
+        r.acquisitions++;
+        r.wait += at - since;
+        r.max_wait = max(r.max_wait, at - since);
+
+        s.held.push_back (make_pair(instance, at));
+        s.blocked = false;
+        s.t = at;
+        s.pc += 2;
+        schedule (th);
+    };
+
+    for (size_t th=0; th<threads.size (); th++)
+    {
+        threads[th].t = threads_[th].start;
+        schedule (th);
+    }
+
+    while (!queue.empty ())
+    {
+        double t = queue.top ().first;
+        size_t th = queue.top ().second;
+        queue.pop ();
+
+        thread_state& s = threads[th];
+        const vector<op>& ops = threads_[th].ops;
+        const op& o = ops[s.pc];
+        s.t = t;
+
+        if (o.kind == lock_trace::requested)
+        {
+            const op& outcome = ops[s.pc+1];
+            if (outcome.kind == lock_trace::abandoned)
+            {
+                s.t += outcome.gap;
+                s.pc += 2;
+                schedule (th);
+                continue;
+            }
+
+            bool shared = o.shared && reads_shared (o.instance);
+            if (lock_free (o.instance))
+                grant (th, o.instance, shared, t, t);
+            else
+            {
+                lock_state& l = locks[o.instance];
+                if (can_grant (l, th, shared, false))
+                    grant (th, o.instance, shared, t, t);
+                else
+                {
+                    l.waiters.push_back (waiter{th, shared, t});
+                    s.blocked = true;
+                }
+            }
+        }
+        else // released
+        {
+            auto h = find_if (s.held.rbegin (), s.held.rend (),
+                              [&o](const pair<uint64_t,double>& p) { return p.first == o.instance; });
+            instances[o.instance].hold += t - h->second;
+            s.held.erase (std::next(h).base ());
+            s.pc++;
+            schedule (th);
+
+            if (lock_free (o.instance))
+                continue;
+
+            lock_state& l = locks[o.instance];
+            if (0 == --l.holders[th])
+                l.holders.erase (th);
+
+            while (!l.waiters.empty ())
+            {
+                waiter w = l.waiters.front ();
+                if (!can_grant (l, w.thread, w.shared, true))
+                    break;
+                l.waiters.pop_front ();
+                grant (w.thread, o.instance, w.shared, w.since, t);
+            }
+        }
+    }
+
+    result r;
+    for (const thread_state& s : threads)
+    {
+        if (s.blocked)
+            r.stuck_threads++;
+        else
+            r.makespan = max(r.makespan, s.t);
+    }
+
+    finish (r, instances);
+    return r;
+}
+
+
+void lock_simulator::
+        test()
+{
+    const uint64_t ms = 1000000;
+    const uint64_t X = 0x1000, Y = 0x2000;
+    typedef lock_trace::event E;
+
+    // Two threads that take turns on X for 10 ms each
+    vector<E> turns = {
+        E{0*ms,  X, 0, lock_trace::requested, 1, 0},
+        E{0*ms,  X, 0, lock_trace::acquired, 1, 0},
+        E{10*ms, X, 0, lock_trace::released, 1, 0},
+        E{0*ms,  X, 1, lock_trace::requested, 1, 0},
+        E{10*ms, X, 1, lock_trace::acquired, 1, 0},
+        E{20*ms, X, 1, lock_trace::released, 1, 0},
+    };
+
+    // It should summarize the recorded trace
+    {
+        lock_simulator s(turns);
+        result r = s.recorded ();
+        EXCEPTION_ASSERT_EQUALS(r.acquisitions, 2u);
+        EXCEPTION_ASSERT_FUZZYEQUALS(r.makespan, 0.020, 1e-9);
+        EXCEPTION_ASSERT_FUZZYEQUALS(r.wait, 0.010, 1e-9);
+        EXCEPTION_ASSERT_FUZZYEQUALS(r.throughput, 100, 1e-6);
+        EXCEPTION_ASSERT_EQUALS(r.instances.size (), 1u);
+        EXCEPTION_ASSERT_FUZZYEQUALS(r.instances[0].hold, 0.020, 1e-9);
+        // The reads never overlapped, the lock didn't allow shared reads
+        EXCEPTION_ASSERT(!r.instances[0].shared_reads);
+    }
+
+    // It should reproduce the recorded trace with an empty model
+    {
+        lock_simulator s(turns);
+        result r = s.simulate (model());
+        EXCEPTION_ASSERT_FUZZYEQUALS(r.makespan, 0.020, 1e-9);
+        EXCEPTION_ASSERT_FUZZYEQUALS(r.wait, 0.010, 1e-9);
+        EXCEPTION_ASSERT_EQUALS(r.stuck_threads, 0u);
+    }
+
+    // It should predict the effect of what-if models
+    {
+        lock_simulator s(turns);
+
+        model lock_free;
+        lock_free.lock_free.insert (X);
+        result r = s.simulate (lock_free);
+        EXCEPTION_ASSERT_FUZZYEQUALS(r.makespan, 0.010, 1e-9);
+        EXCEPTION_ASSERT_FUZZYEQUALS(r.wait, 0, 1e-9);
+
+        model shared;
+        shared.shared_reads[all] = true;
+        r = s.simulate (shared);
+        EXCEPTION_ASSERT_FUZZYEQUALS(r.makespan, 0.010, 1e-9);
+        EXCEPTION_ASSERT(r.instances[0].shared_reads);
+
+        model shorter;
+        shorter.critical_section_scale[X] = 0.5;
+        r = s.simulate (shorter);
+        EXCEPTION_ASSERT_FUZZYEQUALS(r.makespan, 0.010, 1e-9);
+        EXCEPTION_ASSERT_FUZZYEQUALS(r.wait, 0.005, 1e-9);
+
+        // Other instances are unaffected
+        shorter.critical_section_scale.clear ();
+        shorter.critical_section_scale[Y] = 0.5;
+        r = s.simulate (shorter);
+        EXCEPTION_ASSERT_FUZZYEQUALS(r.makespan, 0.020, 1e-9);
+    }
+
+    // It should replay the time between locks and keep waits on other
+    // instances
+    {
+        // Thread 0 holds X, then Y. Thread 1 waits for X, works 5 ms and then
+        // takes Y.
+        vector<E> chain = {
+            E{0*ms,  X, 0, lock_trace::requested, 0, 0},
+            E{0*ms,  X, 0, lock_trace::acquired, 0, 0},
+            E{10*ms, X, 0, lock_trace::released, 0, 0},
+            E{10*ms, Y, 0, lock_trace::requested, 0, 0},
+            E{10*ms, Y, 0, lock_trace::acquired, 0, 0},
+            E{30*ms, Y, 0, lock_trace::released, 0, 0},
+            E{0*ms,  X, 1, lock_trace::requested, 0, 0},
+            E{10*ms, X, 1, lock_trace::acquired, 0, 0},
+            E{12*ms, X, 1, lock_trace::released, 0, 0},
+            E{17*ms, Y, 1, lock_trace::requested, 0, 0},
+            E{30*ms, Y, 1, lock_trace::acquired, 0, 0},
+            E{31*ms, Y, 1, lock_trace::released, 0, 0},
+        };
+
+        lock_simulator s(chain);
+        result r = s.simulate (model());
+        EXCEPTION_ASSERT_FUZZYEQUALS(r.makespan, 0.031, 1e-9);
+        EXCEPTION_ASSERT_EQUALS(r.instances[0].instance, Y);
+        EXCEPTION_ASSERT_FUZZYEQUALS(r.instances[0].wait, 0.013, 1e-9);
+
+        // Without a lock on X thread 1 is done with Y before thread 0 gets it
+        model m;
+        m.lock_free.insert (X);
+        r = s.simulate (m);
+        EXCEPTION_ASSERT_FUZZYEQUALS(r.makespan, 0.030, 1e-9);
+        EXCEPTION_ASSERT_FUZZYEQUALS(r.wait, 0, 1e-9);
+    }
+
+    // It should replay recorded timeouts as delays and skip incomplete events
+    {
+        vector<E> partial = {
+            E{0*ms,  X, 0, lock_trace::released, 0, 0},
+            E{1*ms,  X, 0, lock_trace::requested, 0, 0},
+            E{3*ms,  X, 0, lock_trace::abandoned, 0, 0},
+            E{4*ms,  X, 0, lock_trace::requested, 0, 0},
+            E{4*ms,  X, 0, lock_trace::acquired, 0, 0},
+            E{6*ms,  Y, 0, lock_trace::requested, 0, 0},
+        };
+
+        lock_simulator s(partial);
+        result r = s.simulate (model());
+        EXCEPTION_ASSERT_EQUALS(r.acquisitions, 1u);
+        EXCEPTION_ASSERT_FUZZYEQUALS(r.makespan, 0.004, 1e-9);
+        EXCEPTION_ASSERT_EQUALS(r.stuck_threads, 0u);
+    }
+}
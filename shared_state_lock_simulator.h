@@ -0,0 +1,92 @@
+#ifndef SHARED_STATE_LOCK_SIMULATOR_H
+#define SHARED_STATE_LOCK_SIMULATOR_H
+
+#include "shared_state_lock_trace.h"
+
+#include <map>
+#include <set>
+
+/**
+ * @brief The lock_simulator class should replay a lock_trace under what-if
+ * models and predict throughput and wait times.
+ *
+ * Each thread in the trace is replayed as a sequence of lock requests and
+ * releases separated by the time it spent running in between. Waiting is not
+ * replayed, it is simulated from who holds which lock. Changing the model
+ * then tells how much waiting would remain:
+ *
+ *   - lock_free: requests on the instance never wait, as if it had no lock or
+ *     was replaced by a copy-on-write or RCU style state.
+ *   - shared_reads: read locks on the instance may, or may not, be held by
+ *     several threads at once. By default this is inferred from the trace,
+ *     reads are shared if the trace has overlapping reads.
+ *   - critical_section_scale: time spent while holding the instance is
+ *     scaled, 0.5 for a critical section that is 50% shorter.
+ *
+ * Locks are granted in FIFO order. Use 'all' as instance to apply a setting
+ * to all instances. Requests that timed out are replayed as a delay of the
+ * same length.
+ */
+class lock_simulator
+{
+public:
+    static const std::uint64_t all = 0;
+
+    struct model {
+        std::set<std::uint64_t> lock_free;
+        std::map<std::uint64_t, bool> shared_reads;
+        std::map<std::uint64_t, double> critical_section_scale;
+    };
+
+    struct instance_result {
+        std::uint64_t instance = 0;
+        bool shared_reads = false;
+        size_t acquisitions = 0;
+        double wait = 0;     // total time spent waiting for the lock
+        double max_wait = 0;
+        double hold = 0;     // total time the lock was held
+    };
+
+    struct result {
+        double makespan = 0; // from the first event to the last
+        size_t acquisitions = 0;
+        double throughput = 0; // acquisitions per second
+        double wait = 0;
+        size_t stuck_threads = 0; // threads that dead-locked in the simulation
+        std::vector<instance_result> instances; // most waited for first
+    };
+
+    explicit lock_simulator (const std::vector<lock_trace::event>& events);
+
+    /**
+     * @brief recorded summarizes the trace as it was recorded.
+     */
+    result recorded () const;
+
+    /**
+     * @brief simulate replays the trace under 'm'. An empty model should give
+     * a result close to 'recorded'.
+     */
+    result simulate (const model& m) const;
+
+    static void test ();
+
+private:
+    struct op {
+        lock_trace::event_kind kind;
+        std::uint64_t instance;
+        bool shared;
+        double gap; // time since the previous event of the same thread
+    };
+
+    struct thread_ops {
+        double start;
+        std::vector<op> ops;
+    };
+
+    std::vector<thread_ops> threads_;
+    std::set<std::uint64_t> overlapping_reads_;
+    result recorded_;
+};
+
+#endif // SHARED_STATE_LOCK_SIMULATOR_H
@@ -0,0 +1,240 @@
+#include "shared_state_lock_trace.h"
+#include "thread_buffers.h"
+#include "exceptionassert.h"
+#include "trace_perf.h"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <algorithm>
+#include <stdexcept>
+#include <future>
+#include <stdio.h>
+#include <string.h>
+
+using namespace std;
+
+namespace {
+
+const char magic[8] = {'L','O','C','K','T','R','C','1'};
+
+atomic<bool> is_enabled{false};
+
+thread_buffers<vector<lock_trace::event>>& buffers()
+{
+    static auto* b = new thread_buffers<vector<lock_trace::event>>;
+    return *b;
+}
+
+} // namespace
+
+
+void lock_trace::
+        enable(bool v)
+{
+    is_enabled = v;
+}
+
+
+bool lock_trace::
+        enabled()
+{
+    return is_enabled.load (memory_order_relaxed);
+}
+
+
+void lock_trace::
+        record(const void* instance, event_kind kind, bool shared)
+{
+    uint64_t t = steady_now_ns ();
+
+    auto& s = buffers ().this_thread ();
+    event e{t, (uint64_t)(uintptr_t)instance, s.number, (uint8_t)kind, (uint8_t)shared, 0};
+
+    unique_lock<mutex> l(s.lock);
+    if (0 == s.buffer.capacity ())
+        s.buffer.reserve (1 << 12);
+    s.buffer.push_back (e);
+}
+
+
+vector<lock_trace::event> lock_trace::
+        events()
+{
+    vector<event> all;
+    buffers ().for_each ([&all](thread_buffers<vector<event>>::slot& s) {
+        all.insert (all.end (), s.buffer.begin (), s.buffer.end ());
+    });
+    return all;
+}
+
+
+void lock_trace::
+        clear()
+{
+    buffers ().for_each ([](thread_buffers<vector<event>>::slot& s) {
+        s.buffer.clear ();
+    });
+}
+
+
+bool lock_trace::
+        save(const string& filename)
+{
+    vector<event> all = events ();
+    FILE* f = fopen(filename.c_str (), "wb");
+    if (!f)
+        return false;
+
+    uint64_t n = all.size ();
+    bool ok = 1 == fwrite(magic, sizeof(magic), 1, f)
+            && 1 == fwrite(&n, sizeof(n), 1, f)
+            && n == fwrite(all.data (), sizeof(event), n, f);
+    ok &= 0 == fclose(f);
+    return ok;
+}
+
+
+vector<lock_trace::event> lock_trace::
+        load(const string& filename)
+{
+    FILE* f = fopen(filename.c_str (), "rb");
+    if (!f)
+        throw runtime_error("lock_trace: couldn't open " + filename);
+
+    char m[sizeof(magic)];
+    uint64_t n = 0;
+    vector<event> all;
+    bool ok = 1 == fread(m, sizeof(m), 1, f)
+            && 0 == memcmp(m, magic, sizeof(m))
+            && 1 == fread(&n, sizeof(n), 1, f);
+    if (ok)
+    {
+        all.resize (n);
+        ok = n == fread(all.data (), sizeof(event), n, f);
+    }
+    fclose(f);
+
+    if (!ok)
+        throw runtime_error("lock_trace: " + filename + " is not a lock trace");
+
+    stable_sort (all.begin (), all.end (), [](const event& a, const event& b) {
+        return a.thread != b.thread ? a.thread < b.thread : a.time_ns < b.time_ns;
+    });
+    return all;
+}
+
+
+namespace lock_trace_test {
+
+struct Traced
+{
+    struct shared_state_traits: shared_state_traits_lock_trace {
+        double timeout() { return 0.002; }
+    };
+
+    int v = 0;
+};
+
+} // namespace lock_trace_test
+
+using namespace lock_trace_test;
+
+void lock_trace::
+        test()
+{
+    // It should record nothing while disabled
+    {
+        lock_trace::clear ();
+        shared_state<Traced> s {new Traced};
+        s.write ()->v++;
+        EXCEPTION_ASSERT_EQUALS(lock_trace::events ().size (), 0u);
+    }
+
+    // It should record lock requests, acquisitions and releases
+    {
+        shared_state<Traced> s {new Traced};
+        lock_trace::clear ();
+        lock_trace::enable (true);
+
+        s.write ()->v++;
+        s.read ();
+
+        {
+            auto w = s.write ();
+#ifndef SHARED_STATE_NO_TIMEOUT
+            async(launch::async, [&s](){ s.try_read_for (chrono::milliseconds(1)); }).get ();
+#endif
+        }
+
+        lock_trace::enable (false);
+        s.write ();
+
+        vector<event> e = lock_trace::events ();
+        stable_sort (e.begin (), e.end (), [](const event& a, const event& b) { return a.thread < b.thread; });
+
+#ifndef SHARED_STATE_NO_TIMEOUT
+        EXCEPTION_ASSERT_EQUALS(e.size (), 11u);
+#else
+        EXCEPTION_ASSERT_EQUALS(e.size (), 9u);
+#endif
+        uint8_t kinds[] = {requested, acquired, released, requested, acquired, released, requested, acquired, released};
+        uint8_t shared[] = {0, 0, 0, 1, 1, 1, 0, 0, 0};
+        for (unsigned i=0; i<9; i++)
+        {
+            EXCEPTION_ASSERT_EQUALS((int)e[i].kind, (int)kinds[i]);
+            EXCEPTION_ASSERT_EQUALS((int)e[i].shared, (int)shared[i]);
+            EXCEPTION_ASSERT_EQUALS(e[i].instance, e[0].instance);
+            EXCEPTION_ASSERT_EQUALS(e[i].thread, e[0].thread);
+            if (i)
+                EXCEPTION_ASSERT_LESS_OR_EQUAL(e[i-1].time_ns, e[i].time_ns);
+        }
+
+#ifndef SHARED_STATE_NO_TIMEOUT
+        // The other thread gave up
+        EXCEPTION_ASSERT_NOTEQUALS(e[9].thread, e[0].thread);
+        EXCEPTION_ASSERT_EQUALS((int)e[9].kind, (int)requested);
+        EXCEPTION_ASSERT_EQUALS((int)e[10].kind, (int)abandoned);
+        EXCEPTION_ASSERT_LESS(e[7].time_ns, e[9].time_ns);
+        EXCEPTION_ASSERT_LESS(e[10].time_ns, e[8].time_ns);
+#endif
+
+        // It should save and load the trace
+        const char* filename = "lock_trace_test.trace";
+        EXCEPTION_ASSERT(lock_trace::save (filename));
+        vector<event> loaded = lock_trace::load (filename);
+        remove(filename);
+
+        EXCEPTION_ASSERT_EQUALS(loaded.size (), e.size ());
+        for (unsigned i=0; i<e.size (); i++)
+        {
+            EXCEPTION_ASSERT_EQUALS(loaded[i].time_ns, e[i].time_ns);
+            EXCEPTION_ASSERT_EQUALS((int)loaded[i].kind, (int)e[i].kind);
+        }
+
+        lock_trace::clear ();
+    }
+
+    // It should cause a low overhead while disabled
+    {
+        shared_state<Traced> s {new Traced};
+        int N = 10000;
+
+        TRACE_PERF ("lock_trace should cause a low overhead while disabled");
+        for (int i=0; i<N; i++)
+        {
+            s.write ()->v++;
+            s.read ();
+        }
+
+        trace_perf_.reset ("lock_trace should cause a low overhead while enabled");
+        lock_trace::enable (true);
+        for (int i=0; i<N; i++)
+        {
+            s.write ()->v++;
+            s.read ();
+        }
+        lock_trace::enable (false);
+        lock_trace::clear ();
+    }
+}
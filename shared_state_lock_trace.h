@@ -0,0 +1,163 @@
+#ifndef SHARED_STATE_LOCK_TRACE_H
+#define SHARED_STATE_LOCK_TRACE_H
+
+#include "shared_state.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * @brief The lock_trace class should record a compact per-thread binary trace
+ * of lock events for offline analysis with lock_simulator.
+ *
+ * Recording is optional per type, select it through traits:
+ *
+ *        class MyType {
+ *        public:
+ *            struct shared_state_traits: shared_state_traits_lock_trace {};
+ *            ...
+ *        };
+ *
+ *        lock_trace::enable (true);
+ *        ... run the workload
+ *        lock_trace::enable (false);
+ *        lock_trace::save ("locks.trace");
+ *
+ * and then predict the effect of changes with tools/lock_simulator.
+ *
+ * Each thread appends to a buffer of its own. Events are recorded when a lock
+ * is requested, when it is acquired and when it is released. A timed request
+ * that gives up is recorded as abandoned, an immediate try_lock that fails is
+ * not recorded at all. Instances are identified by the address of their
+ * mutex.
+ */
+class lock_trace
+{
+public:
+    enum event_kind : std::uint8_t {
+        requested = 0,
+        acquired = 1,
+        released = 2,
+        abandoned = 3
+    };
+
+    struct event {
+        std::uint64_t time_ns;  // steady clock
+        std::uint64_t instance;
+        std::uint32_t thread;   // 0, 1, 2 ... in order of first event
+        std::uint8_t kind;      // event_kind
+        std::uint8_t shared;    // 1 for read locks
+        std::uint16_t reserved;
+    };
+
+    static void enable (bool v);
+    static bool enabled ();
+
+    /**
+     * @brief record appends an event to the buffer of this thread.
+     */
+    static void record (const void* instance, event_kind kind, bool shared);
+
+    /**
+     * @brief events returns all events from all threads, ordered by thread
+     * and time.
+     */
+    static std::vector<event> events ();
+    static void clear ();
+
+    /**
+     * @brief save writes all events to 'filename'. Returns false if the file
+     * couldn't be written.
+     */
+    static bool save (const std::string& filename);
+
+    /**
+     * @brief load reads events from 'filename'. Throws std::runtime_error on
+     * errors.
+     */
+    static std::vector<event> load (const std::string& filename);
+
+    static void test ();
+};
+
+
+/**
+ * @brief The shared_state_mutex_lock_trace class should record lock_trace
+ * events around the calls to 'Mutex' while lock_trace is enabled.
+ */
+template<class Mutex = shared_state_mutex>
+class shared_state_mutex_lock_trace {
+public:
+    void lock() { request (false, [this](){ m.lock (); return true; }); }
+    void lock_shared() { request (true, [this](){ m.lock_shared (); return true; }); }
+
+    bool try_lock() {
+        bool r = m.try_lock ();
+        if (r) immediate (false);
+        return r;
+    }
+
+    bool try_lock_shared() {
+        bool r = m.try_lock_shared ();
+        if (r) immediate (true);
+        return r;
+    }
+
+    template<class Duration>
+    bool try_lock_for(const Duration& d) { return request (false, [&](){ return m.try_lock_for (d); }); }
+
+    template<class Duration>
+    bool try_lock_shared_for(const Duration& d) { return request (true, [&](){ return m.try_lock_shared_for (d); }); }
+
+    template<class TimePoint>
+    bool try_lock_until(const TimePoint& t) { return request (false, [&](){ return m.try_lock_until (t); }); }
+
+    template<class TimePoint>
+    bool try_lock_shared_until(const TimePoint& t) { return request (true, [&](){ return m.try_lock_shared_until (t); }); }
+
+    void unlock() {
+        if (lock_trace::enabled ())
+            lock_trace::record (this, lock_trace::released, false);
+        m.unlock ();
+    }
+
+    void unlock_shared() {
+        if (lock_trace::enabled ())
+            lock_trace::record (this, lock_trace::released, true);
+        m.unlock_shared ();
+    }
+
+private:
+    Mutex m;
+
+    template<class F>
+    bool request(bool shared, F f) {
+        if (!lock_trace::enabled ())
+            return f();
+
+        lock_trace::record (this, lock_trace::requested, shared);
+        bool r = f();
+        lock_trace::record (this, r ? lock_trace::acquired : lock_trace::abandoned, shared);
+        return r;
+    }
+
+    void immediate(bool shared) {
+        if (lock_trace::enabled ())
+        {
+            lock_trace::record (this, lock_trace::requested, shared);
+            lock_trace::record (this, lock_trace::acquired, shared);
+        }
+    }
+};
+
+
+/**
+ * @brief The shared_state_traits_lock_trace struct should record lock_trace
+ * events for a type.
+ */
+struct shared_state_traits_lock_trace: shared_state_traits_default {
+    typedef shared_state_mutex_lock_trace<> shared_state_mutex;
+};
+
+#endif // SHARED_STATE_LOCK_TRACE_H
@@ -0,0 +1,188 @@
+/**
+  This file only contains unit tests for shared_state_map.
+  This file is not required for using shared_state_map.
+
+  The tests are written so that they can be read as examples.
+  */
+
+#include "shared_state_map.h"
+#include "exceptionassert.h"
+#include "expectexception.h"
+#include "trace_perf.h"
+
+#include <future>
+#include <vector>
+#include <map>
+#include <string>
+
+using namespace std;
+
+struct Route
+{
+    string via;
+    int hops = 0;
+};
+
+// Each shard, a shared_state<Map>, uses the traits of Map
+template<>
+struct shared_state_traits<map<int,Route>>: shared_state_traits_default {
+    double timeout() { return 0.010; }
+};
+
+
+namespace shared_state_map_test {
+
+void test ()
+{
+    // It should provide locked access to single elements
+    {
+        shared_state_map<string,int> m;
+
+        EXCEPTION_ASSERT(!m.read ("a"));
+
+        *m.write ("a") = 1;
+        (*m.write ("b"))++;
+        (*m.write ("b"))++;
+
+        EXCEPTION_ASSERT(m.read ("a"));
+        EXCEPTION_ASSERT_EQUALS(*m.read ("a"), 1);
+        EXCEPTION_ASSERT_EQUALS(*m.read ("b"), 2);
+        EXCEPTION_ASSERT_EQUALS(m.size (), 2u);
+
+        EXCEPTION_ASSERT_EQUALS(m.erase ("a"), 1u);
+        EXCEPTION_ASSERT_EQUALS(m.erase ("a"), 0u);
+        EXCEPTION_ASSERT(!m.read ("a"));
+        EXCEPTION_ASSERT_EQUALS(m.size (), 1u);
+    }
+
+    // It should use the mutex and traits of the map type for each shard
+    {
+        typedef shared_state_map<int,Route,4,hash<int>,map<int,Route>> Routes;
+        Routes m;
+
+        m.write (1)->via = "a";
+        m.write (1)->hops = 2;
+
+        {
+            Routes::write_ptr w = m.write (1);
+            EXCEPTION_ASSERT_EQUALS(w->via, "a");
+
+#ifndef SHARED_STATE_NO_TIMEOUT
+            // Same key, same shard
+            EXPECT_EXCEPTION(lock_failed, m.read (1));
+            EXPECT_EXCEPTION(lock_failed, m.write (1));
+            EXPECT_EXCEPTION(lock_failed, m.read_all ());
+#endif
+
+            // Different shard
+            int other = 2;
+            while (Routes::shard_index (other) == Routes::shard_index (1))
+                other++;
+            EXCEPTION_ASSERT(!m.read (other));
+            m.write (other)->hops = 3;
+        }
+
+        EXCEPTION_ASSERT_EQUALS(m.read (1)->hops, 2);
+
+        // Shared read access within a shard
+        Routes::read_ptr r1 = m.read (1);
+        Routes::read_ptr r2 = m.read (1);
+        EXCEPTION_ASSERT_EQUALS(r1->via, r2->via);
+        r1.unlock ();
+        r2.unlock ();
+
+        // A missing key doesn't keep its shard locked
+        int missing = 2;
+        while (Routes::shard_index (missing) != Routes::shard_index (1))
+            missing++;
+        Routes::read_ptr r3 = m.read (missing);
+        EXCEPTION_ASSERT(!r3);
+        m.write (1)->hops = 4;
+        EXCEPTION_ASSERT_EQUALS(m.read (1)->hops, 4);
+    }
+
+    // It should provide a consistent view of the entire map
+    {
+        shared_state_map<int,int,8> m;
+        for (int i=0; i<100; i++)
+            *m.write (i) = i;
+
+        {
+            auto all = m.read_all ();
+            EXCEPTION_ASSERT_EQUALS(all.size (), 100u);
+
+            int n = 0, sum = 0;
+            for (const auto& kv : all)
+            {
+                EXCEPTION_ASSERT_EQUALS(kv.first, kv.second);
+                n++;
+                sum += kv.second;
+            }
+            EXCEPTION_ASSERT_EQUALS(n, 100);
+            EXCEPTION_ASSERT_EQUALS(sum, 99*100/2);
+        }
+
+        {
+            auto all = m.write_all ();
+            for (auto& kv : all)
+                kv.second = -kv.second;
+            for (unsigned i=0; i<8; i++)
+                all.shard (i).erase (0);
+        }
+
+        EXCEPTION_ASSERT_EQUALS(m.size (), 99u);
+        EXCEPTION_ASSERT_EQUALS(*m.read (5), -5);
+
+        // Empty shards are skipped
+        shared_state_map<int,int,8> e;
+        auto all = e.read_all ();
+        EXCEPTION_ASSERT(all.begin () == all.end ());
+    }
+
+    // It should let threads with different keys work concurrently
+    {
+        shared_state_map<int,int> m;
+        int N = 1000;
+        vector<future<void>> workers(4);
+        for (unsigned i=0; i<workers.size (); i++)
+            workers[i] = async(launch::async, [&m,i,N](){
+                for (int j=0; j<N; j++)
+                {
+                    (*m.write (j))++;
+                    auto w = m.write (-1 - (int)i);
+                    ++*w;
+                }
+            });
+
+        // Whole-map access from another thread, locking shards in order
+        // doesn't deadlock with the workers
+        size_t n = 0;
+        for (int j=0; j<10; j++)
+            n = max(n, m.size ());
+
+        for (unsigned i=0; i<workers.size (); i++)
+            workers[i].get ();
+
+        EXCEPTION_ASSERT_LESS_OR_EQUAL(n, N + workers.size ());
+        EXCEPTION_ASSERT_EQUALS(m.size (), N + workers.size ());
+        for (int j=0; j<N; j++)
+            EXCEPTION_ASSERT_EQUALS(*m.read (j), (int)workers.size ());
+        for (unsigned i=0; i<workers.size (); i++)
+            EXCEPTION_ASSERT_EQUALS(*m.read (-1 - (int)i), N);
+    }
+
+    // It should cause a low overhead
+    {
+        shared_state_map<int,int> m;
+        int N = 10000;
+
+        TRACE_PERF ("shared_state_map should cause a low overhead");
+        for (int i=0; i<N; i++)
+        {
+            *m.write (i&255) = i;
+            m.read (i&255);
+        }
+    }
+}
+
+} // namespace shared_state_map_test
@@ -0,0 +1,268 @@
+/**
+ * Include: shared_state_map.h, shared_state.h
+ * Library: C++11 only
+ *
+ * The shared_state_map class is a concurrent map that hashes keys to a fixed
+ * number of independently locked shards. It replaces the common pattern
+ *
+ *        shared_state<std::unordered_map<K,V>> m {new std::unordered_map<K,V>};
+ *        m.write ()->operator[] (key) = value;
+ *
+ * where all threads contend for a single lock, with
+ *
+ *        shared_state_map<K,V> m;
+ *        *m.write (key) = value;
+ *
+ * where threads only contend when their keys hash to the same shard.
+ *
+ * Each shard is a shared_state<Map> and uses the mutex, timeout and other
+ * hooks of shared_state_traits<Map>, exactly like a single
+ * shared_state<Map> would. lock_failed is thrown on timeouts.
+ *
+ *
+ * Element access
+ * --------------
+ * read(key) and write(key) lock the shard of 'key' and return a pointer to the
+ * element that keeps the lock for as long as the pointer is alive:
+ *
+ *        if (auto r = m.read (key))   // null and unlocked if 'key' is missing
+ *          r->...
+ *
+ *        {
+ *          auto w = m.write (key);    // inserts V() if 'key' is missing
+ *          w->...
+ *        }
+ *
+ * Like with shared_state, never keep more than one element pointer at a time
+ * from the same map in one thread, two keys may share a shard.
+ *
+ *
+ * Whole-map access
+ * ----------------
+ * read_all() and write_all() lock every shard, in shard order, and give a
+ * consistent view of the entire map:
+ *
+ *        auto all = m.read_all ();
+ *        for (const auto& kv : all)
+ *          ...
+ *
+ * Locking shards in the same order from all threads means that concurrent
+ * whole-map accesses don't deadlock each other.
+ *
+ * Author: johan.b.gustafsson@gmail.com
+ */
+
+#ifndef SHARED_STATE_MAP_H
+#define SHARED_STATE_MAP_H
+
+#include "shared_state.h"
+
+#include <unordered_map>
+#include <functional>
+#include <array>
+#include <iterator>
+
+template<class K, class V, unsigned Shards = 16,
+         class Hash = std::hash<K>,
+         class Map = std::unordered_map<K,V,Hash>>
+class shared_state_map final
+{
+public:
+    static_assert(0 < Shards, "shared_state_map needs at least one shard");
+
+    typedef K key_type;
+    typedef V mapped_type;
+    typedef Map map_type;
+    typedef shared_state<Map> shard_type;
+
+    /**
+     * @brief The locked_element class should keep a shard locked for as long
+     * as it points to an element in that shard.
+     */
+    template<class Lock, class T>
+    class locked_element {
+    public:
+        locked_element() : p(0) {}
+        locked_element(Lock&& lock, T* p) : l(std::move(lock)), p(p) {}
+        locked_element(locked_element&& b) : l(std::move(b.l)), p(b.p) { b.p = 0; }
+
+        locked_element(const locked_element&) = delete;
+        locked_element& operator=(const locked_element&) = delete;
+
+#ifdef _DEBUG
+        T* operator-> () const { assert(p); return p; }
+        T& operator* () const { assert(p); return *p; }
+#else
+        T* operator-> () const { return p; }
+        T& operator* () const { return *p; }
+#endif
+        T* get () const { return p; }
+        explicit operator bool() const { return (bool)p; }
+
+        void unlock() { p = 0; l.unlock (); }
+
+    private:
+        Lock l;
+        T* p;
+    };
+
+    typedef locked_element<typename shard_type::read_ptr, const V> read_ptr;
+    typedef locked_element<typename shard_type::write_ptr, V> write_ptr;
+
+
+    /**
+     * @brief The all_ptr class should keep all shards locked and iterate over
+     * all elements in all shards.
+     */
+    template<class Lock, class MapRef, class MapIterator>
+    class all_ptr {
+    public:
+        class iterator: public std::iterator<std::forward_iterator_tag, typename std::iterator_traits<MapIterator>::value_type> {
+        public:
+            iterator(const all_ptr* a, unsigned shard, MapIterator i) : a(a), shard(shard), i(i) { skip_empty (); }
+
+            typename std::iterator_traits<MapIterator>::reference operator* () const { return *i; }
+            typename std::iterator_traits<MapIterator>::pointer operator-> () const { return &*i; }
+            iterator& operator++ () { ++i; skip_empty (); return *this; }
+            iterator operator++ (int) { iterator j = *this; ++*this; return j; }
+            bool operator== (const iterator& b) const { return shard == b.shard && (shard == Shards || i == b.i); }
+            bool operator!= (const iterator& b) const { return !(*this == b); }
+
+        private:
+            void skip_empty() {
+                while (shard < Shards && i == a->locks[shard]->end ())
+                    if (++shard < Shards)
+                        i = a->locks[shard]->begin ();
+            }
+
+            const all_ptr* a;
+            unsigned shard;
+            MapIterator i;
+        };
+
+        all_ptr(all_ptr&& b) : locks(std::move(b.locks)) {}
+        all_ptr(const all_ptr&) = delete;
+        all_ptr& operator=(const all_ptr&) = delete;
+
+        iterator begin() const { return iterator(this, 0, locks[0]->begin ()); }
+        iterator end() const { return iterator(this, Shards, MapIterator()); }
+
+        size_t size() const {
+            size_t n = 0;
+            for (const Lock& l : locks)
+                n += l->size ();
+            return n;
+        }
+
+        /**
+         * @brief shard gives access to a single locked shard, e.g to modify it
+         * with the methods of Map.
+         */
+        MapRef shard(unsigned i) const { return *locks[i]; }
+
+    private:
+        friend class shared_state_map;
+        all_ptr() {}
+
+        std::array<Lock, Shards> locks;
+    };
+
+    typedef all_ptr<typename shard_type::read_ptr, const Map&, typename Map::const_iterator> read_all_ptr;
+    typedef all_ptr<typename shard_type::write_ptr, Map&, typename Map::iterator> write_all_ptr;
+
+
+    shared_state_map ()
+    {
+        for (shard_type& s : shards)
+            s.reset (new Map);
+    }
+
+    shared_state_map (const shared_state_map&) = delete;
+    shared_state_map& operator= (const shared_state_map&) = delete;
+
+    /**
+     * @brief read locks the shard of 'key' for shared read-only access. Null,
+     * and not locked, if 'key' is not in the map.
+     */
+    read_ptr read(const K& key) const {
+        typename shard_type::read_ptr r = shard (key).read ();
+        auto i = r->find (key);
+        if (i == r->end ())
+            return read_ptr();
+        const V* p = &i->second;
+        return read_ptr(std::move(r), p);
+    }
+
+    /**
+     * @brief write locks the shard of 'key' for exclusive access. Inserts a
+     * default constructed V if 'key' is not in the map.
+     */
+    write_ptr write(const K& key) const {
+        typename shard_type::write_ptr w = shard (key).write ();
+        V* p = &(*w)[key];
+        return write_ptr(std::move(w), p);
+    }
+
+    /**
+     * @brief erase removes 'key' from the map. Returns the number of removed
+     * elements.
+     */
+    size_t erase(const K& key) const {
+        return shard (key).write ()->erase (key);
+    }
+
+    /**
+     * @brief read_all locks all shards for shared read-only access.
+     */
+    read_all_ptr read_all() const {
+        read_all_ptr a;
+        for (unsigned i=0; i<Shards; i++)
+        {
+            typename shard_type::read_ptr r = shards[i].read ();
+            a.locks[i].swap (r);
+        }
+        return a;
+    }
+
+    /**
+     * @brief write_all locks all shards for exclusive access.
+     */
+    write_all_ptr write_all() const {
+        write_all_ptr a;
+        for (unsigned i=0; i<Shards; i++)
+        {
+            typename shard_type::write_ptr w = shards[i].write ();
+            a.locks[i].swap (w);
+        }
+        return a;
+    }
+
+    /**
+     * @brief size locks all shards to count the elements.
+     */
+    size_t size() const { return read_all ().size (); }
+
+    /**
+     * @brief shard returns the shard 'key' is hashed to.
+     */
+    const shard_type& shard(const K& key) const {
+        return shards[shard_index (key)];
+    }
+
+    static unsigned shard_index(const K& key) {
+        // std::hash is the identity for integers on many platforms, mix the
+        // bits before picking a shard (Fibonacci hashing).
+        unsigned long long h = Hash()(key);
+        return (unsigned)(((h * 0x9E3779B97F4A7C15ull) >> 32) % Shards);
+    }
+
+private:
+    std::array<shard_type, Shards> shards;
+};
+
+
+namespace shared_state_map_test {
+    void test ();
+}
+
+#endif // SHARED_STATE_MAP_H
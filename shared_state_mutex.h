@@ -16,6 +16,8 @@
         // Discard any timeout parameters
         bool try_lock_for(...) { lock(); return true; }
         bool try_lock_shared_for(...) { lock_shared(); return true; }
+        bool try_lock_until(...) { lock(); return true; }
+        bool try_lock_shared_until(...) { lock_shared(); return true; }
     };
 
     class shared_state_mutex_notimeout: public boost::shared_mutex {
@@ -23,6 +25,8 @@
         // Discard any timeout parameters
         bool try_lock_for(...) { lock(); return true; }
         bool try_lock_shared_for(...) { lock_shared(); return true; }
+        bool try_lock_until(...) { lock(); return true; }
+        bool try_lock_shared_until(...) { lock_shared(); return true; }
     };
 
     class shared_state_mutex_noshared: public boost::timed_mutex {
@@ -33,6 +37,9 @@
 
         template <class Rep, class Period>
         bool try_lock_shared_for(const shared_state_chrono::duration<Rep, Period>& rel_time) { return try_lock_for(rel_time); }
+
+        template <class Clock, class Duration>
+        bool try_lock_shared_until(const shared_state_chrono::time_point<Clock, Duration>& abs_time) { return try_lock_until(abs_time); }
     };
 
     typedef boost::shared_mutex shared_state_mutex_default;
@@ -58,12 +65,16 @@
 
         bool try_lock_for(...) { lock(); return true; }
         bool try_lock_shared_for(...) { lock_shared(); return true; }
+        bool try_lock_until(...) { lock(); return true; }
+        bool try_lock_shared_until(...) { lock_shared(); return true; }
     };
 
     class shared_state_mutex_notimeout: public std::shared_timed_mutex {
     public:
         bool try_lock_for(...) { lock(); return true; }
         bool try_lock_shared_for(...) { lock_shared(); return true; }
+        bool try_lock_until(...) { lock(); return true; }
+        bool try_lock_shared_until(...) { lock_shared(); return true; }
     };
 
     class shared_state_mutex_noshared: public std::timed_mutex {
@@ -74,6 +85,9 @@
 
         template <class Rep, class Period>
         bool try_lock_shared_for(const shared_state_chrono::duration<Rep, Period>& rel_time) { return try_lock_for(rel_time); }
+
+        template <class Clock, class Duration>
+        bool try_lock_shared_until(const shared_state_chrono::time_point<Clock, Duration>& abs_time) { return try_lock_until(abs_time); }
     };
 
     typedef std::shared_timed_mutex shared_state_mutex_default;
@@ -96,6 +110,8 @@ public:
 
     bool try_lock_for(...) { lock(); return true; }
     bool try_lock_shared_for(...) { lock_shared(); return true; }
+    bool try_lock_until(...) { lock(); return true; }
+    bool try_lock_shared_until(...) { lock_shared(); return true; }
 };
 
 
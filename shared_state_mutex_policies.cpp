@@ -0,0 +1,268 @@
+/**
+  This file only contains unit tests for shared_state_mutex_policies.h.
+  This file is not required for using the policies.
+  */
+
+#include "shared_state_mutex_policies.h"
+#include "shared_state.h"
+#include "exceptionassert.h"
+#include "expectexception.h"
+#include "trace_perf.h"
+
+#include <future>
+#include <atomic>
+
+using namespace std;
+
+namespace shared_state_mutex_policies_test {
+
+template<class M>
+struct with_policy
+{
+    struct shared_state_traits: shared_state_traits_default {
+        typedef M shared_state_mutex;
+        double timeout() { return 0.002; }
+    };
+
+    int v = 0;
+};
+
+
+// Waits until 'f' is blocked, or finished. Sleeping is the best we can do
+// without peeking into the mutex.
+static void let_block(future<void>& f)
+{
+    f.wait_for (chrono::milliseconds(3));
+}
+
+
+template<class M>
+void common_test()
+{
+    // It should provide exclusive write access and shared read access
+    {
+        M m;
+        EXCEPTION_ASSERT(m.try_lock ());
+        EXCEPTION_ASSERT(!m.try_lock ());
+        EXCEPTION_ASSERT(!m.try_lock_shared ());
+        m.unlock ();
+
+        EXCEPTION_ASSERT(m.try_lock_shared ());
+        EXCEPTION_ASSERT(m.try_lock_shared ());
+        EXCEPTION_ASSERT(!m.try_lock ());
+        m.unlock_shared ();
+        m.unlock_shared ();
+
+        m.lock ();
+        m.unlock ();
+        m.lock_shared ();
+        m.unlock_shared ();
+    }
+
+    // It should leave the mutex untouched when a lock attempt times out
+    {
+        M m;
+        m.lock_shared ();
+        EXCEPTION_ASSERT(!m.try_lock_for (chrono::milliseconds(1)));
+        EXCEPTION_ASSERT(!m.try_lock_until (chrono::steady_clock::now () + chrono::milliseconds(1)));
+        EXCEPTION_ASSERT(m.try_lock_shared_for (chrono::milliseconds(1)));
+        m.unlock_shared ();
+        m.unlock_shared ();
+
+        m.lock ();
+        EXCEPTION_ASSERT(!m.try_lock_shared_for (chrono::milliseconds(1)));
+        EXCEPTION_ASSERT(!m.try_lock_shared_until (chrono::system_clock::now () + chrono::milliseconds(1)));
+        m.unlock ();
+
+        EXCEPTION_ASSERT(m.try_lock ());
+        m.unlock ();
+    }
+
+    // It should wake up waiters when the lock is released
+    {
+        M m;
+        m.lock ();
+        future<void> f = async(launch::async, [&m](){
+            m.lock_shared ();
+            m.unlock_shared ();
+            m.lock ();
+            m.unlock ();
+        });
+
+        let_block (f);
+        m.unlock ();
+        f.get ();
+    }
+
+    // It should be selectable through shared_state_traits
+    {
+        shared_state<with_policy<M>> s {new with_policy<M>};
+        s->v = 1;
+        EXCEPTION_ASSERT_EQUALS(s.read ()->v, 1);
+
+        auto w = s.write ();
+#ifndef SHARED_STATE_NO_TIMEOUT
+        EXPECT_EXCEPTION(lock_failed, s.read ());
+        EXPECT_EXCEPTION(lock_failed, s.write ());
+#endif
+        w.unlock ();
+
+        int N = 8;
+        atomic<int> sum{0};
+        vector<future<void>> workers(4);
+        for (unsigned i=0; i<workers.size (); i++)
+            workers[i] = async(launch::async, [&s,&sum,N](){
+                for (int j=0; j<N; j++)
+                {
+                    // SHARED_STATE_NO_TIMEOUT would block indefinitely,
+                    // otherwise the timeout might trigger on a busy machine.
+                    while (true) try {
+                        if (j%2)
+                            sum += s.read ()->v;
+                        else
+                            s.write ()->v++;
+                        break;
+                    } catch (const lock_failed&) {}
+                }
+            });
+
+        for (unsigned i=0; i<workers.size (); i++)
+            workers[i].get ();
+
+        EXCEPTION_ASSERT_EQUALS(s.read ()->v, 1 + N/2*(int)workers.size ());
+    }
+}
+
+
+void test ()
+{
+    common_test<shared_state_mutex_writer_preferring>();
+    common_test<shared_state_mutex_reader_preferring>();
+    common_test<shared_state_mutex_phase_fair>();
+    common_test<shared_state_mutex_task_fair>();
+
+    // shared_state_mutex_writer_preferring should block new readers as soon as
+    // a writer is waiting
+    {
+        shared_state_mutex_writer_preferring m;
+        m.lock_shared ();
+        future<void> w = async(launch::async, [&m](){ m.lock (); m.unlock (); });
+        let_block (w);
+        EXCEPTION_ASSERT(!m.try_lock_shared ());
+        m.unlock_shared ();
+        w.get ();
+        EXCEPTION_ASSERT(m.try_lock_shared ());
+        m.unlock_shared ();
+    }
+
+    // shared_state_mutex_reader_preferring should admit readers whenever no
+    // writer holds the lock
+    {
+        shared_state_mutex_reader_preferring m;
+        m.lock_shared ();
+        future<void> w = async(launch::async, [&m](){ m.lock (); m.unlock (); });
+        let_block (w);
+        EXCEPTION_ASSERT(m.try_lock_shared ());
+        m.unlock_shared ();
+        m.unlock_shared ();
+        w.get ();
+    }
+
+    // shared_state_mutex_phase_fair should alternate between reader phases and
+    // writer phases
+    {
+        shared_state_mutex_phase_fair m;
+        vector<int> order;
+        mutex order_lock;
+        auto log = [&](int i){ unique_lock<mutex> l(order_lock); order.push_back (i); };
+
+        m.lock_shared ();
+        future<void> w1 = async(launch::async, [&](){ m.lock (); log(1); m.unlock (); });
+        let_block (w1);
+
+        // A new reader is blocked by the waiting writer ...
+        EXCEPTION_ASSERT(!m.try_lock_shared ());
+        future<void> r2 = async(launch::async, [&](){ m.lock_shared (); log(2); m.unlock_shared (); });
+        let_block (r2);
+        future<void> w3 = async(launch::async, [&](){ m.lock (); log(3); m.unlock (); });
+        let_block (w3);
+
+        // ... and admitted right after the first writer phase, before the
+        // second writer.
+        m.unlock_shared ();
+        w1.get ();
+        r2.get ();
+        w3.get ();
+
+        EXCEPTION_ASSERT_EQUALS(order.size (), 3u);
+        EXCEPTION_ASSERT_EQUALS(order[0], 1);
+        EXCEPTION_ASSERT_EQUALS(order[1], 2);
+        EXCEPTION_ASSERT_EQUALS(order[2], 3);
+
+        // A writer that gives up starts a reader phase for blocked readers
+        m.lock_shared ();
+        future<void> w4 = async(launch::async, [&](){ EXCEPTION_ASSERT(!m.try_lock_for (chrono::milliseconds(20))); });
+        let_block (w4);
+        EXCEPTION_ASSERT(!m.try_lock_shared ());
+        EXCEPTION_ASSERT(m.try_lock_shared_for (chrono::milliseconds(100)));
+        w4.get ();
+        m.unlock_shared ();
+        m.unlock_shared ();
+    }
+
+    // shared_state_mutex_task_fair should grant the lock in FIFO order
+    {
+        shared_state_mutex_task_fair m;
+        vector<int> order;
+        mutex order_lock;
+        auto log = [&](int i){ unique_lock<mutex> l(order_lock); order.push_back (i); };
+
+        m.lock_shared ();
+        future<void> w1 = async(launch::async, [&](){ m.lock (); log(1); m.unlock (); });
+        let_block (w1);
+        future<void> r2 = async(launch::async, [&](){ m.lock_shared (); log(2); m.unlock_shared (); });
+        let_block (r2);
+
+        // A reader that arrives after a writer has to wait for the writer
+        EXCEPTION_ASSERT(!m.try_lock_shared ());
+        m.unlock_shared ();
+        w1.get ();
+        r2.get ();
+
+        EXCEPTION_ASSERT_EQUALS(order.size (), 2u);
+        EXCEPTION_ASSERT_EQUALS(order[0], 1);
+        EXCEPTION_ASSERT_EQUALS(order[1], 2);
+
+        // A writer that leaves the queue lets the readers behind it through
+        m.lock_shared ();
+        future<void> w3 = async(launch::async, [&](){ EXCEPTION_ASSERT(!m.try_lock_for (chrono::milliseconds(20))); });
+        let_block (w3);
+        EXCEPTION_ASSERT(m.try_lock_shared_for (chrono::milliseconds(100)));
+        w3.get ();
+        m.unlock_shared ();
+        m.unlock_shared ();
+    }
+
+    // The policies should cause a low overhead without contention
+    {
+        int N = 10000;
+        shared_state_mutex_writer_preferring wp;
+        shared_state_mutex_reader_preferring rp;
+        shared_state_mutex_phase_fair pf;
+        shared_state_mutex_task_fair tf;
+
+        TRACE_PERF ("shared_state_mutex_writer_preferring should cause a low overhead");
+        for (int i=0; i<N; i++) { wp.lock (); wp.unlock (); wp.lock_shared (); wp.unlock_shared (); }
+
+        trace_perf_.reset ("shared_state_mutex_reader_preferring should cause a low overhead");
+        for (int i=0; i<N; i++) { rp.lock (); rp.unlock (); rp.lock_shared (); rp.unlock_shared (); }
+
+        trace_perf_.reset ("shared_state_mutex_phase_fair should cause a low overhead");
+        for (int i=0; i<N; i++) { pf.lock (); pf.unlock (); pf.lock_shared (); pf.unlock_shared (); }
+
+        trace_perf_.reset ("shared_state_mutex_task_fair should cause a low overhead");
+        for (int i=0; i<N; i++) { tf.lock (); tf.unlock (); tf.lock_shared (); tf.unlock_shared (); }
+    }
+}
+
+} // namespace shared_state_mutex_policies_test
@@ -0,0 +1,480 @@
+#ifndef SHARED_STATE_MUTEX_POLICIES_H
+#define SHARED_STATE_MUTEX_POLICIES_H
+
+#include "shared_state_mutex.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <list>
+
+/**
+ * Read-write mutexes with selectable scheduling policies for shared_state.
+ *
+ * The default shared_state_mutex prefers writers, a pending writer blocks new
+ * readers. Under a flood of readers that protects writers but costs reader
+ * tail latency, and with rare readers and frequent writers the opposite
+ * trade-off is often better. Pick a policy per type through traits:
+ *
+ *        class MyType {
+ *        public:
+ *            struct shared_state_traits: shared_state_traits_default {
+ *                typedef shared_state_mutex_phase_fair shared_state_mutex;
+ *            };
+ *            ...
+ *        };
+ *
+ *   - shared_state_mutex_writer_preferring: a waiting writer blocks new
+ *     readers. Readers may starve.
+ *   - shared_state_mutex_reader_preferring: readers are admitted whenever no
+ *     writer holds the lock, and waiting readers go before waiting writers.
+ *     Writers may starve.
+ *   - shared_state_mutex_phase_fair: reader and writer phases alternate. A
+ *     reader waits for at most one writer phase and a writer waits for at most
+ *     one reader phase (plus the writers queued before it).
+ *   - shared_state_mutex_task_fair: strict FIFO, consecutive readers in the
+ *     queue share the lock.
+ *
+ * All policies support the same timed interface as shared_state_mutex,
+ * including try_lock_until and try_lock_shared_until. A lock attempt that
+ * times out leaves the mutex as if it had never been requested.
+ *
+ * See benchmark/shared_state_mutex_benchmark.cpp for acquisition latency
+ * percentiles of each policy under mixed loads.
+ */
+
+namespace shared_state_mutex_policies_detail {
+
+typedef std::chrono::steady_clock clock;
+
+template<class Clock, class Duration>
+clock::time_point to_steady(const std::chrono::time_point<Clock, Duration>& abs_time)
+{
+    return clock::now () + std::chrono::duration_cast<clock::duration>(abs_time - Clock::now ());
+}
+
+#ifdef SHARED_STATE_BOOST_MUTEX
+template<class Clock, class Duration>
+clock::time_point to_steady(const boost::chrono::time_point<Clock, Duration>& abs_time)
+{
+    boost::chrono::duration<double> d = abs_time - Clock::now ();
+    return clock::now () + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(d.count ()));
+}
+#endif
+
+/**
+ * Waits on 'cv' until 'ready' returns true. Blocks indefinitely if 'deadline'
+ * is null. Returns the value of 'ready' when the deadline has passed.
+ */
+template<class Pred>
+bool wait(std::unique_lock<std::mutex>& lk, std::condition_variable& cv, const clock::time_point* deadline, Pred ready)
+{
+    while (!ready ())
+    {
+        if (!deadline)
+            cv.wait (lk);
+        else if (std::cv_status::timeout == cv.wait_until (lk, *deadline))
+            return ready ();
+    }
+    return true;
+}
+
+
+/**
+ * The policy_base class implements the public mutex interface expected by
+ * shared_state in terms of
+ *
+ *   bool acquire (bool shared, const clock::time_point* deadline);
+ *   bool try_acquire (bool shared);
+ *   void release (bool shared);
+ *
+ * in the derived class.
+ */
+template<class Derived>
+class policy_base {
+public:
+    policy_base() {}
+    policy_base(const policy_base&) = delete;
+    policy_base& operator=(const policy_base&) = delete;
+
+    void lock() { derived ().acquire (false, nullptr); }
+    bool try_lock() { return derived ().try_acquire (false); }
+    void unlock() { derived ().release (false); }
+
+    void lock_shared() { derived ().acquire (true, nullptr); }
+    bool try_lock_shared() { return derived ().try_acquire (true); }
+    void unlock_shared() { derived ().release (true); }
+
+    template <class Rep, class Period>
+    bool try_lock_for(const std::chrono::duration<Rep, Period>& rel_time) {
+        return try_lock_until (clock::now () + rel_time);
+    }
+
+    template <class Clock, class Duration>
+    bool try_lock_until(const std::chrono::time_point<Clock, Duration>& abs_time) {
+        clock::time_point deadline = to_steady (abs_time);
+        return derived ().acquire (false, &deadline);
+    }
+
+    template <class Rep, class Period>
+    bool try_lock_shared_for(const std::chrono::duration<Rep, Period>& rel_time) {
+        return try_lock_shared_until (clock::now () + rel_time);
+    }
+
+    template <class Clock, class Duration>
+    bool try_lock_shared_until(const std::chrono::time_point<Clock, Duration>& abs_time) {
+        clock::time_point deadline = to_steady (abs_time);
+        return derived ().acquire (true, &deadline);
+    }
+
+#ifdef SHARED_STATE_BOOST_MUTEX
+    template <class Rep, class Period>
+    bool try_lock_for(const boost::chrono::duration<Rep, Period>& rel_time) {
+        return try_lock_until (boost::chrono::steady_clock::now () + rel_time);
+    }
+
+    template <class Clock, class Duration>
+    bool try_lock_until(const boost::chrono::time_point<Clock, Duration>& abs_time) {
+        clock::time_point deadline = to_steady (abs_time);
+        return derived ().acquire (false, &deadline);
+    }
+
+    template <class Rep, class Period>
+    bool try_lock_shared_for(const boost::chrono::duration<Rep, Period>& rel_time) {
+        return try_lock_shared_until (boost::chrono::steady_clock::now () + rel_time);
+    }
+
+    template <class Clock, class Duration>
+    bool try_lock_shared_until(const boost::chrono::time_point<Clock, Duration>& abs_time) {
+        clock::time_point deadline = to_steady (abs_time);
+        return derived ().acquire (true, &deadline);
+    }
+#endif
+
+private:
+    Derived& derived() { return static_cast<Derived&>(*this); }
+};
+
+} // namespace shared_state_mutex_policies_detail
+
+
+/**
+ * @brief The shared_state_mutex_writer_preferring class should block new
+ * readers as soon as a writer is waiting.
+ */
+class shared_state_mutex_writer_preferring
+        : public shared_state_mutex_policies_detail::policy_base<shared_state_mutex_writer_preferring>
+{
+public:
+    bool try_acquire(bool shared) {
+        std::unique_lock<std::mutex> lk(m_);
+        return shared ? try_shared () : try_exclusive ();
+    }
+
+    bool acquire(bool shared, const shared_state_mutex_policies_detail::clock::time_point* deadline) {
+        std::unique_lock<std::mutex> lk(m_);
+
+        if (shared)
+            return shared_state_mutex_policies_detail::wait (lk, readers_cv_, deadline, [this]{ return try_shared (); });
+
+        writers_waiting_++;
+        bool ok = shared_state_mutex_policies_detail::wait (lk, writers_cv_, deadline, [this]{ return try_exclusive (); });
+        writers_waiting_--;
+        if (!ok && 0 == writers_waiting_)
+            readers_cv_.notify_all ();
+        return ok;
+    }
+
+    void release(bool shared) {
+        std::unique_lock<std::mutex> lk(m_);
+        if (!shared)
+            writer_ = false;
+        else if (0 < --readers_)
+            return;
+
+        if (writers_waiting_)
+            writers_cv_.notify_one ();
+        else
+            readers_cv_.notify_all ();
+    }
+
+private:
+    bool try_shared() {
+        if (writer_ || writers_waiting_)
+            return false;
+        readers_++;
+        return true;
+    }
+
+    bool try_exclusive() {
+        if (writer_ || readers_)
+            return false;
+        writer_ = true;
+        return true;
+    }
+
+    std::mutex m_;
+    std::condition_variable readers_cv_;
+    std::condition_variable writers_cv_;
+    unsigned readers_ = 0;
+    unsigned writers_waiting_ = 0;
+    bool writer_ = false;
+};
+
+
+/**
+ * @brief The shared_state_mutex_reader_preferring class should admit readers
+ * whenever no writer holds the lock and let waiting readers go before waiting
+ * writers.
+ */
+class shared_state_mutex_reader_preferring
+        : public shared_state_mutex_policies_detail::policy_base<shared_state_mutex_reader_preferring>
+{
+public:
+    bool try_acquire(bool shared) {
+        std::unique_lock<std::mutex> lk(m_);
+        return shared ? try_shared () : try_exclusive ();
+    }
+
+    bool acquire(bool shared, const shared_state_mutex_policies_detail::clock::time_point* deadline) {
+        std::unique_lock<std::mutex> lk(m_);
+
+        if (!shared)
+            return shared_state_mutex_policies_detail::wait (lk, writers_cv_, deadline, [this]{ return try_exclusive (); });
+
+        readers_waiting_++;
+        bool ok = shared_state_mutex_policies_detail::wait (lk, readers_cv_, deadline, [this]{ return try_shared (); });
+        readers_waiting_--;
+        if (!ok && 0 == readers_waiting_ && 0 == readers_ && !writer_)
+            writers_cv_.notify_one ();
+        return ok;
+    }
+
+    void release(bool shared) {
+        std::unique_lock<std::mutex> lk(m_);
+        if (!shared)
+            writer_ = false;
+        else if (0 < --readers_)
+            return;
+
+        if (readers_waiting_)
+            readers_cv_.notify_all ();
+        else
+            writers_cv_.notify_one ();
+    }
+
+private:
+    bool try_shared() {
+        if (writer_)
+            return false;
+        readers_++;
+        return true;
+    }
+
+    bool try_exclusive() {
+        if (writer_ || readers_ || readers_waiting_)
+            return false;
+        writer_ = true;
+        return true;
+    }
+
+    std::mutex m_;
+    std::condition_variable readers_cv_;
+    std::condition_variable writers_cv_;
+    unsigned readers_ = 0;
+    unsigned readers_waiting_ = 0;
+    bool writer_ = false;
+};
+
+
+/**
+ * @brief The shared_state_mutex_phase_fair class should alternate between
+ * reader phases and writer phases.
+ *
+ * Readers that arrive while a writer holds or waits for the lock are blocked
+ * until the end of the next writer phase. They are then all admitted at once,
+ * before any other writer. New readers that arrive during that reader phase
+ * are blocked if a writer is waiting, so the reader phase ends when the
+ * admitted readers are done.
+ *
+ * Based on the phase-fair reader-writer lock by Brandenburg and Anderson.
+ */
+class shared_state_mutex_phase_fair
+        : public shared_state_mutex_policies_detail::policy_base<shared_state_mutex_phase_fair>
+{
+public:
+    bool try_acquire(bool shared) {
+        std::unique_lock<std::mutex> lk(m_);
+        if (shared)
+        {
+            if (writer_ || writers_waiting_)
+                return false;
+            readers_++;
+            return true;
+        }
+
+        return try_exclusive ();
+    }
+
+    bool acquire(bool shared, const shared_state_mutex_policies_detail::clock::time_point* deadline) {
+        std::unique_lock<std::mutex> lk(m_);
+
+        if (shared)
+        {
+            if (!writer_ && !writers_waiting_)
+            {
+                readers_++;
+                return true;
+            }
+
+            // Wait for the next reader phase. The releasing writer counts
+            // this reader in 'readers_' before bumping 'phase_'.
+            unsigned phase = phase_;
+            readers_blocked_++;
+            bool ok = shared_state_mutex_policies_detail::wait (lk, readers_cv_, deadline, [this,phase]{ return phase != phase_; });
+            if (!ok)
+                readers_blocked_--;
+            return ok;
+        }
+
+        writers_waiting_++;
+        bool ok = shared_state_mutex_policies_detail::wait (lk, writers_cv_, deadline, [this]{ return try_exclusive (); });
+        writers_waiting_--;
+        if (!ok && 0 == writers_waiting_ && !writer_)
+            start_reader_phase ();
+        return ok;
+    }
+
+    void release(bool shared) {
+        std::unique_lock<std::mutex> lk(m_);
+        if (shared)
+        {
+            if (0 == --readers_)
+                writers_cv_.notify_one ();
+            return;
+        }
+
+        writer_ = false;
+        if (readers_blocked_)
+            start_reader_phase ();
+        else
+            writers_cv_.notify_one ();
+    }
+
+private:
+    bool try_exclusive() {
+        if (writer_ || readers_)
+            return false;
+        writer_ = true;
+        return true;
+    }
+
+    void start_reader_phase() {
+        readers_ += readers_blocked_;
+        readers_blocked_ = 0;
+        phase_++;
+        readers_cv_.notify_all ();
+    }
+
+    std::mutex m_;
+    std::condition_variable readers_cv_;
+    std::condition_variable writers_cv_;
+    unsigned readers_ = 0;
+    unsigned readers_blocked_ = 0;
+    unsigned writers_waiting_ = 0;
+    unsigned phase_ = 0;
+    bool writer_ = false;
+};
+
+
+/**
+ * @brief The shared_state_mutex_task_fair class should grant the lock in
+ * strict FIFO order. Consecutive readers in the queue share the lock.
+ */
+class shared_state_mutex_task_fair
+        : public shared_state_mutex_policies_detail::policy_base<shared_state_mutex_task_fair>
+{
+public:
+    bool try_acquire(bool shared) {
+        std::unique_lock<std::mutex> lk(m_);
+        if (!queue_.empty () || !compatible (shared))
+            return false;
+        take (shared);
+        return true;
+    }
+
+    bool acquire(bool shared, const shared_state_mutex_policies_detail::clock::time_point* deadline) {
+        std::unique_lock<std::mutex> lk(m_);
+        if (queue_.empty () && compatible (shared))
+        {
+            take (shared);
+            return true;
+        }
+
+        waiter w{shared, false};
+        auto i = queue_.insert (queue_.end (), &w);
+        bool ok = shared_state_mutex_policies_detail::wait (lk, cv_, deadline, [&w]{ return w.granted; });
+        if (!ok)
+        {
+            // A writer leaving the head of the queue may unblock readers
+            // behind it.
+            queue_.erase (i);
+            grant ();
+        }
+        return ok;
+    }
+
+    void release(bool shared) {
+        std::unique_lock<std::mutex> lk(m_);
+        if (shared)
+            readers_--;
+        else
+            writer_ = false;
+        grant ();
+    }
+
+private:
+    struct waiter {
+        bool shared;
+        bool granted;
+    };
+
+    bool compatible(bool shared) const {
+        return shared ? !writer_ : !writer_ && !readers_;
+    }
+
+    void take(bool shared) {
+        if (shared)
+            readers_++;
+        else
+            writer_ = true;
+    }
+
+    void grant() {
+        bool any = false;
+        while (!queue_.empty () && compatible (queue_.front ()->shared))
+        {
+            waiter* w = queue_.front ();
+            queue_.pop_front ();
+            take (w->shared);
+            w->granted = true;
+            any = true;
+        }
+
+        if (any)
+            cv_.notify_all ();
+    }
+
+    std::mutex m_;
+    std::condition_variable cv_;
+    std::list<waiter*> queue_;
+    unsigned readers_ = 0;
+    bool writer_ = false;
+};
+
+
+namespace shared_state_mutex_policies_test {
+    void test ();
+}
+
+#endif // SHARED_STATE_MUTEX_POLICIES_H
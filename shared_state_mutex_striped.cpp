@@ -0,0 +1,276 @@
+#include "shared_state_mutex_striped.h"
+#include "shared_state.h"
+#include "exceptionassert.h"
+#include "expectexception.h"
+#include "trace_perf.h"
+
+#include <vector>
+#include <future>
+
+using namespace std;
+
+namespace shared_state_mutex_striped_detail {
+
+struct held_object {
+    const void* stripe;
+    const void* object;
+    // How the stripe is held, not how the object was requested
+    bool shared_stripe;
+};
+
+// The locks held by this thread, most recent last. Rarely more than a few.
+static thread_local vector<held_object> held;
+
+
+enter_result enter (const void* stripe, const void* object, bool shared)
+{
+    bool held_stripe = false, shared_stripe = false;
+    for (const held_object& h : held)
+    {
+        if (h.stripe != stripe)
+            continue;
+
+        held_stripe = true;
+        shared_stripe = h.shared_stripe;
+
+        // Only recursive reads are allowed on the same object
+        if (!shared_stripe && h.object == object)
+            return enter_impossible;
+    }
+
+    if (!held_stripe)
+        return enter_first;
+
+    // Can't upgrade a shared stripe
+    if (shared_stripe && !shared)
+        return enter_impossible;
+
+    held.push_back (held_object{stripe, object, shared_stripe});
+    return enter_recursive;
+}
+
+
+void entered (const void* stripe, const void* object, bool shared)
+{
+    if (held.capacity () == 0)
+        held.reserve (16);
+    held.push_back (held_object{stripe, object, shared});
+}
+
+
+leave_result leave (const void* stripe, const void* object)
+{
+    auto i = held.end ();
+    while (i != held.begin () && ((--i)->stripe != stripe || i->object != object))
+        {}
+
+    EXCEPTION_ASSERTX(i != held.end () && i->stripe == stripe && i->object == object,
+                      "shared_state_mutex_striped: unlock without a lock in this thread");
+    bool shared_stripe = i->shared_stripe;
+    held.erase (i);
+
+    for (const held_object& h : held)
+        if (h.stripe == stripe)
+            return leave_held;
+    return shared_stripe ? leave_shared : leave_exclusive;
+}
+
+} // namespace shared_state_mutex_striped_detail
+
+
+namespace shared_state_mutex_striped_test {
+
+// A single stripe makes all objects share a lock
+typedef shared_state_mutex_striped<1> one_stripe;
+
+struct Small
+{
+    struct shared_state_traits: shared_state_traits_default {
+        typedef one_stripe shared_state_mutex;
+        double timeout() { return 0.002; }
+    };
+
+    int v = 0;
+};
+
+
+struct Plain
+{
+    int v = 0;
+};
+
+
+struct Striped
+{
+    struct shared_state_traits: shared_state_traits_default {
+        typedef shared_state_mutex_striped<> shared_state_mutex;
+    };
+
+    int v = 0;
+};
+
+
+void test ()
+{
+    // It should not store a lock in each object
+    {
+        EXCEPTION_ASSERT_LESS(sizeof(shared_state_details<Striped>), sizeof(shared_state_details<Plain>));
+        EXCEPTION_ASSERT_EQUALS(sizeof(shared_state_mutex_striped<>), 1u);
+    }
+
+    // It should keep the read-write semantics of the stripe mutex
+    {
+        shared_state<Small> a {new Small};
+
+        {
+            auto r1 = a.read ();
+            auto r2 = a.read ();
+#ifndef SHARED_STATE_NO_TIMEOUT
+            EXPECT_EXCEPTION(lock_failed, a.write ());
+#endif
+        }
+
+        {
+            auto w = a.write ();
+            w->v = 1;
+#ifndef SHARED_STATE_NO_TIMEOUT
+            EXPECT_EXCEPTION(lock_failed, a.read ());
+            EXPECT_EXCEPTION(lock_failed, a.write ());
+#endif
+        }
+
+        EXCEPTION_ASSERT_EQUALS(a.read ()->v, 1);
+    }
+
+    // It should let a thread lock other objects in a stripe it already holds
+    {
+        shared_state<Small> a {new Small}, b {new Small};
+
+        auto wa = a.write ();
+        auto wb = b.write ();
+        auto rb = b.try_read (); // but not the same object twice
+        EXCEPTION_ASSERT(!rb);
+        wb->v = wa->v + 1;
+    }
+
+    // It should handle recursive locking on a shared stripe
+    {
+        shared_state<Small> a {new Small}, b {new Small};
+
+        {
+            auto wa = a.write ();
+            auto rb = b.read ();
+            wa->v = rb->v + 1;
+        }
+
+        {
+            auto ra = a.read ();
+            auto rb = b.read ();
+            auto ra2 = a.read ();
+            EXCEPTION_ASSERT_EQUALS(ra->v, 1);
+
+#ifndef SHARED_STATE_NO_TIMEOUT
+            // Can't upgrade a shared stripe
+            EXPECT_EXCEPTION(lock_failed, b.write ());
+#endif
+        }
+
+        // The stripe is released when the last object is released, in any
+        // order
+        {
+            auto wa = a.write ();
+            auto wb = b.write ();
+            wa.unlock ();
+
+            future<bool> f = async(launch::async, [&a](){ return (bool)a.try_read (); });
+            EXCEPTION_ASSERT(!f.get ());
+
+            wb.unlock ();
+            f = async(launch::async, [&a](){ return (bool)a.try_read (); });
+            EXCEPTION_ASSERT(f.get ());
+        }
+
+        // A read under a stripe held exclusively releases the stripe as
+        // held, not as a read, when it's the last one released
+        {
+            auto wa = a.write ();
+            auto rb = b.read ();
+            wa.unlock ();
+
+            future<bool> f = async(launch::async, [&a](){ return (bool)a.try_read (); });
+            EXCEPTION_ASSERT(!f.get ());
+
+            rb.unlock ();
+            f = async(launch::async, [&a](){ return (bool)a.try_write (); });
+            EXCEPTION_ASSERT(f.get ());
+            f = async(launch::async, [&a](){ return (bool)a.try_read (); });
+            EXCEPTION_ASSERT(f.get ());
+        }
+
+        one_stripe m;
+        m.lock_shared ();
+        EXPECT_EXCEPTION(std::system_error, m.lock ());
+        m.unlock_shared ();
+    }
+
+    // It should share a lock between objects in the same stripe from
+    // different threads, and keep the timeout
+    {
+        shared_state<Small> a {new Small}, b {new Small};
+
+        auto wa = a.write ();
+        future<void> f = async(launch::async, [&b](){
+#ifndef SHARED_STATE_NO_TIMEOUT
+            EXPECT_EXCEPTION(lock_failed, b.write ());
+#endif
+            EXCEPTION_ASSERT(!b.try_read ());
+        });
+        f.get ();
+        wa.unlock ();
+
+        f = async(launch::async, [&b](){ b.write ()->v = 2; });
+        f.get ();
+        EXCEPTION_ASSERT_EQUALS(b.read ()->v, 2);
+    }
+
+    // It should protect objects that are accessed concurrently
+    {
+        vector<shared_state<Striped>> objects;
+        for (int i=0; i<64; i++)
+            objects.push_back (shared_state<Striped>{new Striped});
+
+        int N = 1000;
+        vector<future<void>> workers(4);
+        for (unsigned i=0; i<workers.size (); i++)
+            workers[i] = async(launch::async, [&objects,N](){
+                for (int j=0; j<N; j++)
+                {
+                    objects[j % objects.size ()].write ()->v++;
+                    objects[(j*7+1) % objects.size ()].write ()->v++;
+                }
+            });
+
+        for (unsigned i=0; i<workers.size (); i++)
+            workers[i].get ();
+
+        int sum = 0;
+        for (auto& o : objects)
+            sum += o.read ()->v;
+        EXCEPTION_ASSERT_EQUALS(sum, 2*N*(int)workers.size ());
+    }
+
+    // It should cause a low overhead
+    {
+        shared_state<Striped> a {new Striped};
+        int N = 10000;
+
+        TRACE_PERF ("shared_state_mutex_striped should cause a low overhead");
+        for (int i=0; i<N; i++)
+        {
+            a.write ()->v++;
+            a.read ();
+        }
+    }
+}
+
+} // namespace shared_state_mutex_striped_test
@@ -0,0 +1,206 @@
+#ifndef SHARED_STATE_MUTEX_STRIPED_H
+#define SHARED_STATE_MUTEX_STRIPED_H
+
+#include "shared_state_mutex.h"
+
+#include <system_error>
+
+/**
+ * A striped lock pool for shared_state.
+ *
+ * Each shared_state instance normally owns a shared_state_mutex, which is
+ * larger than many of the types it protects. shared_state_mutex_striped has
+ * no state of its own. Instead it hashes its address into a global pool of
+ * 'Stripes' cache-aligned locks. Select it per type through traits:
+ *
+ *        class MyType {
+ *        public:
+ *            struct shared_state_traits: shared_state_traits_default {
+ *                typedef shared_state_mutex_striped<> shared_state_mutex;
+ *            };
+ *            ...
+ *        };
+ *
+ * Objects that share a stripe also share a lock, trading some false
+ * contention for memory. Each distinct 'Stripes' has its own pool and
+ * 'Mutex' decides the read-write and timeout semantics of the stripes.
+ *
+ * Holding a lock on one object and then locking another object in the same
+ * stripe, from the same thread, would dead-lock with a plain mutex. This is
+ * handled by keeping track of the stripes held by each thread:
+ *
+ *   - A thread that holds a stripe exclusively may lock any other object in
+ *     that stripe, for reading or writing, without waiting.
+ *   - A thread that holds a stripe for reading may read any other object in
+ *     that stripe without waiting, even if a writer is queued for the stripe.
+ *   - A thread that holds a stripe for reading can't write to another object
+ *     in that stripe. The lock attempt fails right away (shared_state throws
+ *     lock_failed) instead of waiting for a timeout that can't expire in its
+ *     favour. lock() without a timeout throws
+ *     std::errc::resource_deadlock_would_occur.
+ *   - Locking the same object twice only succeeds for recursive reads, like
+ *     with a mutex of its own, anything else fails right away.
+ *
+ * Note that a consistent locking order between objects does not give a
+ * consistent locking order between stripes. Threads that hold locks on
+ * several objects at once may time out on each other where separate locks
+ * wouldn't.
+ *
+ * A lock must be released by the same thread that acquired it.
+ */
+namespace shared_state_mutex_striped_detail {
+
+enum enter_result {
+    // The thread doesn't hold the stripe, lock it
+    enter_first,
+    // The thread holds the stripe already, the object is now locked as well
+    enter_recursive,
+    // The thread holds the stripe in a way that makes the object impossible
+    // to lock
+    enter_impossible
+};
+
+/**
+ * @brief enter should be called before locking 'object' in 'stripe'. If it
+ * returns enter_first, entered should be called after 'stripe' is locked.
+ */
+enter_result enter (const void* stripe, const void* object, bool shared);
+void entered (const void* stripe, const void* object, bool shared);
+
+enum leave_result {
+    // The thread still holds the stripe for other objects
+    leave_held,
+    // The thread held the stripe for reading, unlock it with unlock_shared
+    leave_shared,
+    // The thread held the stripe exclusively, unlock it with unlock
+    leave_exclusive
+};
+
+/**
+ * @brief leave should be called when 'object' is unlocked. Tells if and how
+ * 'stripe' should be unlocked as well, which depends on how the stripe was
+ * locked and not on how 'object' was.
+ */
+leave_result leave (const void* stripe, const void* object);
+
+inline std::size_t mix(const void* p)
+{
+    // Fibonacci hashing, objects are aligned so the lowest bits carry no
+    // information
+    unsigned long long h = (unsigned long long)(std::size_t)p;
+    return (std::size_t)((h * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+} // namespace shared_state_mutex_striped_detail
+
+
+template<unsigned Stripes = 1024, class Mutex = shared_state_mutex>
+class shared_state_mutex_striped {
+public:
+    static_assert(0 < Stripes, "shared_state_mutex_striped needs at least one stripe");
+
+    void lock() {
+        if (!enter (false, [](Mutex& m) { m.lock (); return true; }))
+            throw std::system_error(std::make_error_code (std::errc::resource_deadlock_would_occur));
+    }
+
+    void lock_shared() {
+        if (!enter (true, [](Mutex& m) { m.lock_shared (); return true; }))
+            throw std::system_error(std::make_error_code (std::errc::resource_deadlock_would_occur));
+    }
+
+    bool try_lock() { return enter (false, [](Mutex& m) { return m.try_lock (); }); }
+    bool try_lock_shared() { return enter (true, [](Mutex& m) { return m.try_lock_shared (); }); }
+
+    template<class Duration>
+    bool try_lock_for(const Duration& d) { return enter (false, [&d](Mutex& m) { return m.try_lock_for (d); }); }
+
+    template<class Duration>
+    bool try_lock_shared_for(const Duration& d) { return enter (true, [&d](Mutex& m) { return m.try_lock_shared_for (d); }); }
+
+    template<class TimePoint>
+    bool try_lock_until(const TimePoint& t) { return enter (false, [&t](Mutex& m) { return m.try_lock_until (t); }); }
+
+    template<class TimePoint>
+    bool try_lock_shared_until(const TimePoint& t) { return enter (true, [&t](Mutex& m) { return m.try_lock_shared_until (t); }); }
+
+    void unlock() { release (); }
+    void unlock_shared() { release (); }
+
+    /**
+     * @brief stripe_index tells which stripe 'object' is hashed to.
+     */
+    static unsigned stripe_index(const void* object) {
+        return (unsigned)(shared_state_mutex_striped_detail::mix (object) % Stripes);
+    }
+
+private:
+    struct alignas(64) stripe_t {
+        Mutex m;
+    };
+
+    static stripe_t* pool() {
+        static stripe_t stripes[Stripes];
+        return stripes;
+    }
+
+    Mutex& stripe() const {
+        return pool ()[stripe_index (this)].m;
+    }
+
+    // A read of an object in a stripe held exclusively doesn't own a shared
+    // lock of the stripe, it's released as the stripe is held
+    void release() {
+        using namespace shared_state_mutex_striped_detail;
+
+        Mutex& m = stripe ();
+        switch (leave (&m, this))
+        {
+        case leave_held:
+            break;
+        case leave_shared:
+            m.unlock_shared ();
+            break;
+        case leave_exclusive:
+            m.unlock ();
+            break;
+        }
+    }
+
+    template<class F>
+    bool enter(bool shared, F f) {
+        using namespace shared_state_mutex_striped_detail;
+
+        Mutex& m = stripe ();
+        switch (shared_state_mutex_striped_detail::enter (&m, this, shared))
+        {
+        case enter_recursive:
+            return true;
+        case enter_impossible:
+            return false;
+        case enter_first:
+            break;
+        }
+
+        if (!f(m))
+            return false;
+
+        try {
+            entered (&m, this, shared);
+        } catch (...) {
+            if (shared)
+                m.unlock_shared ();
+            else
+                m.unlock ();
+            throw;
+        }
+        return true;
+    }
+};
+
+
+namespace shared_state_mutex_striped_test {
+    void test ();
+}
+
+#endif // SHARED_STATE_MUTEX_STRIPED_H
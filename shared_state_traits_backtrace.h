@@ -2,7 +2,7 @@
 #define SHARED_STATE_TRAITS_BACKTRACE_H
 
 #include "shared_state.h"
-#include "backtrace.h"
+#include "backtrace_policy.h"
 
 #include <thread>
 #include <boost/exception/all.hpp>
@@ -18,6 +18,8 @@ class lock_failed_boost
  * @brief The shared_state_traits_backtrace struct should provide backtraces on
  * lock_failed exceptions. It should issue a warning if the lock is kept too long.
  *
+ * The backtraces are limited by the budget of the type in backtrace_policy.
+ *
  * class MyType {
  * public:
  *     struct shared_state_traits: shared_state_traits_backtrace {
@@ -41,7 +43,7 @@ struct shared_state_traits_backtrace: shared_state_traits_default {
         std::this_thread::sleep_for (std::chrono::duration<double>{2*timeout()});
 
         BOOST_THROW_EXCEPTION(lock_failed_boost<T>()
-                              << Backtrace::make ());
+                              << backtrace_policy::make (typeid(T)));
     }
 
     template<class T>
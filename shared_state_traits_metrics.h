@@ -0,0 +1,134 @@
+#ifndef SHARED_STATE_TRAITS_METRICS_H
+#define SHARED_STATE_TRAITS_METRICS_H
+
+#include "shared_state.h"
+#include "shared_metrics.h"
+#include "pprof.h"
+#include "demangle.h"
+
+#include <algorithm>
+#include <chrono>
+#include <type_traits>
+
+/**
+ * @brief The shared_state_mutex_metrics class should measure how long a
+ * thread waited for 'Mutex' while shared_metrics is open or pprof collects
+ * contention.
+ *
+ * Only requests where the lock wasn't available right away are measured. The
+ * wait is left for the traits to record, they know the type of the object.
+ */
+template<class Mutex = shared_state_mutex>
+class shared_state_mutex_metrics {
+public:
+    void lock() {
+        if (!m.try_lock ())
+            request ([this](){ m.lock (); return true; });
+    }
+
+    void lock_shared() {
+        if (!m.try_lock_shared ())
+            request ([this](){ m.lock_shared (); return true; });
+    }
+
+    bool try_lock() { return m.try_lock (); }
+    bool try_lock_shared() { return m.try_lock_shared (); }
+
+    template<class Duration>
+    bool try_lock_for(const Duration& d) { return m.try_lock () || request ([&](){ return m.try_lock_for (d); }); }
+
+    template<class Duration>
+    bool try_lock_shared_for(const Duration& d) { return m.try_lock_shared () || request ([&](){ return m.try_lock_shared_for (d); }); }
+
+    template<class TimePoint>
+    bool try_lock_until(const TimePoint& t) { return m.try_lock () || request ([&](){ return m.try_lock_until (t); }); }
+
+    template<class TimePoint>
+    bool try_lock_shared_until(const TimePoint& t) { return m.try_lock_shared () || request ([&](){ return m.try_lock_shared_until (t); }); }
+
+    void unlock() { m.unlock (); }
+    void unlock_shared() { m.unlock_shared (); }
+
+    /**
+     * @brief last_wait is the wait of the latest request by this thread that
+     * had to wait, in seconds. Cleared by reading it.
+     */
+    static double last_wait() {
+        double w = wait ();
+        wait () = 0;
+        return w;
+    }
+
+private:
+    Mutex m;
+
+    static double& wait() {
+        static thread_local double w = 0;
+        return w;
+    }
+
+    template<class F>
+    bool request(F f) {
+        if (!shared_metrics::is_open () && !pprof::running (pprof::contention))
+            return f();
+
+        auto t = std::chrono::steady_clock::now ();
+        bool r = f();
+        std::chrono::duration<double> d = std::chrono::steady_clock::now () - t;
+        // Nonzero marks that this request had to wait
+        wait () = std::max(d.count (), 1e-9);
+        return r;
+    }
+};
+
+
+/**
+ * @brief The shared_state_traits_metrics struct should count lock waits and
+ * lock timeouts of a type in the shared_metrics site "lock <type>". The
+ * latencies of the site are the waits. The waits are also sampled by stack
+ * for the pprof contention profile.
+ *
+ * class MyType {
+ * public:
+ *     struct shared_state_traits: shared_state_traits_metrics {};
+ * ...
+ * };
+ */
+struct shared_state_traits_metrics: shared_state_traits_default {
+    typedef shared_state_mutex_metrics<> shared_state_mutex;
+
+    template<class T>
+    void locked (T*) {
+        double w = shared_state_mutex::last_wait ();
+        if (0 < w)
+        {
+            shared_metrics::site& s = site<T>();
+            s.record (w);
+            s.contended ();
+            pprof::record_contention (w, 1);
+        }
+    }
+
+    template<class T>
+    void timeout_failed (T* p) {
+        shared_metrics::site& s = site<T>();
+        double w = shared_state_mutex::last_wait ();
+        if (0 < w)
+        {
+            s.record (w);
+            s.contended ();
+            pprof::record_contention (w, 1);
+        }
+        s.overrun ();
+        shared_state_traits_default::timeout_failed (p);
+    }
+
+private:
+    template<class T>
+    static shared_metrics::site& site () {
+        static shared_metrics::site s("lock " + demangle (typeid(typename std::remove_const<T>::type)));
+        return s;
+    }
+};
+
+#endif // SHARED_STATE_TRAITS_METRICS_H
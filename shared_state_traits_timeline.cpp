@@ -0,0 +1,281 @@
+#include "shared_state_traits_timeline.h"
+#include "tasktimer.h"
+#include "exceptionassert.h"
+#include "trace_perf.h"
+
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include <thread>
+
+using namespace std;
+
+namespace {
+
+const char* category = "shared_state";
+
+// What the mutex saw when it was last locked by this thread, completed by the
+// traits that know the type
+struct pending_t {
+    const void* instance = 0;
+    uint64_t wait_start = 0;
+    uint64_t acquired = 0;
+    uint64_t flow = 0;
+};
+
+struct held_t {
+    const void* object;
+    const void* instance;
+    const string* type;
+    bool shared;
+    uint64_t start;
+};
+
+thread_local pending_t pending;
+thread_local vector<held_t> held;
+thread_local uint64_t session = 0;
+
+// Forgets what was seen in an earlier session of the timeline
+void sync_session()
+{
+    uint64_t s = timeline::session ();
+    if (session == s)
+        return;
+
+    session = s;
+    pending = pending_t();
+    held.clear ();
+}
+
+} // namespace
+
+
+void shared_state_timeline::
+        acquired(const void* instance, uint64_t wait_start, uint64_t flow)
+{
+    sync_session ();
+
+    pending.instance = instance;
+    pending.wait_start = wait_start;
+    pending.acquired = wait_start ? timeline::now () : 0;
+    pending.flow = flow;
+}
+
+
+void shared_state_timeline::
+        abandoned(const void* instance, uint64_t wait_start, bool shared)
+{
+    // The type is unknown as the traits are not called
+    timeline::record_span (shared ? "read lock timed out" : "write lock timed out", category,
+                           wait_start, timeline::now (), (uint64_t)(uintptr_t)instance);
+}
+
+
+uint64_t shared_state_timeline::
+        released()
+{
+    return timeline::record_flow_start (category, timeline::now ());
+}
+
+
+void shared_state_timeline::
+        locked(const void* object, const string& type, bool shared)
+{
+    sync_session ();
+
+    pending_t p = pending;
+    pending = pending_t();
+
+    uint64_t t = timeline::now ();
+    if (p.wait_start)
+    {
+        timeline::record_span ("wait " + type, category, p.wait_start, p.acquired,
+                               (uint64_t)(uintptr_t)p.instance);
+        // The flow ends in the hold span
+        if (p.flow)
+            timeline::record_flow_end (p.flow, category, t);
+    }
+
+    held.push_back (held_t{object, p.instance, &type, shared, t});
+}
+
+
+void shared_state_timeline::
+        unlocked(const void* object)
+{
+    sync_session ();
+
+    // Most recent first, read locks may be held recursively
+    for (auto i = held.rbegin (); i != held.rend (); ++i)
+    {
+        if (i->object != object)
+            continue;
+
+        timeline::record_span ((i->shared ? "read " : "write ") + *i->type, category,
+                               i->start, timeline::now (), (uint64_t)(uintptr_t)i->instance);
+        held.erase (next(i).base ());
+        return;
+    }
+}
+
+
+namespace shared_state_timeline_test {
+
+struct Timed
+{
+    struct shared_state_traits: shared_state_traits_timeline {};
+
+    int v = 0;
+};
+
+} // namespace shared_state_timeline_test
+
+using namespace shared_state_timeline_test;
+
+void shared_state_timeline::
+        test()
+{
+    // It should record nothing while disabled
+    {
+        timeline::clear ();
+        shared_state<Timed> s {new Timed};
+        s.write ()->v++;
+        s.read ();
+        EXCEPTION_ASSERT_EQUALS(timeline::events ().size (), 0u);
+    }
+
+    // It should record hold spans named by the type
+    {
+        shared_state<Timed> s {new Timed};
+        timeline::clear ();
+        timeline::enable (true);
+        {
+            TaskTimer tt("shared_state_timeline");
+            s.write ()->v++;
+            s.read ();
+        }
+        timeline::enable (false);
+
+        // Nothing waited, so no flows
+        vector<timeline::event> e = timeline::events ();
+        EXCEPTION_ASSERT_EQUALS(e.size (), 3u);
+        e.erase (remove_if(e.begin (), e.end (), [](const timeline::event& x) { return x.kind != timeline::span; }), e.end ());
+        EXCEPTION_ASSERT_EQUALS(e.size (), 3u);
+        EXCEPTION_ASSERT_EQUALS(e[0].name, "shared_state_timeline");
+        EXCEPTION_ASSERT_EQUALS(e[1].name, "write shared_state_timeline_test::Timed");
+        EXCEPTION_ASSERT_EQUALS(e[2].name, "read shared_state_timeline_test::Timed");
+        EXCEPTION_ASSERT_NOTEQUALS(e[1].id, 0u);
+        EXCEPTION_ASSERT_EQUALS(e[1].id, e[2].id);
+        EXCEPTION_ASSERT_LESS_OR_EQUAL(e[1].end_ns, e[2].start_ns);
+        EXCEPTION_ASSERT_LESS_OR_EQUAL(e[2].end_ns, e[0].end_ns);
+    }
+
+    // It should record a wait span and a flow from the thread that released
+    // the lock to the thread that waited for it
+    {
+        shared_state<Timed> s {new Timed};
+        timeline::clear ();
+        timeline::enable (true);
+
+        future<void> f;
+        {
+            atomic<bool> waiting{false};
+            auto w = s.write ();
+            f = async(launch::async, [&s, &waiting](){
+                EXCEPTION_ASSERT(!s.try_read ());
+                waiting = true;
+                s.read ();
+            });
+            while (!waiting)
+                this_thread::yield ();
+            this_thread::sleep_for (chrono::milliseconds(1));
+        }
+        f.get ();
+
+#ifndef SHARED_STATE_NO_TIMEOUT
+        // It should record requests that timed out
+        {
+            auto w = s.write ();
+            async(launch::async, [&s](){ s.try_read_for (chrono::milliseconds(1)); }).get ();
+        }
+#endif
+        timeline::enable (false);
+
+        vector<timeline::event> e = timeline::events ();
+        const timeline::event *wait = 0, *start = 0, *end = 0, *timed_out = 0;
+        for (const timeline::event& x : e)
+        {
+            if (x.kind == timeline::span && x.name == "wait shared_state_timeline_test::Timed")
+                wait = &x;
+            if (x.kind == timeline::flow_end)
+                end = &x;
+            if (x.kind == timeline::span && x.name == "read lock timed out")
+                timed_out = &x;
+        }
+
+        EXCEPTION_ASSERT(wait);
+        EXCEPTION_ASSERT(end);
+        for (const timeline::event& x : e)
+            if (x.kind == timeline::flow_start && x.id == end->id)
+                start = &x;
+        EXCEPTION_ASSERT(start);
+        EXCEPTION_ASSERT_NOTEQUALS(start->thread, end->thread);
+        EXCEPTION_ASSERT_EQUALS(wait->thread, end->thread);
+        EXCEPTION_ASSERT_LESS_OR_EQUAL(start->start_ns, wait->end_ns);
+        EXCEPTION_ASSERT_LESS_OR_EQUAL(wait->end_ns, end->start_ns);
+        EXCEPTION_ASSERT_LESS(wait->start_ns, wait->end_ns);
+
+#ifndef SHARED_STATE_NO_TIMEOUT
+        EXCEPTION_ASSERT(timed_out);
+        EXCEPTION_ASSERT_EQUALS(timed_out->id, wait->id);
+#else
+        EXCEPTION_ASSERT(!timed_out);
+#endif
+
+        string json = timeline::chrome_trace ();
+        EXCEPTION_ASSERT(json.find ("\"ph\":\"s\"") != string::npos);
+        EXCEPTION_ASSERT(json.find ("\"ph\":\"f\"") != string::npos);
+        timeline::clear ();
+    }
+
+    // It should not pair a lock with an unlock from another session
+    {
+        shared_state<Timed> s {new Timed};
+        timeline::enable (true);
+        {
+            auto w = s.write ();
+            timeline::enable (false);
+        }
+        {
+            auto w = s.write ();
+            timeline::clear ();
+            timeline::enable (true);
+        }
+        timeline::enable (false);
+
+        EXCEPTION_ASSERT_EQUALS(timeline::events ().size (), 0u);
+    }
+
+    // It should cause a low overhead while disabled
+    {
+        shared_state<Timed> s {new Timed};
+        int N = 10000;
+
+        TRACE_PERF ("shared_state_traits_timeline should cause a low overhead while disabled");
+        for (int i=0; i<N; i++)
+        {
+            s.write ()->v++;
+            s.read ();
+        }
+
+        trace_perf_.reset ("shared_state_traits_timeline should cause a low overhead while enabled");
+        timeline::enable (true);
+        for (int i=0; i<N; i++)
+        {
+            s.write ()->v++;
+            s.read ();
+        }
+        timeline::enable (false);
+        timeline::clear ();
+    }
+}
@@ -0,0 +1,169 @@
+#ifndef SHARED_STATE_TRAITS_TIMELINE_H
+#define SHARED_STATE_TRAITS_TIMELINE_H
+
+#include "shared_state.h"
+#include "timeline.h"
+#include "demangle.h"
+
+#include <atomic>
+#include <type_traits>
+
+/**
+ * @brief The shared_state_timeline class should put lock waits and lock holds
+ * on the timeline, next to the TaskTimer scopes of the same thread.
+ *
+ * A wait span is recorded when a lock wasn't available right away, from the
+ * request until the lock was acquired or the request timed out. A hold span
+ * covers the time the lock was held. Both are named by the type and tagged
+ * with the instance, the address of its mutex.
+ *
+ * When a thread had to wait, a flow is drawn from the release in the thread
+ * that held the lock to the acquisition in the waiting thread. Releases
+ * without a waiting thread don't start a flow.
+ *
+ * Used by shared_state_mutex_timeline and shared_state_traits_timeline.
+ */
+class shared_state_timeline
+{
+public:
+    /**
+     * @brief acquired is called by the mutex when it was locked by this
+     * thread. 'wait_start' is 0 if the lock was available right away.
+     */
+    static void acquired (const void* instance, std::uint64_t wait_start, std::uint64_t flow);
+
+    /**
+     * @brief abandoned is called by the mutex when a timed request gave up.
+     */
+    static void abandoned (const void* instance, std::uint64_t wait_start, bool shared);
+
+    /**
+     * @brief released is called by the mutex right before it is unlocked and
+     * returns the id of the flow to the next thread that acquires it.
+     */
+    static std::uint64_t released ();
+
+    /**
+     * @brief locked and unlocked are called by the traits with the type name.
+     */
+    static void locked (const void* object, const std::string& type, bool shared);
+    static void unlocked (const void* object);
+
+    static void test ();
+};
+
+
+/**
+ * @brief The shared_state_mutex_timeline class should inform
+ * shared_state_timeline about waits and hand-offs of 'Mutex' while the
+ * timeline is enabled.
+ */
+template<class Mutex = shared_state_mutex>
+class shared_state_mutex_timeline {
+public:
+    void lock() {
+        if (!try_lock ())
+            request (false, [this](){ m.lock (); return true; });
+    }
+
+    void lock_shared() {
+        if (!try_lock_shared ())
+            request (true, [this](){ m.lock_shared (); return true; });
+    }
+
+    bool try_lock() {
+        bool r = m.try_lock ();
+        if (r && timeline::enabled ())
+            shared_state_timeline::acquired (this, 0, 0);
+        return r;
+    }
+
+    bool try_lock_shared() {
+        bool r = m.try_lock_shared ();
+        if (r && timeline::enabled ())
+            shared_state_timeline::acquired (this, 0, 0);
+        return r;
+    }
+
+    template<class Duration>
+    bool try_lock_for(const Duration& d) { return try_lock () || request (false, [&](){ return m.try_lock_for (d); }); }
+
+    template<class Duration>
+    bool try_lock_shared_for(const Duration& d) { return try_lock_shared () || request (true, [&](){ return m.try_lock_shared_for (d); }); }
+
+    template<class TimePoint>
+    bool try_lock_until(const TimePoint& t) { return try_lock () || request (false, [&](){ return m.try_lock_until (t); }); }
+
+    template<class TimePoint>
+    bool try_lock_shared_until(const TimePoint& t) { return try_lock_shared () || request (true, [&](){ return m.try_lock_shared_until (t); }); }
+
+    void unlock() {
+        if (0 < waiting_.load (std::memory_order_relaxed) && timeline::enabled ())
+            handoff_ = shared_state_timeline::released ();
+        m.unlock ();
+    }
+
+    void unlock_shared() {
+        if (0 < waiting_.load (std::memory_order_relaxed) && timeline::enabled ())
+            handoff_ = shared_state_timeline::released ();
+        m.unlock_shared ();
+    }
+
+private:
+    Mutex m;
+    std::atomic<std::uint64_t> handoff_{0};
+    std::atomic<int> waiting_{0};
+
+    // Only called after an immediate attempt failed, so it always waits
+    template<class F>
+    bool request(bool shared, F f) {
+        if (!timeline::enabled ())
+            return f();
+
+        std::uint64_t t = timeline::now ();
+        waiting_++;
+        bool r = f();
+        waiting_--;
+        if (r)
+            shared_state_timeline::acquired (this, t, handoff_.exchange (0));
+        else
+            shared_state_timeline::abandoned (this, t, shared);
+        return r;
+    }
+};
+
+
+/**
+ * @brief The shared_state_traits_timeline struct should put lock waits and
+ * lock holds of a type on the timeline.
+ *
+ * class MyType {
+ * public:
+ *     struct shared_state_traits: shared_state_traits_timeline {};
+ * ...
+ * };
+ */
+struct shared_state_traits_timeline: shared_state_traits_default {
+    typedef shared_state_mutex_timeline<> shared_state_mutex;
+
+    template<class T>
+    void locked (T* p) {
+        if (timeline::enabled ())
+            shared_state_timeline::locked (p, type_name<T>(), std::is_const<T>::value);
+    }
+
+    template<class T>
+    void unlocked (T* p) {
+        if (timeline::enabled ())
+            shared_state_timeline::unlocked (p);
+    }
+
+private:
+    template<class T>
+    static const std::string& type_name () {
+        static const std::string name = demangle (typeid(T));
+        return name;
+    }
+};
+
+#endif // SHARED_STATE_TRAITS_TIMELINE_H
@@ -0,0 +1,159 @@
+#include "split_barrier.h"
+#include "exceptionassert.h"
+
+#include <future>
+#include <vector>
+
+using namespace std;
+
+split_barrier::arrival_token split_barrier::
+        arrive(bool& last)
+{
+    // The phase can't complete before this thread has arrived
+    arrival_token token = step_.load ();
+
+    last = remaining_.fetch_sub (1) == 1;
+    if (!last)
+        return token;
+
+    // OK, last thread to come.
+    if (completion_)
+        completion_ ();
+
+    remaining_.store (expected_.load ());
+    step_.fetch_add (1);
+
+    if (sleepers_.load ())
+    {
+        // Synchronize with threads that are about to sleep
+        { unique_lock<mutex> l(m_); }
+        cv_.notify_all ();
+    }
+    return token;
+}
+
+
+void split_barrier::
+        sleep(arrival_token token) const
+{
+    sleepers_.fetch_add (1);
+    {
+        unique_lock<mutex> l(m_);
+        while (step_.load () == token)
+            cv_.wait (l);
+    }
+    sleepers_.fetch_sub (1);
+}
+
+
+void split_barrier::
+        test()
+{
+    // It should let threads work between arrive and wait
+    {
+        unsigned N = 4, M = 100;
+        vector<atomic<unsigned>> arrived(M), worked(M);
+        for (unsigned j=0; j<M; j++)
+            arrived[j] = worked[j] = 0;
+
+        atomic<unsigned> completions{0};
+        atomic<bool> ok{true};
+
+        split_barrier b(N, [&]() {
+            // It should run the completion once per phase after all threads
+            // have arrived
+            unsigned phase = completions++;
+            if (arrived[phase] != N)
+                ok = false;
+        });
+
+        vector<future<void>> f(N);
+        for (unsigned i=0; i<N; i++)
+            f[i] = async(launch::async, [&]()
+            {
+                for (unsigned j=0; j<M; j++)
+                {
+                    arrived[j]++;
+                    auto token = b.arrive ();
+                    worked[j]++;
+                    b.wait (token);
+
+                    // The completion has run before anyone returns from wait
+                    if (completions < j + 1)
+                        ok = false;
+                }
+            });
+
+        for (auto& x : f)
+            x.get ();
+
+        EXCEPTION_ASSERT(ok);
+        EXCEPTION_ASSERT_EQUALS(completions, M);
+        for (unsigned j=0; j<M; j++)
+            EXCEPTION_ASSERT_EQUALS(worked[j], N);
+    }
+
+    // It should not block in arrive, and wait should return right away once
+    // the phase is completed
+    {
+        split_barrier b(2);
+        auto t0 = b.arrive ();
+        auto t1 = b.arrive ();
+        EXCEPTION_ASSERT_EQUALS(t0, t1);
+        b.wait (t0);
+        b.wait (t1);
+        EXCEPTION_ASSERT_NOTEQUALS(b.arrive (), t0);
+    }
+
+    // It should let the last thread to come return true from arrive_and_wait
+    {
+        unsigned N = 3, M = 100;
+        split_barrier b(N);
+        vector<atomic<unsigned>> returned_true(M);
+        for (auto& x : returned_true)
+            x = 0;
+
+        vector<future<void>> f(N);
+        for (unsigned i=0; i<N; i++)
+            f[i] = async(launch::async, [&]()
+            {
+                for (unsigned j=0; j<M; j++)
+                    if (b.arrive_and_wait ())
+                        returned_true[j]++;
+            });
+
+        for (auto& x : f)
+            x.get ();
+
+        for (unsigned j=0; j<M; j++)
+            EXCEPTION_ASSERT_EQUALS(returned_true[j], 1u);
+    }
+
+    // It should let threads leave with arrive_and_drop
+    {
+        unsigned N = 4, M = 50;
+        atomic<unsigned> completions{0};
+        split_barrier b(N, [&completions]() { completions++; });
+
+        vector<future<void>> f(N);
+        for (unsigned i=0; i<N; i++)
+            f[i] = async(launch::async, [&,i]()
+            {
+                // Thread i leaves after i*10 phases
+                for (unsigned j=0; j<M; j++)
+                {
+                    if (j == i*10 && i > 0)
+                    {
+                        b.arrive_and_drop ();
+                        return;
+                    }
+                    b.arrive_and_wait ();
+                }
+            });
+
+        for (auto& x : f)
+            x.get ();
+
+        EXCEPTION_ASSERT_EQUALS(completions, M);
+    }
+}
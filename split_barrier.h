@@ -0,0 +1,121 @@
+#ifndef SPLIT_BARRIER_H
+#define SPLIT_BARRIER_H
+
+#include "barrier.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+
+/**
+ * @brief The split_barrier class should let threads arrive at a barrier and
+ * wait for it separately, and do independent work in between.
+ *
+ *        split_barrier b(n, []{ swap(front, back); });
+ *        while (running) {
+ *            compute_boundary (back);
+ *            auto token = b.arrive ();
+ *            compute_interior (back);   // doesn't depend on other threads
+ *            b.wait (token);
+ *        }
+ *
+ * The completion function runs exactly once per phase, in the last thread to
+ * arrive, before any thread returns from wait.
+ *
+ * arrive_and_drop arrives at the current phase and leaves the barrier, the
+ * following phases expect one thread less.
+ *
+ * A thread must not arrive twice in the same phase.
+ */
+class split_barrier
+{
+public:
+    typedef unsigned int arrival_token;
+
+    /**
+     * @brief split_barrier
+     * @param n number of threads to participate in the barrier.
+     * @param completion runs once per phase, may be empty.
+     */
+    split_barrier (unsigned int n, std::function<void()> completion = std::function<void()>())
+        :
+          completion_ (completion),
+          expected_ (n),
+          remaining_ (n)
+    {}
+
+    split_barrier (const split_barrier&) = delete;
+    split_barrier& operator= (const split_barrier&) = delete;
+
+    /**
+     * @brief arrive never blocks, but runs the completion function if this
+     * is the last thread to arrive.
+     */
+    arrival_token arrive ()
+    {
+        bool last;
+        return arrive (last);
+    }
+
+    /**
+     * @brief wait blocks until the phase of 'token' has completed.
+     */
+    void wait (arrival_token token) const
+    {
+        for (int i=0; i<spin_count; i++)
+        {
+            if (step_.load (std::memory_order_acquire) != token)
+                return;
+            barrier_pause ();
+        }
+
+        sleep (token);
+    }
+
+    /**
+     * @brief arrive_and_wait returns true in the last thread to arrive, like
+     * spinning_barrier::wait.
+     */
+    bool arrive_and_wait ()
+    {
+        bool last;
+        arrival_token token = arrive (last);
+        if (!last)
+            wait (token);
+        return last;
+    }
+
+    void arrive_and_drop ()
+    {
+        expected_.fetch_sub (1);
+        arrive ();
+    }
+
+    // Spin this many times in wait before sleeping
+    static const int spin_count = 1000;
+
+private:
+    const std::function<void()> completion_;
+
+    // Number of threads in the next phase.
+    std::atomic<unsigned int> expected_;
+
+    // Number of threads yet to arrive in this phase.
+    std::atomic<unsigned int> remaining_;
+
+    // Number of completed phases, it's OK to wrap.
+    std::atomic<unsigned int> step_{0};
+
+    mutable std::atomic<unsigned int> sleepers_{0};
+    mutable std::mutex m_;
+    mutable std::condition_variable cv_;
+
+    arrival_token arrive (bool& last);
+    void sleep (arrival_token token) const;
+
+public:
+    static void test();
+};
+
+#endif // SPLIT_BARRIER_H
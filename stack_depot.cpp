@@ -0,0 +1,195 @@
+#include "stack_depot.h"
+#include "demangle.h"
+#include "exceptionassert.h"
+
+#include <algorithm>
+#include <mutex>
+#include <unordered_map>
+#include <stdio.h>
+
+#ifdef _MSC_VER
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#include <execinfo.h>
+#endif
+
+using namespace std;
+
+namespace {
+
+struct depot {
+    mutex lock;
+    vector<void*> frames;
+    vector<pair<uint32_t,uint32_t>> stacks; // offset and count in 'frames'
+    unordered_multimap<size_t, stack_depot::id> index;
+};
+
+// Never destroyed, stacks may be looked up by atexit handlers
+depot& the_depot()
+{
+    static depot* d = new depot;
+    return *d;
+}
+
+size_t hash_frames(void* const* frames, int n)
+{
+    size_t h = 14695981039346656037ull;
+    for (int i=0; i<n; i++)
+        h = (h ^ (size_t)frames[i]) * 1099511628211ull;
+    return h;
+}
+
+} // namespace
+
+
+int stack_depot::
+        capture(void** frames, int max_frames, int skip)
+{
+    void* buffer[256];
+    int n = min(max_frames + skip + 1, 256);
+
+#ifdef _MSC_VER
+    n = CaptureStackBackTrace (0, n, buffer, 0);
+#else
+    n = backtrace (buffer, n);
+#endif
+
+    int first = min(n, skip + 1);
+    for (int i=first; i<n; i++)
+        frames[i-first] = buffer[i];
+    return n - first;
+}
+
+
+stack_depot::id stack_depot::
+        intern(void* const* frames, int n)
+{
+    depot& d = the_depot ();
+    size_t h = hash_frames (frames, n);
+
+    unique_lock<mutex> l(d.lock);
+    auto r = d.index.equal_range (h);
+    for (auto i = r.first; i != r.second; ++i)
+    {
+        const pair<uint32_t,uint32_t>& s = d.stacks[i->second];
+        if (s.second == (uint32_t)n && equal (frames, frames + n, d.frames.begin () + s.first))
+            return i->second;
+    }
+
+    id x = (id)d.stacks.size ();
+    d.stacks.push_back (make_pair((uint32_t)d.frames.size (), (uint32_t)n));
+    d.frames.insert (d.frames.end (), frames, frames + n);
+    d.index.insert (make_pair(h, x));
+    return x;
+}
+
+
+vector<void*> stack_depot::
+        frames(id i)
+{
+    depot& d = the_depot ();
+    unique_lock<mutex> l(d.lock);
+    if (i >= d.stacks.size ())
+        return vector<void*>();
+
+    auto b = d.frames.begin () + d.stacks[i].first;
+    return vector<void*>(b, b + d.stacks[i].second);
+}
+
+
+size_t stack_depot::
+        size()
+{
+    depot& d = the_depot ();
+    unique_lock<mutex> l(d.lock);
+    return d.stacks.size ();
+}
+
+
+string stack_depot::
+        symbol(void* frame)
+{
+#ifndef _MSC_VER
+    Dl_info info;
+    if (dladdr (frame, &info) && info.dli_sname)
+        return demangle (info.dli_sname);
+#endif
+
+    char buf[32];
+    snprintf (buf, sizeof(buf), "%p", frame);
+    return buf;
+}
+
+
+string stack_depot::
+        to_string(const vector<void*>& frames, const char* indent)
+{
+    string s;
+    char line[16];
+    for (size_t k=0; k<frames.size (); k++)
+    {
+        snprintf (line, sizeof(line), "%-5d", (int)k);
+        s += indent;
+        s += line;
+        s += symbol (caller (frames[k]));
+        s += "\n";
+    }
+    return s;
+}
+
+
+void stack_depot::
+        test()
+{
+    // It should give the same id to the same stack
+    {
+        void* a[] = {(void*)1, (void*)2, (void*)3};
+        void* b[] = {(void*)1, (void*)2, (void*)4};
+
+        id ia = intern (a, 3);
+        id ib = intern (b, 3);
+        EXCEPTION_ASSERT_NOTEQUALS(ia, ib);
+        EXCEPTION_ASSERT_EQUALS(intern (a, 3), ia);
+        EXCEPTION_ASSERT_NOTEQUALS(intern (a, 2), ia);
+
+        size_t n = size ();
+        intern (b, 3);
+        EXCEPTION_ASSERT_EQUALS(size (), n);
+
+        vector<void*> f = frames (ib);
+        EXCEPTION_ASSERT_EQUALS(f.size (), 3u);
+        EXCEPTION_ASSERT(f[2] == (void*)4);
+        EXCEPTION_ASSERT(frames (id(-1)).empty ());
+    }
+
+    // It should capture the stack of the caller
+    {
+        // Through a volatile pointer to not inline capture
+        int (*volatile capture_here)(void**, int, int) = &capture;
+
+        void* f1[16];
+        void* f2[16];
+        int n1 = capture_here (f1, 16, 0);
+        int n2 = capture_here (f2, 16, 0);
+        EXCEPTION_ASSERT_LESS(1, n1);
+        EXCEPTION_ASSERT_EQUALS(n1, n2);
+        // Called from different places in the same function
+        EXCEPTION_ASSERT(f1[0] != f2[0]);
+        EXCEPTION_ASSERT(equal (f1 + 1, f1 + n1, f2 + 1));
+
+        EXCEPTION_ASSERT_EQUALS(capture (f1, 1), 1);
+    }
+
+#ifndef _MSC_VER
+    // It should print each frame named by the function that made the call
+    {
+        int (*volatile capture_here)(void**, int, int) = &capture;
+
+        void* f[16];
+        int n = capture_here (f, 16, 0);
+        string s = to_string (vector<void*>(f, f + n), "  ");
+        EXCEPTION_ASSERTX(s.find ("  0    stack_depot::test()\n  1    ") == 0, s);
+    }
+#endif
+}
@@ -0,0 +1,63 @@
+#ifndef STACK_DEPOT_H
+#define STACK_DEPOT_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * @brief The stack_depot class should store each distinct call stack once and
+ * identify it by a small integer.
+ *
+ * Profilers that capture many raw stacks keep the id instead of the frames:
+ *
+ *        void* frames[64];
+ *        int n = stack_depot::capture (frames, 64, 1);
+ *        stack_depot::id id = stack_depot::intern (frames, n);
+ *        ...
+ *        std::vector<void*> f = stack_depot::frames (id);
+ *
+ * Stacks are never removed, the depot grows with the number of distinct
+ * stacks. intern only allocates memory for stacks that are new to the depot,
+ * and capture only the first time it's called, which makes them usable from
+ * a malloc hook with a guard against recursion.
+ */
+class stack_depot
+{
+public:
+    typedef std::uint32_t id;
+
+    /**
+     * @brief capture writes the return addresses of the calling thread to
+     * 'frames', innermost first, skipping capture itself and 'skip' more.
+     * Returns the number of frames written.
+     */
+    static int capture (void** frames, int max_frames, int skip = 0);
+
+    static id intern (void* const* frames, int n);
+    static std::vector<void*> frames (id i);
+    static std::size_t size ();
+
+    /**
+     * @brief symbol returns the demangled name of the function containing
+     * 'frame', or its address if there is no symbol. Link with -rdynamic to
+     * find the symbols of the executable.
+     */
+    static std::string symbol (void* frame);
+
+    /**
+     * @brief caller returns an address in the call instruction that 'frame'
+     * returns to, return addresses themselves may be in the next function.
+     */
+    static void* caller (void* frame) { return (char*)frame - 1; }
+
+    /**
+     * @brief to_string prints one frame per line after 'indent', numbered
+     * innermost first and named by the calling function.
+     */
+    static std::string to_string (const std::vector<void*>& frames, const char* indent = "");
+
+    static void test ();
+};
+
+#endif // STACK_DEPOT_H
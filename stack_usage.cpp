@@ -0,0 +1,463 @@
+#include "stack_usage.h"
+#include "exceptionassert.h"
+#include "tasktimer.h"
+#include "trace_perf.h"
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <pthread.h>
+#endif
+
+using namespace std;
+
+namespace {
+
+const uint64_t canary = 0x5ca1ab1e5ca1ab1eull;
+
+// Below the stack pointer of register_thread, left for its own calls and
+// for signal handlers that run while it paints
+const size_t paint_margin = 4096;
+
+struct record {
+    string name;
+    double warn_at;
+    char* low;
+    char* high;
+    char* paint_low = 0;
+    char* paint_high = 0;
+    atomic<size_t> sampled{0};
+    atomic<stack_depot::id> deepest{0};
+    atomic<bool> warned{false};
+};
+
+mutex registry_lock;
+vector<record*> running;
+map<string, stack_usage::thread> ended;
+
+stack_usage::report& the_report()
+{
+    static stack_usage::report* r = new stack_usage::report(stack_usage::default_report);
+    return *r;
+}
+
+thread_local record* current_record = 0;
+thread_local bool in_check = false;
+
+// The lowest word that isn't the canary anymore
+size_t painted_usage(const record& r)
+{
+    if (r.paint_low == r.paint_high)
+        return 0;
+
+    const volatile uint64_t* p = (const uint64_t*)r.paint_low;
+    const volatile uint64_t* end = (const uint64_t*)r.paint_high;
+    while (p < end && *p == canary)
+        p++;
+    return r.high - (const char*)p;
+}
+
+stack_usage::thread to_thread(const record& r)
+{
+    stack_usage::thread t;
+    t.name = r.name;
+    t.running = true;
+    t.threads = 1;
+    t.size = r.high - r.low;
+    t.painted = painted_usage (r);
+    t.sampled = r.sampled.load (memory_order_relaxed);
+    t.deepest = r.deepest.load (memory_order_relaxed);
+    return t;
+}
+
+void warn_if_deep(record& r, size_t used)
+{
+    if (0 < r.warn_at && used >= r.warn_at * (r.high - r.low) && !r.warned.exchange (true))
+    {
+        stack_usage::report f;
+        {
+            unique_lock<mutex> l(registry_lock);
+            f = the_report ();
+        }
+        if (f)
+            f (to_thread (r));
+    }
+}
+
+void finish(unique_ptr<record>& r)
+{
+    if (!r)
+        return;
+
+    in_check = true;
+    stack_usage::thread t = to_thread (*r);
+    warn_if_deep (*r, t.used ());
+    in_check = false;
+    current_record = 0;
+
+    unique_lock<mutex> l(registry_lock);
+    running.erase (remove (running.begin (), running.end (), r.get ()), running.end ());
+
+    auto i = ended.find (t.name);
+    if (i == ended.end ())
+    {
+        t.running = false;
+        ended[t.name] = t;
+    }
+    else
+    {
+        stack_usage::thread& e = i->second;
+        e.threads++;
+        e.size = max(e.size, t.size);
+        e.painted = max(e.painted, t.painted);
+        if (t.sampled > e.sampled)
+        {
+            e.sampled = t.sampled;
+            e.deepest = t.deepest;
+        }
+    }
+
+    r.reset ();
+}
+
+// Folds the record into the summary of its name when the thread exits
+struct record_owner {
+    unique_ptr<record> r;
+
+    ~record_owner() { finish (r); }
+};
+
+record_owner& this_thread_owner()
+{
+    static thread_local record_owner o;
+    return o;
+}
+
+} // namespace
+
+
+const size_t stack_usage::whole_stack;
+const size_t stack_usage::default_paint;
+
+
+#ifdef __GNUC__
+__attribute__((noinline))
+#endif
+void stack_usage::
+        register_thread(const string& name, double warn_at, size_t paint_bytes)
+{
+    record_owner& o = this_thread_owner ();
+    finish (o.r);
+
+    char* low;
+    char* high;
+    if (!bounds (low, high))
+        return;
+
+    unique_ptr<record> r(new record);
+    r->name = name;
+    r->warn_at = warn_at;
+    r->low = low;
+    r->high = high;
+
+#ifndef _WIN32
+    // Leave a page above the bottom of the stack, in case the reported
+    // bounds include the guard page
+    char probe;
+    uintptr_t top = ((uintptr_t)&probe - paint_margin) & ~uintptr_t(7);
+    uintptr_t bottom = (uintptr_t)low + 4096;
+    if (paint_bytes < top - bottom)
+        bottom = top - paint_bytes;
+    if (bottom < top)
+    {
+        bottom = (bottom + 7) & ~uintptr_t(7);
+        for (volatile uint64_t* p = (uint64_t*)top; p > (uint64_t*)bottom; )
+            *--p = canary;
+        r->paint_low = (char*)bottom;
+        r->paint_high = (char*)top;
+    }
+#else
+    (void)paint_bytes;
+#endif
+
+    current_record = r.get ();
+    o.r = move(r);
+
+    unique_lock<mutex> l(registry_lock);
+    running.push_back (current_record);
+}
+
+
+void stack_usage::
+        unregister_thread()
+{
+    finish (this_thread_owner ().r);
+}
+
+
+void stack_usage::
+        check()
+{
+    record* r = current_record;
+    if (!r || in_check)
+        return;
+
+    char probe;
+    size_t depth = r->high - &probe;
+    if (depth <= r->sampled.load (memory_order_relaxed))
+        return;
+
+    in_check = true;
+    r->sampled.store (depth, memory_order_relaxed);
+
+    void* frames[64];
+    int n = stack_depot::capture (frames, 64, 1);
+    r->deepest.store (stack_depot::intern (frames, n), memory_order_relaxed);
+
+    warn_if_deep (*r, depth);
+    in_check = false;
+}
+
+
+vector<stack_usage::thread> stack_usage::
+        snapshot()
+{
+    // A running thread can't end while its stack is read, it takes
+    // registry_lock to unregister
+    unique_lock<mutex> l(registry_lock);
+    vector<thread> v;
+    for (const record* r : running)
+        v.push_back (to_thread (*r));
+    for (const auto& e : ended)
+        v.push_back (e.second);
+    return v;
+}
+
+
+string stack_usage::
+        dump()
+{
+    ostringstream o;
+    char line[160];
+    snprintf (line, sizeof(line), "%-24s %-9s %-9s %-9s %-9s %s\n",
+              "thread", "threads", "stack", "used", "painted", "sampled");
+    o << line;
+
+    for (const thread& t : snapshot ())
+    {
+        string threads = t.running ? string("running") : std::to_string (t.threads) + " ended";
+        snprintf (line, sizeof(line), "%-24s %-9s %-9s %-9s %-9s %s\n",
+                  t.name.c_str (), threads.c_str (),
+                  TaskTimer::bytesToString (t.size).c_str (),
+                  TaskTimer::bytesToString (t.used ()).c_str (),
+                  t.painted ? TaskTimer::bytesToString (t.painted).c_str () : "-",
+                  t.sampled ? TaskTimer::bytesToString (t.sampled).c_str () : "-");
+        o << line;
+        if (t.sampled)
+            o << "    deepest at\n" << stack_depot::to_string (stack_depot::frames (t.deepest), "    ");
+    }
+    return o.str ();
+}
+
+
+bool stack_usage::
+        bounds(char*& low, char*& high)
+{
+#if defined(_WIN32)
+    ULONG_PTR l, h;
+    GetCurrentThreadStackLimits (&l, &h);
+    low = (char*)l;
+    high = (char*)h;
+    return true;
+#elif defined(__APPLE__)
+    pthread_t self = pthread_self ();
+    high = (char*)pthread_get_stackaddr_np (self);
+    low = high - pthread_get_stacksize_np (self);
+    return true;
+#else
+    pthread_attr_t attr;
+    if (0 != pthread_getattr_np (pthread_self (), &attr))
+        return false;
+
+    void* addr = 0;
+    size_t size = 0;
+    int r = pthread_attr_getstack (&attr, &addr, &size);
+    pthread_attr_destroy (&attr);
+    if (0 != r)
+        return false;
+
+    low = (char*)addr;
+    high = low + size;
+    return true;
+#endif
+}
+
+
+void stack_usage::
+        default_report(const thread& t)
+{
+    string deepest = t.sampled ? "\n" + stack_depot::to_string (stack_depot::frames (t.deepest), "") : string();
+    TaskInfo("!!! Warning: thread '%s' used %s of its stack of %s%s",
+             t.name.c_str (),
+             TaskTimer::bytesToString (t.used ()).c_str (),
+             TaskTimer::bytesToString (t.size).c_str (),
+             deepest.c_str ());
+}
+
+
+void stack_usage::
+        set_report(report func)
+{
+    unique_lock<mutex> l(registry_lock);
+    the_report () = func;
+}
+
+
+namespace stack_usage_test {
+
+// Uses about 'kb' KB of stack below the caller
+#ifdef __GNUC__
+__attribute__((noinline))
+#endif
+int recurse(int kb)
+{
+    volatile char buf[1024];
+    buf[0] = (char)kb;
+    if (kb <= 1)
+    {
+        stack_usage::check ();
+        return buf[0];
+    }
+    return recurse (kb - 1) + buf[0];
+}
+
+const stack_usage::thread* find(const vector<stack_usage::thread>& v, const string& name, bool running)
+{
+    for (const auto& t : v)
+        if (t.name == name && t.running == running)
+            return &t;
+    return 0;
+}
+
+} // namespace stack_usage_test
+
+using namespace stack_usage_test;
+
+void stack_usage::
+        test()
+{
+    // It should measure the stack of a registered thread both by the canary
+    // and by sampling the stack pointer, and find the deepest stack
+    {
+        std::thread([]()
+        {
+            register_thread ("stack_usage_test a");
+            recurse (64);
+
+            vector<thread> v = snapshot ();
+            const thread* t = find (v, "stack_usage_test a", true);
+            EXCEPTION_ASSERT(t);
+            EXCEPTION_ASSERT_LESS(64u*1024, t->painted);
+            EXCEPTION_ASSERT_LESS(t->painted, 256u*1024);
+            EXCEPTION_ASSERT_LESS(64u*1024, t->sampled);
+            EXCEPTION_ASSERT_LESS(t->sampled, t->painted + 1);
+            EXCEPTION_ASSERT_LESS(t->painted, t->size);
+            EXCEPTION_ASSERT_LESS(0u, stack_depot::frames (t->deepest).size ());
+#ifndef _MSC_VER
+            string d = dump ();
+            EXCEPTION_ASSERTX(d.find ("stack_usage_test::recurse") != string::npos, d);
+#endif
+        }).join ();
+    }
+
+    // It should only paint 'default_paint' unless told otherwise
+    {
+        std::thread([]()
+        {
+            register_thread ("stack_usage_test deep");
+            recurse (512);
+
+            vector<thread> v = snapshot ();
+            const thread* t = find (v, "stack_usage_test deep", true);
+            EXCEPTION_ASSERT(t);
+            EXCEPTION_ASSERT_LESS(t->painted, default_paint + 16*1024);
+            EXCEPTION_ASSERT_LESS(512u*1024, t->sampled);
+        }).join ();
+    }
+
+    // It should fold the threads of a name into a summary when they end
+    {
+        for (int i=1; i<=2; i++)
+            std::thread([i]()
+            {
+                register_thread ("stack_usage_test pool", 0.9, 0);
+                recurse (16*i);
+            }).join ();
+
+        vector<thread> v = snapshot ();
+        EXCEPTION_ASSERT(!find (v, "stack_usage_test pool", true));
+        const thread* t = find (v, "stack_usage_test pool", false);
+        EXCEPTION_ASSERT(t);
+        EXCEPTION_ASSERT_EQUALS(t->threads, 2u);
+        EXCEPTION_ASSERT_EQUALS(t->painted, 0u);
+        EXCEPTION_ASSERT_LESS(32u*1024, t->sampled);
+        EXCEPTION_ASSERT_LESS(0u, stack_depot::frames (t->deepest).size ());
+        EXCEPTION_ASSERT(dump ().find ("2 ended") != string::npos);
+    }
+
+    // It should report a thread once when it uses 'warn_at' of its stack
+    {
+        int reports = 0;
+        set_report ([&reports](const thread& t) {
+            EXCEPTION_ASSERT_EQUALS(t.name, "stack_usage_test warn");
+            reports++;
+        });
+
+        std::thread([]()
+        {
+            char* low;
+            char* high;
+            EXCEPTION_ASSERT(bounds (low, high));
+            register_thread ("stack_usage_test warn", 32.0*1024 / (high - low));
+            recurse (16);
+            recurse (64);
+            recurse (64);
+        }).join ();
+
+        set_report (default_report);
+        EXCEPTION_ASSERT_EQUALS(reports, 1);
+    }
+
+    // It should ignore threads that aren't registered
+    {
+        size_t n = snapshot ().size ();
+        std::thread([]()
+        {
+            check ();
+            recurse (16);
+        }).join ();
+
+        EXCEPTION_ASSERT_EQUALS(snapshot ().size (), n);
+    }
+
+    // It should be cheap enough to check the stack at every TaskTimer
+    {
+        std::thread([]()
+        {
+            register_thread ("stack_usage_test perf", 0.9, 0);
+            TRACE_PERF("stack_usage 100000 checks");
+            for (int i=0; i<100000; i++)
+                check ();
+        }).join ();
+    }
+}
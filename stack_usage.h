@@ -0,0 +1,102 @@
+#ifndef STACK_USAGE_H
+#define STACK_USAGE_H
+
+#include "stack_depot.h"
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+/**
+ * @brief The stack_usage class should tell how much of its stack each thread
+ * uses, so that stack sizes can be chosen from measurements rather than
+ * guessed.
+ *
+ * Register a thread where it starts, threads of a pool can share a name:
+ *
+ *        void worker()
+ *        {
+ *            stack_usage::register_thread ("decoder");
+ *            ...
+ *        }
+ *
+ *        std::cout << stack_usage::dump ();
+ *
+ * Example output:
+ *
+ *        thread           threads  stack     used      painted   sampled
+ *        decoder          4        8.0 MB    212.0 KB  212.0 KB  188.3 KB
+ *            deepest at
+ *            0    decoder::parse_block(...)
+ *            ...
+ *
+ * Usage is measured two ways:
+ *
+ *   painted   register_thread fills 'paint_bytes' of the unused stack below
+ *             the caller with a canary pattern, the usage is the deepest word
+ *             that was overwritten. This commits the painted pages, so only
+ *             256 KB are painted by default, pass whole_stack to paint all
+ *             of it. Not on Windows.
+ *   sampled   check compares the stack pointer with the deepest one seen so
+ *             far and captures the stack when it's deeper. TaskTimer calls
+ *             check, so the deepest stack is where a TaskTimer was started.
+ *
+ * A thread that ends is folded into a summary of all ended threads with the
+ * same name, which keeps the deepest usage. The report function is called
+ * once per thread when its usage reaches 'warn_at' of the stack, by default
+ * it prints a warning with TaskInfo.
+ *
+ * check costs a thread_local lookup on threads that aren't registered.
+ */
+class stack_usage
+{
+public:
+    static const std::size_t whole_stack = ~std::size_t(0);
+    static const std::size_t default_paint = 256*1024;
+
+    /**
+     * @brief register_thread starts to measure the calling thread as 'name'
+     * until unregister_thread or the end of the thread.
+     */
+    static void register_thread (const std::string& name, double warn_at = 0.9, std::size_t paint_bytes = default_paint);
+    static void unregister_thread ();
+
+    /**
+     * @brief check samples the stack pointer of the calling thread.
+     */
+    static void check ();
+
+    struct thread {
+        std::string name;
+        bool running;
+        unsigned threads;       // 1 if running, ended threads with this name otherwise
+        std::size_t size;       // bytes in the stack
+        std::size_t painted;    // bytes used according to the canary, 0 if not painted
+        std::size_t sampled;    // deepest stack pointer seen by check
+        stack_depot::id deepest; // stack at the deepest check, if sampled
+
+        std::size_t used () const { return painted > sampled ? painted : sampled; }
+    };
+
+    /**
+     * @brief snapshot lists the running threads followed by the summaries of
+     * ended threads.
+     */
+    static std::vector<thread> snapshot ();
+    static std::string dump ();
+
+    /**
+     * @brief bounds tells where the stack of the calling thread is. Returns
+     * false if it isn't known.
+     */
+    static bool bounds (char*& low, char*& high);
+
+    typedef std::function<void(const thread&)> report;
+    static void default_report (const thread& t);
+    static void set_report (report func);
+
+    static void test ();
+};
+
+#endif // STACK_USAGE_H
@@ -0,0 +1,250 @@
+#include "task_origin.h"
+#include "backtrace.h"
+#include "exceptionassert.h"
+#include "stack_depot.h"
+#include "trace_perf.h"
+
+#include <future>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
+#include <stdio.h>
+
+using namespace std;
+
+namespace {
+
+struct node {
+    stack_depot::id stack;
+    task_origin::id parent;
+    unsigned depth; // number of origins in the chain, this one included
+};
+
+struct origins {
+    mutex lock;
+    vector<node> nodes{node{0, 0, 0}}; // id 0 is no origin
+    unordered_map<uint64_t, task_origin::id> index;
+
+    // Assumes 'lock' is held
+    task_origin::id intern(stack_depot::id stack, task_origin::id parent)
+    {
+        uint64_t key = (uint64_t)stack << 32 | parent;
+        auto i = index.find (key);
+        if (i != index.end ())
+            return i->second;
+
+        task_origin::id x = (task_origin::id)nodes.size ();
+        nodes.push_back (node{stack, parent, parent ? nodes[parent].depth + 1 : 1});
+        index[key] = x;
+        return x;
+    }
+
+    // Assumes 'lock' is held. The chain 'i' without its oldest origins
+    task_origin::id truncated(task_origin::id i, unsigned depth)
+    {
+        if (0 == i || 0 == depth)
+            return 0;
+        node n = nodes[i];
+        return intern (n.stack, truncated (n.parent, depth - 1));
+    }
+};
+
+// Never destroyed, backtraces may be printed by atexit handlers
+origins& O()
+{
+    static origins* o = new origins;
+    return *o;
+}
+
+thread_local task_origin::id current_origin = 0;
+
+} // namespace
+
+
+const unsigned task_origin::max_depth;
+
+
+task_origin::id task_origin::
+        capture(int skip)
+{
+    void* frames[64];
+    int n = stack_depot::capture (frames, 64, skip + 1);
+    stack_depot::id stack = stack_depot::intern (frames, n);
+
+    origins& o = O();
+    unique_lock<mutex> l(o.lock);
+    id parent = current_origin;
+    if (parent >= o.nodes.size ())
+        parent = 0;
+    if (parent && o.nodes[parent].depth >= max_depth)
+        parent = o.truncated (parent, max_depth - 1);
+    return o.intern (stack, parent);
+}
+
+
+task_origin::id task_origin::
+        current()
+{
+    return current_origin;
+}
+
+
+vector<void*> task_origin::
+        frames(id i)
+{
+    origins& o = O();
+    stack_depot::id stack;
+    {
+        unique_lock<mutex> l(o.lock);
+        if (0 == i || i >= o.nodes.size ())
+            return vector<void*>();
+        stack = o.nodes[i].stack;
+    }
+    return stack_depot::frames (stack);
+}
+
+
+task_origin::id task_origin::
+        parent(id i)
+{
+    origins& o = O();
+    unique_lock<mutex> l(o.lock);
+    return i < o.nodes.size () ? o.nodes[i].parent : 0;
+}
+
+
+string task_origin::
+        to_string(id i)
+{
+    ostringstream o;
+    for (; i; i = parent (i))
+    {
+        vector<void*> f = frames (i);
+        o << "submitted from (" << f.size () << " frames)\n"
+          << stack_depot::to_string (f) << "\n";
+    }
+    return o.str ();
+}
+
+
+task_origin::scope::
+        scope(id origin)
+    :
+      previous_(current_origin)
+{
+    current_origin = origin;
+}
+
+
+task_origin::scope::
+        ~scope()
+{
+    current_origin = previous_;
+}
+
+
+namespace task_origin_test {
+
+#ifdef __GNUC__
+__attribute__((noinline))
+#endif
+string submit_and_backtrace()
+{
+    return async(launch::async, task_origin::wrap ([]() { return Backtrace::make_string (); })).get ();
+}
+
+#ifdef __GNUC__
+__attribute__((noinline))
+#endif
+string submit_nested()
+{
+    return async(launch::async, task_origin::wrap ([]() { return submit_and_backtrace (); })).get ();
+}
+
+task_origin::id resubmit(int n)
+{
+    if (0 == n)
+        return task_origin::current ();
+    return async(launch::async, task_origin::wrap ([n]() { return resubmit (n - 1); })).get ();
+}
+
+unsigned count(const string& s, const string& what)
+{
+    unsigned n = 0;
+    for (size_t i = s.find (what); i != string::npos; i = s.find (what, i + 1))
+        n++;
+    return n;
+}
+
+} // namespace task_origin_test
+
+using namespace task_origin_test;
+
+void task_origin::
+        test()
+{
+    // It should print where a task was submitted after the frames of the task
+    {
+        EXCEPTION_ASSERT_EQUALS(current (), 0u);
+        EXCEPTION_ASSERT(Backtrace::make_string ().find ("submitted from") == string::npos);
+
+        string s = submit_and_backtrace ();
+        size_t i = s.find ("submitted from");
+        EXCEPTION_ASSERTX(i != string::npos, s);
+        EXCEPTION_ASSERT_EQUALS(count (s, "submitted from"), 1u);
+#ifndef _MSC_VER
+        EXCEPTION_ASSERTX(s.find ("task_origin_test::submit_and_backtrace", i) != string::npos, s);
+#endif
+    }
+
+    // It should follow a task submitted from within another task
+    {
+        string s = submit_nested ();
+        EXCEPTION_ASSERT_EQUALS(count (s, "submitted from"), 2u);
+#ifndef _MSC_VER
+        size_t i = s.find ("submitted from");
+        size_t j = s.find ("submitted from", i + 1);
+        EXCEPTION_ASSERTX(s.find ("task_origin_test::submit_and_backtrace", i) < j, s);
+        EXCEPTION_ASSERTX(s.find ("task_origin_test::submit_nested", j) != string::npos, s);
+#endif
+    }
+
+    // It should keep at most max_depth origins of tasks that resubmit
+    // themselves
+    {
+        id o = resubmit (20);
+        unsigned depth = 0;
+        for (id i = o; i; i = parent (i))
+            depth++;
+        EXCEPTION_ASSERT_EQUALS(depth, max_depth);
+        EXCEPTION_ASSERT_EQUALS(count (to_string (o), "submitted from"), max_depth);
+    }
+
+    // It should restore the origin at the end of a scope, and store each
+    // distinct origin once
+    {
+        // Not unrolled, both captures have the same return addresses
+        volatile int n = 2;
+        id a[2];
+        for (int i=0; i<n; i++)
+            a[i] = capture ();
+        EXCEPTION_ASSERT_NOTEQUALS(a[0], 0u);
+        EXCEPTION_ASSERT_EQUALS(a[0], a[1]);
+        EXCEPTION_ASSERT_LESS(0u, frames (a[0]).size ());
+
+        {
+            scope s(a[0]);
+            EXCEPTION_ASSERT_EQUALS(current (), a[0]);
+            id b = capture ();
+            EXCEPTION_ASSERT_EQUALS(parent (b), a[0]);
+        }
+        EXCEPTION_ASSERT_EQUALS(current (), 0u);
+    }
+
+    // It should be cheap enough to capture the origin of every task
+    {
+        TRACE_PERF("task_origin 10000 captures");
+        for (int i=0; i<10000; i++)
+            capture ();
+    }
+}
@@ -0,0 +1,108 @@
+#ifndef TASK_ORIGIN_H
+#define TASK_ORIGIN_H
+
+#include <cstdint>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief The task_origin class should tell where a task that runs on another
+ * thread was submitted from, so that a backtrace doesn't end at the entry
+ * point of the worker thread.
+ *
+ * Wrap a task where it's submitted:
+ *
+ *        std::async (std::launch::async, task_origin::wrap ([]{ ... }));
+ *        pool.submit (task_origin::wrap (job));
+ *
+ * While the task runs, Backtrace::make links the backtrace to the stack that
+ * submitted it, and Backtrace::to_string prints it after the frames of the
+ * task:
+ *
+ *        backtrace (6 frames)
+ *        0    lock_failed ...
+ *        ...
+ *
+ *        submitted from (5 frames)
+ *        0    decoder::start()
+ *        ...
+ *
+ * A task submitted from within another task links to the origin of that task
+ * too, up to max_depth origins.
+ *
+ * capture stores the raw return addresses in stack_depot and each distinct
+ * origin once, a capture costs a stack walk and two lookups under a mutex.
+ * Symbols are only looked up by to_string.
+ */
+class task_origin
+{
+public:
+    typedef std::uint32_t id; // 0 is no origin
+    static const unsigned max_depth = 8;
+
+    /**
+     * @brief capture returns the stack of the caller, skipping 'skip' more
+     * frames, linked to the origin of the running task.
+     */
+    static id capture (int skip = 0);
+
+    /**
+     * @brief current is the origin of the task that runs on this thread.
+     */
+    static id current ();
+
+    static std::vector<void*> frames (id i);
+    static id parent (id i);
+
+    /**
+     * @brief to_string prints the stacks of 'i' and its parents, or nothing if
+     * 'i' is 0.
+     */
+    static std::string to_string (id i);
+
+    /**
+     * @brief The scope class should make 'origin' the origin of the running
+     * task, until the end of the scope.
+     */
+    class scope {
+    public:
+        explicit scope (id origin);
+        scope (const scope&) = delete;
+        scope& operator= (const scope&) = delete;
+        ~scope ();
+
+    private:
+        id previous_;
+    };
+
+    template<class F>
+    class wrapped {
+    public:
+        wrapped (F f, id origin) : f_(std::move(f)), origin_(origin) {}
+
+        template<class... Args>
+        auto operator() (Args&&... args) -> decltype(std::declval<F&>()(std::forward<Args>(args)...)) {
+            scope s(origin_);
+            return f_(std::forward<Args>(args)...);
+        }
+
+    private:
+        F f_;
+        id origin_;
+    };
+
+    /**
+     * @brief wrap captures the origin of 'f' and returns a callable that runs
+     * 'f' with that origin.
+     */
+    template<class F>
+    static wrapped<typename std::decay<F>::type> wrap (F&& f) {
+        return wrapped<typename std::decay<F>::type>(std::forward<F>(f), capture ());
+    }
+
+    static void test ();
+};
+
+#endif // TASK_ORIGIN_H
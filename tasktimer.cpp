@@ -1,7 +1,11 @@
 #include "tasktimer.h"
 
 #include "cva_list.h"
+#include "shared_metrics.h"
+#include "stack_usage.h"
+#include "thread_scopes.h"
 
+#include <atomic>
 #include <iomanip>
 #include <map>
 #include <thread>
@@ -28,7 +32,8 @@
 using namespace boost;
 using namespace std;
 
-bool DISABLE_TASKTIMER = false;
+// Toggled by control_socket while other threads run TaskTimers
+atomic<bool> DISABLE_TASKTIMER{false};
 const int thread_column_width = 4;
 
 class is_alive_t {
@@ -131,6 +136,7 @@ TaskTimer::TaskTimer(bool, LogLevel logLevel, const char* f, va_list args) {
 TaskTimer::TaskTimer(const format& fmt)
 {
     initEllipsis (LogSimple, "%s", fmt.str ().c_str ());
+    goal_.clear (); // The format string of 'fmt' isn't known
 }
 
 void TaskTimer::initEllipsis(LogLevel logLevel, const char* f, ...) {
@@ -139,9 +145,14 @@ void TaskTimer::initEllipsis(LogLevel logLevel, const char* f, ...) {
 }
 
 void TaskTimer::init(LogLevel logLevel, const char* task, va_list args) {
-    if (DISABLE_TASKTIMER)
+    // A TaskTimer that started disabled stays disabled, and the other way
+    // around, whatever happens to DISABLE_TASKTIMER meanwhile
+    enabled_ = !DISABLE_TASKTIMER;
+    if (!enabled_)
         return;
 
+    stack_usage::check ();
+
     TaskTimerLock scope(staticLock);
 
     this->numPartlyDone = 0;
@@ -162,6 +173,7 @@ void TaskTimer::init(LogLevel logLevel, const char* task, va_list args) {
     if( 0<logLevel ) {
         logLevel = (LogLevel)((int)logLevel-1);
         upperLevel = new TaskTimer( 0, logLevel, task, args );
+        upperLevel->goal_.clear ();
     }
 
     T().counter[this->logLevel]++;
@@ -192,6 +204,20 @@ void TaskTimer::init(LogLevel logLevel, const char* task, va_list args) {
     for (unsigned i=1; i<strs.size(); i++)
         info("> %s", strs[i].c_str());
 
+    // Named by the call site, i.e. the format string, not by text that may
+    // differ on each call. "%s" passes the text through, as TIME does.
+    if (0 == strcmp(task, "%s"))
+        goal_ = s;
+    else
+        goal_.assign (task, strcspn(task, "\n"));
+    causal_start_ = causal_profiler::begin_latency ();
+    if (!upperLevel)
+        thread_scopes::push (s.c_str ());
+    if (!upperLevel && timeline::enabled ())
+    {
+        timeline_name_ = s;
+        timeline_start_ = timeline::now ();
+    }
     timer_.restart ();
 }
 
@@ -219,7 +245,7 @@ void TaskTimer::vinfo(const char* taskInfo, va_list args) {
 }
 
 void TaskTimer::suppressTiming() {
-    if (DISABLE_TASKTIMER)
+    if (!enabled_)
         return;
 
     TaskTimerLock scope(staticLock);
@@ -299,7 +325,7 @@ bool TaskTimer::printIndentation() {
 }
 
 void TaskTimer::partlyDone() {
-    if (DISABLE_TASKTIMER)
+    if (!enabled_)
         return;
 
     TaskTimerLock scope(staticLock);
@@ -340,11 +366,23 @@ double TaskTimer::elapsedTime()
 
 
 TaskTimer::~TaskTimer() {
-    if (DISABLE_TASKTIMER)
+    if (!enabled_)
         return;
 
     double diff = elapsedTime();
 
+    if (!goal_.empty () && !suppressTimingInfo)
+        causal_profiler::end_latency (goal_, diff, causal_start_);
+
+    if (!goal_.empty () && !suppressTimingInfo && shared_metrics::is_open ())
+        shared_metrics::record (goal_, diff);
+
+    if (timeline_start_)
+        timeline::record_span (timeline_name_, "TaskTimer", timeline_start_, timeline::now ());
+
+    if (!upperLevel)
+        thread_scopes::pop ();
+
     TaskTimerLock scope(staticLock);
 
     bool didIdent = printIndentation();
@@ -459,6 +497,20 @@ string TaskTimer::
     }
 }
 
+string TaskTimer::
+        bytesToString( double b )
+{
+    if (b < 1024) {
+        return str(format("%.0f B") % b);
+    } else if (b < 1024*1024) {
+        return str(format("%.1f KB") % (b/1024));
+    } else if (b < 1024*1024*1024) {
+        return str(format("%.1f MB") % (b/(1024*1024)));
+    } else {
+        return str(format("%.1f GB") % (b/(1024*1024*1024)));
+    }
+}
+
 TaskInfo::
         TaskInfo(const char* taskInfo, ...)
 {
@@ -1,6 +1,8 @@
 #pragma once
 
 #include "timer.h"
+#include "causal_profiler.h"
+#include "timeline.h"
 #include <stdarg.h>
 #if defined(__cplusplus) && !defined(__CUDACC__)
     #include <ostream>
@@ -108,10 +110,12 @@ public:
     static bool enabled();
     static void setEnabled( bool );
     static std::string timeToString( double T );
+    static std::string bytesToString( double bytes );
 
 private:
     Timer timer_{false};
 
+    bool enabled_;  // TaskTimer::enabled () when this was created
     unsigned numPartlyDone;
     bool is_unwinding;
     bool suppressTimingInfo;
@@ -119,6 +123,15 @@ private:
 
     TaskTimer* upperLevel; // obsolete
 
+    // Latency goal for causal_profiler, named by the first line of the format
+    // string
+    std::string goal_;
+    causal_profiler::latency_start causal_start_;
+
+    // Span on the timeline, recorded by the lowest log level only
+    std::uint64_t timeline_start_ = 0;
+    std::string timeline_name_;
+
     //TaskTimer& getCurrentTimer();
     void init(LogLevel logLevel, const char* task, va_list args);
     void initEllipsis(LogLevel logLevel, const char* f, ...);
@@ -0,0 +1,691 @@
+#include "testrunner.h"
+#include "exceptionassert.h"
+#include "tasktimer.h"
+#include "timer.h"
+#include "trace_perf.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace BacktraceTest {
+
+namespace {
+
+bool glob_match(const char* p, const char* s)
+{
+    if (*p == '*')
+        return glob_match (p+1, s) || (*s && glob_match (p, s+1));
+    if (!*p)
+        return !*s;
+    return *p == *s && glob_match (p+1, s+1);
+}
+
+
+string json_string(const string& s)
+{
+    ostringstream o;
+    o << '"';
+    for (unsigned char c : s)
+    {
+        switch (c)
+        {
+        case '"': o << "\\\""; break;
+        case '\\': o << "\\\\"; break;
+        case '\n': o << "\\n"; break;
+        case '\r': o << "\\r"; break;
+        case '\t': o << "\\t"; break;
+        default:
+            if (c < 0x20)
+            {
+                char buf[8];
+                snprintf (buf, sizeof(buf), "\\u%04x", c);
+                o << buf;
+            }
+            else
+                o << c;
+        }
+    }
+    o << '"';
+    return o.str ();
+}
+
+
+string xml_string(const string& s)
+{
+    string r;
+    for (unsigned char c : s)
+    {
+        switch (c)
+        {
+        case '&': r += "&amp;"; break;
+        case '<': r += "&lt;"; break;
+        case '>': r += "&gt;"; break;
+        case '"': r += "&quot;"; break;
+        default:
+            // Other control characters aren't allowed in XML 1.0
+            if (c >= 0x20 || c == '\n' || c == '\t')
+                r += c;
+        }
+    }
+    return r;
+}
+
+
+bool write_file(const string& filename, const string& content)
+{
+    ofstream f(filename.c_str ());
+    f << content;
+    return f.good ();
+}
+
+
+#ifndef _WIN32
+struct running_test {
+    unsigned index;
+    pid_t pid;
+    int fd;
+    Timer wall;
+    bool exited;
+    bool timed_out;
+    int exit_status;
+    double cpu;
+    string output;
+};
+
+
+void read_available(running_test& r)
+{
+    char buf[4096];
+    while (r.fd >= 0)
+    {
+        ssize_t n = read (r.fd, buf, sizeof(buf));
+        if (n > 0)
+            r.output.append (buf, n);
+        else if (n < 0 && errno == EINTR)
+            continue;
+        else
+        {
+            // EOF, or EAGAIN until the test writes more
+            if (n == 0)
+            {
+                close (r.fd);
+                r.fd = -1;
+            }
+            break;
+        }
+    }
+}
+
+
+bool start(const TestRunner::test_case& t, unsigned index, running_test& r)
+{
+    int fds[2];
+    if (0 != pipe (fds))
+        return false;
+
+    // Don't let the child repeat anything buffered in the runner
+    fflush (stdout);
+    fflush (stderr);
+
+    pid_t pid = fork ();
+    if (pid < 0)
+    {
+        close (fds[0]);
+        close (fds[1]);
+        return false;
+    }
+
+    if (0 == pid)
+    {
+        // A process group of its own lets the runner kill anything the test
+        // has started as well
+        setpgid (0, 0);
+        close (fds[0]);
+        dup2 (fds[1], 1);
+        dup2 (fds[1], 2);
+        close (fds[1]);
+        // Keep what was written before a timeout kills the test
+        setvbuf (stdout, 0, _IONBF, 0);
+
+        int code = t.run ();
+        fflush (stdout);
+        fflush (stderr);
+        exit (code);
+    }
+
+    setpgid (pid, pid);
+    close (fds[1]);
+    fcntl (fds[0], F_SETFL, fcntl (fds[0], F_GETFL) | O_NONBLOCK);
+
+    r.index = index;
+    r.pid = pid;
+    r.fd = fds[0];
+    r.wall.restart ();
+    r.exited = false;
+    r.timed_out = false;
+    r.exit_status = 0;
+    r.cpu = 0;
+    r.output.clear ();
+    return true;
+}
+
+
+TestRunner::result finish(const TestRunner::test_case& t, running_test& r)
+{
+    TestRunner::result x{t.name, TestRunner::passed, 0, r.wall.elapsed (), r.cpu, string()};
+
+    // Processes started by the test may still hold the pipe. They are killed
+    // with the test, but one that has left its process group isn't, so only
+    // wait a moment for the end of the output
+    kill (-r.pid, SIGKILL);
+    Timer drain;
+    while (r.fd >= 0 && drain.elapsed () < 0.2)
+    {
+        pollfd p{r.fd, POLLIN, 0};
+        poll (&p, 1, 20);
+        read_available (r);
+    }
+    if (r.fd >= 0)
+    {
+        close (r.fd);
+        r.fd = -1;
+    }
+    x.output.swap (r.output);
+
+    if (r.timed_out)
+        x.status = TestRunner::timed_out;
+    else if (WIFSIGNALED(r.exit_status))
+    {
+        x.status = TestRunner::crashed;
+        x.code = WTERMSIG(r.exit_status);
+    }
+    else
+    {
+        x.code = WEXITSTATUS(r.exit_status);
+        x.status = x.code ? TestRunner::failed : TestRunner::passed;
+    }
+    return x;
+}
+#endif
+
+} // namespace
+
+
+bool TestRunner::
+        parse(int argc, const char* const* argv, options& o, string& error)
+{
+    for (int i=1; i<argc; i++)
+    {
+        string a = argv[i];
+        bool has_value = i+1 < argc;
+        string v = has_value ? argv[i+1] : "";
+
+        if (a == "--list")
+        {
+            o.list = true;
+            continue;
+        }
+
+        if (a != "--filter" && a != "--jobs" && a != "-j" && a != "--timeout"
+                && a != "--json" && a != "--junit")
+        {
+            error = "Invalid argument '" + a + "'";
+            return false;
+        }
+
+        if (!has_value)
+        {
+            error = "Missing value for '" + a + "'";
+            return false;
+        }
+        i++;
+
+        char* end = 0;
+        if (a == "--filter")
+            o.filter = v;
+        else if (a == "--json")
+            o.json = v;
+        else if (a == "--junit")
+            o.junit = v;
+        else if (a == "--timeout")
+        {
+            o.timeout = strtod (v.c_str (), &end);
+            if (*end || !(o.timeout > 0))
+            {
+                error = "Invalid timeout '" + v + "'";
+                return false;
+            }
+        }
+        else
+        {
+            long jobs = strtol (v.c_str (), &end, 10);
+            if (*end || jobs < 1)
+            {
+                error = "Invalid number of jobs '" + v + "'";
+                return false;
+            }
+            o.jobs = (unsigned)jobs;
+        }
+    }
+
+    return true;
+}
+
+
+bool TestRunner::
+        matches(const string& filter, const string& name)
+{
+    if (filter.empty ())
+        return true;
+
+    bool included = false, any_include = false;
+    istringstream ss(filter);
+    string p;
+    while (getline (ss, p, ','))
+    {
+        if (p.empty ())
+            continue;
+
+        if (p[0] == '-')
+        {
+            if (glob_match (p.c_str () + 1, name.c_str ()))
+                return false;
+        }
+        else
+        {
+            any_include = true;
+            included = included || glob_match (p.c_str (), name.c_str ());
+        }
+    }
+
+    // Only exclusions select everything else
+    return included || !any_include;
+}
+
+
+vector<TestRunner::result> TestRunner::
+        execute(const vector<test_case>& tests, const options& o, function<void(const result&)> finished)
+{
+    vector<unsigned> selected;
+    for (unsigned i=0; i<tests.size (); i++)
+        if (matches (o.filter, tests[i].name))
+            selected.push_back (i);
+
+    vector<result> results(selected.size ());
+
+#ifdef _WIN32
+    for (unsigned k=0; k<selected.size (); k++)
+    {
+        const test_case& t = tests[selected[k]];
+        Timer wall;
+        clock_t cpu = clock ();
+        int code = t.run ();
+        result& x = results[k];
+        x = result{t.name, code ? failed : passed, code, wall.elapsed (),
+                   (clock () - cpu) / (double)CLOCKS_PER_SEC, string()};
+        if (finished)
+            finished (x);
+    }
+#else
+    unsigned jobs = o.jobs ? o.jobs : max(1u, thread::hardware_concurrency ());
+    vector<running_test> running;
+    vector<unsigned> slot_of; // position in 'results' of each running test
+    unsigned next = 0;
+
+    while (next < selected.size () || !running.empty ())
+    {
+        while (running.size () < jobs && next < selected.size ())
+        {
+            running_test r;
+            unsigned k = next++;
+            if (!start (tests[selected[k]], selected[k], r))
+            {
+                results[k] = result{tests[selected[k]].name, crashed, 0, 0, 0,
+                                    string("Couldn't start process: ") + strerror (errno)};
+                if (finished)
+                    finished (results[k]);
+                continue;
+            }
+            running.push_back (r);
+            slot_of.push_back (k);
+        }
+
+        if (running.empty ())
+            continue;
+
+        // A test that exits closes its end of the pipe, which wakes poll
+        vector<pollfd> fds;
+        for (const running_test& r : running)
+            if (r.fd >= 0)
+                fds.push_back (pollfd{r.fd, POLLIN, 0});
+        poll (fds.data (), fds.size (), 50);
+
+        for (unsigned j=0; j<running.size ();)
+        {
+            running_test& r = running[j];
+            read_available (r);
+
+            struct rusage ru;
+            if (!r.exited && r.pid == wait4 (r.pid, &r.exit_status, WNOHANG, &ru))
+            {
+                r.exited = true;
+                r.cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec*1e-6
+                        + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec*1e-6;
+            }
+
+            if (!r.exited && !r.timed_out && r.wall.elapsed () > o.timeout)
+            {
+                // Reaped on a later round
+                r.timed_out = true;
+                kill (-r.pid, SIGKILL);
+            }
+
+            if (!r.exited)
+            {
+                j++;
+                continue;
+            }
+
+            unsigned k = slot_of[j];
+            results[k] = finish (tests[r.index], r);
+            if (finished)
+                finished (results[k]);
+
+            running.erase (running.begin () + j);
+            slot_of.erase (slot_of.begin () + j);
+        }
+    }
+#endif
+
+    return results;
+}
+
+
+int TestRunner::
+        run(const vector<test_case>& tests, const options& o)
+{
+    if (o.list)
+    {
+        for (const test_case& t : tests)
+            if (matches (o.filter, t.name))
+                printf("%s\n", t.name.c_str ());
+        return 0;
+    }
+
+    // The traces of all tests are compared to the databases when the runner
+    // quits, as if they had run in this process
+    trace_perf::begin_collecting_forks ();
+
+    Timer wall;
+    vector<result> results = execute (tests, o, [](const result& x)
+    {
+        printf("%-10s %-40s %10s wall %10s cpu\n", TestRunner::name (x.status), x.name.c_str (),
+               TaskTimer::timeToString (x.wall).c_str (),
+               TaskTimer::timeToString (x.cpu).c_str ());
+
+        if (x.status != passed)
+        {
+            if (x.status == crashed)
+                printf("Got signal %d\n", x.code);
+            printf("%s\n", x.output.c_str ());
+        }
+        fflush(stdout);
+    });
+    double T = wall.elapsed ();
+
+    trace_perf::end_collecting_forks ();
+
+    unsigned n_passed = 0;
+    const result* slowest = 0;
+    for (const result& x : results)
+    {
+        n_passed += x.status == passed;
+        if (!slowest || slowest->wall < x.wall)
+            slowest = &x;
+    }
+
+    printf("\n%u of %u tests passed in %s", n_passed, (unsigned)results.size (),
+           TaskTimer::timeToString (T).c_str ());
+    if (slowest)
+        printf(", the slowest was %s in %s", slowest->name.c_str (),
+               TaskTimer::timeToString (slowest->wall).c_str ());
+    printf("\n\n");
+
+    int r = n_passed == results.size () ? 0 : 1;
+    if (!o.json.empty () && !write_file (o.json, json (results)))
+    {
+        fprintf(stderr, "Couldn't write %s\n", o.json.c_str ());
+        r = 1;
+    }
+    if (!o.junit.empty () && !write_file (o.junit, junit (results)))
+    {
+        fprintf(stderr, "Couldn't write %s\n", o.junit.c_str ());
+        r = 1;
+    }
+    return r;
+}
+
+
+string TestRunner::
+        json(const vector<result>& results)
+{
+    ostringstream o;
+    o << "{\"tests\": [";
+    for (unsigned i=0; i<results.size (); i++)
+    {
+        const result& x = results[i];
+        o << (i ? ",\n  " : "\n  ")
+          << "{\"name\": " << json_string (x.name)
+          << ", \"status\": \"" << name (x.status) << "\""
+          << ", \"code\": " << x.code
+          << ", \"wall\": " << x.wall
+          << ", \"cpu\": " << x.cpu;
+        if (x.status != passed)
+            o << ", \"output\": " << json_string (x.output);
+        o << "}";
+    }
+    o << "\n]}\n";
+    return o.str ();
+}
+
+
+string TestRunner::
+        junit(const vector<result>& results)
+{
+    unsigned failures = 0, errors = 0;
+    double T = 0;
+    for (const result& x : results)
+    {
+        failures += x.status == failed;
+        errors += x.status == crashed || x.status == timed_out;
+        T += x.wall;
+    }
+
+    ostringstream o;
+    o << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+      << "<testsuites>\n"
+      << "  <testsuite name=\"BacktraceTest\" tests=\"" << results.size ()
+      << "\" failures=\"" << failures << "\" errors=\"" << errors
+      << "\" time=\"" << T << "\">\n";
+
+    for (const result& x : results)
+    {
+        o << "    <testcase classname=\"BacktraceTest\" name=\"" << xml_string (x.name)
+          << "\" time=\"" << x.wall << "\"";
+        if (x.status == passed)
+        {
+            o << "/>\n";
+            continue;
+        }
+
+        const char* tag = x.status == failed ? "failure" : "error";
+        ostringstream message;
+        if (x.status == failed)
+            message << "exit code " << x.code;
+        else if (x.status == crashed)
+            message << "signal " << x.code;
+        else
+            message << "timed out";
+
+        o << ">\n      <" << tag << " message=\"" << message.str () << "\">"
+          << xml_string (x.output) << "</" << tag << ">\n"
+          << "    </testcase>\n";
+    }
+
+    o << "  </testsuite>\n"
+      << "</testsuites>\n";
+    return o.str ();
+}
+
+
+const char* TestRunner::
+        name(status s)
+{
+    switch (s)
+    {
+    case passed: return "passed";
+    case failed: return "failed";
+    case crashed: return "crashed";
+    case timed_out: return "timed out";
+    }
+    return "";
+}
+
+
+void TestRunner::
+        test()
+{
+    // It should select tests with wildcards and exclusions
+    {
+        EXCEPTION_ASSERT(matches ("", "shared_state_test"));
+        EXCEPTION_ASSERT(matches ("shared_state*", "shared_state_test"));
+        EXCEPTION_ASSERT(!matches ("shared_state*", "timeline"));
+        EXCEPTION_ASSERT(matches ("Timer,timeline", "timeline"));
+        EXCEPTION_ASSERT(matches ("*barrier", "split_barrier"));
+        EXCEPTION_ASSERT(!matches ("*barrier,-split*", "split_barrier"));
+        EXCEPTION_ASSERT(matches ("-split*", "hybrid_barrier"));
+        EXCEPTION_ASSERT(!matches ("-split*", "split_barrier"));
+    }
+
+    // It should parse command line options
+    {
+        const char* argv[] = {"unittest", "--filter", "a*", "-j", "3", "--timeout", "2.5", "--json", "r.json"};
+        options o;
+        string error;
+        EXCEPTION_ASSERT(parse (9, argv, o, error));
+        EXCEPTION_ASSERT_EQUALS(o.filter, "a*");
+        EXCEPTION_ASSERT_EQUALS(o.jobs, 3u);
+        EXCEPTION_ASSERT_EQUALS(o.timeout, 2.5);
+        EXCEPTION_ASSERT_EQUALS(o.json, "r.json");
+
+        const char* bad[] = {"unittest", "--jobs", "0"};
+        EXCEPTION_ASSERT(!parse (3, bad, o, error));
+        const char* unknown[] = {"unittest", "--frobnicate"};
+        EXCEPTION_ASSERT(!parse (2, unknown, o, error));
+        EXCEPTION_ASSERT_EQUALS(error, "Invalid argument '--frobnicate'");
+    }
+
+#ifndef _WIN32
+    // It should isolate crashes and hangs, run tests in parallel and measure
+    // wall and cpu time
+    {
+        // The tests _exit to skip the static destructors of this process
+        vector<test_case> tests{
+            {"pass", []() { printf("hello\n"); _exit (0); return 0; }},
+            {"fail", []() { _exit (3); return 0; }},
+            {"crash", []() { kill (getpid (), SIGKILL); return 0; }},
+            {"hang", []() { this_thread::sleep_for (chrono::seconds(10)); _exit (0); return 0; }},
+            {"busy", []() {
+                clock_t c = clock ();
+                while (clock () - c < CLOCKS_PER_SEC/20) {}
+                _exit (0); return 0;
+            }},
+            {"sleep1", []() { this_thread::sleep_for (chrono::milliseconds(300)); _exit (0); return 0; }},
+            {"sleep2", []() { this_thread::sleep_for (chrono::milliseconds(300)); _exit (0); return 0; }},
+        };
+
+        options o;
+        o.jobs = (unsigned)tests.size ();
+        o.timeout = 0.5;
+        o.filter = "-skipped";
+
+        vector<string> order;
+        Timer t;
+        vector<result> r = execute (tests, o, [&order](const result& x) { order.push_back (x.name); });
+        double T = t.elapsed ();
+
+        EXCEPTION_ASSERT_EQUALS(r.size (), tests.size ());
+        EXCEPTION_ASSERT_EQUALS(order.size (), tests.size ());
+        EXCEPTION_ASSERT_EQUALS(order.back (), "hang");
+
+        EXCEPTION_ASSERT_EQUALS(r[0].status, passed);
+        EXCEPTION_ASSERT_EQUALS(r[0].output, "hello\n");
+        EXCEPTION_ASSERT_EQUALS(r[1].status, failed);
+        EXCEPTION_ASSERT_EQUALS(r[1].code, 3);
+        EXCEPTION_ASSERT_EQUALS(r[2].status, crashed);
+        EXCEPTION_ASSERT_EQUALS(r[2].code, SIGKILL);
+        EXCEPTION_ASSERT_EQUALS(r[3].status, timed_out);
+        EXCEPTION_ASSERT_LESS(0.5, r[3].wall);
+        EXCEPTION_ASSERT_LESS(0.04, r[4].cpu);
+        EXCEPTION_ASSERT_LESS(0.25, r[5].wall);
+        EXCEPTION_ASSERT_LESS(r[5].cpu, 0.1);
+
+        // Together the sleeps and the timeout take 1.1 s one after another
+        EXCEPTION_ASSERT_LESS(T, 0.9);
+
+        string json = TestRunner::json (r);
+        EXCEPTION_ASSERT(json.find ("{\"name\": \"crash\", \"status\": \"crashed\", \"code\": 9") != string::npos);
+        EXCEPTION_ASSERT(json.find ("\"status\": \"timed out\"") != string::npos);
+
+        string junit = TestRunner::junit (r);
+        EXCEPTION_ASSERT(junit.find ("tests=\"7\" failures=\"1\" errors=\"2\"") != string::npos);
+        EXCEPTION_ASSERT(junit.find ("<failure message=\"exit code 3\">") != string::npos);
+    }
+
+    // It should not wait for the output of a process that has left the
+    // process group of a test
+    {
+        vector<test_case> tests{
+            {"escape", []() {
+                if (0 == fork ())
+                {
+                    setsid ();
+                    this_thread::sleep_for (chrono::seconds(2));
+                    _exit (0);
+                }
+                printf("escaped\n");
+                _exit (0);
+                return 0;
+            }},
+        };
+
+        Timer t;
+        vector<result> r = execute (tests, options());
+        double T = t.elapsed ();
+
+        EXCEPTION_ASSERT_EQUALS(r[0].status, passed);
+        EXCEPTION_ASSERT_EQUALS(r[0].output, "escaped\n");
+        EXCEPTION_ASSERT_LESS(T, 1);
+    }
+#endif
+}
+
+} // namespace BacktraceTest
@@ -0,0 +1,94 @@
+#ifndef BACKTRACETEST_TESTRUNNER_H
+#define BACKTRACETEST_TESTRUNNER_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace BacktraceTest {
+
+/**
+ * @brief The TestRunner class should run each test in a process of its own,
+ * several at a time, and report how long each test took.
+ *
+ * A test that crashes, fails or hangs doesn't stop the other tests. Each test
+ * is forked from the runner and killed, with any processes it has started, if
+ * it runs longer than the timeout. The output of a test is collected and
+ * printed when it finishes, in full if the test didn't pass. The trace_perf
+ * entries of all tests are compared to the databases once, when the runner
+ * quits.
+ *
+ *     ./backtrace-unittest --jobs 8 --timeout 60 --filter 'shared_state*'
+ *     ./backtrace-unittest --json report.json --junit report.xml
+ *
+ * With as many jobs as tests the whole run takes as long as the slowest test.
+ *
+ * Windows has no fork, tests run one after another in the runner process
+ * without a timeout.
+ */
+class TestRunner
+{
+public:
+    struct test_case {
+        std::string name;
+        std::function<int()> run; // returns the exit code of the process
+    };
+
+    struct options {
+        // Comma separated patterns where '*' matches anything, a name is
+        // selected if it matches any pattern not starting with '-' and none
+        // that does. An empty filter selects every test.
+        std::string filter;
+        unsigned jobs = 0;      // 0 for one per core
+        double timeout = 300;   // seconds per test
+        std::string json, junit; // report files, or empty
+        bool list = false;      // print the selected names without running them
+    };
+
+    enum status {
+        passed,
+        failed,     // exit code other than 0
+        crashed,    // killed by a signal
+        timed_out
+    };
+
+    struct result {
+        std::string name;
+        TestRunner::status status;
+        int code;           // exit code, or signal if crashed
+        double wall, cpu;   // seconds
+        std::string output;
+    };
+
+    /**
+     * @brief parse reads options from a command line. Returns false with a
+     * description in 'error' on invalid arguments.
+     */
+    static bool parse (int argc, const char* const* argv, options& o, std::string& error);
+
+    static bool matches (const std::string& filter, const std::string& name);
+
+    /**
+     * @brief execute runs the selected tests and returns their results in
+     * the same order as 'tests'. 'finished' is called in the runner as soon
+     * as each test has finished.
+     */
+    static std::vector<result> execute (const std::vector<test_case>& tests, const options& o,
+                                        std::function<void(const result&)> finished = std::function<void(const result&)>());
+
+    /**
+     * @brief run executes the tests, prints each result as it finishes and a
+     * summary, and writes the reports. Returns the exit code of the runner.
+     */
+    static int run (const std::vector<test_case>& tests, const options& o);
+
+    static std::string json (const std::vector<result>& results);
+    static std::string junit (const std::vector<result>& results);
+    static const char* name (status s);
+
+    static void test ();
+};
+
+} // namespace BacktraceTest
+
+#endif // BACKTRACETEST_TESTRUNNER_H
@@ -0,0 +1,68 @@
+/**
+  This file only contains unit tests for thread_buffers.
+  This file is not required for using thread_buffers.
+  */
+
+#include "thread_buffers.h"
+#include "exceptionassert.h"
+
+#include <algorithm>
+#include <future>
+
+using namespace std;
+
+namespace thread_buffers_test {
+
+void test ()
+{
+    typedef thread_buffers<vector<int>> buffers;
+
+    // It should give each thread a slot of its own, numbered in order of first use
+    {
+        buffers b;
+        b.this_thread ().buffer.push_back (1);
+
+        async(launch::async, [&b]() {
+            buffers::slot& s = b.this_thread ();
+            unique_lock<mutex> l(s.lock);
+            s.buffer.push_back (2);
+            s.buffer.push_back (3);
+        }).get ();
+
+        EXCEPTION_ASSERT_EQUALS(&b.this_thread (), &b.this_thread ());
+        EXCEPTION_ASSERT_EQUALS(b.this_thread ().number, 0u);
+
+        vector<size_t> sizes;
+        vector<uint32_t> numbers;
+        b.for_each ([&](buffers::slot& s) {
+            sizes.push_back (s.buffer.size ());
+            numbers.push_back (s.number);
+        });
+        EXCEPTION_ASSERT_EQUALS(sizes.size (), 2u);
+        EXCEPTION_ASSERT_EQUALS(sizes[0], 1u);
+        EXCEPTION_ASSERT_EQUALS(sizes[1], 2u);
+        EXCEPTION_ASSERT_EQUALS(numbers[1], 1u);
+    }
+
+    // It should keep the slots of different instances apart
+    {
+        buffers a, b;
+        a.this_thread ().buffer.push_back (1);
+        b.this_thread ().buffer.push_back (2);
+        a.this_thread ().buffer.push_back (3);
+
+        EXCEPTION_ASSERT_EQUALS(a.this_thread ().buffer.size (), 2u);
+        EXCEPTION_ASSERT_EQUALS(b.this_thread ().buffer.size (), 1u);
+        EXCEPTION_ASSERT_EQUALS(b.this_thread ().buffer[0], 2);
+    }
+
+    // It should tell the time in nanoseconds of the steady clock
+    {
+        uint64_t t0 = steady_now_ns ();
+        this_thread::sleep_for (chrono::milliseconds(1));
+        uint64_t t1 = steady_now_ns ();
+        EXCEPTION_ASSERT_LESS_OR_EQUAL(t0 + 1000000, t1);
+    }
+}
+
+} // namespace thread_buffers_test
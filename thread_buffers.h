@@ -0,0 +1,121 @@
+#ifndef THREAD_BUFFERS_H
+#define THREAD_BUFFERS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief The thread_buffers class should give each thread a buffer of its own
+ * to record events in, and let another thread collect or clear them.
+ *
+ *        thread_buffers<std::vector<event>> events;
+ *
+ *        auto& s = events.this_thread ();  // created on first use
+ *        std::unique_lock<std::mutex> l(s.lock);
+ *        s.buffer.push_back (e);
+ *
+ *        events.for_each ([&](decltype(events)::slot& s) { ... });
+ *
+ * The lock of a slot is only contended while the buffers are collected.
+ * Slots are numbered in the order threads first use them and are kept until
+ * the thread_buffers is destroyed. Each thread caches its slot in the most
+ * recently used thread_buffers of the same type, other lookups search the
+ * slots by thread id.
+ */
+template<class Buffer>
+class thread_buffers
+{
+public:
+    struct slot {
+        std::mutex lock;
+        std::thread::id id;
+        std::uint32_t number;
+        Buffer buffer;
+    };
+
+    thread_buffers () : instance_(next_instance ()) {}
+    thread_buffers (const thread_buffers&) = delete;
+    thread_buffers& operator= (const thread_buffers&) = delete;
+
+    slot& this_thread ()
+    {
+        cached& c = cache ();
+        if (c.instance == instance_)
+            return *c.s;
+
+        std::thread::id id = std::this_thread::get_id ();
+        std::unique_lock<std::mutex> l(slots_lock_);
+        std::size_t i = 0;
+        while (i < slots_.size () && slots_[i]->id != id)
+            i++;
+
+        if (i == slots_.size ())
+        {
+            slots_.emplace_back (new slot);
+            slots_.back ()->id = id;
+            slots_.back ()->number = (std::uint32_t)i;
+        }
+
+        c.instance = instance_;
+        c.s = slots_[i].get ();
+        return *c.s;
+    }
+
+    /**
+     * @brief for_each calls 'f' with each slot locked, in slot order.
+     */
+    template<class F>
+    void for_each (F f)
+    {
+        std::unique_lock<std::mutex> l(slots_lock_);
+        for (auto& s : slots_)
+        {
+            std::unique_lock<std::mutex> sl(s->lock);
+            f(*s);
+        }
+    }
+
+private:
+    struct cached {
+        std::uint64_t instance = 0;
+        slot* s = 0;
+    };
+
+    static cached& cache ()
+    {
+        static thread_local cached c;
+        return c;
+    }
+
+    static std::uint64_t next_instance ()
+    {
+        static std::atomic<std::uint64_t> n{1};
+        return n++;
+    }
+
+    const std::uint64_t instance_;
+    std::mutex slots_lock_;
+    std::vector<std::unique_ptr<slot>> slots_;
+};
+
+
+/**
+ * @brief steady_now_ns returns the time of the steady clock in nanoseconds,
+ * the time stamp of recorded events.
+ */
+inline std::uint64_t steady_now_ns ()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now ().time_since_epoch ()).count ();
+}
+
+namespace thread_buffers_test {
+    void test ();
+}
+
+#endif // THREAD_BUFFERS_H
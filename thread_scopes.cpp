@@ -0,0 +1,409 @@
+#include "thread_scopes.h"
+#include "thread_buffers.h"
+#include "exceptionassert.h"
+#include "tasktimer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <string.h>
+
+#ifndef _WIN32
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace {
+
+struct entry {
+    uint64_t start_ns;
+    char label[thread_scopes::max_label];
+};
+
+struct slot {
+    // Odd while the thread writes to its slot
+    atomic<uint32_t> seq{0};
+    unsigned depth = 0;
+    entry entries[thread_scopes::max_depth];
+
+    unsigned number;
+    string id;
+
+    void begin_write()
+    {
+        seq.store (seq.load (memory_order_relaxed) + 1, memory_order_relaxed);
+        atomic_thread_fence (memory_order_release);
+    }
+
+    void end_write()
+    {
+        seq.store (seq.load (memory_order_relaxed) + 1, memory_order_release);
+    }
+};
+
+void set_label(entry& e, const char* label)
+{
+    strncpy (e.label, label ? label : "", thread_scopes::max_label - 1);
+    e.label[thread_scopes::max_label - 1] = 0;
+}
+
+mutex registry_lock;
+vector<slot*> registry;
+unsigned next_number = 0;
+
+// Unregisters the slot when the thread exits
+struct slot_owner {
+    unique_ptr<slot> s;
+
+    ~slot_owner()
+    {
+        if (!s)
+            return;
+
+        unique_lock<mutex> l(registry_lock);
+        registry.erase (remove (registry.begin (), registry.end (), s.get ()), registry.end ());
+    }
+};
+
+slot& this_thread_slot()
+{
+    static thread_local slot_owner o;
+    if (!o.s)
+    {
+        o.s.reset (new slot);
+
+        ostringstream id;
+        id << this_thread::get_id ();
+        o.s->id = id.str ();
+
+        unique_lock<mutex> l(registry_lock);
+        o.s->number = next_number++;
+        registry.push_back (o.s.get ());
+    }
+    return *o.s;
+}
+
+} // namespace
+
+
+void thread_scopes::
+        push(const char* label)
+{
+    slot& s = this_thread_slot ();
+    s.begin_write ();
+    if (s.depth < max_depth)
+    {
+        entry& e = s.entries[s.depth];
+        e.start_ns = steady_now_ns ();
+        set_label (e, label);
+    }
+    s.depth++;
+    s.end_write ();
+}
+
+
+void thread_scopes::
+        pop()
+{
+    slot& s = this_thread_slot ();
+    if (0 == s.depth)
+        return;
+
+    s.begin_write ();
+    s.depth--;
+    s.end_write ();
+}
+
+
+void thread_scopes::
+        rename(const char* label)
+{
+    slot& s = this_thread_slot ();
+    if (0 == s.depth || s.depth > max_depth)
+        return;
+
+    s.begin_write ();
+    set_label (s.entries[s.depth-1], label);
+    s.end_write ();
+}
+
+
+vector<thread_scopes::thread> thread_scopes::
+        snapshot()
+{
+    vector<thread> r;
+    unique_lock<mutex> l(registry_lock);
+    uint64_t T = steady_now_ns ();
+
+    for (slot* s : registry)
+    {
+        thread t{s->number, s->id, 0, vector<scope>()};
+        unsigned depth = 0;
+        entry entries[max_depth];
+
+        // Give up on a thread that keeps changing its scopes
+        for (int attempt=0; attempt<1000; attempt++)
+        {
+            uint32_t seq = s->seq.load (memory_order_acquire);
+            if (seq & 1)
+            {
+                this_thread::yield ();
+                continue;
+            }
+
+            depth = s->depth;
+            memcpy (entries, s->entries, min(depth, max_depth) * sizeof(entry));
+
+            atomic_thread_fence (memory_order_acquire);
+            if (seq == s->seq.load (memory_order_relaxed))
+            {
+                t.depth = depth;
+                break;
+            }
+        }
+
+        for (unsigned i=0; i<min(t.depth, max_depth); i++)
+        {
+            uint64_t start = entries[i].start_ns;
+            t.scopes.push_back (scope{entries[i].label, start < T ? (T - start) * 1e-9 : 0});
+        }
+        r.push_back (t);
+    }
+
+    sort (r.begin (), r.end (), [](const thread& a, const thread& b) { return a.number < b.number; });
+    return r;
+}
+
+
+string thread_scopes::
+        dump()
+{
+    ostringstream o;
+    for (const thread& t : snapshot ())
+    {
+        o << "thread " << t.number << " " << t.id << endl;
+        for (const scope& s : t.scopes)
+            o << "    " << TaskTimer::timeToString (s.elapsed) << " " << s.label << endl;
+        if (t.depth > t.scopes.size ())
+            o << "    ... " << t.depth - t.scopes.size () << " more" << endl;
+    }
+    return o.str ();
+}
+
+
+#ifndef _WIN32
+namespace {
+
+int signal_pipe[2] = {-1, -1};
+FILE* signal_file = 0;
+
+void signal_handler(int)
+{
+    char c = 0;
+    ssize_t r = write (signal_pipe[1], &c, 1);
+    (void)r;
+}
+
+void dump_when_signalled()
+{
+    char c;
+    while (1 == read (signal_pipe[0], &c, 1))
+    {
+        string s = thread_scopes::dump ();
+        fwrite (s.data (), 1, s.size (), signal_file);
+        fflush (signal_file);
+    }
+}
+
+} // namespace
+#endif
+
+
+void thread_scopes::
+        dump_on_signal(int sig, FILE* f)
+{
+#ifndef _WIN32
+    static mutex m;
+    unique_lock<mutex> l(m);
+
+    signal_file = f;
+    if (signal_pipe[0] < 0)
+    {
+        if (0 != pipe (signal_pipe))
+            return;
+
+        // Dumping isn't safe in a signal handler, the handler only wakes the
+        // thread that dumps
+        std::thread(dump_when_signalled).detach ();
+    }
+
+    struct sigaction sa;
+    memset (&sa, 0, sizeof(sa));
+    sa.sa_handler = signal_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset (&sa.sa_mask);
+    sigaction (sig, &sa, 0);
+#else
+    (void)sig;
+    (void)f;
+#endif
+}
+
+
+namespace thread_scopes_test {
+
+const thread_scopes::thread* find(const vector<thread_scopes::thread>& v, const string& outer)
+{
+    for (const thread_scopes::thread& t : v)
+        if (!t.scopes.empty () && t.scopes[0].label == outer)
+            return &t;
+    return 0;
+}
+
+} // namespace thread_scopes_test
+
+using namespace thread_scopes_test;
+
+void thread_scopes::
+        test()
+{
+    // It should tell what other threads are doing, and since when
+    {
+        promise<void> started, done;
+        shared_future<void> done_f = done.get_future ();
+        std::thread th([&started, done_f]()
+        {
+            thread_scope a("thread_scopes_test outer");
+            thread_scope b("inner");
+            started.set_value ();
+            done_f.wait ();
+        });
+
+        started.get_future ().wait ();
+        this_thread::sleep_for (chrono::milliseconds(2));
+
+        vector<thread> v = snapshot ();
+        const thread* t = find (v, "thread_scopes_test outer");
+        EXCEPTION_ASSERT(t);
+        EXCEPTION_ASSERT_EQUALS(t->depth, 2u);
+        EXCEPTION_ASSERT_EQUALS(t->scopes.size (), 2u);
+        EXCEPTION_ASSERT_EQUALS(t->scopes[1].label, "inner");
+        EXCEPTION_ASSERT_LESS(0.0015, t->scopes[1].elapsed);
+        EXCEPTION_ASSERT_LESS_OR_EQUAL(t->scopes[1].elapsed, t->scopes[0].elapsed);
+
+        string d = dump ();
+        EXCEPTION_ASSERTX(d.find (" thread_scopes_test outer\n") != string::npos, d);
+
+        done.set_value ();
+        th.join ();
+
+        // It should forget threads that have exited
+        EXCEPTION_ASSERT(!find (snapshot (), "thread_scopes_test outer"));
+    }
+
+    // It should publish TaskTimer scopes
+    {
+        TaskTimer tt("thread_scopes %s", "test");
+        string d = dump ();
+        EXCEPTION_ASSERTX(d.find (" thread_scopes test\n") != string::npos, d);
+    }
+
+    // It should truncate long labels, count deep scopes and rename scopes
+    {
+        future<thread> f = async(launch::async, []()
+        {
+            string long_label(200, 'x');
+            thread_scope a("thread_scopes_test deep");
+            push (long_label.c_str ());
+            for (unsigned i=0; i<max_depth; i++)
+                push ("deep");
+            rename ("ignored");
+            pop ();
+            rename ("ignored");
+            for (unsigned i=1; i<max_depth-1; i++)
+                pop ();
+            rename ("renamed");
+
+            const thread* t = find (snapshot (), "thread_scopes_test deep");
+            thread r = *t;
+            pop ();
+            pop ();
+            return r;
+        });
+
+        thread t = f.get ();
+        EXCEPTION_ASSERT_EQUALS(t.depth, 3u);
+        EXCEPTION_ASSERT_EQUALS(t.scopes[1].label.size (), max_label - 1);
+        EXCEPTION_ASSERT_EQUALS(t.scopes[2].label, "renamed");
+    }
+
+    // It should not let a reader see a half written slot
+    {
+        atomic<bool> stop{false};
+        future<void> f = async(launch::async, [&stop]()
+        {
+            thread_scope a("thread_scopes_test busy");
+            char label[16];
+            while (!stop)
+            {
+                for (unsigned i=1; i<8; i++)
+                {
+                    snprintf (label, sizeof(label), "%u", i);
+                    push (label);
+                    rename (label);
+                }
+                for (unsigned i=1; i<8; i++)
+                    pop ();
+            }
+        });
+
+        bool consistent = true;
+        for (int i=0; i<1000; i++)
+        {
+            vector<thread> v = snapshot ();
+            const thread* t = find (v, "thread_scopes_test busy");
+            if (!t)
+                continue;
+            for (unsigned j=1; j<t->scopes.size (); j++)
+            {
+                const string& l = t->scopes[j].label;
+                if (l.size () != 1 || l[0] < '1' || l[0] > '7')
+                    consistent = false;
+            }
+        }
+        stop = true;
+        f.get ();
+        EXCEPTION_ASSERT(consistent);
+    }
+
+#ifndef _WIN32
+    // It should dump when signalled
+    {
+        FILE* f = tmpfile ();
+        dump_on_signal (SIGUSR2, f);
+
+        thread_scope a("thread_scopes_test signalled");
+        raise (SIGUSR2);
+
+        bool found = false;
+        for (int i=0; i<1000 && !found; i++)
+        {
+            this_thread::sleep_for (chrono::milliseconds(1));
+            // Without moving the position the dumping thread writes at
+            char buf[4096];
+            ssize_t n = pread (fileno (f), buf, sizeof(buf), 0);
+            found = n > 0 && string(buf, n).find ("thread_scopes_test signalled") != string::npos;
+        }
+
+        signal (SIGUSR2, SIG_DFL);
+        EXCEPTION_ASSERT(found);
+    }
+#endif
+}
@@ -0,0 +1,88 @@
+#ifndef THREAD_SCOPES_H
+#define THREAD_SCOPES_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+/**
+ * @brief The thread_scopes class should tell what every thread is doing right
+ * now, and for how long it has been doing it, without stopping the threads.
+ *
+ * Each thread publishes its stack of current scopes in a slot of its own.
+ * TaskTimer and TRACE_PERF scopes are published, and thread_scope adds
+ * others:
+ *
+ *        {
+ *            thread_scope s("waiting for the next frame");
+ *            ...
+ *        }
+ *
+ *        std::cerr << thread_scopes::dump ();
+ *
+ * or 'kill -USR1 <pid>' after thread_scopes::dump_on_signal (SIGUSR1).
+ *
+ * Example output:
+ *
+ *        thread 0 140234568812352
+ *            12.3 s Running tests
+ *            1.2 s  shared_state_test
+ *        thread 1 140234568816448
+ *            3.4 min decode stream 4
+ *
+ * A slot is only written by its thread and protected by a sequence lock, a
+ * reader retries if the thread changed its slot while it was being read.
+ * Publishing a scope copies at most max_label - 1 characters of the label and
+ * costs no locks. Scopes nested deeper than max_depth are counted but not
+ * listed.
+ */
+class thread_scopes
+{
+public:
+    static const unsigned max_depth = 16;
+    static const unsigned max_label = 64;
+
+    static void push (const char* label);
+    static void pop ();
+
+    /**
+     * @brief rename replaces the label of the innermost scope.
+     */
+    static void rename (const char* label);
+
+    struct scope {
+        std::string label;
+        double elapsed;     // seconds
+    };
+
+    struct thread {
+        unsigned number;    // in order of first scope
+        std::string id;     // std::thread::id
+        unsigned depth;     // may be more than scopes.size ()
+        std::vector<scope> scopes; // outermost first
+    };
+
+    static std::vector<thread> snapshot ();
+    static std::string dump ();
+
+    /**
+     * @brief dump_on_signal writes dump to 'f' from a background thread
+     * whenever the process gets signal 'sig'. Not on Windows.
+     */
+    static void dump_on_signal (int sig, FILE* f = stderr);
+
+    static void test ();
+};
+
+
+class thread_scope
+{
+public:
+    explicit thread_scope (const char* label) { thread_scopes::push (label); }
+    thread_scope (const thread_scope&) = delete;
+    thread_scope& operator= (const thread_scope&) = delete;
+    ~thread_scope () { thread_scopes::pop (); }
+};
+
+#endif // THREAD_SCOPES_H
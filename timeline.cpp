@@ -0,0 +1,291 @@
+#include "timeline.h"
+#include "tasktimer.h"
+#include "thread_buffers.h"
+#include "exceptionassert.h"
+
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <algorithm>
+#include <future>
+#include <stdio.h>
+
+using namespace std;
+
+namespace {
+
+atomic<bool> is_enabled{false};
+atomic<uint64_t> sessions{0};
+atomic<uint64_t> next_flow{1};
+
+thread_buffers<vector<timeline::event>>& buffers()
+{
+    static auto* b = new thread_buffers<vector<timeline::event>>;
+    return *b;
+}
+
+void append(timeline::event&& e)
+{
+    auto& s = buffers ().this_thread ();
+    e.thread = s.number;
+
+    unique_lock<mutex> l(s.lock);
+    if (0 == s.buffer.capacity ())
+        s.buffer.reserve (1 << 10);
+    s.buffer.push_back (move(e));
+}
+
+void json_string(ostream& o, const string& s)
+{
+    o << '"';
+    for (char c : s)
+    {
+        switch (c)
+        {
+        case '"': o << "\\\""; break;
+        case '\\': o << "\\\\"; break;
+        case '\n': o << "\\n"; break;
+        case '\t': o << "\\t"; break;
+        default:
+            if ((unsigned char)c < 0x20)
+            {
+                char u[8];
+                snprintf(u, sizeof(u), "\\u%04x", c);
+                o << u;
+            }
+            else
+                o << c;
+        }
+    }
+    o << '"';
+}
+
+} // namespace
+
+
+void timeline::
+        enable(bool v)
+{
+    if (v && !is_enabled)
+        sessions++;
+    is_enabled = v;
+}
+
+
+bool timeline::
+        enabled()
+{
+    return is_enabled.load (memory_order_relaxed);
+}
+
+
+uint64_t timeline::
+        session()
+{
+    return sessions.load (memory_order_relaxed);
+}
+
+
+uint64_t timeline::
+        now()
+{
+    return steady_now_ns ();
+}
+
+
+void timeline::
+        record_span(const string& name, const char* category, uint64_t start_ns, uint64_t end_ns, uint64_t instance)
+{
+    append (event{start_ns, end_ns, instance, 0, span, category, name});
+}
+
+
+uint64_t timeline::
+        record_flow_start(const char* category, uint64_t t_ns)
+{
+    uint64_t id = next_flow++;
+    append (event{t_ns, t_ns, id, 0, flow_start, category, string()});
+    return id;
+}
+
+
+void timeline::
+        record_flow_end(uint64_t id, const char* category, uint64_t t_ns)
+{
+    append (event{t_ns, t_ns, id, 0, flow_end, category, string()});
+}
+
+
+vector<timeline::event> timeline::
+        events()
+{
+    vector<event> all;
+    buffers ().for_each ([&all](thread_buffers<vector<event>>::slot& s) {
+        all.insert (all.end (), s.buffer.begin (), s.buffer.end ());
+    });
+
+    // Spans are recorded when they end
+    stable_sort (all.begin (), all.end (), [](const event& a, const event& b) {
+        return a.thread != b.thread ? a.thread < b.thread : a.start_ns < b.start_ns;
+    });
+    return all;
+}
+
+
+void timeline::
+        clear()
+{
+    buffers ().for_each ([](thread_buffers<vector<event>>::slot& s) {
+        s.buffer.clear ();
+    });
+}
+
+
+string timeline::
+        chrome_trace()
+{
+    vector<event> all = events ();
+
+    uint64_t t0 = all.empty () ? 0 : all.front ().start_ns;
+    set<uint64_t> started, ended;
+    set<uint32_t> threads;
+    for (const event& e : all)
+    {
+        t0 = min(t0, e.start_ns);
+        threads.insert (e.thread);
+        if (e.kind == flow_start) started.insert (e.id);
+        if (e.kind == flow_end) ended.insert (e.id);
+    }
+
+    ostringstream o;
+    o.precision (3);
+    o << fixed << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+
+    const char* separator = "\n";
+    for (uint32_t t : threads)
+    {
+        o << separator << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << t
+          << ",\"args\":{\"name\":\"thread " << t << "\"}}";
+        separator = ",\n";
+    }
+
+    for (const event& e : all)
+    {
+        // Timestamps are in microseconds
+        double ts = (e.start_ns - t0) * 1e-3;
+
+        switch (e.kind)
+        {
+        case span:
+            o << separator << "{\"ph\":\"X\",\"name\":";
+            json_string (o, e.name);
+            o << ",\"cat\":\"" << e.category << "\",\"pid\":1,\"tid\":" << e.thread
+              << ",\"ts\":" << ts << ",\"dur\":" << (e.end_ns - e.start_ns) * 1e-3;
+            if (e.id)
+                o << ",\"args\":{\"instance\":\"0x" << hex << e.id << dec << "\"}";
+            o << "}";
+            break;
+
+        case flow_start:
+        case flow_end:
+            if (!started.count (e.id) || !ended.count (e.id))
+                continue;
+
+            o << separator << "{\"ph\":\"" << (e.kind == flow_start ? "s" : "f") << "\""
+              << (e.kind == flow_end ? ",\"bp\":\"e\"" : "")
+              << ",\"name\":\"" << e.category << "\",\"cat\":\"" << e.category
+              << "\",\"id\":" << e.id << ",\"pid\":1,\"tid\":" << e.thread << ",\"ts\":" << ts << "}";
+            break;
+        }
+        separator = ",\n";
+    }
+
+    o << "\n]}\n";
+    return o.str ();
+}
+
+
+bool timeline::
+        save(const string& filename)
+{
+    string s = chrome_trace ();
+    FILE* f = fopen(filename.c_str (), "wb");
+    if (!f)
+        return false;
+
+    bool ok = s.size () == fwrite(s.data (), 1, s.size (), f);
+    ok &= 0 == fclose(f);
+    return ok;
+}
+
+
+void timeline::
+        test()
+{
+    // It should record nothing while disabled
+    {
+        timeline::clear ();
+        TaskInfo("timeline test");
+        EXCEPTION_ASSERT_EQUALS(timeline::events ().size (), 0u);
+    }
+
+    // It should record TaskTimer scopes as spans
+    {
+        timeline::clear ();
+        timeline::enable (true);
+        {
+            TaskTimer tt("timeline %s", "outer");
+            TaskInfo("timeline \"inner\"");
+        }
+        timeline::enable (false);
+        TaskInfo("timeline after");
+
+        vector<event> e = timeline::events ();
+        EXCEPTION_ASSERT_EQUALS(e.size (), 2u);
+        EXCEPTION_ASSERT_EQUALS(e[0].name, "timeline outer");
+        EXCEPTION_ASSERT_EQUALS(e[1].name, "timeline \"inner\"");
+        EXCEPTION_ASSERT_EQUALS((int)e[0].kind, (int)span);
+        EXCEPTION_ASSERT_EQUALS(e[0].thread, e[1].thread);
+        EXCEPTION_ASSERT_LESS_OR_EQUAL(e[0].start_ns, e[1].start_ns);
+        EXCEPTION_ASSERT_LESS_OR_EQUAL(e[1].end_ns, e[0].end_ns);
+
+        string json = timeline::chrome_trace ();
+        EXCEPTION_ASSERT(json.find ("\"name\":\"timeline outer\"") != string::npos);
+        EXCEPTION_ASSERT(json.find ("\"name\":\"timeline \\\"inner\\\"\"") != string::npos);
+        EXCEPTION_ASSERT(json.find ("\"cat\":\"TaskTimer\"") != string::npos);
+    }
+
+    // It should draw flows between threads and leave out flows that never ended
+    {
+        timeline::clear ();
+        uint64_t t = timeline::now ();
+        timeline::record_span ("a", "test", t, t + 2000, 0x10);
+        uint64_t id = timeline::record_flow_start ("test", t + 1000);
+        timeline::record_flow_start ("test", t + 1500);
+
+        async(launch::async, [id, t]{
+            timeline::record_span ("b", "test", t + 3000, t + 4000);
+            timeline::record_flow_end (id, "test", t + 3000);
+        }).get ();
+
+        vector<event> e = timeline::events ();
+        EXCEPTION_ASSERT_EQUALS(e.size (), 5u);
+        EXCEPTION_ASSERT_NOTEQUALS(e[0].thread, e[4].thread);
+        EXCEPTION_ASSERT_EQUALS((int)e[4].kind, (int)flow_end);
+
+        string json = timeline::chrome_trace ();
+        EXCEPTION_ASSERT(json.find ("\"ph\":\"s\"") != string::npos);
+        EXCEPTION_ASSERT(json.find ("\"ph\":\"f\",\"bp\":\"e\"") != string::npos);
+        EXCEPTION_ASSERT_EQUALS(json.find ("\"ph\":\"s\""), json.rfind ("\"ph\":\"s\""));
+        EXCEPTION_ASSERT(json.find ("\"ts\":1.000") != string::npos);
+        EXCEPTION_ASSERT(json.find ("\"instance\":\"0x10\"") != string::npos);
+
+        // It should save the timeline
+        const char* filename = "timeline_test.json";
+        EXCEPTION_ASSERT(timeline::save (filename));
+        remove(filename);
+
+        timeline::clear ();
+    }
+}
@@ -0,0 +1,95 @@
+#ifndef TIMELINE_H
+#define TIMELINE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * @brief The timeline class should collect spans from all threads into
+ * per-thread event buffers and export them as one timeline.
+ *
+ * TaskTimer scopes are recorded as spans while the timeline is enabled.
+ * shared_state_traits_timeline adds lock wait and lock hold spans to the same
+ * buffers.
+ *
+ *        timeline::enable (true);
+ *        ... run the workload
+ *        timeline::enable (false);
+ *        timeline::save ("timeline.json");
+ *
+ * The file is in the Chrome trace event format, open it in chrome://tracing
+ * or https://ui.perfetto.dev. Flows are drawn as arrows from the span that
+ * encloses the start of the flow to the span that encloses its end. Flows
+ * that were never ended are left out.
+ */
+class timeline
+{
+public:
+    enum event_kind : std::uint8_t {
+        span = 0,
+        flow_start = 1,
+        flow_end = 2
+    };
+
+    struct event {
+        std::uint64_t start_ns;   // steady clock
+        std::uint64_t end_ns;     // same as start_ns for flows
+        std::uint64_t id;         // instance for spans, 0 if none. Flow id for flows
+        std::uint32_t thread;     // 0, 1, 2 ... in order of first event
+        std::uint8_t kind;        // event_kind
+        const char* category;     // string literal
+        std::string name;
+    };
+
+    static void enable (bool v);
+    static bool enabled ();
+
+    /**
+     * @brief session counts the times the timeline has been enabled. State
+     * kept between events only pairs events of the same session.
+     */
+    static std::uint64_t session ();
+
+    /**
+     * @brief now returns the time in ns on the clock used by the timeline.
+     */
+    static std::uint64_t now ();
+
+    /**
+     * @brief record_span appends a finished span to the buffer of this
+     * thread. 'category' must be a string literal.
+     */
+    static void record_span (const std::string& name, const char* category,
+                             std::uint64_t start_ns, std::uint64_t end_ns,
+                             std::uint64_t instance = 0);
+
+    /**
+     * @brief record_flow_start appends the start of a new flow and returns
+     * its id. record_flow_end ends the flow in another, or the same, thread.
+     */
+    static std::uint64_t record_flow_start (const char* category, std::uint64_t t_ns);
+    static void record_flow_end (std::uint64_t id, const char* category, std::uint64_t t_ns);
+
+    /**
+     * @brief events returns all events from all threads, ordered by thread
+     * and time.
+     */
+    static std::vector<event> events ();
+    static void clear ();
+
+    /**
+     * @brief chrome_trace formats all events in the Chrome trace event format.
+     */
+    static std::string chrome_trace ();
+
+    /**
+     * @brief save writes chrome_trace to 'filename'. Returns false if the file
+     * couldn't be written.
+     */
+    static bool save (const std::string& filename);
+
+    static void test ();
+};
+
+#endif // TIMELINE_H
@@ -0,0 +1,126 @@
+/**
+  Predicts throughput and wait times of a recorded lock_trace under what-if
+  models. See shared_state_lock_simulator.h.
+
+    lock_simulator trace-file [options]
+
+      --lock-free ID           requests on ID never wait
+      --shared-reads ID        read locks on ID are shared
+      --exclusive-reads ID     read locks on ID are exclusive
+      --shorter ID PERCENT     critical sections on ID are PERCENT % shorter,
+                               from 0 to 100
+
+  ID is an instance id as listed in the output, or 'all'. Options may be
+  repeated.
+  */
+
+#include "../shared_state_lock_simulator.h"
+
+#include <stdexcept>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace std;
+
+static void usage(const char* name)
+{
+    printf("Usage: %s trace-file [--lock-free ID] [--shared-reads ID] [--exclusive-reads ID] [--shorter ID PERCENT]\n"
+           "ID is an instance id or 'all'\n", name);
+}
+
+
+static uint64_t parse_id(const char* s)
+{
+    if (0 == strcmp(s, "all"))
+        return lock_simulator::all;
+
+    char* end;
+    uint64_t id = strtoull(s, &end, 0);
+    if (*end || id == lock_simulator::all)
+        throw invalid_argument(string("not an instance id: ") + s);
+    return id;
+}
+
+
+static double parse_percent(const char* s)
+{
+    char* end;
+    double p = strtod(s, &end);
+    if (end == s || *end || !(0 <= p && p <= 100))
+        throw invalid_argument(string("not a percentage from 0 to 100: ") + s);
+    return p;
+}
+
+
+static void print(const char* title, const lock_simulator::result& r, const lock_simulator::result* baseline)
+{
+    printf("%s\n", title);
+    printf("  makespan %.6f s, %zu acquisitions, %.0f acquisitions/s, total wait %.6f s",
+           r.makespan, r.acquisitions, r.throughput, r.wait);
+    if (baseline && 0 < baseline->throughput)
+        printf(", throughput %+.1f%%", 100 * (r.throughput / baseline->throughput - 1));
+    printf("\n");
+    if (r.stuck_threads)
+        printf("  %zu threads dead-locked\n", r.stuck_threads);
+
+    printf("  %-18s %6s %12s %12s %12s %12s\n", "instance", "reads", "acquisitions", "wait s", "max wait s", "hold s");
+    for (const auto& i : r.instances)
+        printf("  0x%-16llx %6s %12zu %12.6f %12.6f %12.6f\n",
+               (unsigned long long)i.instance, i.shared_reads ? "shared" : "excl",
+               i.acquisitions, i.wait, i.max_wait, i.hold);
+}
+
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        usage (argv[0]);
+        return 1;
+    }
+
+    try
+    {
+        lock_simulator::model m;
+        bool what_if = false;
+
+        for (int i=2; i<argc; i++)
+        {
+            string a = argv[i];
+            if (a == "--lock-free" && i+1 < argc)
+                m.lock_free.insert (parse_id (argv[++i]));
+            else if (a == "--shared-reads" && i+1 < argc)
+                m.shared_reads[parse_id (argv[++i])] = true;
+            else if (a == "--exclusive-reads" && i+1 < argc)
+                m.shared_reads[parse_id (argv[++i])] = false;
+            else if (a == "--shorter" && i+2 < argc)
+            {
+                uint64_t id = parse_id (argv[++i]);
+                m.critical_section_scale[id] = 1 - parse_percent (argv[++i]) / 100;
+            }
+            else
+            {
+                usage (argv[0]);
+                return 1;
+            }
+            what_if = true;
+        }
+
+        lock_simulator s(lock_trace::load (argv[1]));
+        lock_simulator::result recorded = s.recorded ();
+        lock_simulator::result baseline = s.simulate (lock_simulator::model());
+
+        print ("Recorded", recorded, 0);
+        print ("Simulated", baseline, &recorded);
+        if (what_if)
+            print ("What-if", s.simulate (m), &baseline);
+    }
+    catch (const exception& x)
+    {
+        printf("%s: %s\n", argv[0], x.what ());
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,138 @@
+/**
+  Shows the shared_metrics of running processes, merged by site over all
+  processes that write to the same segment. See shared_metrics.h.
+
+    metrics_top segment [options]
+
+      --interval SECONDS       time between updates, default 1
+      --once                   print the totals once and exit
+      --processes              also list the sites of each process
+
+  Rates are computed over the interval, the other columns are totals since
+  each process opened the segment.
+  */
+
+#include "../shared_metrics.h"
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <thread>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace std;
+
+static void usage(const char* name)
+{
+    printf("Usage: %s segment [--interval SECONDS] [--once] [--processes]\n"
+           "segment is the name given to shared_metrics::open, like /myservice\n", name);
+}
+
+
+static string ms(double seconds)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.3f", seconds * 1e3);
+    return buf;
+}
+
+
+static void print(const vector<shared_metrics::site_stats>& sites,
+                  const map<string, uint64_t>* previous, double interval)
+{
+    printf("%-40s %10s %9s %10s %10s %10s %10s %9s %9s\n",
+           "site", "count", "rate/s", "mean ms", "p50 ms", "p99 ms", "max ms", "overruns", "contended");
+    for (const auto& s : sites)
+    {
+        string rate = "-";
+        if (previous && 0 < interval)
+        {
+            auto i = previous->find (s.name);
+            uint64_t before = i == previous->end () ? 0 : i->second;
+            char buf[32];
+            snprintf(buf, sizeof(buf), "%.1f", (s.count - before) / interval);
+            rate = buf;
+        }
+
+        printf("%-40s %10llu %9s %10s %10s %10s %10s %9llu %9llu\n",
+               s.name.c_str (), (unsigned long long)s.count, rate.c_str (),
+               ms (s.mean ()).c_str (), ms (s.percentile (0.5)).c_str (),
+               ms (s.percentile (0.99)).c_str (), ms (s.max_ns * 1e-9).c_str (),
+               (unsigned long long)s.overruns, (unsigned long long)s.contended);
+    }
+}
+
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        usage (argv[0]);
+        return 1;
+    }
+
+    double interval = 1;
+    bool once = false, processes = false;
+    for (int i=2; i<argc; i++)
+    {
+        string a = argv[i];
+        if (a == "--interval" && i+1 < argc)
+            interval = atof(argv[++i]);
+        else if (a == "--once")
+            once = true;
+        else if (a == "--processes")
+            processes = true;
+        else
+        {
+            usage (argv[0]);
+            return 1;
+        }
+    }
+
+    map<string, uint64_t> previous;
+    bool has_previous = false;
+    auto t = chrono::steady_clock::now ();
+
+    while (true)
+    {
+        vector<shared_metrics::process_stats> p;
+        string error;
+        if (!shared_metrics::read (argv[1], p, error))
+        {
+            printf("%s: %s\n", argv[0], error.c_str ());
+            return 1;
+        }
+
+        auto now = chrono::steady_clock::now ();
+        double elapsed = chrono::duration<double>(now - t).count ();
+        t = now;
+
+        vector<shared_metrics::site_stats> sites = shared_metrics::merge (p);
+        if (!once)
+            printf("\033[H\033[2J");
+        printf("%s, %zu processes\n\n", argv[1], p.size ());
+        print (sites, has_previous ? &previous : 0, elapsed);
+
+        if (processes)
+            for (const auto& ps : p)
+            {
+                printf("\npid %u %s\n", ps.pid, ps.process.c_str ());
+                print (ps.sites, 0, 0);
+            }
+
+        if (once)
+            break;
+
+        fflush(stdout);
+        previous.clear ();
+        for (const auto& s : sites)
+            previous[s.name] = s.count;
+        has_previous = true;
+
+        this_thread::sleep_for (chrono::duration<double>(interval));
+    }
+
+    return 0;
+}
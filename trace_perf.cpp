@@ -1,5 +1,7 @@
 #include "trace_perf.h"
 #include "detectgdb.h"
+#include "shared_metrics.h"
+#include "thread_scopes.h"
 #include "shared_state.h"
 
 #include <vector>
@@ -9,12 +11,16 @@
 #include <sstream>
 #include <iostream>
 
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 
 #ifdef _MSC_VER
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h> // gethostname
 #else
+#include <fcntl.h>
 #include <unistd.h> // gethostname
 #endif
 
@@ -31,6 +37,8 @@ private:
 
     map<string, vector<Entry>> entries;
     vector<string> database_paths;
+    FILE* forks = 0;        // where forked processes hand over their traces
+    int collector = 0;      // the process that reads them
 
     vector<string> get_database_names(string sourcefilename);
     void load_db(map<string, map<string, double>>& dbs, string sourcefilename);
@@ -42,6 +50,8 @@ private:
     static void read_database(map<string, double>& db, string filename);
     static void dump_entries(const vector<Entry>& entries, string sourcefilaname);
 
+    void hand_over();
+
 public:
     performance_traces();
     ~performance_traces();
@@ -57,9 +67,18 @@ public:
     void add_path(string path) {
         database_paths.push_back (path);
     }
+
+    void begin_collecting_forks();
+    void end_collecting_forks();
 };
 
-static shared_state<performance_traces> traces {new performance_traces};
+// Created by the first trace_perf, a process without any doesn't read or
+// write databases at exit
+static shared_state<performance_traces>& traces()
+{
+    static shared_state<performance_traces> traces {new performance_traces};
+    return traces;
+}
 
 
 performance_traces::
@@ -75,11 +94,84 @@ performance_traces::
     fflush (stdout);
     fflush (stderr);
 
+#ifndef _MSC_VER
+    if (forks && collector != getpid ())
+    {
+        hand_over ();
+        return;
+    }
+#endif
+
     compare_to_db ();
     dump_entries ();
 }
 
 
+void performance_traces::
+        begin_collecting_forks()
+{
+#ifndef _MSC_VER
+    if (forks)
+        return;
+
+    forks = tmpfile ();
+    if (!forks)
+    {
+        cerr << "Couldn't collect performance entries from forked processes" << endl;
+        return;
+    }
+
+    // Forks share the file offset, each hands over its traces in one write
+    fcntl (fileno (forks), F_SETFL, fcntl (fileno (forks), F_GETFL) | O_APPEND);
+    collector = getpid ();
+#endif
+}
+
+
+void performance_traces::
+        end_collecting_forks()
+{
+#ifndef _MSC_VER
+    if (!forks || collector != getpid ())
+        return;
+
+    string content;
+    char buf[4096];
+    size_t n;
+    rewind (forks);
+    while (0 < (n = fread (buf, 1, sizeof(buf), forks)))
+        content.append (buf, n);
+    fclose (forks);
+    forks = 0;
+
+    istringstream ss(content);
+    string filename, info, elapsed;
+    while (getline (ss, filename) && getline (ss, info) && getline (ss, elapsed))
+        log (filename, info, strtod (elapsed.c_str (), 0));
+#endif
+}
+
+
+void performance_traces::
+        hand_over()
+{
+#ifndef _MSC_VER
+    string content;
+    char elapsed[32];
+    for (auto i=entries.begin (); i!=entries.end (); i++)
+        for (const Entry& e : i->second)
+        {
+            snprintf (elapsed, sizeof(elapsed), "%.17g", e.elapsed);
+            content += i->first + "\n" + e.info + "\n" + elapsed + "\n";
+        }
+
+    if (!content.empty ()
+            && (ssize_t)content.size () != write (fileno (forks), content.data (), content.size ()))
+        cerr << "Couldn't hand over performance entries" << endl;
+#endif
+}
+
+
 void performance_traces::
         load_db(map<string, map<string, double>>& dbs, string sourcefilename)
 {
@@ -188,30 +280,33 @@ void performance_traces::
     mkdir("trace_perf", S_IRWXU|S_IRGRP|S_IXGRP);
     mkdir("trace_perf/dump", S_IRWXU|S_IRGRP|S_IXGRP);
 
-    int i=0;
+    // Take the first free number, creating the file fails if another
+    // process took it first
+    FILE* o = 0;
     string filename;
-    while (true) {
+    for (int i=0; !o; i++) {
         stringstream ss;
         ss << "trace_perf/dump/" << sourcefilaname << ".db" << i;
         filename = ss.str ();
-        ifstream file(filename);
-        if (!file)
+        o = fopen (filename.c_str (), "wx");
+        if (!o && errno != EEXIST)
             break;
-        i++;
     }
 
-    ofstream o(filename);
     if (!o)
+    {
         cerr << "Couldn't dump performance entries to " << filename << endl;
+        return;
+    }
 
     for (unsigned i=0; i<entries.size (); i++)
     {
         if (0 < i)
-            o << endl;
+            fprintf (o, "\n");
 
-        o << entries[i].info << endl
-          << entries[i].elapsed << endl;
+        fprintf (o, "%s\n%g\n", entries[i].info.c_str (), entries[i].elapsed);
     }
+    fclose (o);
 }
 
 
@@ -256,7 +351,8 @@ vector<string> performance_traces::
     config.push_back ("-debug");
 #endif
 
-    if (DetectGdb::is_running_through_gdb())
+    static const bool gdb = DetectGdb::is_running_through_gdb();
+    if (gdb)
         config.push_back ("-gdb");
 
     vector<string> db;
@@ -287,9 +383,11 @@ vector<string> performance_traces::
 
 trace_perf::trace_perf(const char* filename, const string& info)
     :
+      info(info),
       filename(filename)
 {
-    reset(info);
+    thread_scopes::push (info.c_str ());
+    timer.restart ();
 }
 
 
@@ -297,6 +395,7 @@ trace_perf::
         ~trace_perf()
 {
     reset();
+    thread_scopes::pop ();
 }
 
 
@@ -305,7 +404,11 @@ void trace_perf::
 {
     double d = timer.elapsed ();
     if (!info.empty ())
-        traces->log (filename, info, d);
+    {
+        traces()->log (filename, info, d);
+        if (shared_metrics::is_open ())
+            shared_metrics::record (info, d);
+    }
 }
 
 
@@ -315,6 +418,7 @@ void trace_perf::
     reset();
 
     this->info = info;
+    thread_scopes::rename (info.c_str ());
     this->timer.restart ();
 }
 
@@ -322,5 +426,19 @@ void trace_perf::
 void trace_perf::
         add_database_path(const std::string& path)
 {
-    traces->add_path(path);
+    traces()->add_path(path);
+}
+
+
+void trace_perf::
+        begin_collecting_forks()
+{
+    traces()->begin_collecting_forks();
+}
+
+
+void trace_perf::
+        end_collecting_forks()
+{
+    traces()->end_collecting_forks();
 }
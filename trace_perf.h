@@ -34,6 +34,16 @@ public:
     void reset(const std::string& info);
 
     static void add_database_path(const std::string& path);
+
+    /**
+     * @brief begin_collecting_forks makes processes forked after this call
+     * hand their traces over to this process when they exit, instead of
+     * comparing them to the databases and dumping them on their own.
+     * end_collecting_forks logs the traces handed over so far in this
+     * process, they are compared and dumped with its own when it quits.
+     */
+    static void begin_collecting_forks();
+    static void end_collecting_forks();
 private:
     Timer timer;
     std::string info;
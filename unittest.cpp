@@ -1,15 +1,39 @@
 #include "unittest.h"
 
 #include "backtrace.h"
+#include "causal_profiler.h"
 #include "exceptionassert.h"
 #include "prettifysegfault.h"
 #include "shared_state.h"
+#include "shared_state_cow.h"
+#include "shared_state_map.h"
+#include "shared_state_mutex_striped.h"
+#include "shared_state_lock_trace.h"
+#include "thread_buffers.h"
+#include "shared_state_lock_simulator.h"
+#include "shared_state_mutex_policies.h"
 #include "tasktimer.h"
 #include "timer.h"
 #include "verifyexecutiontime.h"
 #include "demangle.h"
 #include "barrier.h"
+#include "hybrid_barrier.h"
+#include "split_barrier.h"
+#include "barrier_diagnostics.h"
 #include "shared_state_traits_backtrace.h"
+#include "shared_state_traits_timeline.h"
+#include "timeline.h"
+#include "testrunner.h"
+#include "stack_depot.h"
+#include "heap_profiler.h"
+#include "thread_scopes.h"
+#include "shared_metrics.h"
+#include "control_socket.h"
+#include "pprof.h"
+#include "task_origin.h"
+#include "stack_usage.h"
+#include "backtrace_format.h"
+#include "backtrace_policy.h"
 
 #include <stdio.h>
 #include <exception>
@@ -20,30 +44,59 @@ using namespace std;
 
 namespace BacktraceTest {
 
-string lastname;
-
-#define RUNTEST(x) do { \
-        TaskTimer tt("%s", #x); \
-        lastname = #x; \
-        x::test (); \
-    } while(false)
-
-int UnitTest::
-        test(bool rethrow_exceptions)
+namespace {
+
+struct unit_test {
+    const char* name;
+    void (*test)();
+};
+
+#define RUNTEST(x) {#x, &x::test}
+
+const unit_test tests[] = {
+        RUNTEST(Backtrace),
+        RUNTEST(ExceptionAssert),
+        RUNTEST(PrettifySegfault),
+        RUNTEST(Timer),
+        RUNTEST(causal_profiler),
+        RUNTEST(shared_state_test),
+        RUNTEST(shared_state_cow_test),
+        RUNTEST(shared_state_map_test),
+        RUNTEST(shared_state_mutex_policies_test),
+        RUNTEST(shared_state_mutex_striped_test),
+        RUNTEST(thread_buffers_test),
+        RUNTEST(lock_trace),
+        RUNTEST(lock_simulator),
+        RUNTEST(VerifyExecutionTime),
+        RUNTEST(spinning_barrier),
+        RUNTEST(locking_barrier),
+        RUNTEST(combining_tree_barrier),
+        RUNTEST(dissemination_barrier),
+        RUNTEST(hybrid_barrier),
+        RUNTEST(split_barrier),
+        RUNTEST(barrier_diagnostics),
+        RUNTEST(shared_state_traits_backtrace),
+        RUNTEST(timeline),
+        RUNTEST(shared_state_timeline),
+        RUNTEST(TestRunner),
+        RUNTEST(stack_depot),
+        RUNTEST(heap_profiler),
+        RUNTEST(thread_scopes),
+        RUNTEST(shared_metrics),
+        RUNTEST(control_socket),
+        RUNTEST(pprof),
+        RUNTEST(task_origin),
+        RUNTEST(stack_usage),
+        RUNTEST(backtrace_format),
+        RUNTEST(backtrace_policy),
+};
+
+// Returns 0 if the test passed, prints the failure and returns 1 otherwise
+int run(const unit_test& t, bool rethrow_exceptions)
 {
     try {
-        Timer(); // Init performance counting
-        TaskTimer tt("Running tests");
-
-        RUNTEST(Backtrace);
-        RUNTEST(ExceptionAssert);
-        RUNTEST(PrettifySegfault);
-        RUNTEST(Timer);
-        RUNTEST(shared_state_test);
-        RUNTEST(VerifyExecutionTime);
-        RUNTEST(spinning_barrier);
-        RUNTEST(locking_barrier);
-        RUNTEST(shared_state_traits_backtrace);
+        TaskTimer tt("%s", t.name);
+        t.test ();
 
     } catch (const ExceptionAssert& x) {
         if (rethrow_exceptions)
@@ -59,7 +112,7 @@ int UnitTest::
                 str(boost::format("%s:%d: %s. %s\n"
                                   "%s\n"
                                   " FAILED in %s::test()\n\n")
-                    % (f?*f:0) % (l?*l:-1) % (c?*c:0) % (m?*m:0) % boost::diagnostic_information(x) % lastname ).c_str());
+                    % (f?*f:0) % (l?*l:-1) % (c?*c:0) % (m?*m:0) % boost::diagnostic_information(x) % t.name ).c_str());
         fflush(stderr);
         return 1;
     } catch (const exception& x) {
@@ -71,7 +124,7 @@ int UnitTest::
                 str(boost::format("%s\n"
                                   "%s\n"
                                   " FAILED in %s::test()\n\n")
-                    % vartype(x) % boost::diagnostic_information(x) % lastname ).c_str());
+                    % vartype(x) % boost::diagnostic_information(x) % t.name ).c_str());
         fflush(stderr);
         return 1;
     } catch (...) {
@@ -83,13 +136,56 @@ int UnitTest::
                 str(boost::format("Not an std::exception\n"
                                   "%s\n"
                                   " FAILED in %s::test()\n\n")
-                    % boost::current_exception_diagnostic_information () % lastname ).c_str());
+                    % boost::current_exception_diagnostic_information () % t.name ).c_str());
         fflush(stderr);
         return 1;
     }
 
+    return 0;
+}
+
+} // namespace
+
+
+int UnitTest::
+        test(bool rethrow_exceptions)
+{
+    Timer(); // Init performance counting
+
+    {
+        TaskTimer tt("Running tests");
+
+        for (const unit_test& t : tests)
+            if (run (t, rethrow_exceptions))
+                return 1;
+    }
+
     printf("\n OK\n\n");
     return 0;
 }
 
+
+int UnitTest::
+        test(int argc, const char* const* argv)
+{
+    if (1 == argc)
+        return test (false);
+
+    TestRunner::options o;
+    string error;
+    if (!TestRunner::parse (argc, argv, o, error))
+    {
+        printf("%s: %s\n", argv[0], error.c_str ());
+        return 1;
+    }
+
+    Timer(); // Init performance counting
+
+    vector<TestRunner::test_case> cases;
+    for (const unit_test& t : tests)
+        cases.push_back (TestRunner::test_case{t.name, [&t]() { return run (t, false); }});
+
+    return TestRunner::run (cases, o);
+}
+
 } // namespace BacktraceTest
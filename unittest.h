@@ -7,6 +7,13 @@ class UnitTest
 {
 public:
     static int test(bool rethrow_exceptions=true);
+
+    /**
+     * @brief test runs all tests in this process without arguments, and
+     * through TestRunner with one process per test otherwise. See
+     * TestRunner::parse.
+     */
+    static int test(int argc, const char* const* argv);
 };
 
 } // namespace BacktraceTest